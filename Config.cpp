@@ -18,16 +18,34 @@ const auto Log = ReStreamerLog;
 #if VK_VIDEO_STREAMER
 const char* ConfigFileName = "vk-streamer.conf";
 const char* AppConfigFileName = "vk-streamer.app.conf";
+const char* CacheFileNamePrefix = "vk-streamer.";
 #elif YOUTUBE_LIVE_STREAMER
 const char* ConfigFileName = "live-streamer.conf";
 const char* AppConfigFileName = "live-streamer.app.conf";
+const char* CacheFileNamePrefix = "live-streamer.";
 #else
 const char* ConfigFileName = "rtmp-streamer.conf";
 const char* AppConfigFileName = "rtmp-streamer.app.conf";
+const char* CacheFileNamePrefix = "rtmp-streamer.";
 #endif
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC(config_t, config_destroy)
 
+// file in the same dir as app config
+std::optional<std::string> AppConfigDirFilePath(const std::string& fileName)
+{
+#ifdef SNAPCRAFT_BUILD
+    if(const gchar* snapData = g_getenv("SNAP_DATA"))
+        return std::string(snapData) + "/" + fileName;
+#endif
+
+    const std::deque<std::string> configDirs = ::ConfigDirs();
+    if(!configDirs.empty())
+        return *configDirs.rbegin() + "/" + fileName;
+
+    return {};
+}
+
 }
 
 std::string Config::ReStreamer::BuildTargetUrl(
@@ -56,6 +74,64 @@ std::string Config::ReStreamer::BuildTargetUrl(
     }
 }
 
+std::optional<LatencyProfile> Config::ReStreamer::ParseLatencyProfile(const char* name)
+{
+    if(!name)
+        return {};
+
+    const std::string_view nameView = name;
+    if(nameView == "low-latency")
+        return LatencyProfile::LowLatency;
+    if(nameView == "balanced")
+        return LatencyProfile::Balanced;
+    if(nameView == "resilient")
+        return LatencyProfile::Resilient;
+
+    return {};
+}
+
+const char* Config::ReStreamer::LatencyProfileName(LatencyProfile latencyProfile)
+{
+    switch(latencyProfile) {
+        case LatencyProfile::LowLatency:
+            return "low-latency";
+        case LatencyProfile::Balanced:
+            return "balanced";
+        case LatencyProfile::Resilient:
+        default:
+            return "resilient";
+    }
+}
+
+std::optional<RtspTransport> Config::ReStreamer::ParseRtspTransport(const char* name)
+{
+    if(!name)
+        return {};
+
+    const std::string_view nameView = name;
+    if(nameView == "auto")
+        return RtspTransport::Auto;
+    if(nameView == "udp")
+        return RtspTransport::Udp;
+    if(nameView == "tcp")
+        return RtspTransport::Tcp;
+
+    return {};
+}
+
+const char* Config::ReStreamer::RtspTransportName(RtspTransport rtspTransport)
+{
+    switch(rtspTransport) {
+        case RtspTransport::Udp:
+            return "udp";
+        case RtspTransport::Tcp:
+            return "tcp";
+        case RtspTransport::Auto:
+        default:
+            return "auto";
+    }
+}
+
 std::map<std::string, Config::ReStreamer>::const_iterator
 Config::addReStreamer(
     const std::string& id,
@@ -82,12 +158,21 @@ void Config::removeReStreamer(const std::string& id)
 
 Config::ReStreamer ConfigChanges::ReStreamerChanges::makeReStreamer() const
 {
-    return Config::ReStreamer {
+    Config::ReStreamer reStreamer {
         sourceUrl ? *sourceUrl : std::string(),
         description ? *description : std::string(),
         targetUrl ? *targetUrl : std::string(),
         enabled ? *enabled : false,
     };
+
+    if(audioBitrate)
+        reStreamer.audioBitrate = *audioBitrate;
+    if(audioSampleRate)
+        reStreamer.audioSampleRate = *audioSampleRate;
+    if(audioChannels)
+        reStreamer.audioChannels = *audioChannels;
+
+    return reStreamer;
 }
 
 std::string UserConfigPath(const std::string& userConfigDir)
@@ -97,20 +182,12 @@ std::string UserConfigPath(const std::string& userConfigDir)
 
 std::optional<std::string> AppConfigPath()
 {
-#ifdef SNAPCRAFT_BUILD
-    if(const gchar* snapData = g_getenv("SNAP_DATA")) {
-        std::string configFile = snapData;
-        configFile += "/";
-        configFile += AppConfigFileName;
-        return configFile;
-    }
-#endif
-
-    const std::deque<std::string> configDirs = ::ConfigDirs();
-    if(!configDirs.empty())
-        return *configDirs.rbegin() + "/" + AppConfigFileName;
+    return AppConfigDirFilePath(AppConfigFileName);
+}
 
-    return {};
+std::optional<std::string> CachePath(const char* name)
+{
+    return AppConfigDirFilePath(std::string(CacheFileNamePrefix) + name + ".conf");
 }
 
 void SaveAppConfig(const Config& appConfig)
@@ -146,6 +223,44 @@ void SaveAppConfig(const Config& appConfig)
 
         config_setting_t* enable = config_setting_add(streamer, "enable", CONFIG_TYPE_BOOL);
         config_setting_set_bool(enable, it->second.enabled);
+
+        config_setting_t* audioBitrate = config_setting_add(streamer, "audio-bitrate", CONFIG_TYPE_INT);
+        config_setting_set_int(audioBitrate, it->second.audioBitrate);
+
+        config_setting_t* audioSampleRate = config_setting_add(streamer, "audio-sample-rate", CONFIG_TYPE_INT);
+        config_setting_set_int(audioSampleRate, it->second.audioSampleRate);
+
+        config_setting_t* audioChannels = config_setting_add(streamer, "audio-channels", CONFIG_TYPE_INT);
+        config_setting_set_int(audioChannels, it->second.audioChannels);
+
+        config_setting_t* hls = config_setting_add(streamer, "hls", CONFIG_TYPE_BOOL);
+        config_setting_set_bool(hls, it->second.hls);
+
+        if(!it->second.backupSources.empty()) {
+            config_setting_t* backupSources = config_setting_add(streamer, "backup-sources", CONFIG_TYPE_ARRAY);
+            for(const std::string& backupSource: it->second.backupSources)
+                config_setting_set_string_elem(backupSources, -1, backupSource.c_str());
+        }
+
+        config_setting_t* stallTimeout = config_setting_add(streamer, "stall-timeout", CONFIG_TYPE_INT);
+        config_setting_set_int(stallTimeout, it->second.stallTimeout);
+
+        config_setting_t* rtspTransport = config_setting_add(streamer, "rtsp-transport", CONFIG_TYPE_STRING);
+        config_setting_set_string(
+            rtspTransport,
+            Config::ReStreamer::RtspTransportName(it->second.rtspTransport));
+
+        if(it->second.latencyProfile) {
+            config_setting_t* latencyProfile = config_setting_add(streamer, "latency-profile", CONFIG_TYPE_STRING);
+            config_setting_set_string(
+                latencyProfile,
+                Config::ReStreamer::LatencyProfileName(*it->second.latencyProfile));
+        }
+
+        if(!it->second.slate.empty()) {
+            config_setting_t* slate = config_setting_add(streamer, "slate", CONFIG_TYPE_STRING);
+            config_setting_set_string(slate, it->second.slate.c_str());
+        }
     }
 
     if(!config_write_file(&config, targetPath->c_str())) {
@@ -8,6 +8,8 @@
 
 #include <spdlog/common.h>
 
+#include "Types.h"
+
 
 struct Config
 {
@@ -17,6 +19,11 @@ struct Config
 
     spdlog::level::level_enum logLevel = spdlog::level::info;
 
+    unsigned workers = 1; // main loops to spread reStreamers across
+
+    // LL-HLS server, started only if some reStreamer has hls enabled. 0 - disabled
+    unsigned short hlsPort = 4081;
+
 #if VK_VIDEO_STREAMER
     const static constexpr std::string_view targetUrlTemplate = "rtmp://ovsu.okcdn.ru/input/{key}";
 #elif YOUTUBE_LIVE_STREAMER
@@ -40,11 +47,38 @@ struct Config::ReStreamer {
     static std::string BuildTargetUrl(const std::string& key)
         { return BuildTargetUrl(key.c_str()); }
 
+    // "low-latency", "balanced" or "resilient"
+    static std::optional<LatencyProfile> ParseLatencyProfile(const char*);
+    static const char* LatencyProfileName(LatencyProfile);
+    // "auto", "udp" or "tcp"
+    static std::optional<RtspTransport> ParseRtspTransport(const char*);
+    static const char* RtspTransportName(RtspTransport);
+
     std::string sourceUrl;
     std::string description;
     std::string targetUrl;
     bool enabled;
     std::string forceH264ProfileLevelId = "42c015";
+
+    // used only if source audio is not compressed
+    unsigned audioBitrate = 128000; // bits per second
+    unsigned audioSampleRate = 44100;
+    unsigned audioChannels = 2;
+
+    // LL-HLS served from memory at http://<host>:<hls-port>/api/streamers/<id>/hls/index.m3u8
+    bool hls = false;
+
+    // tried in order when source fails, then slate is looped until source is back
+    std::deque<std::string> backupSources;
+    std::string slate; // file with the same video codec as source
+
+    // source jitterbuffer, muxer and sink settings. element defaults if not set
+    std::optional<LatencyProfile> latencyProfile;
+
+    RtspTransport rtspTransport = RtspTransport::Auto;
+
+    // source is restarted if video doesn't flow (or it's timestamps don't advance) for that time
+    unsigned stallTimeout = 10; // seconds, 0 - disabled
 };
 
 struct ConfigChanges
@@ -59,6 +93,9 @@ struct ConfigChanges::ReStreamerChanges {
     std::optional<std::string> description;
     std::optional<std::string> targetUrl;
     std::optional<bool> enabled;
+    std::optional<unsigned> audioBitrate;
+    std::optional<unsigned> audioSampleRate;
+    std::optional<unsigned> audioChannels;
     bool drop = false;
 
     Config::ReStreamer makeReStreamer() const;
@@ -67,4 +104,6 @@ struct ConfigChanges::ReStreamerChanges {
 std::string UserConfigPath(const std::string& userConfigDir);
 
 std::optional<std::string> AppConfigPath();
+// cache file (like "transports" or "caps"), next to app config
+std::optional<std::string> CachePath(const char* name);
 void SaveAppConfig(const Config& appConfig);
@@ -0,0 +1,146 @@
+#include "GopCache.h"
+
+#include <algorithm>
+
+
+namespace {
+
+// called from video streaming thread
+GstPadProbeReturn OnVideo(GstPad*, GstPadProbeInfo* info, gpointer userData)
+{
+    GopCache* gopCache = static_cast<std::shared_ptr<GopCache>*>(userData)->get();
+
+    if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        switch(GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info))) {
+            case GST_EVENT_STREAM_START:
+            case GST_EVENT_CAPS:
+            case GST_EVENT_SEGMENT:
+            case GST_EVENT_FLUSH_STOP:
+            case GST_EVENT_EOS:
+                // cached frames would not fit anymore
+                gopCache->reset();
+                break;
+            default:
+                break;
+        }
+    } else if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        gopCache->push(GST_PAD_PROBE_INFO_BUFFER(info));
+    } else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        for(guint i = 0, length = gst_buffer_list_length(list); i < length; ++i)
+            gopCache->push(gst_buffer_list_get(list, i));
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+}
+
+GopCache::~GopCache()
+{
+    reset();
+}
+
+void GopCache::reset() noexcept
+{
+    for(GstBuffer* buffer: _buffers)
+        gst_buffer_unref(buffer);
+
+    _buffers.clear();
+    _bytes = 0;
+    _valid = false;
+}
+
+void GopCache::push(GstBuffer* buffer) noexcept
+{
+    if(!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        reset();
+        _valid = true;
+    }
+
+    if(!_valid)
+        return;
+
+    const gsize size = gst_buffer_get_size(buffer);
+    if(_buffers.size() >= MAX_BUFFERS || _bytes + size > MAX_BYTES) {
+        // too long GOP, wait for the next keyframe
+        reset();
+        return;
+    }
+
+    _buffers.push_back(gst_buffer_ref(buffer));
+    _bytes += size;
+}
+
+std::deque<GstBuffer*> GopCache::retimedUntil(GstBuffer* liveBuffer) const noexcept
+{
+    if(!_valid)
+        return {};
+
+    const auto liveIt = std::find(_buffers.begin(), _buffers.end(), liveBuffer);
+    if(liveIt == _buffers.end())
+        return {};
+
+    GstClockTime liveTime = GST_BUFFER_DTS(liveBuffer);
+    if(!GST_CLOCK_TIME_IS_VALID(liveTime))
+        liveTime = GST_BUFFER_PTS(liveBuffer);
+    if(!GST_CLOCK_TIME_IS_VALID(liveTime))
+        return {};
+
+    GstClockTime livePts = GST_BUFFER_PTS(liveBuffer);
+    if(!GST_CLOCK_TIME_IS_VALID(livePts) || livePts < liveTime)
+        livePts = liveTime;
+
+    const guint64 count = liveIt - _buffers.begin();
+
+    // FLV timestamps have millisecond resolution
+    GstClockTime step = GST_MSECOND;
+    if(liveTime < (count + 1) * step)
+        step = liveTime / (count + 1);
+
+    std::deque<GstBuffer*> retimed;
+    for(auto it = _buffers.begin(); it != liveIt; ++it) {
+        GstBuffer* cached = *it;
+        GstBuffer* buffer = gst_buffer_copy(cached); // memory is shared
+
+        const GstClockTime dts = liveTime - (count - retimed.size()) * step;
+
+        // keep composition offset for frames with reordering,
+        // but replayed frame should still end before live one is presented
+        GstClockTime pts = dts;
+        if(GST_BUFFER_PTS_IS_VALID(cached) && GST_BUFFER_DTS_IS_VALID(cached) &&
+            GST_BUFFER_PTS(cached) > GST_BUFFER_DTS(cached))
+        {
+            pts += GST_BUFFER_PTS(cached) - GST_BUFFER_DTS(cached);
+            pts = std::min(pts, livePts - step);
+        }
+
+        GST_BUFFER_DTS(buffer) = dts;
+        GST_BUFFER_PTS(buffer) = pts;
+        GST_BUFFER_DURATION(buffer) = step;
+        if(retimed.empty())
+            GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+        else
+            GST_BUFFER_FLAG_UNSET(buffer, GST_BUFFER_FLAG_DISCONT);
+
+        retimed.push_back(buffer);
+    }
+
+    return retimed;
+}
+
+void AddGopCacheProbe(GstPad* videoPad, const std::shared_ptr<GopCache>& gopCache)
+{
+    gst_pad_add_probe(
+        videoPad,
+        GstPadProbeType(
+            GST_PAD_PROBE_TYPE_BUFFER |
+            GST_PAD_PROBE_TYPE_BUFFER_LIST |
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+            GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+        OnVideo,
+        new std::shared_ptr<GopCache>(gopCache),
+        [] (gpointer userData) {
+            delete static_cast<std::shared_ptr<GopCache>*>(userData);
+        });
+}
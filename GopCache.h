@@ -0,0 +1,47 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <atomic>
+
+#include <gst/gst.h>
+
+
+// Keeps the most recent video GOP (keyframe and following delta frames)
+// passed through pad, so branches attached to already running source
+// could start immediately instead of waiting for the next keyframe.
+// Cache is bounded, GOP exceeding limits is not cached at all.
+// Accessed from video streaming thread only (except hasGop).
+class GopCache
+{
+public:
+    enum {
+        MAX_BUFFERS = 600,
+        MAX_BYTES = 32 * 1024 * 1024,
+    };
+
+    GopCache() = default;
+    GopCache(const GopCache&) = delete;
+    GopCache& operator = (const GopCache&) = delete;
+    ~GopCache();
+
+    void push(GstBuffer*) noexcept;
+    void reset() noexcept;
+
+    // could be called from any thread
+    bool hasGop() const noexcept { return _valid; }
+
+    // returns copies of cached buffers preceding liveBuffer,
+    // retimed to be squeezed right before it.
+    // returns nothing if liveBuffer doesn't belong to cached GOP.
+    // caller owns returned buffers
+    std::deque<GstBuffer*> retimedUntil(GstBuffer* liveBuffer) const noexcept;
+
+private:
+    std::atomic<bool> _valid = false; // starts from keyframe and fits limits
+    std::deque<GstBuffer*> _buffers;
+    gsize _bytes = 0;
+};
+
+// records buffers passing through videoPad to gopCache
+void AddGopCacheProbe(GstPad* videoPad, const std::shared_ptr<GopCache>& gopCache);
@@ -0,0 +1,744 @@
+#include "HlsSegmenter.h"
+
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <CxxPtr/GstPtr.h>
+
+#include "Log.h"
+#include "HlsStream.h"
+
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+enum {
+    VIDEO_TRACK_ID = 1,
+    AUDIO_TRACK_ID = 2,
+
+    VIDEO_TIMESCALE = 90000,
+    AAC_FRAME_SAMPLES = 1024,
+
+    // audio waiting for video to be muxed with
+    MAX_PENDING_AUDIO_FRAMES = 500,
+
+    // trun sample flags
+    SAMPLE_FLAGS_SYNC = 0x02000000, // depends on no other samples
+    SAMPLE_FLAGS_NON_SYNC = 0x01010000, // depends on others, non sync sample
+
+    TFHD_DEFAULT_BASE_IS_MOOF = 0x020000,
+
+    TRUN_DATA_OFFSET = 0x000001,
+    TRUN_SAMPLE_DURATION = 0x000100,
+    TRUN_SAMPLE_SIZE = 0x000200,
+    TRUN_SAMPLE_FLAGS = 0x000400,
+    TRUN_SAMPLE_CTO = 0x000800,
+};
+
+const guint32 UnityMatrix[] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+
+// ISO BMFF boxes serializer
+class BoxWriter
+{
+public:
+    explicit BoxWriter(HlsStream::Data* out) : _out(out) {}
+
+    size_t size() const { return _out->size(); }
+
+    // returns box position to be passed to close()
+    size_t open(const char* type)
+    {
+        const size_t position = size();
+        u32(0); // patched in close()
+        bytes(reinterpret_cast<const guint8*>(type), 4);
+        return position;
+    }
+    size_t openFull(const char* type, guint8 version, guint32 flags)
+    {
+        const size_t position = open(type);
+        u8(version);
+        u24(flags);
+        return position;
+    }
+    void close(size_t position)
+        { patch32(position, static_cast<guint32>(size() - position)); }
+
+    void u8(guint8 value) { _out->push_back(value); }
+    void u16(guint16 value) { u8(value >> 8); u8(value); }
+    void u24(guint32 value) { u8(value >> 16); u16(value); }
+    void u32(guint32 value) { u16(value >> 16); u16(value); }
+    void u64(guint64 value) { u32(value >> 32); u32(value); }
+    void zeros(size_t count) { _out->insert(_out->end(), count, 0); }
+    void bytes(const guint8* data, size_t size) { _out->insert(_out->end(), data, data + size); }
+    void buffer(GstBuffer* buffer)
+    {
+        const size_t position = size();
+        const gsize bufferSize = gst_buffer_get_size(buffer);
+        _out->resize(position + bufferSize);
+        gst_buffer_extract(buffer, 0, _out->data() + position, bufferSize);
+    }
+
+    void patch32(size_t position, guint32 value)
+    {
+        guint8* data = _out->data() + position;
+        data[0] = value >> 24;
+        data[1] = value >> 16;
+        data[2] = value >> 8;
+        data[3] = value;
+    }
+
+private:
+    HlsStream::Data* _out;
+};
+
+struct VideoSample {
+    GstBuffer* buffer;
+    guint64 dts; // VIDEO_TIMESCALE
+    gint32 compositionOffset; // VIDEO_TIMESCALE
+    guint32 duration; // VIDEO_TIMESCALE, known when the next sample arrives
+    bool keyFrame;
+};
+
+struct AudioSample {
+    GstBuffer* buffer;
+    GstClockTime pts;
+    guint32 duration; // audio timescale
+};
+
+class Segmenter
+{
+public:
+    explicit Segmenter(const std::shared_ptr<HlsStream>& hlsStream) :
+        _hlsStreamPtr(hlsStream) {}
+    ~Segmenter() { reset(); }
+
+    void onVideoCaps(GstCaps*);
+    void onAudioCaps(GstCaps*);
+    void onVideo(GstBuffer*);
+    void onAudio(GstBuffer*);
+    void onStreamReset();
+
+private:
+    void reset();
+    bool start(GstClockTime baseTime);
+    void writeInit(BoxWriter*) const;
+    void writeVideoTrack(BoxWriter*) const;
+    void writeAudioTrack(BoxWriter*) const;
+    void flush(GstClockTime cutTime, guint64 cutDts, bool nextStartsSegment);
+
+private:
+    std::mutex _mutex; // video and audio are coming from different streaming threads
+
+    const std::shared_ptr<HlsStream> _hlsStreamPtr;
+
+    GstCapsPtr _videoCapsPtr;
+    GstCapsPtr _audioCapsPtr;
+
+    bool _started = false;
+    bool _keyFrameSkipped = false; // to give audio caps a chance to arrive
+    bool _withAudio = false;
+    guint32 _audioTimescale = 0;
+
+    GstClockTime _baseTime = 0;
+    guint64 _segmentStartDts = 0; // VIDEO_TIMESCALE
+    bool _partStartsSegment = true;
+    guint32 _sequenceNumber = 0;
+
+    std::deque<VideoSample> _videoSamples;
+    std::deque<AudioSample> _audioSamples;
+    bool _audioDecodeTimeValid = false;
+    guint64 _audioDecodeTime = 0; // audio timescale
+};
+
+GstBuffer* CodecData(GstCaps* caps)
+{
+    const GstStructure* structure = gst_caps_get_structure(caps, 0);
+    const GValue* codecData = gst_structure_get_value(structure, "codec_data");
+    if(!codecData || !GST_VALUE_HOLDS_BUFFER(codecData))
+        return nullptr;
+
+    return gst_value_get_buffer(codecData);
+}
+
+void Segmenter::reset()
+{
+    for(VideoSample& sample: _videoSamples)
+        gst_buffer_unref(sample.buffer);
+    _videoSamples.clear();
+
+    for(AudioSample& sample: _audioSamples)
+        gst_buffer_unref(sample.buffer);
+    _audioSamples.clear();
+
+    _started = false;
+    _keyFrameSkipped = false;
+    _audioDecodeTimeValid = false;
+}
+
+void Segmenter::onStreamReset()
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    reset();
+}
+
+void Segmenter::onVideoCaps(GstCaps* caps)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_videoCapsPtr && gst_caps_is_equal(_videoCapsPtr.get(), caps))
+        return;
+
+    // new init section is required
+    reset();
+    _videoCapsPtr.reset(gst_caps_ref(caps));
+}
+
+void Segmenter::onAudioCaps(GstCaps* caps)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_audioCapsPtr && gst_caps_is_equal(_audioCapsPtr.get(), caps))
+        return;
+
+    if(_withAudio)
+        reset(); // new init section is required
+    _audioCapsPtr.reset(gst_caps_ref(caps));
+}
+
+void Segmenter::writeVideoTrack(BoxWriter* writer) const
+{
+    const GstStructure* structure = gst_caps_get_structure(_videoCapsPtr.get(), 0);
+    const bool h265 = gst_structure_has_name(structure, "video/x-h265");
+    gint width = 0;
+    gint height = 0;
+    gst_structure_get_int(structure, "width", &width);
+    gst_structure_get_int(structure, "height", &height);
+
+    const size_t trak = writer->open("trak");
+    {
+        const size_t tkhd = writer->openFull("tkhd", 0, 0x000003); // enabled, in movie
+        writer->zeros(8); // creation/modification time
+        writer->u32(VIDEO_TRACK_ID);
+        writer->zeros(4 + 4 + 8); // reserved, duration, reserved
+        writer->zeros(2 + 2 + 2 + 2); // layer, alternate group, volume, reserved
+        for(guint32 value: UnityMatrix)
+            writer->u32(value);
+        writer->u32(width << 16);
+        writer->u32(height << 16);
+        writer->close(tkhd);
+
+        const size_t mdia = writer->open("mdia");
+        {
+            const size_t mdhd = writer->openFull("mdhd", 0, 0);
+            writer->zeros(8); // creation/modification time
+            writer->u32(VIDEO_TIMESCALE);
+            writer->u32(0); // duration
+            writer->u16(0x55C4); // "und" language
+            writer->u16(0);
+            writer->close(mdhd);
+
+            const size_t hdlr = writer->openFull("hdlr", 0, 0);
+            writer->u32(0);
+            writer->bytes(reinterpret_cast<const guint8*>("vide"), 4);
+            writer->zeros(12);
+            writer->bytes(reinterpret_cast<const guint8*>("Video"), sizeof("Video"));
+            writer->close(hdlr);
+
+            const size_t minf = writer->open("minf");
+            {
+                const size_t vmhd = writer->openFull("vmhd", 0, 0x000001);
+                writer->zeros(2 + 6); // graphics mode, opcolor
+                writer->close(vmhd);
+
+                const size_t dinf = writer->open("dinf");
+                const size_t dref = writer->openFull("dref", 0, 0);
+                writer->u32(1);
+                writer->close(writer->openFull("url ", 0, 0x000001)); // media is in the same file
+                writer->close(dref);
+                writer->close(dinf);
+
+                const size_t stbl = writer->open("stbl");
+                {
+                    const size_t stsd = writer->openFull("stsd", 0, 0);
+                    writer->u32(1);
+                    const size_t entry = writer->open(h265 ? "hvc1" : "avc1");
+                    writer->zeros(6);
+                    writer->u16(1); // data reference index
+                    writer->zeros(2 + 2 + 12); // pre defined, reserved, pre defined
+                    writer->u16(width);
+                    writer->u16(height);
+                    writer->u32(0x00480000); // 72 dpi
+                    writer->u32(0x00480000);
+                    writer->u32(0);
+                    writer->u16(1); // frame count
+                    writer->zeros(32); // compressor name
+                    writer->u16(0x0018); // depth
+                    writer->u16(0xFFFF); // pre defined
+                    const size_t config = writer->open(h265 ? "hvcC" : "avcC");
+                    writer->buffer(CodecData(_videoCapsPtr.get()));
+                    writer->close(config);
+                    writer->close(entry);
+                    writer->close(stsd);
+
+                    // samples are in fragments only
+                    for(const char* type: { "stts", "stsc", "stco" }) {
+                        const size_t box = writer->openFull(type, 0, 0);
+                        writer->u32(0);
+                        writer->close(box);
+                    }
+                    const size_t stsz = writer->openFull("stsz", 0, 0);
+                    writer->u32(0);
+                    writer->u32(0);
+                    writer->close(stsz);
+                }
+                writer->close(stbl);
+            }
+            writer->close(minf);
+        }
+        writer->close(mdia);
+    }
+    writer->close(trak);
+}
+
+void Segmenter::writeAudioTrack(BoxWriter* writer) const
+{
+    const GstStructure* structure = gst_caps_get_structure(_audioCapsPtr.get(), 0);
+    gint channels = 0;
+    gst_structure_get_int(structure, "channels", &channels);
+
+    GstBuffer* audioSpecificConfig = CodecData(_audioCapsPtr.get());
+    const guint8 configSize = static_cast<guint8>(gst_buffer_get_size(audioSpecificConfig));
+
+    const size_t trak = writer->open("trak");
+    {
+        const size_t tkhd = writer->openFull("tkhd", 0, 0x000003); // enabled, in movie
+        writer->zeros(8); // creation/modification time
+        writer->u32(AUDIO_TRACK_ID);
+        writer->zeros(4 + 4 + 8); // reserved, duration, reserved
+        writer->zeros(2 + 2); // layer, alternate group
+        writer->u16(0x0100); // volume
+        writer->zeros(2);
+        for(guint32 value: UnityMatrix)
+            writer->u32(value);
+        writer->zeros(4 + 4); // width, height
+        writer->close(tkhd);
+
+        const size_t mdia = writer->open("mdia");
+        {
+            const size_t mdhd = writer->openFull("mdhd", 0, 0);
+            writer->zeros(8); // creation/modification time
+            writer->u32(_audioTimescale);
+            writer->u32(0); // duration
+            writer->u16(0x55C4); // "und" language
+            writer->u16(0);
+            writer->close(mdhd);
+
+            const size_t hdlr = writer->openFull("hdlr", 0, 0);
+            writer->u32(0);
+            writer->bytes(reinterpret_cast<const guint8*>("soun"), 4);
+            writer->zeros(12);
+            writer->bytes(reinterpret_cast<const guint8*>("Audio"), sizeof("Audio"));
+            writer->close(hdlr);
+
+            const size_t minf = writer->open("minf");
+            {
+                const size_t smhd = writer->openFull("smhd", 0, 0);
+                writer->zeros(2 + 2); // balance, reserved
+                writer->close(smhd);
+
+                const size_t dinf = writer->open("dinf");
+                const size_t dref = writer->openFull("dref", 0, 0);
+                writer->u32(1);
+                writer->close(writer->openFull("url ", 0, 0x000001)); // media is in the same file
+                writer->close(dref);
+                writer->close(dinf);
+
+                const size_t stbl = writer->open("stbl");
+                {
+                    const size_t stsd = writer->openFull("stsd", 0, 0);
+                    writer->u32(1);
+                    const size_t entry = writer->open("mp4a");
+                    writer->zeros(6);
+                    writer->u16(1); // data reference index
+                    writer->zeros(8);
+                    writer->u16(channels);
+                    writer->u16(16); // sample size
+                    writer->zeros(2 + 2);
+                    writer->u32(_audioTimescale << 16);
+
+                    const size_t esds = writer->openFull("esds", 0, 0);
+                    const guint8 decoderConfigSize = 13 + 2 + configSize;
+                    writer->u8(0x03); // ES_Descriptor
+                    writer->u8(3 + 2 + decoderConfigSize + 3);
+                    writer->u16(0); // ES_ID
+                    writer->u8(0);
+                    writer->u8(0x04); // DecoderConfigDescriptor
+                    writer->u8(decoderConfigSize);
+                    writer->u8(0x40); // MPEG-4 Audio
+                    writer->u8(0x15); // audio stream
+                    writer->u24(0); // buffer size
+                    writer->u32(0); // max bitrate
+                    writer->u32(0); // avg bitrate
+                    writer->u8(0x05); // DecoderSpecificInfo
+                    writer->u8(configSize);
+                    writer->buffer(audioSpecificConfig);
+                    writer->u8(0x06); // SLConfigDescriptor
+                    writer->u8(1);
+                    writer->u8(0x02);
+                    writer->close(esds);
+
+                    writer->close(entry);
+                    writer->close(stsd);
+
+                    // samples are in fragments only
+                    for(const char* type: { "stts", "stsc", "stco" }) {
+                        const size_t box = writer->openFull(type, 0, 0);
+                        writer->u32(0);
+                        writer->close(box);
+                    }
+                    const size_t stsz = writer->openFull("stsz", 0, 0);
+                    writer->u32(0);
+                    writer->u32(0);
+                    writer->close(stsz);
+                }
+                writer->close(stbl);
+            }
+            writer->close(minf);
+        }
+        writer->close(mdia);
+    }
+    writer->close(trak);
+}
+
+void Segmenter::writeInit(BoxWriter* writer) const
+{
+    const size_t ftyp = writer->open("ftyp");
+    writer->bytes(reinterpret_cast<const guint8*>("iso6"), 4);
+    writer->u32(0);
+    writer->bytes(reinterpret_cast<const guint8*>("iso6cmfcisommp41"), 16);
+    writer->close(ftyp);
+
+    const size_t moov = writer->open("moov");
+    {
+        const size_t mvhd = writer->openFull("mvhd", 0, 0);
+        writer->zeros(8); // creation/modification time
+        writer->u32(1000); // timescale
+        writer->u32(0); // duration
+        writer->u32(0x00010000); // rate
+        writer->u16(0x0100); // volume
+        writer->zeros(2 + 8);
+        for(guint32 value: UnityMatrix)
+            writer->u32(value);
+        writer->zeros(24);
+        writer->u32(_withAudio ? AUDIO_TRACK_ID + 1 : VIDEO_TRACK_ID + 1);
+        writer->close(mvhd);
+
+        writeVideoTrack(writer);
+        if(_withAudio)
+            writeAudioTrack(writer);
+
+        const size_t mvex = writer->open("mvex");
+        for(guint32 trackId: { VIDEO_TRACK_ID, AUDIO_TRACK_ID }) {
+            if(trackId == AUDIO_TRACK_ID && !_withAudio)
+                break;
+
+            const size_t trex = writer->openFull("trex", 0, 0);
+            writer->u32(trackId);
+            writer->u32(1); // sample description index
+            writer->zeros(4 + 4 + 4); // default duration, size, flags
+            writer->close(trex);
+        }
+        writer->close(mvex);
+    }
+    writer->close(moov);
+}
+
+bool Segmenter::start(GstClockTime baseTime)
+{
+    if(!CodecData(_videoCapsPtr.get())) {
+        Log()->error("HLS: video caps without codec data");
+        return false;
+    }
+
+    _withAudio = false;
+    if(_audioCapsPtr) {
+        const GstStructure* structure = gst_caps_get_structure(_audioCapsPtr.get(), 0);
+        gint rate = 0;
+        GstBuffer* codecData = CodecData(_audioCapsPtr.get());
+        if(gst_structure_get_int(structure, "rate", &rate) && rate > 0 &&
+            codecData && gst_buffer_get_size(codecData) < 100)
+        {
+            _withAudio = true;
+            _audioTimescale = rate;
+        } else {
+            Log()->warn("HLS: unsupported audio caps, only video will be available");
+        }
+    }
+
+    auto initPtr = std::make_shared<HlsStream::Data>();
+    BoxWriter writer(initPtr.get());
+    writeInit(&writer);
+    _hlsStreamPtr->setInit(initPtr);
+
+    _started = true;
+    _baseTime = baseTime;
+    _segmentStartDts = 0;
+    _partStartsSegment = true;
+    _audioDecodeTimeValid = false;
+
+    return true;
+}
+
+void Segmenter::flush(GstClockTime cutTime, guint64 cutDts, bool nextStartsSegment)
+{
+    std::deque<AudioSample> audioSamples;
+    while(!_audioSamples.empty() && _audioSamples.front().pts < cutTime) {
+        audioSamples.push_back(_audioSamples.front());
+        _audioSamples.pop_front();
+    }
+
+    if(!audioSamples.empty() && !_audioDecodeTimeValid) {
+        _audioDecodeTime =
+            gst_util_uint64_scale_round(audioSamples.front().pts - _baseTime, _audioTimescale, GST_SECOND);
+        _audioDecodeTimeValid = true;
+    }
+
+    auto partPtr = std::make_shared<HlsStream::Data>();
+    BoxWriter writer(partPtr.get());
+
+    const size_t moof = writer.open("moof");
+    const size_t mfhd = writer.openFull("mfhd", 0, 0);
+    writer.u32(++_sequenceNumber);
+    writer.close(mfhd);
+
+    size_t videoDataOffset;
+    {
+        const size_t traf = writer.open("traf");
+        const size_t tfhd = writer.openFull("tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+        writer.u32(VIDEO_TRACK_ID);
+        writer.close(tfhd);
+
+        const size_t tfdt = writer.openFull("tfdt", 1, 0);
+        writer.u64(_videoSamples.front().dts);
+        writer.close(tfdt);
+
+        const size_t trun = writer.openFull(
+            "trun",
+            1, // signed composition offsets
+            TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE | TRUN_SAMPLE_FLAGS | TRUN_SAMPLE_CTO);
+        writer.u32(_videoSamples.size());
+        videoDataOffset = writer.size();
+        writer.u32(0); // patched below
+        for(const VideoSample& sample: _videoSamples) {
+            writer.u32(sample.duration);
+            writer.u32(gst_buffer_get_size(sample.buffer));
+            writer.u32(sample.keyFrame ? SAMPLE_FLAGS_SYNC : SAMPLE_FLAGS_NON_SYNC);
+            writer.u32(static_cast<guint32>(sample.compositionOffset));
+        }
+        writer.close(trun);
+        writer.close(traf);
+    }
+
+    size_t audioDataOffset = 0;
+    if(!audioSamples.empty()) {
+        const size_t traf = writer.open("traf");
+        const size_t tfhd = writer.openFull("tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+        writer.u32(AUDIO_TRACK_ID);
+        writer.close(tfhd);
+
+        const size_t tfdt = writer.openFull("tfdt", 1, 0);
+        writer.u64(_audioDecodeTime);
+        writer.close(tfdt);
+
+        const size_t trun = writer.openFull("trun", 0, TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE);
+        writer.u32(audioSamples.size());
+        audioDataOffset = writer.size();
+        writer.u32(0); // patched below
+        for(const AudioSample& sample: audioSamples) {
+            writer.u32(sample.duration);
+            writer.u32(gst_buffer_get_size(sample.buffer));
+            _audioDecodeTime += sample.duration;
+        }
+        writer.close(trun);
+        writer.close(traf);
+    }
+    writer.close(moof);
+
+    const size_t mdat = writer.open("mdat");
+    writer.patch32(videoDataOffset, static_cast<guint32>(writer.size() - moof));
+    for(const VideoSample& sample: _videoSamples)
+        writer.buffer(sample.buffer);
+    if(audioDataOffset)
+        writer.patch32(audioDataOffset, static_cast<guint32>(writer.size() - moof));
+    for(const AudioSample& sample: audioSamples)
+        writer.buffer(sample.buffer);
+    writer.close(mdat);
+
+    const double duration = double(cutDts - _videoSamples.front().dts) * 1000 / VIDEO_TIMESCALE;
+    _hlsStreamPtr->addPart(partPtr, duration, _videoSamples.front().keyFrame, _partStartsSegment);
+
+    for(VideoSample& sample: _videoSamples)
+        gst_buffer_unref(sample.buffer);
+    _videoSamples.clear();
+    for(AudioSample& sample: audioSamples)
+        gst_buffer_unref(sample.buffer);
+
+    _partStartsSegment = nextStartsSegment;
+    if(nextStartsSegment)
+        _segmentStartDts = cutDts;
+}
+
+void Segmenter::onVideo(GstBuffer* buffer)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(!_videoCapsPtr)
+        return;
+
+    const GstClockTime dts = GST_BUFFER_DTS_OR_PTS(buffer);
+    if(!GST_CLOCK_TIME_IS_VALID(dts))
+        return;
+
+    const bool keyFrame = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if(!_started) {
+        if(!keyFrame)
+            return;
+
+        if(!_audioCapsPtr && !_keyFrameSkipped) {
+            // audio is usually linked a bit later than video
+            _keyFrameSkipped = true;
+            return;
+        }
+
+        if(!start(dts))
+            return;
+    }
+
+    if(dts < _baseTime)
+        return;
+
+    const guint64 sampleDts = gst_util_uint64_scale_round(dts - _baseTime, VIDEO_TIMESCALE, GST_SECOND);
+    gint32 compositionOffset = 0;
+    if(GST_BUFFER_PTS_IS_VALID(buffer) && GST_BUFFER_PTS(buffer) >= _baseTime) {
+        const guint64 samplePts =
+            gst_util_uint64_scale_round(GST_BUFFER_PTS(buffer) - _baseTime, VIDEO_TIMESCALE, GST_SECOND);
+        compositionOffset = static_cast<gint32>(gint64(samplePts) - gint64(sampleDts));
+    }
+
+    if(!_videoSamples.empty()) {
+        VideoSample& last = _videoSamples.back();
+        last.duration = sampleDts > last.dts ? static_cast<guint32>(sampleDts - last.dts) : 1;
+
+        const guint64 partDuration = sampleDts - _videoSamples.front().dts;
+        const guint64 segmentDuration = sampleDts - _segmentStartDts;
+        const bool startSegment =
+            keyFrame && segmentDuration >= HlsStream::MIN_SEGMENT_DURATION * VIDEO_TIMESCALE / 1000;
+        // one more frame would make part longer than target
+        const bool partFull =
+            partDuration + last.duration > HlsStream::PART_TARGET * VIDEO_TIMESCALE / 1000;
+        if(startSegment || partFull)
+            flush(dts, sampleDts, startSegment);
+    }
+
+    _videoSamples.push_back(VideoSample { gst_buffer_ref(buffer), sampleDts, compositionOffset, 0, keyFrame });
+}
+
+void Segmenter::onAudio(GstBuffer* buffer)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(!_started || !_withAudio)
+        return;
+
+    const GstClockTime pts = GST_BUFFER_PTS(buffer);
+    if(!GST_CLOCK_TIME_IS_VALID(pts) || pts < _baseTime)
+        return;
+
+    guint32 duration = AAC_FRAME_SAMPLES;
+    if(GST_BUFFER_DURATION_IS_VALID(buffer)) {
+        duration = static_cast<guint32>(
+            gst_util_uint64_scale_round(GST_BUFFER_DURATION(buffer), _audioTimescale, GST_SECOND));
+    }
+
+    _audioSamples.push_back(AudioSample { gst_buffer_ref(buffer), pts, duration });
+
+    if(_audioSamples.size() > MAX_PENDING_AUDIO_FRAMES) {
+        gst_buffer_unref(_audioSamples.front().buffer);
+        _audioSamples.pop_front();
+        _audioDecodeTimeValid = false;
+    }
+}
+
+template<bool video>
+GstPadProbeReturn OnData(GstPad*, GstPadProbeInfo* info, gpointer userData)
+{
+    Segmenter* segmenter = static_cast<std::shared_ptr<Segmenter>*>(userData)->get();
+
+    if(info->type & (GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH)) {
+        GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+        switch(GST_EVENT_TYPE(event)) {
+            case GST_EVENT_CAPS: {
+                GstCaps* caps = nullptr;
+                gst_event_parse_caps(event, &caps);
+                if(video)
+                    segmenter->onVideoCaps(caps);
+                else
+                    segmenter->onAudioCaps(caps);
+                break;
+            }
+            case GST_EVENT_FLUSH_STOP:
+            case GST_EVENT_EOS:
+                segmenter->onStreamReset();
+                break;
+            default:
+                break;
+        }
+    } else if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        if(video)
+            segmenter->onVideo(GST_PAD_PROBE_INFO_BUFFER(info));
+        else
+            segmenter->onAudio(GST_PAD_PROBE_INFO_BUFFER(info));
+    } else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        for(guint i = 0, length = gst_buffer_list_length(list); i < length; ++i) {
+            if(video)
+                segmenter->onVideo(gst_buffer_list_get(list, i));
+            else
+                segmenter->onAudio(gst_buffer_list_get(list, i));
+        }
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+void AddProbe(GstPad* pad, GstPadProbeCallback callback, const std::shared_ptr<Segmenter>& segmenter)
+{
+    gst_pad_add_probe(
+        pad,
+        GstPadProbeType(
+            GST_PAD_PROBE_TYPE_BUFFER |
+            GST_PAD_PROBE_TYPE_BUFFER_LIST |
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM |
+            GST_PAD_PROBE_TYPE_EVENT_FLUSH),
+        callback,
+        new std::shared_ptr<Segmenter>(segmenter),
+        [] (gpointer userData) {
+            delete static_cast<std::shared_ptr<Segmenter>*>(userData);
+        });
+}
+
+}
+
+void AddHlsSegmenterProbes(
+    GstPad* videoPad,
+    GstPad* audioPad,
+    const std::shared_ptr<HlsStream>& hlsStream)
+{
+    auto segmenter = std::make_shared<Segmenter>(hlsStream);
+
+    AddProbe(videoPad, OnData<true>, segmenter);
+    AddProbe(audioPad, OnData<false>, segmenter);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <memory>
+
+#include <gst/gst.h>
+
+
+class HlsStream;
+
+// Muxes H.264/H.265 video (avc/hvc1 stream format, access unit aligned)
+// and raw AAC audio passing through pads into fMP4 (CMAF) parts of hlsStream.
+// Parts are cut not longer than HlsStream::PART_TARGET,
+// segments are started from keyframes only.
+// Audio is muxed only if its caps are known when muxing starts.
+void AddHlsSegmenterProbes(
+    GstPad* videoPad,
+    GstPad* audioPad,
+    const std::shared_ptr<HlsStream>& hlsStream);
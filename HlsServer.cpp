@@ -0,0 +1,538 @@
+#include "HlsServer.h"
+
+#include <cstring>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <microhttpd.h>
+
+#include "Log.h"
+#include "HlsStream.h"
+
+
+namespace {
+
+enum {
+    STRCMP_EQUAL = 0
+};
+
+enum {
+    HLS_READER_BLOCK_SIZE = 64 * 1024,
+    HLS_MAX_WAIT_TARGET_DURATIONS = 3,
+};
+
+const auto Log = ReStreamerLog;
+
+const char *const StreamersPrefix = "/api/streamers/";
+const size_t StreamersPrefixLen = strlen(StreamersPrefix);
+
+const char *const HlsInfix = "/hls/";
+const size_t HlsInfixLen = strlen(HlsInfix);
+const char *const HlsPlaylistName = "index.m3u8";
+
+const char* const CONTENT_TYPE_HLS_PLAYLIST = "application/vnd.apple.mpegurl";
+const char* const CONTENT_TYPE_MP4 = "video/mp4";
+
+typedef unsigned StatusCode;
+
+inline MHD_Response*
+FixResponse(MHD_Response* response)
+{
+    return response ? response : MHD_create_response_from_buffer_static(0, nullptr);
+}
+
+inline std::pair<StatusCode, MHD_Response*>
+OK(MHD_Response* response)
+{
+    return { MHD_HTTP_OK, FixResponse(response) };
+}
+
+inline std::pair<StatusCode, MHD_Response*>
+InternalError()
+{
+    return { MHD_HTTP_INTERNAL_SERVER_ERROR, FixResponse(nullptr) };
+}
+
+inline std::pair<StatusCode, MHD_Response*>
+BadRequest()
+{
+    return { MHD_HTTP_BAD_REQUEST, FixResponse(nullptr) };
+}
+
+inline std::pair<StatusCode, MHD_Response*>
+NotFound()
+{
+    return { MHD_HTTP_NOT_FOUND, FixResponse(nullptr) };
+}
+
+inline std::pair<StatusCode, MHD_Response*>
+ApplyHlsHeaders(
+    std::pair<StatusCode, MHD_Response*>&& response,
+    const char* contentType,
+    bool cacheable)
+{
+    if(response.second) {
+        if(response.first == MHD_HTTP_OK) {
+            MHD_add_response_header(
+                response.second,
+                MHD_HTTP_HEADER_CONTENT_TYPE,
+                contentType);
+        }
+        // errors could go away as soon as stream advances
+        MHD_add_response_header(
+            response.second,
+            MHD_HTTP_HEADER_CACHE_CONTROL,
+            cacheable && response.first == MHD_HTTP_OK ? "max-age=60" : "no-cache");
+        // HLS is expected to be played from anywhere
+        MHD_add_response_header(
+            response.second,
+            MHD_HTTP_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,
+            "*");
+    }
+
+    return response;
+}
+
+// parses unsigned number at the beginning of str and advances it
+bool ParseNumber(const char** str, guint64* number)
+{
+    if(!g_ascii_isdigit(**str))
+        return false;
+
+    gchar* end = nullptr;
+    *number = g_ascii_strtoull(*str, &end, 10);
+    *str = end;
+
+    return true;
+}
+
+// shares stored data with response without copying
+MHD_Response* CreateHlsDataResponse(const HlsStream::DataPtr& data)
+{
+    return MHD_create_response_from_buffer_with_free_callback_cls(
+        data->size(),
+        data->data(),
+        [] (void* cls) {
+            delete static_cast<HlsStream::DataPtr*>(cls);
+        },
+        new HlsStream::DataPtr(data));
+}
+
+MHD_Response* CreateHlsSegmentResponse(std::deque<HlsStream::DataPtr>&& parts)
+{
+    struct Reader {
+        std::deque<HlsStream::DataPtr> parts;
+    };
+
+    uint64_t size = 0;
+    for(const HlsStream::DataPtr& part: parts)
+        size += part->size();
+
+    auto read =
+        + [] (void* cls, uint64_t pos, char* buf, size_t max) -> ssize_t
+    {
+        const Reader* reader = static_cast<Reader*>(cls);
+
+        uint64_t partPos = 0;
+        for(const HlsStream::DataPtr& part: reader->parts) {
+            if(pos < partPos + part->size()) {
+                const size_t offset = pos - partPos;
+                const size_t count = std::min(max, part->size() - offset);
+                memcpy(buf, part->data() + offset, count);
+                return count;
+            }
+            partPos += part->size();
+        }
+
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    };
+
+    return MHD_create_response_from_callback(
+        size,
+        HLS_READER_BLOCK_SIZE,
+        read,
+        new Reader { std::move(parts) },
+        [] (void* cls) {
+            delete static_cast<Reader*>(cls);
+        });
+}
+
+std::pair<StatusCode, MHD_Response*>
+PlaylistResponse(const HlsStream& stream)
+{
+    const std::string playlist = stream.playlist();
+    if(playlist.empty())
+        return NotFound(); // nothing to play yet
+
+    MHD_Response* response = MHD_create_response_from_buffer_copy(playlist.size(), playlist.data());
+    if(!response)
+        return InternalError();
+
+    return OK(response);
+}
+
+std::pair<StatusCode, MHD_Response*>
+PartResponse(const HlsStream& stream, guint64 msn, unsigned part)
+{
+    if(const HlsStream::DataPtr data = stream.part(msn, part))
+        return OK(CreateHlsDataResponse(data));
+
+    return NotFound();
+}
+
+}
+
+// blocking request waiting for segment/part to appear
+struct HlsServer::Request
+{
+    MHD_Connection* connection;
+    std::shared_ptr<const HlsStream> stream;
+    guint64 msn;
+    std::optional<unsigned> part;
+    bool playlist;
+    gint64 deadline; // monotonic
+};
+
+HlsServer::HlsServer(
+    const HlsRegistry* hlsRegistry,
+    unsigned short port,
+    bool bindToLoopbackOnly) :
+    _hlsRegistry(hlsRegistry),
+    _port(port),
+    _bindToLoopbackOnly(bindToLoopbackOnly)
+{
+}
+
+HlsServer::~HlsServer()
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _suspendedChanged.notify_all();
+    if(_timeoutsThread.joinable())
+        _timeoutsThread.join();
+
+    // waits for listeners being called right now
+    std::map<const HlsStream*, std::weak_ptr<const HlsStream>> subscribedStreams;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        subscribedStreams.swap(_subscribedStreams);
+    }
+    for(const auto& [_, weakStream]: subscribedStreams) {
+        if(std::shared_ptr<const HlsStream> stream = weakStream.lock())
+            stream->removeListener(this);
+    }
+
+    // suspended connections have to be resumed before daemon is stopped
+    resumeAll();
+
+    if(_daemon)
+        MHD_stop_daemon(_daemon);
+}
+
+bool HlsServer::init() noexcept
+{
+    auto accessHandlerCallback =
+        + [] (
+            void* cls,
+            MHD_Connection* connection,
+            const char* url,
+            const char* method,
+            const char* /*version*/,
+            const char* /*uploadData*/,
+            size_t* uploadDataSize,
+            void** conCls) -> MHD_Result
+    {
+        HlsServer* self = static_cast<HlsServer*>(cls);
+        if(*uploadDataSize)
+            return MHD_NO; // GET only
+
+        return self->handleRequest(
+            connection,
+            method,
+            url,
+            reinterpret_cast<Request**>(conCls)) == MHD_YES ? MHD_YES : MHD_NO;
+    };
+
+    auto requestCompletedCallback =
+        + [] (
+            void* /*cls*/,
+            MHD_Connection* /*connection*/,
+            void** conCls,
+            MHD_RequestTerminationCode /*toe*/)
+    {
+        delete static_cast<Request*>(*conCls);
+        *conCls = nullptr;
+    };
+
+    sockaddr_in loopbackAddr {};
+    loopbackAddr.sin_family = AF_INET;
+    loopbackAddr.sin_port = htons(_port);
+    loopbackAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    MHD_OptionItem options[] = {
+        {
+            MHD_OPTION_NOTIFY_COMPLETED,
+            reinterpret_cast<intptr_t>(requestCompletedCallback),
+            nullptr
+        },
+        { _bindToLoopbackOnly ? MHD_OPTION_SOCK_ADDR : MHD_OPTION_END, 0, &loopbackAddr },
+        { MHD_OPTION_END, 0, nullptr },
+    };
+
+    _daemon = MHD_start_daemon(
+        MHD_USE_AUTO_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_ERROR_LOG,
+        _port,
+        nullptr, nullptr,
+        accessHandlerCallback, this,
+        MHD_OPTION_ARRAY, options,
+        MHD_OPTION_END);
+    if(!_daemon) {
+        Log()->error("Failed to start HLS server on port {}", _port);
+        return false;
+    }
+
+    _timeoutsThread = std::thread(&HlsServer::timeoutsMain, this);
+
+    Log()->info("HLS server listening on port {}", _port);
+
+    return true;
+}
+
+// path is expected to be "/api/streamers/<id>/hls/<name>"
+int HlsServer::handleRequest(
+    MHD_Connection* connection,
+    const char* method,
+    const char* url,
+    Request** request) noexcept
+{
+    auto respond = [connection] (std::pair<StatusCode, MHD_Response*>&& response) -> int {
+        const MHD_Result result = MHD_queue_response(connection, response.first, response.second);
+        MHD_destroy_response(response.second);
+        return result;
+    };
+
+    if(Request* resumed = *request) {
+        // requested data appeared or request timed out
+        if(resumed->playlist)
+            return respond(ApplyHlsHeaders(PlaylistResponse(*resumed->stream), CONTENT_TYPE_HLS_PLAYLIST, false));
+
+        return respond(ApplyHlsHeaders(PartResponse(*resumed->stream, resumed->msn, *resumed->part), CONTENT_TYPE_MP4, true));
+    }
+
+    if(strcmp(method, MHD_HTTP_METHOD_GET) != STRCMP_EQUAL)
+        return respond(BadRequest());
+
+    if(!g_str_has_prefix(url, StreamersPrefix))
+        return respond(NotFound());
+
+    const char* path = url + StreamersPrefixLen;
+    const char* infix = strstr(path, HlsInfix);
+    if(!infix)
+        return respond(NotFound());
+
+    const std::string id(path, infix - path);
+    const char* name = infix + HlsInfixLen;
+
+    const std::shared_ptr<const HlsStream> stream = _hlsRegistry->find(id);
+    if(!stream)
+        return respond(NotFound());
+
+    // server is allowed to fail blocked request after three target durations
+    const gint64 deadline =
+        g_get_monotonic_time() +
+        HLS_MAX_WAIT_TARGET_DURATIONS * HlsStream::MIN_SEGMENT_DURATION * 1000;
+
+    guint64 number;
+
+    if(strcmp(name, HlsPlaylistName) == STRCMP_EQUAL) {
+        std::optional<guint64> msn;
+        std::optional<unsigned> part;
+        if(const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "_HLS_msn")) {
+            if(!ParseNumber(&value, &number) || *value != '\0')
+                return respond(BadRequest());
+            msn = number;
+        }
+        if(const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "_HLS_part")) {
+            if(!msn || !ParseNumber(&value, &number) || *value != '\0')
+                return respond(BadRequest());
+            part = static_cast<unsigned>(number);
+        }
+
+        if(msn && !stream->isExpected(*msn, part))
+            return respond(ApplyHlsHeaders(BadRequest(), CONTENT_TYPE_HLS_PLAYLIST, false));
+
+        if(msn && !stream->isAvailable(*msn, part)) {
+            *request = new Request { connection, stream, *msn, part, true, deadline };
+            if(suspend(connection, *request))
+                return MHD_YES;
+        }
+
+        return respond(ApplyHlsHeaders(PlaylistResponse(*stream), CONTENT_TYPE_HLS_PLAYLIST, false));
+    }
+
+    if(g_str_has_prefix(name, "init-")) {
+        const char* initId = name + strlen("init-");
+        if(!ParseNumber(&initId, &number) || strcmp(initId, ".mp4") != STRCMP_EQUAL)
+            return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+
+        const HlsStream::DataPtr init = stream->init(static_cast<unsigned>(number));
+        if(!init)
+            return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+
+        return respond(ApplyHlsHeaders(OK(CreateHlsDataResponse(init)), CONTENT_TYPE_MP4, true));
+    }
+
+    if(!ParseNumber(&name, &number))
+        return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+    const guint64 msn = number;
+
+    if(strcmp(name, ".m4s") == STRCMP_EQUAL) {
+        std::deque<HlsStream::DataPtr> parts = stream->segment(msn);
+        if(parts.empty())
+            return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+
+        return respond(ApplyHlsHeaders(OK(CreateHlsSegmentResponse(std::move(parts))), CONTENT_TYPE_MP4, true));
+    }
+
+    if(*name != '.')
+        return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+    ++name;
+    if(!ParseNumber(&name, &number) || strcmp(name, ".m4s") != STRCMP_EQUAL)
+        return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+    const unsigned part = static_cast<unsigned>(number);
+
+    if(const HlsStream::DataPtr data = stream->part(msn, part))
+        return respond(ApplyHlsHeaders(OK(CreateHlsDataResponse(data)), CONTENT_TYPE_MP4, true));
+
+    // preload hinted part
+    if(!stream->isExpected(msn, part))
+        return respond(ApplyHlsHeaders(NotFound(), CONTENT_TYPE_MP4, true));
+
+    *request = new Request { connection, stream, msn, part, false, deadline };
+    if(suspend(connection, *request))
+        return MHD_YES;
+
+    return respond(ApplyHlsHeaders(PartResponse(*stream, msn, part), CONTENT_TYPE_MP4, true));
+}
+
+// returns false if server is stopping and request should be answered right away
+bool HlsServer::suspend(MHD_Connection* connection, Request* request) noexcept
+{
+    subscribe(request->stream);
+
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+
+        if(_stopping)
+            return false;
+
+        // connection has to be suspended before anybody could resume it
+        MHD_suspend_connection(connection);
+        _suspended.push_back(request);
+    }
+    _suspendedChanged.notify_all();
+
+    // data could appear before request was added to suspended
+    onStreamChanged(request->stream.get());
+
+    return true;
+}
+
+// called from HTTP server thread only
+void HlsServer::subscribe(const std::shared_ptr<const HlsStream>& stream) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+
+        auto [it, inserted] = _subscribedStreams.emplace(stream.get(), stream);
+        if(!inserted) {
+            if(!it->second.expired())
+                return;
+            // another stream got the same address
+            it->second = stream;
+        }
+    }
+
+    // listener is added without _mutex held, since it's locked inside listener
+    const HlsStream* streamPtr = stream.get();
+    stream->addListener(this, [this, streamPtr] () {
+        onStreamChanged(streamPtr);
+    });
+}
+
+void HlsServer::onStreamChanged(const HlsStream* stream) noexcept
+{
+    std::deque<MHD_Connection*> ready;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+
+        for(auto it = _suspended.begin(); it != _suspended.end();) {
+            Request* request = *it;
+            if(request->stream.get() == stream && stream->isAvailable(request->msn, request->part)) {
+                ready.push_back(request->connection);
+                it = _suspended.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for(MHD_Connection* connection: ready)
+        MHD_resume_connection(connection);
+}
+
+void HlsServer::timeoutsMain() noexcept
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(!_stopping) {
+        const gint64 now = g_get_monotonic_time();
+
+        std::deque<MHD_Connection*> expired;
+        std::optional<gint64> nextDeadline;
+        for(auto it = _suspended.begin(); it != _suspended.end();) {
+            Request* request = *it;
+            if(request->deadline <= now) {
+                expired.push_back(request->connection);
+                it = _suspended.erase(it);
+            } else {
+                nextDeadline = std::min(nextDeadline.value_or(request->deadline), request->deadline);
+                ++it;
+            }
+        }
+
+        if(!expired.empty()) {
+            lock.unlock();
+            for(MHD_Connection* connection: expired)
+                MHD_resume_connection(connection);
+            lock.lock();
+            continue;
+        }
+
+        if(nextDeadline)
+            _suspendedChanged.wait_for(lock, std::chrono::microseconds(*nextDeadline - now));
+        else
+            _suspendedChanged.wait(lock);
+    }
+}
+
+void HlsServer::resumeAll() noexcept
+{
+    std::list<Request*> suspended;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        suspended.swap(_suspended);
+    }
+
+    for(Request* request: suspended)
+        MHD_resume_connection(request->connection);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <optional>
+
+#include <glib.h>
+
+class HlsRegistry;
+class HlsStream;
+struct MHD_Daemon;
+struct MHD_Connection;
+
+
+// Serves LL-HLS streams from HlsRegistry at /api/streamers/<id>/hls/.
+// Blocking playlist reloads and preload hinted parts suspend HTTP connection
+// until HlsStream gets requested data (or request times out),
+// so waiting viewers don't hold server thread.
+class HlsServer
+{
+public:
+    HlsServer(const HlsRegistry*, unsigned short port, bool bindToLoopbackOnly);
+    HlsServer(const HlsServer&) = delete;
+    HlsServer& operator = (const HlsServer&) = delete;
+    ~HlsServer();
+
+    bool init() noexcept;
+
+private:
+    struct Request;
+
+    int handleRequest(MHD_Connection*, const char* method, const char* url, Request**) noexcept;
+    bool suspend(MHD_Connection*, Request*) noexcept;
+    void subscribe(const std::shared_ptr<const HlsStream>&) noexcept;
+
+    // called from HlsStream writer threads
+    void onStreamChanged(const HlsStream*) noexcept;
+    // resumes timed out requests
+    void timeoutsMain() noexcept;
+    void resumeAll() noexcept;
+
+private:
+    const HlsRegistry* _hlsRegistry;
+    const unsigned short _port;
+    const bool _bindToLoopbackOnly;
+
+    MHD_Daemon* _daemon = nullptr;
+
+    std::mutex _mutex;
+    std::condition_variable _suspendedChanged;
+    bool _stopping = false;
+    std::list<Request*> _suspended;
+    std::map<const HlsStream*, std::weak_ptr<const HlsStream>> _subscribedStreams;
+    std::thread _timeoutsThread;
+};
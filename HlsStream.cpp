@@ -0,0 +1,257 @@
+#include "HlsStream.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+
+#include <spdlog/fmt/fmt.h>
+
+
+void HlsStream::setInit(const DataPtr& init) noexcept
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    _inits.emplace(_nextInitId++, init);
+    _discontinuityPending = !_segments.empty();
+}
+
+void HlsStream::addPart(
+    const DataPtr& data,
+    double duration,
+    bool independent,
+    bool startsSegment) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+
+        if(_inits.empty())
+            return;
+
+        if(startsSegment || _segments.empty()) {
+            if(!_segments.empty()) {
+                // the previous segment is complete now
+                const unsigned segmentDuration =
+                    static_cast<unsigned>(std::lround(_segments.back().duration / 1000));
+                _targetDuration = std::max(_targetDuration, segmentDuration);
+            }
+
+            _segments.push_back(Segment { _nextMsn++, _inits.rbegin()->first, _discontinuityPending });
+            _discontinuityPending = false;
+        }
+
+        Segment& segment = _segments.back();
+        segment.parts.push_back(Part { data, duration, independent });
+        segment.duration += duration;
+
+        trim();
+    }
+
+    const std::lock_guard<std::mutex> lock(_listenersMutex);
+    for(const auto& [_, listener]: _listeners)
+        listener();
+}
+
+void HlsStream::trim()
+{
+    while(_segments.size() > MAX_SEGMENTS + 1) {
+        if(_segments.front().discontinuity)
+            ++_discontinuitySequence;
+        _segments.pop_front();
+    }
+
+    // init sections not referenced anymore
+    const unsigned firstInitId = _segments.front().initId;
+    while(!_inits.empty() && _inits.begin()->first < firstInitId)
+        _inits.erase(_inits.begin());
+}
+
+std::string HlsStream::playlist() const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_segments.empty())
+        return {};
+
+    fmt::memory_buffer out;
+    auto appender = std::back_inserter(out);
+
+    fmt::format_to(
+        appender,
+        "#EXTM3U\n"
+        "#EXT-X-VERSION:9\n"
+        "#EXT-X-TARGETDURATION:{}\n"
+        "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK={:.3f}\n"
+        "#EXT-X-PART-INF:PART-TARGET={:.3f}\n"
+        "#EXT-X-MEDIA-SEQUENCE:{}\n",
+        _targetDuration,
+        3 * PART_TARGET / 1000.,
+        PART_TARGET / 1000.,
+        _segments.front().msn);
+    if(_discontinuitySequence)
+        fmt::format_to(appender, "#EXT-X-DISCONTINUITY-SEQUENCE:{}\n", _discontinuitySequence);
+
+    std::optional<unsigned> initId;
+    for(auto it = _segments.begin(); it != _segments.end(); ++it) {
+        const Segment& segment = *it;
+        const size_t segmentsAfter = std::distance(it, _segments.end()) - 1;
+        const bool complete = segmentsAfter > 0;
+
+        if(segment.discontinuity)
+            fmt::format_to(appender, "#EXT-X-DISCONTINUITY\n");
+        if(initId != segment.initId) {
+            fmt::format_to(appender, "#EXT-X-MAP:URI=\"init-{}.mp4\"\n", segment.initId);
+            initId = segment.initId;
+        }
+
+        if(segmentsAfter <= PARTS_SEGMENTS) {
+            for(unsigned part = 0; part < segment.parts.size(); ++part) {
+                fmt::format_to(
+                    appender,
+                    "#EXT-X-PART:DURATION={:.5f},URI=\"{}.{}.m4s\"{}\n",
+                    segment.parts[part].duration / 1000,
+                    segment.msn,
+                    part,
+                    segment.parts[part].independent ? ",INDEPENDENT=YES" : "");
+            }
+        }
+
+        if(complete)
+            fmt::format_to(appender, "#EXTINF:{:.5f},\n{}.m4s\n", segment.duration / 1000, segment.msn);
+    }
+
+    const Segment& last = _segments.back();
+    fmt::format_to(
+        appender,
+        "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"{}.{}.m4s\"\n",
+        last.msn,
+        last.parts.size());
+
+    return fmt::to_string(out);
+}
+
+const HlsStream::Segment* HlsStream::findSegment(guint64 msn) const
+{
+    if(_segments.empty() || msn < _segments.front().msn || msn > _segments.back().msn)
+        return nullptr;
+
+    return &_segments[msn - _segments.front().msn];
+}
+
+bool HlsStream::available(guint64 msn, std::optional<unsigned> part) const
+{
+    if(_segments.empty())
+        return false;
+
+    const Segment& last = _segments.back();
+    if(msn < last.msn)
+        return true;
+    if(msn > last.msn)
+        return false;
+
+    // segment is complete only when the next one is started
+    return part && *part < last.parts.size();
+}
+
+bool HlsStream::isExpected(guint64 msn, std::optional<unsigned> part) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_segments.empty())
+        return msn == _nextMsn;
+
+    if(msn < _segments.front().msn)
+        return false;
+    if(available(msn, part))
+        return true;
+
+    const Segment& last = _segments.back();
+
+    // next part of the current segment or the beginning of the next segment
+    return
+        (msn == last.msn && (!part || *part == last.parts.size())) ||
+        (msn == last.msn + 1 && (!part || *part == 0));
+}
+
+bool HlsStream::isAvailable(guint64 msn, std::optional<unsigned> part) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    return available(msn, part);
+}
+
+void HlsStream::addListener(const void* owner, const std::function<void ()>& listener) const
+{
+    const std::lock_guard<std::mutex> lock(_listenersMutex);
+    _listeners[owner] = listener;
+}
+
+void HlsStream::removeListener(const void* owner) const
+{
+    const std::lock_guard<std::mutex> lock(_listenersMutex);
+    _listeners.erase(owner);
+}
+
+HlsStream::DataPtr HlsStream::init(unsigned initId) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _inits.find(initId);
+    if(it == _inits.end())
+        return nullptr;
+
+    return it->second;
+}
+
+HlsStream::DataPtr HlsStream::part(guint64 msn, unsigned part) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    const Segment* segment = findSegment(msn);
+    if(!segment || part >= segment->parts.size())
+        return nullptr;
+
+    return segment->parts[part].data;
+}
+
+std::deque<HlsStream::DataPtr> HlsStream::segment(guint64 msn) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    const Segment* segment = findSegment(msn);
+    if(!segment || segment == &_segments.back())
+        return {};
+
+    std::deque<DataPtr> parts;
+    for(const Part& part: segment->parts)
+        parts.push_back(part.data);
+
+    return parts;
+}
+
+std::shared_ptr<HlsStream> HlsRegistry::acquire(const std::string& id)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    std::shared_ptr<HlsStream>& stream = _streams[id];
+    if(!stream)
+        stream = std::make_shared<HlsStream>();
+
+    return stream;
+}
+
+void HlsRegistry::remove(const std::string& id)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _streams.erase(id);
+}
+
+std::shared_ptr<const HlsStream> HlsRegistry::find(const std::string& id) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _streams.find(id);
+    if(it == _streams.end())
+        return nullptr;
+
+    return it->second;
+}
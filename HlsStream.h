@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <optional>
+
+#include <glib.h>
+
+
+// Low-Latency HLS media playlist with fMP4 init sections, segments and parts
+// kept in memory. Stored data is immutable and shared with HTTP responses,
+// so serving doesn't copy it and doesn't block the writer.
+// Written from streaming threads, read from HTTP server threads.
+class HlsStream
+{
+public:
+    typedef std::vector<guint8> Data;
+    typedef std::shared_ptr<const Data> DataPtr;
+
+    enum {
+        PART_TARGET = 500, // milliseconds
+        MIN_SEGMENT_DURATION = 2000, // milliseconds
+        MAX_SEGMENTS = 6, // complete segments in playlist
+        PARTS_SEGMENTS = 2, // complete segments still listing their parts
+    };
+
+    // starts new discontinuity with new init section
+    void setInit(const DataPtr&) noexcept;
+    // duration in milliseconds
+    void addPart(const DataPtr&, double duration, bool independent, bool startsSegment) noexcept;
+
+    // empty if there is nothing to play yet
+    std::string playlist() const;
+
+    // segment if part is not specified
+    bool isAvailable(guint64 msn, std::optional<unsigned> part) const;
+    // returns true if requested segment (or part) is either available already,
+    // or could appear soon
+    bool isExpected(guint64 msn, std::optional<unsigned> part) const;
+
+    // listener is called from writer thread every time new part is added,
+    // removeListener() waits for listener being called right now
+    void addListener(const void* owner, const std::function<void ()>&) const;
+    void removeListener(const void* owner) const;
+
+    DataPtr init(unsigned initId) const;
+    DataPtr part(guint64 msn, unsigned part) const;
+    // parts of complete segment
+    std::deque<DataPtr> segment(guint64 msn) const;
+
+private:
+    struct Part {
+        DataPtr data;
+        double duration; // milliseconds
+        bool independent;
+    };
+
+    struct Segment {
+        guint64 msn;
+        unsigned initId;
+        bool discontinuity;
+        std::deque<Part> parts;
+        double duration; // milliseconds
+    };
+
+    bool available(guint64 msn, std::optional<unsigned> part) const;
+    const Segment* findSegment(guint64 msn) const;
+    void trim();
+
+private:
+    mutable std::mutex _mutex;
+
+    mutable std::mutex _listenersMutex;
+    mutable std::map<const void*, std::function<void ()>> _listeners; // owner -> listener
+
+    std::map<unsigned, DataPtr> _inits; // initId -> init section
+    unsigned _nextInitId = 0;
+    bool _discontinuityPending = false;
+
+    std::deque<Segment> _segments; // the last one is still growing
+    guint64 _nextMsn = 0;
+    unsigned _discontinuitySequence = 0;
+    unsigned _targetDuration = (MIN_SEGMENT_DURATION + 999) / 1000; // seconds, never decreases
+};
+
+// thread safe
+class HlsRegistry
+{
+public:
+    // creates stream if it doesn't exist yet
+    std::shared_ptr<HlsStream> acquire(const std::string& id);
+    void remove(const std::string& id);
+
+    std::shared_ptr<const HlsStream> find(const std::string& id) const;
+
+private:
+    mutable std::mutex _mutex;
+    std::map<std::string, std::shared_ptr<HlsStream>> _streams;
+};
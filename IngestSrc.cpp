@@ -0,0 +1,408 @@
+#include "IngestSrc.h"
+
+#include <cassert>
+#include <cstring>
+#include <mutex>
+
+#include <CxxPtr/GstPtr.h>
+#include <CxxPtr/GlibPtr.h>
+
+#include "Log.h"
+
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+const char *const IngestSrcName = "ingestsrc";
+const char *const IngestUriPrefix = "ingest://";
+
+std::mutex SubscriptionHandlersMutex;
+IngestSubscribe SubscribeHandler;
+IngestUnsubscribe UnsubscribeHandler;
+
+GstStaticPadTemplate SrcTemplate =
+    GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS_ANY);
+
+// owned by proxy sink pad linked to ingest,
+// so it's accessed only from ingest streaming thread
+struct IngestProxy
+{
+    GstPadPtr srcPadPtr; // linked to consumer
+
+    GstSegment segment;
+    bool keyFrameReceived = false;
+    bool offsetValid = false;
+    GstClockTimeDiff offset = 0;
+};
+
+// ingest and consumer have different clocks and base times,
+// so all timestamps are moved to consumer's running time
+GstClockTime ProxyTimestamp(const IngestProxy& proxy, GstClockTime timestamp)
+{
+    if(!GST_CLOCK_TIME_IS_VALID(timestamp))
+        return GST_CLOCK_TIME_NONE;
+
+    const GstClockTime runningTime =
+        gst_segment_to_running_time(&proxy.segment, GST_FORMAT_TIME, timestamp);
+    if(!GST_CLOCK_TIME_IS_VALID(runningTime))
+        return GST_CLOCK_TIME_NONE;
+
+    const GstClockTimeDiff proxyTimestamp = static_cast<GstClockTimeDiff>(runningTime) + proxy.offset;
+
+    return proxyTimestamp > 0 ? proxyTimestamp : 0;
+}
+
+// called from ingest streaming thread
+GstFlowReturn ProxyChain(GstPad* pad, GstObject* /*parent*/, GstBuffer* buffer)
+{
+    IngestProxy* proxy = static_cast<IngestProxy*>(GST_PAD_CHAINDATA(pad));
+    GstPad* srcPad = proxy->srcPadPtr.get();
+
+    if(!proxy->keyFrameReceived) {
+        if(GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            gst_buffer_unref(buffer);
+            return GST_FLOW_OK;
+        }
+        proxy->keyFrameReceived = true;
+    }
+
+    if(!proxy->offsetValid) {
+        GstPadPtr peerPtr(gst_pad_get_peer(srcPad));
+        GstElementPtr consumerPtr(peerPtr ? gst_pad_get_parent_element(peerPtr.get()) : nullptr);
+        GstClock* clock = consumerPtr ? gst_element_get_clock(consumerPtr.get()) : nullptr;
+        const GstClockTime runningTime =
+            gst_segment_to_running_time(
+                &proxy->segment,
+                GST_FORMAT_TIME,
+                GST_BUFFER_DTS_OR_PTS(buffer));
+        if(!clock || !GST_CLOCK_TIME_IS_VALID(runningTime)) {
+            // consumer is not playing yet
+            if(clock) gst_object_unref(clock);
+            gst_buffer_unref(buffer);
+            proxy->keyFrameReceived = false;
+            return GST_FLOW_OK;
+        }
+
+        const GstClockTime consumerRunningTime =
+            gst_clock_get_time(clock) - gst_element_get_base_time(consumerPtr.get());
+        gst_object_unref(clock);
+
+        proxy->offset = GST_CLOCK_DIFF(runningTime, consumerRunningTime);
+        proxy->offsetValid = true;
+    }
+
+    buffer = gst_buffer_make_writable(buffer);
+    GST_BUFFER_PTS(buffer) = ProxyTimestamp(*proxy, GST_BUFFER_PTS(buffer));
+    GST_BUFFER_DTS(buffer) = ProxyTimestamp(*proxy, GST_BUFFER_DTS(buffer));
+
+    gst_pad_push(srcPad, buffer);
+
+    // any consumer issues should not affect ingest
+    return GST_FLOW_OK;
+}
+
+// called from ingest streaming thread
+gboolean ProxyEvent(GstPad* pad, GstObject* /*parent*/, GstEvent* event)
+{
+    IngestProxy* proxy = static_cast<IngestProxy*>(GST_PAD_EVENTDATA(pad));
+    GstPad* srcPad = proxy->srcPadPtr.get();
+
+    switch(GST_EVENT_TYPE(event)) {
+        case GST_EVENT_STREAM_START:
+        case GST_EVENT_CAPS:
+            gst_pad_push_event(srcPad, event);
+            break;
+        case GST_EVENT_SEGMENT: {
+            gst_event_copy_segment(event, &proxy->segment);
+            gst_event_unref(event);
+
+            proxy->offsetValid = false;
+
+            GstSegment segment;
+            gst_segment_init(&segment, GST_FORMAT_TIME);
+            gst_pad_push_event(srcPad, gst_event_new_segment(&segment));
+            break;
+        }
+        default:
+            // ingest lifetime is not related to consumer lifetime
+            gst_event_unref(event);
+            break;
+    }
+
+    return TRUE;
+}
+
+}
+
+struct IngestSrc
+{
+    GstBin parent;
+
+    GstElement* queue;
+
+    gchar* uri;
+    gchar* sourceUrl;
+
+    GstPad* proxySrcPad;
+    GstPad* proxySinkPad;
+};
+
+struct IngestSrcClass
+{
+    GstBinClass parent_class;
+};
+
+static void ingest_src_uri_handler_init(gpointer iface, gpointer ifaceData);
+
+G_DEFINE_TYPE_WITH_CODE(
+    IngestSrc,
+    ingest_src,
+    GST_TYPE_BIN,
+    G_IMPLEMENT_INTERFACE(GST_TYPE_URI_HANDLER, ingest_src_uri_handler_init))
+
+static bool ingest_src_subscribe(IngestSrc* self)
+{
+    std::lock_guard<std::mutex> lock(SubscriptionHandlersMutex);
+    if(!SubscribeHandler)
+        return false;
+
+    GstPadPtr queueSinkPad(gst_element_get_static_pad(self->queue, "sink"));
+
+    GstPad* proxySrcPad = gst_pad_new("proxysrc", GST_PAD_SRC);
+    gst_object_ref_sink(proxySrcPad);
+    GstPad* proxySinkPad = gst_pad_new("proxysink", GST_PAD_SINK);
+    gst_object_ref_sink(proxySinkPad);
+
+    IngestProxy* proxy = new IngestProxy { GstPadPtr(GST_PAD(gst_object_ref(proxySrcPad))) };
+    gst_segment_init(&proxy->segment, GST_FORMAT_TIME);
+
+    gst_pad_set_chain_function_full(
+        proxySinkPad,
+        ProxyChain,
+        proxy,
+        [] (gpointer userData) {
+            delete static_cast<IngestProxy*>(userData);
+        });
+    gst_pad_set_event_function_full(proxySinkPad, ProxyEvent, proxy, nullptr);
+
+    gst_pad_set_active(proxySrcPad, TRUE);
+    gst_pad_set_active(proxySinkPad, TRUE);
+
+    if(GST_PAD_LINK_OK != gst_pad_link(proxySrcPad, queueSinkPad.get())) {
+        Log()->error("Failed to link ingest proxy");
+        gst_object_unref(proxySinkPad);
+        gst_object_unref(proxySrcPad);
+        return false;
+    }
+
+    self->proxySrcPad = proxySrcPad;
+    self->proxySinkPad = proxySinkPad;
+
+    SubscribeHandler(self->sourceUrl, proxySinkPad);
+
+    return true;
+}
+
+static void ingest_src_unsubscribe(IngestSrc* self)
+{
+    if(!self->proxySinkPad)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(SubscriptionHandlersMutex);
+        if(UnsubscribeHandler)
+            UnsubscribeHandler(self->sourceUrl, self->proxySinkPad);
+    }
+
+    // ingest could still push some data until it will process unsubscribe
+    gst_pad_set_active(self->proxySrcPad, FALSE);
+    if(GstPadPtr peerPtr { gst_pad_get_peer(self->proxySrcPad) })
+        gst_pad_unlink(self->proxySrcPad, peerPtr.get());
+
+    gst_object_unref(self->proxySinkPad);
+    self->proxySinkPad = nullptr;
+    gst_object_unref(self->proxySrcPad);
+    self->proxySrcPad = nullptr;
+}
+
+static GstStateChangeReturn ingest_src_change_state(
+    GstElement* element,
+    GstStateChange transition)
+{
+    IngestSrc* self = reinterpret_cast<IngestSrc*>(element);
+
+    switch(transition) {
+        case GST_STATE_CHANGE_NULL_TO_READY:
+            if(!self->queue || !self->sourceUrl || !ingest_src_subscribe(self))
+                return GST_STATE_CHANGE_FAILURE;
+            break;
+        default:
+            break;
+    }
+
+    GstStateChangeReturn result =
+        GST_ELEMENT_CLASS(ingest_src_parent_class)->change_state(element, transition);
+
+    switch(transition) {
+        case GST_STATE_CHANGE_READY_TO_PAUSED:
+        case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
+            // ingest is always live
+            if(result != GST_STATE_CHANGE_FAILURE)
+                result = GST_STATE_CHANGE_NO_PREROLL;
+            break;
+        case GST_STATE_CHANGE_READY_TO_NULL:
+            ingest_src_unsubscribe(self);
+            break;
+        default:
+            break;
+    }
+
+    return result;
+}
+
+static void ingest_src_finalize(GObject* object)
+{
+    IngestSrc* self = reinterpret_cast<IngestSrc*>(object);
+
+    ingest_src_unsubscribe(self);
+
+    g_free(self->uri);
+    g_free(self->sourceUrl);
+
+    G_OBJECT_CLASS(ingest_src_parent_class)->finalize(object);
+}
+
+static void ingest_src_class_init(IngestSrcClass* klass)
+{
+    GObjectClass* objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass* elementClass = GST_ELEMENT_CLASS(klass);
+
+    objectClass->finalize = ingest_src_finalize;
+    elementClass->change_state = ingest_src_change_state;
+
+    gst_element_class_set_static_metadata(
+        elementClass,
+        "Ingest source",
+        "Source/Video",
+        "Consumes video from already running ingest",
+        "RTMPVideoStreamer");
+    gst_element_class_add_static_pad_template(elementClass, &SrcTemplate);
+}
+
+static void ingest_src_init(IngestSrc* self)
+{
+    GST_OBJECT_FLAG_SET(self, GST_ELEMENT_FLAG_SOURCE);
+
+    // slow consumer should never block ingest
+    self->queue = gst_element_factory_make("queue", nullptr);
+    if(!self->queue) {
+        Log()->error("Failed to create \"queue\" element");
+        return;
+    }
+    gst_util_set_object_arg(G_OBJECT(self->queue), "leaky", "downstream");
+
+    gst_bin_add(GST_BIN(self), self->queue);
+
+    GstPadPtr queueSrcPad(gst_element_get_static_pad(self->queue, "src"));
+    GstPadTemplate* srcTemplate = gst_static_pad_template_get(&SrcTemplate);
+    gst_element_add_pad(
+        GST_ELEMENT(self),
+        gst_ghost_pad_new_from_template("src", queueSrcPad.get(), srcTemplate));
+    gst_object_unref(srcTemplate);
+}
+
+static GstURIType ingest_src_uri_get_type(GType)
+{
+    return GST_URI_SRC;
+}
+
+static const gchar* const* ingest_src_uri_get_protocols(GType)
+{
+    static const gchar* const protocols[] = { "ingest", nullptr };
+    return protocols;
+}
+
+static gchar* ingest_src_uri_get_uri(GstURIHandler* handler)
+{
+    IngestSrc* self = reinterpret_cast<IngestSrc*>(handler);
+
+    return g_strdup(self->uri);
+}
+
+static gboolean ingest_src_uri_set_uri(
+    GstURIHandler* handler,
+    const gchar* uri,
+    GError** error)
+{
+    IngestSrc* self = reinterpret_cast<IngestSrc*>(handler);
+
+    if(GST_STATE(self) != GST_STATE_NULL) {
+        g_set_error(
+            error,
+            GST_URI_ERROR, GST_URI_ERROR_BAD_STATE,
+            "Changing uri is not supported in current state");
+        return FALSE;
+    }
+
+    if(!g_str_has_prefix(uri, IngestUriPrefix)) {
+        g_set_error(
+            error,
+            GST_URI_ERROR, GST_URI_ERROR_BAD_URI,
+            "Invalid ingest uri \"%s\"", uri);
+        return FALSE;
+    }
+
+    gchar* sourceUrl = g_uri_unescape_string(uri + strlen(IngestUriPrefix), nullptr);
+    if(!sourceUrl || sourceUrl[0] == '\0') {
+        g_free(sourceUrl);
+        g_set_error(
+            error,
+            GST_URI_ERROR, GST_URI_ERROR_BAD_URI,
+            "Invalid ingest uri \"%s\"", uri);
+        return FALSE;
+    }
+
+    g_free(self->uri);
+    self->uri = g_strdup(uri);
+    g_free(self->sourceUrl);
+    self->sourceUrl = sourceUrl;
+
+    return TRUE;
+}
+
+static void ingest_src_uri_handler_init(gpointer iface, gpointer /*ifaceData*/)
+{
+    GstURIHandlerInterface* uriHandler = static_cast<GstURIHandlerInterface*>(iface);
+
+    uriHandler->get_type = ingest_src_uri_get_type;
+    uriHandler->get_protocols = ingest_src_uri_get_protocols;
+    uriHandler->get_uri = ingest_src_uri_get_uri;
+    uriHandler->set_uri = ingest_src_uri_set_uri;
+}
+
+bool RegisterIngestSrc()
+{
+    return gst_element_register(
+        nullptr,
+        IngestSrcName,
+        GST_RANK_PRIMARY,
+        ingest_src_get_type()) != FALSE;
+}
+
+void SetIngestSubscriptionHandlers(
+    const IngestSubscribe& subscribe,
+    const IngestUnsubscribe& unsubscribe)
+{
+    std::lock_guard<std::mutex> lock(SubscriptionHandlersMutex);
+
+    SubscribeHandler = subscribe;
+    UnsubscribeHandler = unsubscribe;
+}
+
+std::string IngestUri(const std::string& sourceUrl)
+{
+    GCharPtr escapedSourceUrlPtr(g_uri_escape_string(sourceUrl.c_str(), nullptr, FALSE));
+
+    return std::string(IngestUriPrefix) + escapedSourceUrlPtr.get();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <functional>
+
+#include <gst/gst.h>
+
+
+// Source element handling "ingest://" uris.
+// Allows to consume already running ingest from other pipelines (i.e. WebRTC preview)
+// instead of pulling the same source one more time.
+
+// both should be thread safe
+typedef std::function<void (const std::string& sourceUrl, GstPad* videoSinkPad)> IngestSubscribe;
+typedef std::function<void (const std::string& sourceUrl, GstPad* videoSinkPad)> IngestUnsubscribe;
+
+bool RegisterIngestSrc();
+void SetIngestSubscriptionHandlers(const IngestSubscribe&, const IngestUnsubscribe&);
+
+std::string IngestUri(const std::string& sourceUrl);
@@ -0,0 +1,272 @@
+#include "Metrics.h"
+
+#include <cstring>
+#include <array>
+#include <iterator>
+
+#include <glib.h>
+
+
+namespace {
+
+const char* EosReasonLabel(unsigned reason)
+{
+    switch(static_cast<ReStreamer::EosReason>(reason)) {
+        case ReStreamer::EosReason::Disconnect:
+            return "disconnect";
+        case ReStreamer::EosReason::RtspSourceError:
+            return "source_error";
+        case ReStreamer::EosReason::RtmpTargetError:
+            return "target_error";
+        case ReStreamer::EosReason::Stall:
+            return "stall";
+        case ReStreamer::EosReason::OtherError:
+            break;
+    }
+
+    return "other_error";
+}
+
+// label value with '\', '"' and new lines escaped
+struct Label {
+    const std::string& value;
+};
+
+}
+
+template<>
+struct fmt::formatter<Label> : fmt::formatter<std::string_view>
+{
+    template<typename FormatContext>
+    auto format(const Label& label, FormatContext& context) const
+    {
+        auto out = context.out();
+        for(char c: label.value) {
+            switch(c) {
+                case '\\':
+                    out = fmt::format_to(out, "\\\\");
+                    break;
+                case '"':
+                    out = fmt::format_to(out, "\\\"");
+                    break;
+                case '\n':
+                    out = fmt::format_to(out, "\\n");
+                    break;
+                default:
+                    *out++ = c;
+                    break;
+            }
+        }
+
+        return out;
+    }
+};
+
+namespace {
+
+void Header(fmt::memory_buffer* out, const char* name, const char* type, const char* help)
+{
+    fmt::format_to(std::back_inserter(*out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+// one metric family for all streamers
+template<typename Value>
+void StreamersFamily(
+    fmt::memory_buffer* out,
+    const StatsRegistry* statsRegistry,
+    const char* name,
+    const char* type,
+    const char* help,
+    const Value& value)
+{
+    Header(out, name, type, help);
+    statsRegistry->forEach([out, name, &value] (const std::string& id, const TargetStats& stats) {
+        fmt::format_to(std::back_inserter(*out), "{}{{streamer=\"{}\"}} {}\n", name, Label { id }, value(stats));
+    });
+}
+
+unsigned ThreadsCount()
+{
+#ifdef __linux__
+    g_autofree gchar* status = nullptr;
+    if(!g_file_get_contents("/proc/self/status", &status, nullptr, nullptr))
+        return 0;
+
+    const gchar* threads = strstr(status, "\nThreads:");
+    if(!threads)
+        return 0;
+
+    return static_cast<unsigned>(g_ascii_strtoull(threads + strlen("\nThreads:"), nullptr, 10));
+#else
+    return 0;
+#endif
+}
+
+}
+
+void RenderMetrics(
+    fmt::memory_buffer* out,
+    const StatsRegistry* statsRegistry,
+    const ReconnectSchedulers& reconnectSchedulers)
+{
+    auto appender = std::back_inserter(*out);
+
+    if(statsRegistry) {
+        StreamersFamily(out, statsRegistry,
+            "restreamer_uptime_seconds", "gauge", "Time since target was (re)started.",
+            [now = g_get_monotonic_time()] (const TargetStats& stats) -> gint64 {
+                const gint64 startTime = stats.startTime;
+                return startTime ? (now - startTime) / G_USEC_PER_SEC : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_bytes_total", "counter", "Video bytes passed to muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.videoBytes; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_frames_total", "counter", "Video frames passed to muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.videoBuffers; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_keyframes_total", "counter", "Video keyframes passed to muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.keyFrames; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_bitrate_bps", "gauge", "Video bitrate.",
+            [] (const TargetStats& stats) -> guint64 { return stats.videoBitrate; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_fps", "gauge", "Video frame rate.",
+            [] (const TargetStats& stats) -> double { return stats.videoFps; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_video_keyframe_interval_seconds", "gauge", "Last interval between video keyframes.",
+            [] (const TargetStats& stats) -> double { return double(stats.keyFrameInterval) / 1e9; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_audio_bytes_total", "counter", "Audio bytes passed to muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.audioBytes; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_audio_frames_total", "counter", "Audio frames passed to muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.audioBuffers; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_output_bytes_total", "counter", "Bytes passed to RTMP sink.",
+            [] (const TargetStats& stats) -> guint64 { return stats.outBytes; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_output_acked_bytes_total", "counter", "Bytes acknowledged by RTMP server.",
+            [] (const TargetStats& stats) -> guint64 { return stats.ackedBytes; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_output_acked_bitrate_bps", "gauge", "Bitrate acknowledged by RTMP server.",
+            [] (const TargetStats& stats) -> guint64 { return stats.ackedBitrate; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_target_connect_seconds", "gauge", "Last connect time to RTMP server.",
+            [] (const TargetStats& stats) -> double { return double(stats.connectTime) / G_USEC_PER_SEC; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_target_handshake_seconds", "gauge", "Last RTMP handshake time.",
+            [] (const TargetStats& stats) -> double { return double(stats.handshakeTime) / G_USEC_PER_SEC; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_output_latency_seconds", "gauge", "Latency added before data reaches sink.",
+            [] (const TargetStats& stats) -> double { return double(stats.latency) / G_USEC_PER_SEC; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_dropped_buffers_total", "counter", "Buffers dropped before muxer.",
+            [] (const TargetStats& stats) -> guint64 { return stats.droppedBuffers; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_congestion_dropped_frames_total", "counter", "Video and audio frames dropped because of slow uplink.",
+            [] (const TargetStats& stats) -> guint64 { return stats.congestionDroppedFrames; });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_packets_lost_total", "counter", "RTP packets lost reported by RTCP.",
+            [] (const TargetStats& stats) -> guint64 {
+                return stats.sourceStats ? stats.sourceStats->packetsLost.load() : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_jitter_seconds", "gauge", "RTP interarrival jitter reported by RTCP.",
+            [] (const TargetStats& stats) -> double {
+                return stats.sourceStats ? double(stats.sourceStats->jitter) / G_USEC_PER_SEC : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_active", "gauge", "Active source: 0 - primary, then backups, then slate.",
+            [] (const TargetStats& stats) -> guint64 {
+                return stats.sourceStats ? stats.sourceStats->activeSource.load() : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_failovers_total", "counter", "Switches to the next source after failure.",
+            [] (const TargetStats& stats) -> guint64 {
+                return stats.sourceStats ? stats.sourceStats->failovers.load() : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_failover_seconds", "gauge", "Last switch-over time to the next source.",
+            [] (const TargetStats& stats) -> double {
+                return stats.sourceStats ? double(stats.sourceStats->failoverTime) / G_USEC_PER_SEC : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_keyframe_requests_total", "counter", "Keyframes requested from source.",
+            [] (const TargetStats& stats) -> guint64 {
+                return stats.sourceStats ? stats.sourceStats->keyFrameRequests.load() : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_keyframe_requests_honoured_total", "counter", "Keyframe requests answered by source.",
+            [] (const TargetStats& stats) -> guint64 {
+                return stats.sourceStats ? stats.sourceStats->keyFrameRequestsHonoured.load() : 0;
+            });
+        StreamersFamily(out, statsRegistry,
+            "restreamer_source_keyframe_request_seconds", "gauge", "Last time from keyframe request to keyframe.",
+            [] (const TargetStats& stats) -> double {
+                return stats.sourceStats ? double(stats.sourceStats->keyFrameRequestTime) / G_USEC_PER_SEC : 0;
+            });
+    }
+
+    if(!reconnectSchedulers.empty()) {
+        size_t pendingCount = 0;
+        for(const ReconnectScheduler* reconnectScheduler: reconnectSchedulers)
+            pendingCount += reconnectScheduler->pending().size();
+
+        Header(out, "restreamer_pending_restarts", "gauge", "Restarts waiting to be done.");
+        fmt::format_to(appender, "restreamer_pending_restarts {}\n", pendingCount);
+
+        // every reStreamer is handled by single worker, so restarts could be just concatenated
+        std::array<guint64, std::size(ReconnectScheduler::LatencyBuckets) + 1> latencyBuckets {};
+        double latencySum = 0;
+        guint64 latencyCount = 0;
+
+        Header(out, "restreamer_restarts_total", "counter", "Restarts requested by end of stream reason.");
+        for(const ReconnectScheduler* reconnectScheduler: reconnectSchedulers) {
+            reconnectScheduler->withMetrics([&] (const ReconnectScheduler::Metrics& metrics) {
+                for(const auto& [id, restarts]: metrics.restarts) {
+                    for(unsigned reason = 0; reason < restarts.size(); ++reason) {
+                        fmt::format_to(
+                            appender,
+                            "restreamer_restarts_total{{streamer=\"{}\",reason=\"{}\"}} {}\n",
+                            Label { id },
+                            EosReasonLabel(reason),
+                            restarts[reason]);
+                    }
+                }
+
+                for(size_t i = 0; i < latencyBuckets.size(); ++i)
+                    latencyBuckets[i] += metrics.latencyBuckets[i];
+                latencySum += metrics.latencySum;
+                latencyCount += metrics.latencyCount;
+            });
+        }
+
+        Header(out, "restreamer_reconnect_latency_seconds", "histogram", "Time from failure to restart.");
+        guint64 cumulative = 0;
+        for(size_t i = 0; i < std::size(ReconnectScheduler::LatencyBuckets); ++i) {
+            cumulative += latencyBuckets[i];
+            fmt::format_to(
+                appender,
+                "restreamer_reconnect_latency_seconds_bucket{{le=\"{}\"}} {}\n",
+                ReconnectScheduler::LatencyBuckets[i],
+                cumulative);
+        }
+        fmt::format_to(
+            appender,
+            "restreamer_reconnect_latency_seconds_bucket{{le=\"+Inf\"}} {}\n"
+            "restreamer_reconnect_latency_seconds_sum {}\n"
+            "restreamer_reconnect_latency_seconds_count {}\n",
+            latencyCount,
+            latencySum,
+            latencyCount);
+    }
+
+    Header(out, "restreamer_pipelines", "gauge", "Running source pipelines.");
+    fmt::format_to(appender, "restreamer_pipelines {}\n", ReStreamer::pipelinesCount());
+
+    if(const unsigned threadsCount = ThreadsCount()) {
+        Header(out, "restreamer_threads", "gauge", "Process threads.");
+        fmt::format_to(appender, "restreamer_threads {}\n", threadsCount);
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <spdlog/fmt/fmt.h>
+
+#include "Stats.h"
+#include "ReconnectScheduler.h"
+
+
+// Renders metrics in Prometheus text exposition format.
+// Only atomic counters and locks never taken by streaming threads are touched,
+// so it's safe to call from any thread.
+void RenderMetrics(
+    fmt::memory_buffer* out,
+    const StatsRegistry*,
+    const ReconnectSchedulers&);
@@ -1,39 +1,878 @@
 #include "ReStreamer.h"
 
 #include <cassert>
+#include <atomic>
+#include <initializer_list>
+#include <algorithm>
+#include <tuple>
+#include <mutex>
+#include <optional>
+#include <set>
 
 #include <CxxPtr/GlibPtr.h>
 
+#include <gst/rtsp/gstrtsptransport.h>
+#include <gst/base/gstbasesink.h>
+
 #include "Log.h"
+#include "Config.h"
+#include "SilentAudio.h"
+#include "GopCache.h"
+#include "HlsStream.h"
+#include "HlsSegmenter.h"
+#include "RtmpPublisher.h"
+#include "SourceCache.h"
+#include "SourceSwitcher.h"
 
 
 static const auto Log = ReStreamerLog;
 
+// set on target branch bin,
+// to let streaming threads know target failed and should not receive data anymore
+static const char *const TargetFailedKey = "restreamer-target-failed";
+
+// set on target branch bin, holds std::shared_ptr<TargetStats>
+static const char *const TargetStatsKey = "restreamer-target-stats";
+
+// name of sink element inside target branch bin
+static const char *const TargetSinkName = "sink";
+// name of muxer element inside target branch bin (if any)
+static const char *const TargetMuxerName = "muxer";
+
+// set on source bin, holds SourceState
+static const char *const SourceStateKey = "restreamer-source-state";
+
+enum {
+    STATS_INTERVAL = 5, // seconds
+
+    // between muxer and sink, absorbs short uplink stalls
+    EGRESS_QUEUE_MAX_BYTES = 2 * 1024 * 1024,
+
+    // video waiting for muxer. frames are dropped before limits are reached,
+    // so target never blocks source
+    VIDEO_BACKLOG_MAX_BYTES = 16 * 1024 * 1024,
+
+    // used if not specified in target url ("srt://host:port?latency=2000")
+    SRT_DEFAULT_LATENCY = 1000, // milliseconds
+
+    // 7 MPEG-TS packets fit into single SRT packet
+    MPEGTS_ALIGNMENT = 7,
+
+    STALL_CHECK_INTERVAL = 1, // seconds
+    // until the first video buffer. covers slow RTSP setup,
+    // like UDP to TCP fallback, and is used if stall timeout is shorter
+    STALL_STARTUP_TIMEOUT = 60, // seconds
+
+    // decodebin unable to plug anything could never emit "no-more-pads"
+    NO_MORE_PADS_TIMEOUT = 5, // seconds
+};
+
+static const GstClockTime VideoBacklogMaxTime = 3 * GST_SECOND;
+
+// stored to source caps cache
+static const char *const H264MediaType = "video/x-h264";
+static const char *const H265MediaType = "video/x-h265";
+
+// what FLV (and fMP4) requires, so parsers of RTSP sources are constrained to it
+static const char *const H264AvcCaps = "video/x-h264, stream-format=(string)avc, alignment=(string)au";
+static const char *const H265Hvc1Caps = "video/x-h265, stream-format=(string)hvc1, alignment=(string)au";
+
+struct LatencySettings
+{
+    guint jitterBufferLatency; // milliseconds
+    bool dropOnLatency; // late packets are dropped instead of delaying the whole stream
+    GstClockTime muxLatency; // extra time muxer waits for late input
+    bool syncSink; // output is paced by clock, smoothing bursts
+};
+
+static const LatencySettings& GetLatencySettings(LatencyProfile profile)
+{
+    static const LatencySettings lowLatency { 150, true, 0, false };
+    static const LatencySettings balanced { 500, false, 0, false };
+    // rtspsrc defaults
+    static const LatencySettings resilient { 2000, false, 200 * GST_MSECOND, true };
+
+    switch(profile) {
+        case LatencyProfile::LowLatency:
+            return lowLatency;
+        case LatencyProfile::Balanced:
+            return balanced;
+        case LatencyProfile::Resilient:
+        default:
+            return resilient;
+    }
+}
+
+// rtspsrc tries transports in order UDP, UDP multicast, TCP,
+// and switches to the next one only after timeout
+static GstRTSPLowerTrans RtspProtocols(
+    RtspTransport transport,
+    const std::optional<RtspTransport>& lastTransport)
+{
+    const GstRTSPLowerTrans udp =
+        GstRTSPLowerTrans(GST_RTSP_LOWER_TRANS_UDP | GST_RTSP_LOWER_TRANS_UDP_MCAST);
+    const GstRTSPLowerTrans any =
+        GstRTSPLowerTrans(udp | GST_RTSP_LOWER_TRANS_TCP);
+
+    switch(transport) {
+        case RtspTransport::Udp:
+            return udp;
+        case RtspTransport::Tcp:
+            return GST_RTSP_LOWER_TRANS_TCP;
+        case RtspTransport::Auto:
+        default:
+            // UDP is tried first anyway
+            return lastTransport == RtspTransport::Tcp ? GST_RTSP_LOWER_TRANS_TCP : any;
+    }
+}
+
+static std::atomic<unsigned> PipelinesCount = 0;
+
+// ordered by preference
+static const char *const AacEncoders[] = {
+    "fdkaacenc",
+    "avenc_aac",
+    "voaacenc",
+    "mfaacenc",
+    "faac",
+};
+
+// ordered by preference.
+// H.265 in FLV requires Enhanced RTMP (FourCC "hvc1") support in muxer
+static const char *const HevcFlvMuxers[] = {
+    "eflvmux",
+    "flvmux",
+};
+
+static void CountDropped(gpointer targetBin, GstPadProbeInfo* info)
+{
+    gpointer stats = g_object_get_data(G_OBJECT(targetBin), TargetStatsKey);
+    if(!stats)
+        return;
+
+    const guint count = (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) ?
+        gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info)) : 1;
+
+    (*static_cast<std::shared_ptr<TargetStats>*>(stats))->droppedBuffers += count;
+}
+
+// called from streaming thread
+static GstPadProbeReturn DropIfTargetFailed(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    gpointer targetFailed = g_object_get_data(G_OBJECT(userData), TargetFailedKey);
+    if(targetFailed && static_cast<std::atomic<bool>*>(targetFailed)->load()) {
+        CountDropped(userData, info);
+        return GST_PAD_PROBE_DROP;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+struct GopReplay
+{
+    GstElementPtr targetBinPtr;
+    std::shared_ptr<GopCache> gopCachePtr;
+    bool replaying = false;
+};
+
+// called from streaming thread.
+// target attached to already running source starts from cached GOP,
+// or, if there is nothing suitable in cache, from the next keyframe
+static GstPadProbeReturn ReplayGopOrDropUntilKeyFrame(
+    GstPad* pad,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    GopReplay* gopReplay = static_cast<GopReplay*>(userData);
+    if(gopReplay->replaying)
+        return GST_PAD_PROBE_OK; // pushed from below
+
+    GstBuffer* buffer = nullptr;
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER)
+        buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        buffer = gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0);
+
+    if(buffer && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_REMOVE;
+
+    std::deque<GstBuffer*> gop;
+    if(buffer && (info->type & GST_PAD_PROBE_TYPE_BUFFER))
+        gop = gopReplay->gopCachePtr->retimedUntil(buffer);
+
+    if(gop.empty()) {
+        CountDropped(gopReplay->targetBinPtr.get(), info);
+        return GST_PAD_PROBE_DROP;
+    }
+
+    // current buffer is the continuation of replayed GOP
+    gopReplay->replaying = true;
+    GstFlowReturn flowReturn = GST_FLOW_OK;
+    for(GstBuffer* cachedBuffer: gop) {
+        if(flowReturn == GST_FLOW_OK)
+            flowReturn = gst_pad_push(pad, cachedBuffer);
+        else
+            gst_buffer_unref(cachedBuffer);
+    }
+    gopReplay->replaying = false;
+
+    return GST_PAD_PROBE_REMOVE;
+}
+
+struct EgressPolicy
+{
+    std::shared_ptr<TargetStats> statsPtr;
+    bool dropUntilKeyFrame = false; // accessed from video streaming thread only
+};
+
+// called from streaming thread.
+// if uplink can't keep up, video backlog grows.
+// after half of the limits droppable frames are discarded,
+// on overflow everything is discarded up to the next keyframe
+// to keep stream decodable
+static GstPadProbeReturn ApplyEgressPolicy(
+    GstPad* pad,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    EgressPolicy* policy = static_cast<EgressPolicy*>(userData);
+
+    GstBuffer* buffer = nullptr;
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER)
+        buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        buffer = gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0);
+    if(!buffer)
+        return GST_PAD_PROBE_OK;
+
+    guint64 backlogTime = 0;
+    guint backlogBytes = 0;
+    g_object_get(
+        GST_PAD_PARENT(pad),
+        "current-level-time", &backlogTime,
+        "current-level-bytes", &backlogBytes,
+        nullptr);
+
+    const bool overflow =
+        backlogTime >= VideoBacklogMaxTime ||
+        backlogBytes >= VIDEO_BACKLOG_MAX_BYTES;
+    const bool congested =
+        backlogTime >= VideoBacklogMaxTime / 2 ||
+        backlogBytes >= VIDEO_BACKLOG_MAX_BYTES / 2;
+    const bool keyFrame = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    bool drop = false;
+    if(policy->dropUntilKeyFrame) {
+        if(keyFrame && !overflow)
+            policy->dropUntilKeyFrame = false;
+        else
+            drop = true;
+    } else if(overflow) {
+        Log()->warn(
+            "Video backlog overflow ({} ms, {} bytes). Dropping up to the next keyframe...",
+            backlogTime / GST_MSECOND,
+            backlogBytes);
+        policy->dropUntilKeyFrame = true;
+        drop = true;
+    } else if(congested && GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DROPPABLE)) {
+        drop = true;
+    }
+
+    if(!drop)
+        return GST_PAD_PROBE_OK;
+
+    policy->statsPtr->congestionDroppedFrames +=
+        (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) ?
+            gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info)) : 1;
+
+    return GST_PAD_PROBE_DROP;
+}
+
+// called from streaming thread.
+// audio backlog is limited the same way as video one,
+// but there is nothing to wait for, every audio frame is decodable
+static GstPadProbeReturn ApplyAudioEgressPolicy(
+    GstPad* pad,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    TargetStats* stats = static_cast<std::shared_ptr<TargetStats>*>(userData)->get();
+
+    guint64 backlogTime = 0;
+    g_object_get(GST_PAD_PARENT(pad), "current-level-time", &backlogTime, nullptr);
+    if(backlogTime < VideoBacklogMaxTime)
+        return GST_PAD_PROBE_OK;
+
+    stats->congestionDroppedFrames +=
+        (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) ?
+            gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info)) : 1;
+
+    return GST_PAD_PROBE_DROP;
+}
+
+// state of single source bin, updated from it's streaming threads
+struct SourceState
+{
+    SourceState(bool paced, StandbySource* standby) : paced(paced), standby(standby) {}
+
+    const bool paced; // not live source (slate) should be played in real time
+    // set for primary source started next to active one,
+    // it exposes pads without linking them
+    const std::unique_ptr<StandbySource> standby;
+
+    std::atomic<bool> videoLinked = false;
+    std::atomic<bool> audioLinked = false;
+    std::atomic<unsigned> pendingNoMorePads = 1; // source itself + fallback decodebins
+
+    std::mutex mutex; // guards fields below
+
+    // fallback decodebin -> when it was added (monotonic), 0 if it's accounted already
+    std::map<GstElement*, gint64> fallbackDecodebins;
+};
+
+static SourceState* GetSourceState(GstBin* sourceBin)
+{
+    return static_cast<SourceState*>(g_object_get_data(G_OBJECT(sourceBin), SourceStateKey));
+}
+
+static void AddDropIfTargetFailedProbe(GstPad* teePad, GstElement* targetBin)
+{
+    gst_pad_add_probe(
+        teePad,
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        DropIfTargetFailed,
+        gst_object_ref(targetBin),
+        gst_object_unref);
+}
+
+template<typename Callback>
+static void ForEachBuffer(GstPadProbeInfo* info, const Callback& callback)
+{
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        callback(GST_PAD_PROBE_INFO_BUFFER(info));
+    } else if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        for(guint i = 0, length = gst_buffer_list_length(list); i < length; ++i)
+            callback(gst_buffer_list_get(list, i));
+    }
+}
+
+// source video passing to targets, updated from streaming thread
+struct VideoFlow
+{
+    std::atomic<bool> started; // current source sent video already
+    std::atomic<gint64> lastBufferTime; // monotonic
+    std::atomic<gint64> lastProgressTime; // monotonic, when timestamps advanced last time
+    GstClockTime maxTimestamp = GST_CLOCK_TIME_NONE; // accessed from streaming thread only
+
+    void reset()
+    {
+        const gint64 now = g_get_monotonic_time();
+        started = false;
+        lastBufferTime = now;
+        lastProgressTime = now;
+    }
+};
+
+// called from streaming thread
+static GstPadProbeReturn TrackVideoFlow(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    VideoFlow* flow = static_cast<std::shared_ptr<VideoFlow>*>(userData)->get();
+
+    const gint64 now = g_get_monotonic_time();
+    ForEachBuffer(info, [flow, now] (GstBuffer* buffer) {
+        flow->started = true;
+        flow->lastBufferTime = now;
+
+        const GstClockTime timestamp = GST_BUFFER_DTS_OR_PTS(buffer);
+        // freeze can't be detected without timestamps
+        if(!GST_CLOCK_TIME_IS_VALID(timestamp) ||
+            !GST_CLOCK_TIME_IS_VALID(flow->maxTimestamp) ||
+            timestamp > flow->maxTimestamp)
+        {
+            flow->maxTimestamp = timestamp;
+            flow->lastProgressTime = now;
+        }
+    });
+
+    return GST_PAD_PROBE_OK;
+}
+
+// called from streaming thread
+static GstPadProbeReturn CountVideo(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    TargetStats* stats = static_cast<std::shared_ptr<TargetStats>*>(userData)->get();
+
+    ForEachBuffer(info, [stats] (GstBuffer* buffer) {
+        ++stats->videoBuffers;
+        stats->videoBytes += gst_buffer_get_size(buffer);
+
+        if(GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+            return;
+
+        ++stats->keyFrames;
+
+        const GstClockTime pts = GST_BUFFER_PTS(buffer);
+        if(!GST_CLOCK_TIME_IS_VALID(pts))
+            return;
+
+        if(GST_CLOCK_TIME_IS_VALID(stats->lastKeyFramePts) && pts > stats->lastKeyFramePts)
+            stats->keyFrameInterval = pts - stats->lastKeyFramePts;
+        stats->lastKeyFramePts = pts;
+    });
+
+    return GST_PAD_PROBE_OK;
+}
+
+// called from streaming thread
+static GstPadProbeReturn CountAudio(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    TargetStats* stats = static_cast<std::shared_ptr<TargetStats>*>(userData)->get();
+
+    ForEachBuffer(info, [stats] (GstBuffer* buffer) {
+        ++stats->audioBuffers;
+        stats->audioBytes += gst_buffer_get_size(buffer);
+    });
+
+    return GST_PAD_PROBE_OK;
+}
+
+// called from streaming thread
+static void MeasureLatency(TargetStats* stats, GstPad* pad, GstBuffer* buffer)
+{
+    const gint64 now = g_get_monotonic_time();
+    if(now - stats->lastLatencyTime < G_USEC_PER_SEC)
+        return;
+
+    const GstClockTime timestamp = GST_BUFFER_DTS_OR_PTS(buffer);
+    if(!GST_CLOCK_TIME_IS_VALID(timestamp))
+        return; // FLV header and such
+
+    GstEvent* segmentEvent = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+    if(!segmentEvent)
+        return;
+
+    const GstSegment* segment = nullptr;
+    gst_event_parse_segment(segmentEvent, &segment);
+    const GstClockTime runningTime =
+        gst_segment_to_running_time(segment, GST_FORMAT_TIME, timestamp);
+    gst_event_unref(segmentEvent);
+
+    GstElement* sink = GST_ELEMENT(GST_PAD_PARENT(pad));
+    GstClock* clock = gst_element_get_clock(sink);
+    if(!clock)
+        return;
+
+    const GstClockTime clockTime = gst_clock_get_time(clock);
+    gst_object_unref(clock);
+    const GstClockTime baseTime = gst_element_get_base_time(sink);
+    if(!GST_CLOCK_TIME_IS_VALID(runningTime) || clockTime < baseTime + runningTime)
+        return;
+
+    GstClockTime latency = clockTime - baseTime - runningTime;
+    // probe is called before sink syncs on buffer, and synced sink renders it
+    // not earlier than it's running time plus pipeline latency (jitterbuffer, muxer)
+    if(GST_IS_BASE_SINK(sink) && gst_base_sink_get_sync(GST_BASE_SINK(sink)))
+        latency = std::max(latency, gst_base_sink_get_latency(GST_BASE_SINK(sink)));
+
+    stats->lastLatencyTime = now;
+    stats->latency = GST_TIME_AS_USECONDS(latency);
+}
+
+static GstPadProbeReturn CountOut(
+    GstPad* pad,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    TargetStats* stats = static_cast<std::shared_ptr<TargetStats>*>(userData)->get();
+
+    ForEachBuffer(info, [stats, pad] (GstBuffer* buffer) {
+        stats->outBytes += gst_buffer_get_size(buffer);
+        MeasureLatency(stats, pad, buffer);
+    });
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void AddStatsProbe(
+    GstElement* element,
+    const char* padName,
+    GstPadProbeCallback callback,
+    const std::shared_ptr<TargetStats>& stats)
+{
+    GstPadPtr padPtr(gst_element_get_static_pad(element, padName));
+    gst_pad_add_probe(
+        padPtr.get(),
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        callback,
+        new std::shared_ptr<TargetStats>(stats),
+        [] (gpointer userData) {
+            delete static_cast<std::shared_ptr<TargetStats>*>(userData);
+        });
+}
+
+static const char* FindAacEncoder()
+{
+    static const char* encoder = [] () -> const char* {
+        for(const char* name: AacEncoders) {
+            if(GstElementFactory* factory = gst_element_factory_find(name)) {
+                gst_object_unref(factory);
+                return name;
+            }
+        }
+
+        return nullptr;
+    } ();
+
+    return encoder;
+}
+
+static const char* FindHevcFlvMuxer()
+{
+    static const char* muxer = [] () -> const char* {
+        GstCapsPtr h265CapsPtr(gst_caps_from_string("video/x-h265"));
+        for(const char* name: HevcFlvMuxers) {
+            if(GstElementFactory* factory = gst_element_factory_find(name)) {
+                const bool canSinkH265 =
+                    gst_element_factory_can_sink_any_caps(factory, h265CapsPtr.get());
+                gst_object_unref(factory);
+                if(canSinkH265)
+                    return name;
+            }
+        }
+
+        return nullptr;
+    } ();
+
+    return muxer;
+}
+
+static bool IsRtspUrl(const std::string& url)
+{
+    GCharPtr protocolPtr(gst_uri_get_protocol(url.c_str()));
+    if(!protocolPtr)
+        return false;
+
+    const std::string protocol = protocolPtr.get();
+
+    return protocol == "rtsp" || protocol == "rtsps" || protocol == "rtspt";
+}
+
+enum class TargetType {
+    Rtmp,
+    Srt, // MPEG-TS over SRT
+    Whip, // WebRTC
+    Hls, // fMP4 parts of in-memory LL-HLS stream
+};
+
+static bool IsWhipEndpoint(const std::string& url)
+{
+    const std::string path = url.substr(0, url.find_first_of("?#"));
+    return g_str_has_suffix(path.c_str(), "/whip") || g_str_has_suffix(path.c_str(), "/whip/");
+}
+
+static TargetType GetTargetType(const std::string& url)
+{
+    GCharPtr protocolPtr(gst_uri_get_protocol(url.c_str()));
+    if(!protocolPtr)
+        return TargetType::Rtmp;
+
+    const std::string protocol = protocolPtr.get();
+    if(protocol == "srt")
+        return TargetType::Srt;
+    if(protocol == "whip" || ((protocol == "http" || protocol == "https") && IsWhipEndpoint(url)))
+        return TargetType::Whip;
+
+    return TargetType::Rtmp;
+}
+
+// "whip://host/path" -> "https://host/path", http(s) endpoints are used as is
+static std::string WhipEndpoint(const std::string& url)
+{
+    const std::string whipPrefix = "whip://";
+    if(0 == g_ascii_strncasecmp(url.c_str(), whipPrefix.c_str(), whipPrefix.size()))
+        return "https://" + url.substr(whipPrefix.size());
+
+    return url;
+}
+
+// adds and links chain of elements to pad,
+// returns src pad of the last element
+static GstPadPtr AddChain(
+    GstBin* bin,
+    GstPad* pad,
+    std::initializer_list<const char*> factories)
+{
+    std::deque<GstElementPtr> elements;
+    for(const char* factory: factories) {
+        GstElementPtr elementPtr(gst_element_factory_make(factory, nullptr));
+        if(!elementPtr) {
+            Log()->error("Failed to create \"{}\" element", factory);
+            return GstPadPtr();
+        }
+        elements.emplace_back(std::move(elementPtr));
+    }
+
+    GstPadPtr srcPadPtr(GST_PAD(gst_object_ref(pad)));
+    for(GstElementPtr& elementPtr: elements) {
+        GstElement* element = elementPtr.get();
+
+        gst_bin_add(bin, elementPtr.release());
+        gst_element_sync_state_with_parent(element);
+
+        GstPadPtr sinkPadPtr(gst_element_get_static_pad(element, "sink"));
+        if(GST_PAD_LINK_OK != gst_pad_link(srcPadPtr.get(), sinkPadPtr.get())) {
+            Log()->error("Failed to link \"{}\" element", GST_OBJECT_NAME(element));
+            return GstPadPtr();
+        }
+
+        srcPadPtr.reset(gst_element_get_static_pad(element, "src"));
+    }
+
+    return srcPadPtr;
+}
+
+// bin of the source element owning pad
+static GstBin* SourceBin(GstPad* pad)
+{
+    return GST_BIN(GST_ELEMENT_PARENT(GST_PAD_PARENT(pad)));
+}
+
+bool ReStreamer::AudioEncoding::operator < (const AudioEncoding& other) const
+{
+    return
+        std::tie(bitrate, sampleRate, channels) <
+        std::tie(other.bitrate, other.sampleRate, other.channels);
+}
+
+bool ReStreamer::AudioEncoding::operator == (const AudioEncoding& other) const
+{
+    return
+        std::tie(bitrate, sampleRate, channels) ==
+        std::tie(other.bitrate, other.sampleRate, other.channels);
+}
+
 
 ReStreamer::ReStreamer(
     const std::string& sourceUrl,
-    const std::string& targetUrl,
-    const EosCallback& onEos) :
-    _onEos(onEos), _sourceUrl(sourceUrl), _targetUrl(targetUrl)
+    const EosCallback& onEos,
+    const TargetEosCallback& onTargetEos,
+    const SourceReadyCallback& onSourceReady) :
+    _onEos(onEos), _onTargetEos(onTargetEos), _onSourceReady(onSourceReady), _sourceUrl(sourceUrl),
+    _sourceStatsPtr(std::make_shared<SourceStats>())
 {
     if(GstElementFactory* rtspSinkFactory = gst_element_factory_find("rtspsrc")) {
         _rtspSrcType = gst_element_factory_get_element_type(rtspSinkFactory);
         gst_object_unref(rtspSinkFactory);
     }
-    if(GstElementFactory* rtmpSinkFactory = gst_element_factory_find("rtmpsink")) {
+    if(GstElementFactory* rtmpSinkFactory = gst_element_factory_find("rtmppublisher")) {
         _rtmpSinkType = gst_element_factory_get_element_type(rtmpSinkFactory);
         gst_object_unref(rtmpSinkFactory);
     }
+    if(GstElementFactory* srtSinkFactory = gst_element_factory_find("srtsink")) {
+        _srtSinkType = gst_element_factory_get_element_type(srtSinkFactory);
+        gst_object_unref(srtSinkFactory);
+    }
+    if(GstElementFactory* whipSinkFactory = gst_element_factory_find("whipclientsink")) {
+        _whipSinkType = gst_element_factory_get_element_type(whipSinkFactory);
+        gst_object_unref(whipSinkFactory);
+    }
+
+    _sourceSwitcherPtr =
+        std::make_unique<SourceSwitcher>(
+            sourceUrl,
+            _sourceStatsPtr,
+            [this] () { retryPrimarySource(); });
+}
+
+unsigned ReStreamer::pipelinesCount()
+{
+    return PipelinesCount;
 }
 
 ReStreamer::~ReStreamer()
 {
+    stopStallWatchdog();
+
+    if(_statsTimerPtr)
+        g_source_destroy(_statsTimerPtr.get());
+    if(_noMorePadsTimerPtr)
+        g_source_destroy(_noMorePadsTimerPtr.get());
+
+    for(const auto& pair: _targets) {
+        const Target& target = pair.second;
+        if(!target.hlsStreamPtr && GetTargetType(target.url) == TargetType::Rtmp)
+            CancelPreconnectRtmp(target.url);
+    }
+
     stop();
 
     if(_pipelinePtr) {
         GstBusPtr busPtr(gst_pipeline_get_bus(GST_PIPELINE(_pipelinePtr.get())));
         gst_bus_remove_watch(busPtr.get());
+
+        --PipelinesCount;
+    }
+}
+
+std::shared_ptr<const TargetStats> ReStreamer::targetStats(const std::string& targetId) const
+{
+    auto it = _targets.find(targetId);
+    if(it == _targets.end())
+        return nullptr;
+
+    return it->second.statsPtr;
+}
+
+void ReStreamer::updateStats() noexcept
+{
+    const gint64 now = g_get_monotonic_time();
+
+    for(auto& pair: _targets) {
+        Target& target = pair.second;
+        TargetStats& stats = *target.statsPtr;
+        StatsSample& prevSample = target.statsSample;
+
+        if(target.binPtr) {
+            GstElementPtr rtmpSinkPtr(gst_bin_get_by_name(GST_BIN(target.binPtr.get()), TargetSinkName));
+            if(rtmpSinkPtr && G_OBJECT_TYPE(rtmpSinkPtr.get()) == _rtmpSinkType) {
+                guint64 connectTime = 0;
+                guint64 handshakeTime = 0;
+                guint64 ackedBytes = 0;
+                g_object_get(rtmpSinkPtr.get(),
+                    "connect-time", &connectTime,
+                    "handshake-time", &handshakeTime,
+                    "acked-bytes", &ackedBytes,
+                    nullptr);
+                stats.connectTime = connectTime;
+                stats.handshakeTime = handshakeTime;
+                stats.ackedBytes = ackedBytes;
+            }
+        }
+
+        const StatsSample sample {
+            now,
+            stats.videoBuffers,
+            stats.videoBytes,
+            stats.audioBytes,
+            stats.outBytes,
+            stats.ackedBytes };
+
+        const gint64 elapsed = sample.time - prevSample.time;
+        if(prevSample.time && elapsed > 0) {
+            auto perSecond = [elapsed] (guint64 value, guint64 prevValue) -> double {
+                return value >= prevValue ?
+                    double(value - prevValue) * G_USEC_PER_SEC / elapsed : 0;
+            };
+
+            stats.videoBitrate = perSecond(sample.videoBytes, prevSample.videoBytes) * 8;
+            stats.videoFps = perSecond(sample.videoBuffers, prevSample.videoBuffers);
+            stats.audioBitrate = perSecond(sample.audioBytes, prevSample.audioBytes) * 8;
+            stats.outBitrate = perSecond(sample.outBytes, prevSample.outBytes) * 8;
+            stats.ackedBitrate = perSecond(sample.ackedBytes, prevSample.ackedBytes) * 8;
+        }
+
+        prevSample = sample;
+    }
+
+    updateSourceStats();
+}
+
+void ReStreamer::updateSourceStats() noexcept
+{
+    if(!_pipelinePtr)
+        return;
+
+    guint64 packetsLost = 0;
+    guint64 jitter = 0;
+
+    // rtpbin is created by rtspsrc (directly or inside uridecodebin)
+    auto collectSessionStats = [&packetsLost, &jitter] (GstElement* rtpBin) {
+        for(guint sessionId = 0; ; ++sessionId) {
+            GObject* session = nullptr;
+            g_signal_emit_by_name(rtpBin, "get-internal-session", sessionId, &session);
+            if(!session)
+                break;
+
+            GstStructure* sessionStats = nullptr;
+            g_object_get(session, "stats", &sessionStats, nullptr);
+            g_object_unref(session);
+            if(!sessionStats)
+                continue;
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+            const GValue* sourceStatsValue = gst_structure_get_value(sessionStats, "source-stats");
+            GValueArray* sourceStatsArray =
+                sourceStatsValue ? static_cast<GValueArray*>(g_value_get_boxed(sourceStatsValue)) : nullptr;
+            for(guint i = 0; sourceStatsArray && i < sourceStatsArray->n_values; ++i) {
+                const GstStructure* sourceStats =
+                    gst_value_get_structure(g_value_array_get_nth(sourceStatsArray, i));
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+                gboolean internal = TRUE;
+                gst_structure_get_boolean(sourceStats, "internal", &internal);
+                if(internal)
+                    continue;
+
+                gint lost = 0;
+                if(gst_structure_get_int(sourceStats, "packets-lost", &lost) && lost > 0)
+                    packetsLost += lost;
+
+                guint sourceJitter = 0;
+                gint clockRate = 0;
+                if(gst_structure_get_uint(sourceStats, "jitter", &sourceJitter) &&
+                    gst_structure_get_int(sourceStats, "clock-rate", &clockRate) &&
+                    clockRate > 0)
+                {
+                    jitter = std::max<guint64>(
+                        jitter,
+                        gst_util_uint64_scale(sourceJitter, G_USEC_PER_SEC, clockRate));
+                }
+            }
+
+            gst_structure_free(sessionStats);
+        }
+    };
+
+    GstIterator* iterator = gst_bin_iterate_recurse(GST_BIN(_pipelinePtr.get()));
+    GValue item = G_VALUE_INIT;
+    while(gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        GstElement* element = GST_ELEMENT(g_value_get_object(&item));
+        GstElementFactory* factory = gst_element_get_factory(element);
+        if(factory && 0 == g_strcmp0(GST_OBJECT_NAME(factory), "rtpbin"))
+            collectSessionStats(element);
+        g_value_reset(&item);
     }
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+
+    // RTCP value starts from 0 with every new source and could even decrease,
+    // so only increments are accumulated
+    if(packetsLost > _lastPacketsLost)
+        _sourceStatsPtr->packetsLost += packetsLost - _lastPacketsLost;
+    _lastPacketsLost = packetsLost;
+    _sourceStatsPtr->jitter = jitter;
+}
+
+std::deque<std::string> ReStreamer::targetIds() const
+{
+    std::deque<std::string> ids;
+    for(const auto& pair: _targets)
+        ids.push_back(pair.first);
+
+    return ids;
 }
 
 void ReStreamer::setState(GstState state) noexcept
@@ -80,6 +919,10 @@ gboolean ReStreamer::onBusMessage(GstMessage* message)
             onEos(EosReason::Disconnect);
             break;
         case GST_MESSAGE_ERROR: {
+            // element of already replaced source
+            if(!gst_object_has_as_ancestor(message->src, GST_OBJECT(_pipelinePtr.get())))
+                break;
+
             gchar* debug = nullptr;
             GError* error = nullptr;
             gst_message_parse_error(message, &error, &debug);
@@ -93,11 +936,52 @@ gboolean ReStreamer::onBusMessage(GstMessage* message)
             if(debug) g_free(debug);
             if(error) g_error_free(error);
 
+            // active source keeps working, primary will be retried later
+            if(_standbySourceBinPtr &&
+                gst_object_has_as_ancestor(message->src, GST_OBJECT(_standbySourceBinPtr.get())))
+            {
+                if(G_OBJECT_TYPE(message->src) == _rtspSrcType &&
+                    _rtspTransport == RtspTransport::Auto && _rtspTransportCache)
+                {
+                    _rtspTransportCache->remove(_sourceUrl);
+                }
+                removeStandbySource();
+                break;
+            }
+
             EosReason reason = EosReason::OtherError;
             if(G_OBJECT_TYPE(message->src) == _rtspSrcType) {
                 reason = EosReason::RtspSourceError;
-            } else if(G_OBJECT_TYPE(message->src) == _rtmpSinkType){
-                reason = EosReason::RtmpTargetError;
+                forgetRtspTransport();
+            }
+
+            for(const auto& [targetId, target]: _targets) {
+                if(!target.binPtr)
+                    continue;
+
+                if(gst_object_has_as_ancestor(message->src, GST_OBJECT(target.binPtr.get()))) {
+                    // whipclientsink is a bin, so it's errors are posted by it's children
+                    GstElementPtr sinkPtr(gst_bin_get_by_name(GST_BIN(target.binPtr.get()), TargetSinkName));
+                    if(sinkPtr &&
+                        gst_object_has_as_ancestor(message->src, GST_OBJECT(sinkPtr.get())) &&
+                        (G_OBJECT_TYPE(sinkPtr.get()) == _rtmpSinkType ||
+                            G_OBJECT_TYPE(sinkPtr.get()) == _srtSinkType ||
+                            G_OBJECT_TYPE(sinkPtr.get()) == _whipSinkType))
+                    {
+                        reason = EosReason::RtmpTargetError;
+                    }
+
+                    // error inside target branch doesn't affect source and other targets
+                    onTargetEos(std::string(targetId), reason);
+                    return TRUE;
+                }
+            }
+
+            if(_sourceBinPtr &&
+                gst_object_has_as_ancestor(message->src, GST_OBJECT(_sourceBinPtr.get())) &&
+                failover())
+            {
+                break;
             }
 
             onEos(reason);
@@ -116,6 +1000,25 @@ gboolean ReStreamer::onBusMessage(GstMessage* message)
                 gboolean error = FALSE;
                 gst_structure_get_boolean(structure, "error", &error);
                 onEos(error ? EosReason::OtherError : EosReason::Disconnect);
+            } else if(gst_message_has_name(message, "video-ready")) {
+                gboolean h265 = FALSE;
+                gst_structure_get_boolean(structure, "h265", &h265);
+                onVideoReady(h265 != FALSE);
+            } else if(gst_message_has_name(message, "audio-ready")) {
+                gboolean compressed = FALSE;
+                gst_structure_get_boolean(structure, "compressed", &compressed);
+                onAudioReady(compressed != FALSE);
+            } else if(gst_message_has_name(message, "source-eos")) {
+                guint generation = 0;
+                gst_structure_get_uint(structure, "generation", &generation);
+                onSourceEos(generation);
+            } else if(gst_message_has_name(message, "fallback-decodebin-added")) {
+                scheduleNoMorePadsCheck(NO_MORE_PADS_TIMEOUT * 1000);
+            } else if(_standbySourceBinPtr && message->src == GST_OBJECT(_standbySourceBinPtr.get())) {
+                if(gst_message_has_name(message, "standby-ready"))
+                    promoteStandbySource();
+                else if(gst_message_has_name(message, "standby-failed"))
+                    removeStandbySource();
             }
             break;
         }
@@ -126,11 +1029,37 @@ gboolean ReStreamer::onBusMessage(GstMessage* message)
     return TRUE;
 }
 
+// called from streaming thread
+GstBusSyncReply ReStreamer::onBusSyncMessage(GstMessage* message)
+{
+    if(GST_MESSAGE_TYPE(message) != GST_MESSAGE_ERROR)
+        return GST_BUS_PASS;
+
+    // failed target should stop to accept data as soon as possible,
+    // otherwise it's error will be propagated upstream through tee and will break source
+    for(GstObject* object = message->src; object; object = GST_OBJECT_PARENT(object)) {
+        gpointer targetFailed = g_object_get_data(G_OBJECT(object), TargetFailedKey);
+        if(targetFailed) {
+            static_cast<std::atomic<bool>*>(targetFailed)->store(true);
+            break;
+        }
+    }
+
+    return GST_BUS_PASS;
+}
+
 void ReStreamer::onEos(EosReason reason)
 {
     _onEos(reason);
 }
 
+void ReStreamer::onTargetEos(const std::string& targetId, EosReason reason)
+{
+    Log()->error("Target \"{}\" of \"{}\" failed", targetId, _sourceUrl);
+
+    _onTargetEos(targetId, reason);
+}
+
 
 // called from streaming thread
 void ReStreamer::postEos(
@@ -150,169 +1079,1796 @@ void ReStreamer::postEos(
     gst_bus_post(busPtr.get(), message);
 }
 
-void ReStreamer::start() noexcept
+// called from streaming thread
+void ReStreamer::postVideoReady(
+    GstElement* pipeline,
+    gboolean h265)
 {
-    GstElementPtr pipelinePtr(gst_pipeline_new(nullptr));
-    GstElement* pipeline = pipelinePtr.get();
-    if(!pipeline) {
-        Log()->error("Failed to create pipeline element");
+    GstStructure* structure =
+        gst_structure_new(
+            "video-ready",
+            "h265", G_TYPE_BOOLEAN, h265,
+            nullptr);
+
+    GstMessage* message =
+        gst_message_new_application(GST_OBJECT(pipeline), structure);
+
+    GstBusPtr busPtr(gst_element_get_bus(pipeline));
+    gst_bus_post(busPtr.get(), message);
+}
+
+// called from streaming thread
+void ReStreamer::postAudioReady(
+    GstElement* pipeline,
+    gboolean compressed)
+{
+    GstStructure* structure =
+        gst_structure_new(
+            "audio-ready",
+            "compressed", G_TYPE_BOOLEAN, compressed,
+            nullptr);
+
+    GstMessage* message =
+        gst_message_new_application(GST_OBJECT(pipeline), structure);
+
+    GstBusPtr busPtr(gst_element_get_bus(pipeline));
+    gst_bus_post(busPtr.get(), message);
+}
+
+// all source elements are kept in separate bin,
+// so source could be replaced without touching the rest of pipeline
+bool ReStreamer::addSource(
+    GstBin* pipeline,
+    const std::string& url,
+    bool paced,
+    bool standby) noexcept
+{
+    // rtsp sources are depayloaded and parsed explicitly,
+    // everything else goes through uridecodebin autoplugging
+    const bool rtspSource = IsRtspUrl(url);
+    const char* srcFactory = rtspSource ? "rtspsrc" : "uridecodebin";
+
+    GstElementPtr srcPtr(gst_element_factory_make(srcFactory, nullptr));
+    GstElement* src = srcPtr.get();
+    if(!src) {
+        Log()->error("Failed to create \"{}\" element", srcFactory);
+        return false;
+    }
+
+    GstElementPtr binPtr(gst_bin_new(nullptr));
+    GstElement* bin = binPtr.get();
+
+    if(rtspSource) {
+        auto rtpPadAddedCallback =
+            + [] (GstElement* rtspsrc, GstPad* pad, gpointer userData)
+        {
+            ReStreamer* self = static_cast<ReStreamer*>(userData);
+            self->rtpPadAdded(rtspsrc, pad);
+        };
+        g_signal_connect(src, "pad-added", G_CALLBACK(rtpPadAddedCallback), this);
+
+        std::optional<RtspTransport> lastTransport;
+        if(_rtspTransport == RtspTransport::Auto && _rtspTransportCache) {
+            if(const std::optional<std::string> transport = _rtspTransportCache->find(url))
+                lastTransport = Config::ReStreamer::ParseRtspTransport(transport->c_str());
+        }
+
+        g_object_set(src,
+            "location", url.c_str(),
+            "protocols", RtspProtocols(_rtspTransport, lastTransport),
+            nullptr);
+        if(_latencyProfile) {
+            const LatencySettings& latencySettings = GetLatencySettings(*_latencyProfile);
+            g_object_set(src,
+                "latency", latencySettings.jitterBufferLatency,
+                "drop-on-latency", latencySettings.dropOnLatency,
+                nullptr);
+        }
+    } else {
+        auto srcPadAddedCallback =
+            + [] (GstElement* decodebin, GstPad* pad, gpointer userData)
+        {
+            ReStreamer* self = static_cast<ReStreamer*>(userData);
+            self->srcPadAdded(decodebin, pad);
+        };
+        g_signal_connect(src, "pad-added", G_CALLBACK(srcPadAddedCallback), this);
+
+        g_object_set(src,
+            "caps", _supportedCapsPtr.get(),
+            "uri", url.c_str(),
+            nullptr);
+    }
+
+    auto noMorePadsCallback =
+        + [] (GstElement* src, gpointer userData)
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        self->noMorePads(src);
+    };
+    g_signal_connect(src, "no-more-pads", G_CALLBACK(noMorePadsCallback), this);
+
+    g_object_set_data_full(
+        G_OBJECT(bin),
+        SourceStateKey,
+        new SourceState(paced, standby ? new StandbySource(bin) : nullptr),
+        [] (gpointer userData) {
+            delete static_cast<SourceState*>(userData);
+        });
+
+    gst_bin_add(GST_BIN(bin), srcPtr.release());
+
+    if(standby) {
+        _standbySourceBinPtr.reset(GST_ELEMENT(gst_object_ref(bin)));
+    } else {
+        _activeSourceUrl = url;
+        _activeSourcePlayed = false;
+        _sourceBinPtr.reset(GST_ELEMENT(gst_object_ref(bin)));
+    }
+    gst_bin_add(pipeline, binPtr.release());
+
+    return true;
+}
+
+void ReStreamer::removeSource() noexcept
+{
+    if(GstElement* bin = _sourceBinPtr.get()) {
+        gst_element_set_state(bin, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(_pipelinePtr.get()), bin);
+        _sourceBinPtr.reset();
+    }
+
+    // silence is linked to audio tee directly
+    GstPadPtr audioTeeSinkPadPtr(gst_element_get_static_pad(_audioTeePtr.get(), "sink"));
+    GstPadPtr silencePadPtr(gst_pad_get_peer(audioTeeSinkPadPtr.get()));
+    if(silencePadPtr)
+        gst_pad_unlink(silencePadPtr.get(), audioTeeSinkPadPtr.get());
+}
+
+void ReStreamer::removeStandbySource() noexcept
+{
+    if(GstElement* bin = _standbySourceBinPtr.get()) {
+        gst_element_set_state(bin, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(_pipelinePtr.get()), bin);
+        _standbySourceBinPtr.reset();
+    }
+}
+
+void ReStreamer::setBackupSources(
+    const std::deque<std::string>& backupUrls,
+    const std::string& slateUrl) noexcept
+{
+    _sourceSwitcherPtr->setBackupSources(backupUrls, slateUrl);
+}
+
+void ReStreamer::setLatencyProfile(LatencyProfile latencyProfile) noexcept
+{
+    _latencyProfile = latencyProfile;
+}
+
+void ReStreamer::setRtspTransport(
+    RtspTransport rtspTransport,
+    SourceCache* rtspTransportCache) noexcept
+{
+    _rtspTransport = rtspTransport;
+    _rtspTransportCache = rtspTransportCache;
+}
+
+// transport is known only when source is playing already
+void ReStreamer::rememberRtspTransport() noexcept
+{
+    if(_rtspTransport != RtspTransport::Auto || !_rtspTransportCache || !_sourceBinPtr)
+        return;
+
+    bool rtspSource = false;
+    bool udp = false;
+
+    GstIterator* iterator = gst_bin_iterate_recurse(GST_BIN(_sourceBinPtr.get()));
+    GValue item = G_VALUE_INIT;
+    while(gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        GstElement* element = GST_ELEMENT(g_value_get_object(&item));
+        GstElementFactory* factory = gst_element_get_factory(element);
+        if(G_OBJECT_TYPE(element) == _rtspSrcType)
+            rtspSource = true;
+        else if(factory && 0 == g_strcmp0(GST_OBJECT_NAME(factory), "udpsrc"))
+            udp = true; // TCP interleaved data is pushed by rtspsrc itself
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+
+    if(rtspSource)
+        _rtspTransportCache->set(
+            _activeSourceUrl,
+            Config::ReStreamer::RtspTransportName(udp ? RtspTransport::Udp : RtspTransport::Tcp));
+}
+
+// remembered transport could stop to work
+void ReStreamer::forgetRtspTransport() noexcept
+{
+    if(_rtspTransport != RtspTransport::Auto || !_rtspTransportCache || _activeSourcePlayed)
+        return;
+
+    _rtspTransportCache->remove(_activeSourceUrl);
+}
+
+void ReStreamer::setSourceCapsCache(SourceCache* sourceCapsCache) noexcept
+{
+    _sourceCapsCache = sourceCapsCache;
+}
+
+void ReStreamer::setStallTimeout(unsigned seconds) noexcept
+{
+    _stallTimeout = seconds;
+}
+
+static thread_local std::set<ReStreamer*> StallWatchedReStreamers;
+static thread_local GSource* StallWatchdogTimer = nullptr;
+
+gboolean ReStreamer::checkStalls()
+{
+    // reStreamer could be destroyed by EOS handler of another one
+    const std::set<ReStreamer*> reStreamers = StallWatchedReStreamers;
+    for(ReStreamer* reStreamer: reStreamers) {
+        if(StallWatchedReStreamers.find(reStreamer) != StallWatchedReStreamers.end())
+            reStreamer->checkStall();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+void ReStreamer::startStallWatchdog() noexcept
+{
+    if(!_stallTimeout)
+        return;
+
+    StallWatchedReStreamers.insert(this);
+
+    if(StallWatchdogTimer)
+        return;
+
+    auto onStallCheckTimeout =
+        + [] (gpointer) -> gboolean
+    {
+        return ReStreamer::checkStalls();
+    };
+    StallWatchdogTimer = g_timeout_source_new_seconds(STALL_CHECK_INTERVAL);
+    g_source_set_callback(StallWatchdogTimer, onStallCheckTimeout, nullptr, nullptr);
+    g_source_attach(StallWatchdogTimer, g_main_context_get_thread_default());
+}
+
+void ReStreamer::stopStallWatchdog() noexcept
+{
+    if(!StallWatchedReStreamers.erase(this) || !StallWatchedReStreamers.empty())
+        return;
+
+    g_source_destroy(StallWatchdogTimer);
+    g_source_unref(StallWatchdogTimer);
+    StallWatchdogTimer = nullptr;
+}
+
+void ReStreamer::checkStall() noexcept
+{
+    if(!_videoFlowPtr)
+        return;
+
+    const bool started = _videoFlowPtr->started;
+    const unsigned timeout = started ? _stallTimeout : std::max<unsigned>(_stallTimeout, STALL_STARTUP_TIMEOUT);
+
+    const gint64 now = g_get_monotonic_time();
+    const gint64 stallTimeout = gint64(timeout) * G_USEC_PER_SEC;
+    const bool noVideo = now - _videoFlowPtr->lastBufferTime > stallTimeout;
+    const bool frozen = started && now - _videoFlowPtr->lastProgressTime > stallTimeout;
+    if(!noVideo && !frozen)
+        return;
+
+    if(!started) {
+        Log()->error("\"{}\" didn't send video in {} seconds after start", _activeSourceUrl, timeout);
+    } else if(noVideo) {
+        Log()->error("No video from \"{}\" for {} seconds", _sourceUrl, _stallTimeout);
+    } else {
+        Log()->error("Video timestamps of \"{}\" are frozen for {} seconds", _sourceUrl, _stallTimeout);
+    }
+
+    // give the next source (or restarted one) the whole timeout
+    _videoFlowPtr->reset();
+
+    if(failover())
+        return;
+
+    onEos(EosReason::Stall);
+}
+
+void ReStreamer::beginSourceSwitch(unsigned sourceIndex) noexcept
+{
+    _sourceSwitcherPtr->beginSwitch(sourceIndex);
+
+    if(_videoFlowPtr)
+        _videoFlowPtr->reset();
+
+    if(sourceIndex == 0)
+        removeStandbySource();
+}
+
+void ReStreamer::switchSource(unsigned sourceIndex) noexcept
+{
+    const bool slate = _sourceSwitcherPtr->isSlate(sourceIndex);
+    const std::string url = _sourceSwitcherPtr->sourceUri(sourceIndex);
+
+    Log()->info(
+        "Switching \"{}\" to {} \"{}\"...",
+        _sourceUrl,
+        sourceIndex == 0 ? "primary source" : slate ? "slate" : "backup source",
+        url);
+
+    removeSource();
+    beginSourceSwitch(sourceIndex);
+
+    if(!addSource(GST_BIN(_pipelinePtr.get()), url, slate)) {
+        onEos(EosReason::OtherError);
+        return;
+    }
+
+    gst_element_sync_state_with_parent(_sourceBinPtr.get());
+}
+
+// primary source is started next to active backup (or slate),
+// so active one keeps streaming until primary has keyframe
+void ReStreamer::retryPrimarySource() noexcept
+{
+    if(_standbySourceBinPtr) {
+        Log()->info("Primary source \"{}\" didn't send keyframe in time, restarting it...", _sourceUrl);
+        removeStandbySource();
+    } else {
+        Log()->info("Trying primary source \"{}\" again...", _sourceUrl);
+    }
+
+    if(!addSource(GST_BIN(_pipelinePtr.get()), _sourceUrl, false, true))
+        return;
+
+    gst_element_sync_state_with_parent(_standbySourceBinPtr.get());
+}
+
+void ReStreamer::promoteStandbySource() noexcept
+{
+    Log()->info("Primary source \"{}\" is back, switching to it...", _sourceUrl);
+
+    GstElementPtr standbyBinPtr = std::move(_standbySourceBinPtr);
+    StandbySource::Pads pads = GetSourceState(GST_BIN(standbyBinPtr.get()))->standby->takePads();
+
+    removeSource();
+    beginSourceSwitch(0);
+
+    _sourceBinPtr = std::move(standbyBinPtr);
+    _activeSourceUrl = _sourceUrl;
+    _activeSourcePlayed = false;
+
+    GstPadPtr videoTeeSinkPadPtr(gst_element_get_static_pad(_videoTeePtr.get(), "sink"));
+    GstPadPtr audioTeeSinkPadPtr(gst_element_get_static_pad(_audioTeePtr.get(), "sink"));
+
+    _sourceSwitcherPtr->addPadProbe(pads.videoPadPtr.get(), true);
+    if(GST_PAD_LINK_OK != gst_pad_link(pads.videoPadPtr.get(), videoTeeSinkPadPtr.get())) {
+        Log()->error("Failed to link video of \"{}\"", _sourceUrl);
+        onEos(EosReason::OtherError);
+        return;
+    }
+
+    bool silenceLinked = false;
+    if(pads.audioPadPtr) {
+        _sourceSwitcherPtr->addPadProbe(pads.audioPadPtr.get(), false);
+        if(GST_PAD_LINK_OK == gst_pad_link(pads.audioPadPtr.get(), audioTeeSinkPadPtr.get()))
+            gst_pad_remove_probe(pads.audioPadPtr.get(), pads.audioDropProbeId);
+        else
+            Log()->error("Failed to link audio of \"{}\"", _sourceUrl);
+    } else if(pads.silenceNeeded) {
+        silenceLinked = LinkSilentAudio(videoTeeSinkPadPtr.get(), audioTeeSinkPadPtr.get());
+    }
+
+    // lets held keyframe to start the stream
+    gst_pad_remove_probe(pads.videoPadPtr.get(), pads.videoHoldProbeId);
+
+    onVideoReady(_sourceSwitcherPtr->videoH265().value_or(false));
+    if(pads.audioPadPtr || silenceLinked)
+        onAudioReady(pads.audioPadPtr ? pads.audioCompressed : true);
+}
+
+// returns false if there is nothing to switch to
+bool ReStreamer::failover() noexcept
+{
+    const std::optional<unsigned> nextSource = _sourceSwitcherPtr->nextSource();
+    if(!nextSource)
+        return false;
+
+    ++_sourceStatsPtr->failovers;
+    switchSource(*nextSource);
+
+    return true;
+}
+
+void ReStreamer::onSourceEos(unsigned generation) noexcept
+{
+    if(generation != _sourceSwitcherPtr->generation())
+        return; // the other pad of already replaced source
+
+    const std::optional<unsigned> nextSource = _sourceSwitcherPtr->nextSource();
+    if(nextSource && *nextSource == _sourceSwitcherPtr->activeSource()) {
+        switchSource(*nextSource); // slate is looped
+        return;
+    }
+
+    if(failover())
+        return;
+
+    onEos(EosReason::Disconnect);
+}
+
+void ReStreamer::start() noexcept
+{
+    GstElementPtr pipelinePtr(gst_pipeline_new(nullptr));
+    GstElement* pipeline = pipelinePtr.get();
+    if(!pipeline) {
+        Log()->error("Failed to create pipeline element");
+        return;
+    }
+
+    GstElementPtr videoTeePtr(gst_element_factory_make("tee", "videotee"));
+    GstElement* videoTee = videoTeePtr.get();
+    if(!videoTee) {
+        Log()->error("Failed to create \"tee\" element");
+        return;
+    }
+
+    GstElementPtr audioTeePtr(gst_element_factory_make("tee", "audiotee"));
+    GstElement* audioTee = audioTeePtr.get();
+    if(!audioTee) {
+        Log()->error("Failed to create \"tee\" element");
+        return;
+    }
+
+    _h264CapsPtr.reset(gst_caps_from_string(H264MediaType));
+    _h265CapsPtr.reset(gst_caps_from_string(H265MediaType));
+    _audioRawCapsPtr.reset(gst_caps_from_string("audio/x-raw"));
+    // audio formats FLV is able to carry as is
+    _aacCapsPtr.reset(gst_caps_from_string("audio/mpeg, mpegversion=(int)4, stream-format=(string){ raw, adts }"));
+    _g711CapsPtr.reset(gst_caps_from_string(
+        "audio/x-alaw, rate=(int)8000, channels=(int)1; "
+        "audio/x-mulaw, rate=(int)8000, channels=(int)1"));
+
+    GstCapsPtr supportedCapsPtr(gst_caps_copy(_h264CapsPtr.get()));
+    gst_caps_append(supportedCapsPtr.get(), gst_caps_copy(_h265CapsPtr.get()));
+    gst_caps_append(supportedCapsPtr.get(), gst_caps_copy(_aacCapsPtr.get()));
+    gst_caps_append(supportedCapsPtr.get(), gst_caps_copy(_g711CapsPtr.get()));
+    gst_caps_append(supportedCapsPtr.get(), gst_caps_copy(_audioRawCapsPtr.get()));
+    _supportedCapsPtr = std::move(supportedCapsPtr);
+
+    if(!addSource(GST_BIN(pipeline), _sourceUrl, false))
+        return;
+
+    auto onBusSyncMessageCallback =
+        + [] (GstBus* bus, GstMessage* message, gpointer /*userData*/) -> GstBusSyncReply
+    {
+        return ReStreamer::onBusSyncMessage(message);
+    };
+    auto onBusMessageCallback =
+        + [] (GstBus* bus, GstMessage* message, gpointer userData) -> gboolean
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        return self->onBusMessage(message);
+    };
+    GstBusPtr busPtr(gst_pipeline_get_bus(GST_PIPELINE(pipeline)));
+    gst_bus_set_sync_handler(busPtr.get(), onBusSyncMessageCallback, nullptr, nullptr);
+    gst_bus_add_watch(busPtr.get(), onBusMessageCallback, this);
+
+    // source should continue to work even if there are no targets attached at the moment
+    g_object_set(videoTee, "allow-not-linked", TRUE, nullptr);
+    g_object_set(audioTee, "allow-not-linked", TRUE, nullptr);
+
+    // lets targets (re)attached to running source to start without waiting for keyframe
+    _gopCachePtr = std::make_shared<GopCache>();
+    GstPadPtr videoTeeSinkPadPtr(gst_element_get_static_pad(videoTee, "sink"));
+    AddGopCacheProbe(videoTeeSinkPadPtr.get(), _gopCachePtr);
+
+    _videoFlowPtr = std::make_shared<VideoFlow>();
+    _videoFlowPtr->reset();
+    gst_pad_add_probe(
+        videoTeeSinkPadPtr.get(),
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        TrackVideoFlow,
+        new std::shared_ptr<VideoFlow>(_videoFlowPtr),
+        [] (gpointer userData) {
+            delete static_cast<std::shared_ptr<VideoFlow>*>(userData);
+        });
+
+    _videoTeePtr.reset(GST_ELEMENT(gst_object_ref(videoTee)));
+    _audioTeePtr.reset(GST_ELEMENT(gst_object_ref(audioTee)));
+    gst_bin_add_many(
+        GST_BIN(pipeline),
+        videoTeePtr.release(), audioTeePtr.release(),
+        nullptr);
+
+    _pipelinePtr = std::move(pipelinePtr);
+    ++PipelinesCount;
+
+    auto onStatsTimeout =
+        + [] (gpointer userData) -> gboolean
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        self->updateStats();
+        return G_SOURCE_CONTINUE;
+    };
+    _statsTimerPtr.reset(g_timeout_source_new_seconds(STATS_INTERVAL));
+    g_source_set_callback(_statsTimerPtr.get(), onStatsTimeout, this, nullptr);
+    g_source_attach(_statsTimerPtr.get(), g_main_context_get_thread_default());
+
+    startStallWatchdog();
+
+    // targets are prebuilt to be ready for the first keyframe
+    if(_sourceCapsCache) {
+        const std::optional<std::string> videoCaps = _sourceCapsCache->find(_sourceUrl);
+        if(videoCaps == H264MediaType)
+            _videoCodec = VideoCodec::H264;
+        else if(videoCaps == H265MediaType)
+            _videoCodec = VideoCodec::H265;
+    }
+
+    for(auto& pair: _targets)
+        attachTarget(&pair.second);
+    for(auto& pair: _subscribers)
+        attachSubscriber(&pair.second);
+
+    play();
+}
+
+void ReStreamer::addTarget(
+    const std::string& targetId,
+    const std::string& targetUrl,
+    const AudioEncoding& audioEncoding) noexcept
+{
+    addTarget(targetId, Target { targetUrl, audioEncoding });
+}
+
+void ReStreamer::addHlsTarget(
+    const std::string& targetId,
+    const std::shared_ptr<HlsStream>& hlsStream,
+    const AudioEncoding& audioEncoding) noexcept
+{
+    Target target { std::string(), audioEncoding };
+    target.hlsStreamPtr = hlsStream;
+
+    addTarget(targetId, std::move(target));
+}
+
+void ReStreamer::addTarget(const std::string& targetId, Target&& target) noexcept
+{
+    target.id = targetId;
+    target.statsPtr = std::make_shared<TargetStats>();
+    target.statsPtr->sourceStats = _sourceStatsPtr;
+
+    auto [it, inserted] = _targets.emplace(targetId, std::move(target));
+    if(!inserted) {
+        Log()->warn("Target \"{}\" is already attached to \"{}\"", targetId, _sourceUrl);
+        return;
+    }
+
+    if(_pipelinePtr)
+        attachTarget(&it->second);
+}
+
+void ReStreamer::changeTargetUrl(
+    const std::string& targetId,
+    const std::string& targetUrl) noexcept
+{
+    auto it = _targets.find(targetId);
+    if(it == _targets.end()) {
+        Log()->warn("Target \"{}\" is not attached to \"{}\"", targetId, _sourceUrl);
+        return;
+    }
+
+    Target& target = it->second;
+    if(target.url == targetUrl)
+        return;
+
+    target.url = targetUrl;
+
+    if(!target.binPtr)
+        return; // will be attached with new url
+
+    // only target branch is replaced, source (and audio encoder if any) keeps running
+    detachTarget(&target);
+    attachTarget(&target);
+}
+
+void ReStreamer::removeTarget(const std::string& targetId) noexcept
+{
+    auto it = _targets.find(targetId);
+    if(it == _targets.end())
+        return;
+
+    detachTarget(&it->second);
+
+    const AudioEncoding audioEncoding = it->second.audioEncoding;
+    _targets.erase(it);
+
+    releaseAudioEncoderIfUnused(audioEncoding);
+}
+
+// links target audio queue to newly requested MPEG-TS muxer pad
+static bool LinkMuxerAudio(GstElement* bin)
+{
+    GstElementPtr muxerPtr(gst_bin_get_by_name(GST_BIN(bin), TargetMuxerName));
+    GstPadPtr audioSinkPadPtr(gst_element_get_static_pad(bin, "audio"));
+    GstPadPtr queueSinkPadPtr(gst_ghost_pad_get_target(GST_GHOST_PAD(audioSinkPadPtr.get())));
+    GstElementPtr audioQueuePtr(gst_pad_get_parent_element(queueSinkPadPtr.get()));
+
+    return muxerPtr && audioQueuePtr &&
+        gst_element_link_pads(audioQueuePtr.get(), nullptr, muxerPtr.get(), "sink_%d");
+}
+
+bool ReStreamer::addMuxedOutput(
+    GstBin* bin,
+    GstElement* videoQueue,
+    GstElement* audioQueue,
+    const Target& target,
+    GstElement** sinkOut) noexcept
+{
+    const bool srtTarget = GetTargetType(target.url) == TargetType::Srt;
+
+    const char* muxerName = "flvmux";
+    const char* videoMuxerPad = "video";
+    const char* sinkName = "rtmppublisher";
+    const char* videoParserName = nullptr;
+    if(srtTarget) {
+        muxerName = "mpegtsmux";
+        videoMuxerPad = "sink_%d";
+        sinkName = "srtsink";
+        // source video is in avc/hvc1 stream format as FLV requires,
+        // but MPEG-TS requires byte-stream
+        videoParserName = _videoCodec == VideoCodec::H265 ? "h265parse" : "h264parse";
+    } else if(_videoCodec == VideoCodec::H265) {
+        muxerName = FindHevcFlvMuxer();
+        if(!muxerName) {
+            Log()->error("There is no FLV muxer with H.265 support");
+            return false;
+        }
+    }
+
+    GstElementPtr videoParserPtr;
+    if(videoParserName) {
+        videoParserPtr.reset(gst_element_factory_make(videoParserName, nullptr));
+        if(!videoParserPtr) {
+            Log()->error("Failed to create \"{}\" element", videoParserName);
+            return false;
+        }
+    }
+    GstElement* videoParser = videoParserPtr.get();
+
+    GstElementPtr muxerPtr(gst_element_factory_make(muxerName, TargetMuxerName));
+    GstElement* muxer = muxerPtr.get();
+    if(!muxer) {
+        Log()->error("Failed to create \"{}\" element", muxerName);
+        return false;
+    }
+
+    GstElementPtr egressQueuePtr(gst_element_factory_make("queue", nullptr));
+    GstElement* egressQueue = egressQueuePtr.get();
+    if(!egressQueue) {
+        Log()->error("Failed to create \"queue\" element");
+        return false;
+    }
+
+    GstElementPtr sinkPtr(gst_element_factory_make(sinkName, TargetSinkName));
+    GstElement* sink = sinkPtr.get();
+    if(!sink) {
+        Log()->error("Failed to create \"{}\" element", sinkName);
+        return false;
+    }
+
+    if(srtTarget) {
+        // SPS/PPS with every keyframe, so receiver could join at any moment
+        g_object_set(videoParser, "config-interval", -1, nullptr);
+        g_object_set(muxer, "alignment", MPEGTS_ALIGNMENT, nullptr);
+    } else {
+        g_object_set(muxer, "streamable", true, nullptr);
+    }
+
+    if(_latencyProfile) {
+        const LatencySettings& latencySettings = GetLatencySettings(*_latencyProfile);
+        // aggregator based muxers only
+        if(g_object_class_find_property(G_OBJECT_GET_CLASS(muxer), "latency"))
+            g_object_set(muxer, "latency", latencySettings.muxLatency, nullptr);
+        g_object_set(sink, "sync", latencySettings.syncSink, nullptr);
+    }
+
+    // when it's full, muxer blocks and backlog grows in front of it
+    g_object_set(egressQueue,
+        "max-size-buffers", 0,
+        "max-size-bytes", EGRESS_QUEUE_MAX_BYTES,
+        "max-size-time", G_GUINT64_CONSTANT(0),
+        nullptr);
+
+    if(srtTarget) {
+        // url query parameters (latency, passphrase, pbkeylen, streamid, mode...)
+        // are applied by srtsink itself and override defaults set before
+        g_object_set(sink,
+            "latency", SRT_DEFAULT_LATENCY,
+            "uri", target.url.c_str(),
+            nullptr);
+    } else {
+        g_object_set(sink, "location", target.url.c_str(), nullptr);
+    }
+
+    gst_bin_add_many(
+        bin,
+        muxerPtr.release(),
+        egressQueuePtr.release(),
+        sinkPtr.release(),
+        nullptr);
+    GstElement* videoMuxerInput = videoQueue;
+    if(videoParser) {
+        gst_bin_add(bin, videoParserPtr.release());
+        if(!gst_element_link(videoQueue, videoParser)) {
+            Log()->error("Failed to link target elements");
+            return false;
+        }
+        videoMuxerInput = videoParser;
+    }
+    // mpegtsmux waits for data on every requested pad,
+    // so audio is linked to it only when source audio could be forwarded (see linkTargetAudio)
+    if(!gst_element_link_pads(videoMuxerInput, nullptr, muxer, videoMuxerPad) ||
+        (!srtTarget && !gst_element_link_pads(audioQueue, nullptr, muxer, "audio")) ||
+        !gst_element_link_many(muxer, egressQueue, sink, nullptr))
+    {
+        Log()->error("Failed to link target elements");
+        return false;
+    }
+
+    *sinkOut = sink;
+
+    return true;
+}
+
+// video is forwarded as is, audio (whatever source has) is decoded
+// and left for whipclientsink to encode to Opus
+bool ReStreamer::addWhipOutput(
+    GstBin* bin,
+    GstElement* videoQueue,
+    GstElement* audioQueue,
+    const Target& target,
+    GstElement** sinkOut) noexcept
+{
+    const char* videoParserName = _videoCodec == VideoCodec::H265 ? "h265parse" : "h264parse";
+    GstElementPtr videoParserPtr(gst_element_factory_make(videoParserName, nullptr));
+    GstElement* videoParser = videoParserPtr.get();
+    if(!videoParser) {
+        Log()->error("Failed to create \"{}\" element", videoParserName);
+        return false;
+    }
+
+    GstElementPtr audioDecodebinPtr(gst_element_factory_make("decodebin", nullptr));
+    GstElement* audioDecodebin = audioDecodebinPtr.get();
+    if(!audioDecodebin) {
+        Log()->error("Failed to create \"decodebin\" element");
+        return false;
+    }
+
+    GstElementPtr audioConvertPtr(gst_element_factory_make("audioconvert", nullptr));
+    GstElement* audioConvert = audioConvertPtr.get();
+    if(!audioConvert) {
+        Log()->error("Failed to create \"audioconvert\" element");
+        return false;
+    }
+
+    GstElementPtr audioResamplePtr(gst_element_factory_make("audioresample", nullptr));
+    GstElement* audioResample = audioResamplePtr.get();
+    if(!audioResample) {
+        Log()->error("Failed to create \"audioresample\" element");
+        return false;
+    }
+
+    GstElementPtr sinkPtr(gst_element_factory_make("whipclientsink", TargetSinkName));
+    GstElement* sink = sinkPtr.get();
+    if(!sink) {
+        Log()->error("Failed to create \"whipclientsink\" element");
+        return false;
+    }
+
+    // SPS/PPS with every keyframe, so receiver could start decoding with any of them
+    g_object_set(videoParser, "config-interval", -1, nullptr);
+
+    const std::string endpoint = WhipEndpoint(target.url);
+    gst_child_proxy_set(GST_CHILD_PROXY(sink), "signaller::whip-endpoint", endpoint.c_str(), nullptr);
+
+    auto onAudioDecoded =
+        + [] (GstElement* /*decodebin*/, GstPad* pad, gpointer userData)
+    {
+        GstElement* audioConvert = static_cast<GstElement*>(userData);
+        GstPadPtr convertSinkPadPtr(gst_element_get_static_pad(audioConvert, "sink"));
+        if(gst_pad_is_linked(convertSinkPadPtr.get()))
+            return;
+
+        if(GST_PAD_LINK_OK != gst_pad_link(pad, convertSinkPadPtr.get()))
+            Log()->error("Failed to link decoded audio to WHIP target");
+    };
+    g_signal_connect(audioDecodebin, "pad-added", G_CALLBACK(onAudioDecoded), audioConvert);
+
+    gst_bin_add_many(
+        bin,
+        videoParserPtr.release(),
+        audioDecodebinPtr.release(),
+        audioConvertPtr.release(),
+        audioResamplePtr.release(),
+        sinkPtr.release(),
+        nullptr);
+    if(!gst_element_link(videoQueue, videoParser) ||
+        !gst_element_link_pads(videoParser, nullptr, sink, "video_%u") ||
+        !gst_element_link(audioQueue, audioDecodebin) ||
+        !gst_element_link(audioConvert, audioResample) ||
+        !gst_element_link_pads(audioResample, nullptr, sink, "audio_%u"))
+    {
+        Log()->error("Failed to link target elements");
+        return false;
+    }
+
+    *sinkOut = sink;
+
+    return true;
+}
+
+// video is parsed to access units of avc/hvc1 stream format
+// and audio to raw AAC frames, as fMP4 requires,
+// then both are muxed by segmenter probes on the sinks
+bool ReStreamer::addHlsOutput(
+    GstBin* bin,
+    GstElement* videoQueue,
+    GstElement* audioQueue,
+    const Target& target,
+    GstElement** sinkOut) noexcept
+{
+    const bool h265 = _videoCodec == VideoCodec::H265;
+    const char* videoParserName = h265 ? "h265parse" : "h264parse";
+    GstElementPtr videoParserPtr(gst_element_factory_make(videoParserName, nullptr));
+    GstElement* videoParser = videoParserPtr.get();
+    if(!videoParser) {
+        Log()->error("Failed to create \"{}\" element", videoParserName);
+        return false;
+    }
+
+    GstElementPtr audioParserPtr(gst_element_factory_make("aacparse", nullptr));
+    GstElement* audioParser = audioParserPtr.get();
+    if(!audioParser) {
+        Log()->error("Failed to create \"aacparse\" element");
+        return false;
+    }
+
+    GstElementPtr videoSinkPtr(gst_element_factory_make("fakesink", TargetSinkName));
+    GstElementPtr audioSinkPtr(gst_element_factory_make("fakesink", nullptr));
+    GstElement* videoSink = videoSinkPtr.get();
+    GstElement* audioSink = audioSinkPtr.get();
+    if(!videoSink || !audioSink) {
+        Log()->error("Failed to create \"fakesink\" element");
+        return false;
+    }
+
+    // segmenter doesn't need clock, and video alone should be enough to preroll
+    for(GstElement* sink: { videoSink, audioSink })
+        g_object_set(sink, "sync", FALSE, "async", FALSE, nullptr);
+
+    GstCapsPtr videoCapsPtr(gst_caps_from_string(h265 ?
+        "video/x-h265, stream-format=(string)hvc1, alignment=(string)au" :
+        "video/x-h264, stream-format=(string)avc, alignment=(string)au"));
+    GstCapsPtr audioCapsPtr(gst_caps_from_string(
+        "audio/mpeg, mpegversion=(int)4, stream-format=(string)raw"));
+
+    gst_bin_add_many(
+        bin,
+        videoParserPtr.release(),
+        audioParserPtr.release(),
+        videoSinkPtr.release(),
+        audioSinkPtr.release(),
+        nullptr);
+    if(!gst_element_link(videoQueue, videoParser) ||
+        !gst_element_link_filtered(videoParser, videoSink, videoCapsPtr.get()) ||
+        !gst_element_link(audioQueue, audioParser) ||
+        !gst_element_link_filtered(audioParser, audioSink, audioCapsPtr.get()))
+    {
+        Log()->error("Failed to link target elements");
+        return false;
+    }
+
+    GstPadPtr videoSinkPadPtr(gst_element_get_static_pad(videoSink, "sink"));
+    GstPadPtr audioSinkPadPtr(gst_element_get_static_pad(audioSink, "sink"));
+    AddHlsSegmenterProbes(videoSinkPadPtr.get(), audioSinkPadPtr.get(), target.hlsStreamPtr);
+
+    *sinkOut = videoSink;
+
+    return true;
+}
+
+bool ReStreamer::attachTarget(Target* target) noexcept
+{
+    GstElement* pipeline = _pipelinePtr.get();
+
+    assert(!target->binPtr);
+
+    const TargetType targetType =
+        target->hlsStreamPtr ? TargetType::Hls : GetTargetType(target->url);
+
+    // connect to RTMP server in parallel with source startup,
+    // so the first keyframe could be sent right away
+    if(!_videoReady && targetType == TargetType::Rtmp)
+        PreconnectRtmp(target->url);
+
+    if(_videoCodec == VideoCodec::Unknown) {
+        // will be attached as soon as source video codec will be known
+        return true;
+    }
+
+    GstElementPtr binPtr(gst_bin_new(nullptr));
+    GstElement* bin = binPtr.get();
+
+    GstElementPtr videoQueuePtr(gst_element_factory_make("queue", nullptr));
+    GstElement* videoQueue = videoQueuePtr.get();
+    if(!videoQueue) {
+        Log()->error("Failed to create \"queue\" element");
+        return false;
+    }
+
+    GstElementPtr audioQueuePtr(gst_element_factory_make("queue", nullptr));
+    GstElement* audioQueue = audioQueuePtr.get();
+    if(!audioQueue) {
+        Log()->error("Failed to create \"queue\" element");
+        return false;
+    }
+
+    // hard limits are just the last resort,
+    // backlog is limited by ApplyEgressPolicy and ApplyAudioEgressPolicy
+    g_object_set(videoQueue,
+        "max-size-buffers", 0,
+        "max-size-bytes", 2 * VIDEO_BACKLOG_MAX_BYTES,
+        "max-size-time", 2 * VideoBacklogMaxTime,
+        "leaky", 2, // downstream
+        nullptr);
+    g_object_set(audioQueue,
+        "max-size-buffers", 0,
+        "max-size-bytes", 0,
+        "max-size-time", 2 * VideoBacklogMaxTime,
+        "leaky", 2, // downstream
+        nullptr);
+
+    gst_bin_add_many(
+        GST_BIN(bin),
+        videoQueuePtr.release(),
+        audioQueuePtr.release(),
+        nullptr);
+
+    GstElement* sink = nullptr;
+    bool outputAdded = false;
+    switch(targetType) {
+        case TargetType::Whip:
+            outputAdded = addWhipOutput(GST_BIN(bin), videoQueue, audioQueue, *target, &sink);
+            break;
+        case TargetType::Hls:
+            outputAdded = addHlsOutput(GST_BIN(bin), videoQueue, audioQueue, *target, &sink);
+            break;
+        default:
+            outputAdded = addMuxedOutput(GST_BIN(bin), videoQueue, audioQueue, *target, &sink);
+            break;
+    }
+    if(!outputAdded)
+        return false;
+
+    GstPadPtr videoQueueSinkPad(gst_element_get_static_pad(videoQueue, "sink"));
+    GstPadPtr audioQueueSinkPad(gst_element_get_static_pad(audioQueue, "sink"));
+    GstPad* videoSinkPad = gst_ghost_pad_new("video", videoQueueSinkPad.get());
+    GstPad* audioSinkPad = gst_ghost_pad_new("audio", audioQueueSinkPad.get());
+    gst_element_add_pad(bin, videoSinkPad);
+    gst_element_add_pad(bin, audioSinkPad);
+
+    g_object_set_data_full(
+        G_OBJECT(bin),
+        TargetFailedKey,
+        new std::atomic<bool>(false),
+        [] (gpointer userData) {
+            delete static_cast<std::atomic<bool>*>(userData);
+        });
+
+    const std::shared_ptr<TargetStats>& stats = target->statsPtr;
+    g_object_set_data_full(
+        G_OBJECT(bin),
+        TargetStatsKey,
+        new std::shared_ptr<TargetStats>(stats),
+        [] (gpointer userData) {
+            delete static_cast<std::shared_ptr<TargetStats>*>(userData);
+        });
+    AddStatsProbe(videoQueue, "src", CountVideo, stats);
+    AddStatsProbe(audioQueue, "src", CountAudio, stats);
+    if(targetType != TargetType::Whip && targetType != TargetType::Hls)
+        AddStatsProbe(sink, "sink", CountOut, stats);
+    gst_pad_add_probe(
+        videoQueueSinkPad.get(),
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        ApplyEgressPolicy,
+        new EgressPolicy { stats },
+        [] (gpointer userData) {
+            delete static_cast<EgressPolicy*>(userData);
+        });
+    AddStatsProbe(audioQueue, "sink", ApplyAudioEgressPolicy, stats);
+    stats->startTime = g_get_monotonic_time();
+
+    target->binPtr.reset(GST_ELEMENT(gst_object_ref(bin)));
+    gst_bin_add(GST_BIN(pipeline), binPtr.release());
+
+    // target should be ready to accept data before it's linked to source
+    gst_element_sync_state_with_parent(bin);
+
+    // target prebuilt for cached caps waits for source to confirm them
+    if(!_videoReady)
+        return true;
+
+    linkTargetVideo(target);
+
+    // otherwise it will be linked as soon as source audio will be available
+    if(_audioReady)
+        linkTargetAudio(target);
+
+    return true;
+}
+
+void ReStreamer::linkTargetVideo(Target* target) noexcept
+{
+    assert(_videoReady);
+    assert(target->binPtr && !target->videoTeePadPtr);
+
+    GstElement* bin = target->binPtr.get();
+
+    target->videoTeePadPtr.reset(gst_element_get_request_pad(_videoTeePtr.get(), "src_%u"));
+    AddDropIfTargetFailedProbe(target->videoTeePadPtr.get(), bin);
+    // target could be attached to already running source
+    gst_pad_add_probe(
+        target->videoTeePadPtr.get(),
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        ReplayGopOrDropUntilKeyFrame,
+        new GopReplay { GstElementPtr(GST_ELEMENT(gst_object_ref(bin))), _gopCachePtr },
+        [] (gpointer userData) {
+            delete static_cast<GopReplay*>(userData);
+        });
+    GstPadPtr videoSinkPad(gst_element_get_static_pad(bin, "video"));
+    if(GST_PAD_LINK_OK != gst_pad_link(target->videoTeePadPtr.get(), videoSinkPad.get()))
+        assert(false);
+
+    // don't wait for natural GOP boundary if source could produce keyframe on demand,
+    // unless target will start from cached GOP anyway
+    if(!_gopCachePtr->hasGop())
+        requestKeyFrame();
+}
+
+void ReStreamer::linkTargetAudio(Target* target) noexcept
+{
+    assert(_audioReady);
+    assert(target->binPtr && !target->audioTeePadPtr);
+
+    const TargetType targetType =
+        target->hlsStreamPtr ? TargetType::Hls : GetTargetType(target->url);
+    if(_audioG711 && targetType == TargetType::Srt) {
+        Log()->warn("G.711 audio can't be carried in MPEG-TS, target \"{}\" will get video only", target->id);
         return;
     }
-
-    GstElementPtr srcPtr(gst_element_factory_make("uridecodebin", nullptr));
-    GstElement* decodebin = srcPtr.get();
-    if(!decodebin) {
-        Log()->error("Failed to create \"uridecodebin\" element");
+    if(_audioG711 && targetType == TargetType::Hls) {
+        Log()->warn("G.711 audio is not supported by HLS, only video will be available");
         return;
     }
-
-    _flvMuxPtr.reset(gst_element_factory_make("flvmux", "mux"));
-    GstElement* flvMux = _flvMuxPtr.get();
-    if(!flvMux) {
-        Log()->error("Failed to create \"flvmux\" element");
+    if(targetType == TargetType::Srt && !LinkMuxerAudio(target->binPtr.get())) {
+        Log()->error("Failed to link audio of target \"{}\"", target->id);
         return;
     }
 
-    GstElementPtr rtmpSinkPtr(gst_element_factory_make("rtmpsink", nullptr));
-    GstElement* rtmpSink = rtmpSinkPtr.get();
-    if(!rtmpSink) {
-        Log()->error("Failed to create \"rtmpsink\" element");
+    GstElement* audioTee = nullptr;
+    // WHIP target encodes audio itself
+    if(!_audioCompressed && targetType != TargetType::Whip)
+        audioTee = acquireAudioEncoder(target->audioEncoding);
+    if(!audioTee) {
+        // source audio is compressed already,
+        // or there is no encoder and flvmux will accept raw audio
+        audioTee = _audioTeePtr.get();
+    }
+
+    target->audioTeePtr.reset(GST_ELEMENT(gst_object_ref(audioTee)));
+    target->audioTeePadPtr.reset(gst_element_get_request_pad(audioTee, "src_%u"));
+    AddDropIfTargetFailedProbe(target->audioTeePadPtr.get(), target->binPtr.get());
+
+    GstPadPtr audioSinkPad(gst_element_get_static_pad(target->binPtr.get(), "audio"));
+    if(GST_PAD_LINK_OK != gst_pad_link(target->audioTeePadPtr.get(), audioSinkPad.get()))
+        assert(false);
+}
+
+void ReStreamer::requestKeyFrame() noexcept
+{
+    // several targets attached at once are served by the same keyframe
+    if(!_sourceSwitcherPtr->requestKeyFrame())
         return;
+
+    // the same as gst_video_event_new_upstream_force_key_unit().
+    // rtpsession of rtspsrc turns it into RTCP PLI/FIR,
+    // if camera announced support of it in SDP
+    GstEvent* event =
+        gst_event_new_custom(
+            GST_EVENT_CUSTOM_UPSTREAM,
+            gst_structure_new(
+                "GstForceKeyUnit",
+                "running-time", GST_TYPE_CLOCK_TIME, GST_CLOCK_TIME_NONE,
+                "all-headers", G_TYPE_BOOLEAN, TRUE,
+                "count", G_TYPE_UINT, 0,
+                nullptr));
+
+    GstPadPtr teeSinkPad(gst_element_get_static_pad(_videoTeePtr.get(), "sink"));
+    if(!gst_pad_push_event(teeSinkPad.get(), event))
+        Log()->debug("Keyframe request was not handled by source \"{}\"", _activeSourceUrl);
+}
+
+void ReStreamer::onVideoReady(bool h265) noexcept
+{
+    const VideoCodec videoCodec = h265 ? VideoCodec::H265 : VideoCodec::H264;
+    if(_videoCodec != VideoCodec::Unknown && _videoCodec != videoCodec) {
+        // targets were prebuilt for cached caps
+        Log()->info("Video codec of \"{}\" changed, rebuilding targets", _activeSourceUrl);
+        for(auto& pair: _targets)
+            detachTarget(&pair.second);
     }
+    _videoCodec = videoCodec;
+    _videoReady = true;
 
-    _h264CapsPtr.reset(gst_caps_from_string("video/x-h264"));
-    _audioRawCapsPtr.reset(gst_caps_from_string("audio/x-raw"));
+    // backup source or slate could have different codec
+    // but targets are prebuilt for the primary source only
+    if(_sourceCapsCache && _activeSourceUrl == _sourceUrl)
+        _sourceCapsCache->set(_sourceUrl, h265 ? H265MediaType : H264MediaType);
 
-    GstCapsPtr supportedCapsPtr(gst_caps_copy(_h264CapsPtr.get()));
-    gst_caps_append(supportedCapsPtr.get(), gst_caps_copy(_audioRawCapsPtr.get()));
-    GstCaps* supportedCaps = supportedCapsPtr.get();
+    if(!_activeSourcePlayed) {
+        _activeSourcePlayed = true;
+        rememberRtspTransport();
+    }
 
-    g_object_set(decodebin, "caps", supportedCaps, nullptr);
+    for(auto& pair: _targets) {
+        Target& target = pair.second;
+        if(!target.binPtr) {
+            attachTarget(&target);
+        } else if(!target.videoTeePadPtr) {
+            linkTargetVideo(&target);
+            if(_audioReady)
+                linkTargetAudio(&target);
+        }
+    }
 
-    auto onBusMessageCallback =
-        + [] (GstBus* bus, GstMessage* message, gpointer userData) -> gboolean
-    {
-        ReStreamer* self = static_cast<ReStreamer*>(userData);
-        return self->onBusMessage(message);
-    };
-    GstBusPtr busPtr(gst_pipeline_get_bus(GST_PIPELINE(pipeline)));
-    gst_bus_add_watch(busPtr.get(), onBusMessageCallback, this);
+    if(_onSourceReady)
+        _onSourceReady();
+}
 
-    auto srcPadAddedCallback =
-        + [] (GstElement* decodebin, GstPad* pad, gpointer userData)
-    {
-        ReStreamer* self = static_cast<ReStreamer*>(userData);
-        self->srcPadAdded(decodebin, pad);
-    };
-    g_signal_connect(decodebin, "pad-added", G_CALLBACK(srcPadAddedCallback), this);
+void ReStreamer::onAudioReady(bool compressed) noexcept
+{
+    _audioReady = true;
+    _audioCompressed = compressed;
 
-    auto noMorePadsCallback =
-        + [] (GstElement* decodebin, gpointer userData)
-    {
-        ReStreamer* self = static_cast<ReStreamer*>(userData);
-        self->noMorePads(decodebin);
-    };
-    g_signal_connect(decodebin, "no-more-pads", G_CALLBACK(noMorePadsCallback), this);
+    for(auto& pair: _targets) {
+        Target& target = pair.second;
+        if(target.videoTeePadPtr && !target.audioTeePadPtr)
+            linkTargetAudio(&target);
+    }
+}
 
-    g_object_set(decodebin,
-        "uri", _sourceUrl.c_str(),
-        nullptr);
+void ReStreamer::detachTarget(Target* target) noexcept
+{
+    if(!target->hlsStreamPtr && GetTargetType(target->url) == TargetType::Rtmp)
+        CancelPreconnectRtmp(target->url);
+
+    if(target->videoTeePadPtr) {
+        gst_element_release_request_pad(_videoTeePtr.get(), target->videoTeePadPtr.get());
+        target->videoTeePadPtr.reset();
+    }
+    if(target->audioTeePadPtr) {
+        gst_element_release_request_pad(target->audioTeePtr.get(), target->audioTeePadPtr.get());
+        target->audioTeePadPtr.reset();
+        target->audioTeePtr.reset();
+    }
+
+    if(GstElement* bin = target->binPtr.get()) {
+        gst_element_set_state(bin, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(_pipelinePtr.get()), bin);
+        target->binPtr.reset();
+    }
+}
+
+// returns tee with encoded audio
+GstElement* ReStreamer::acquireAudioEncoder(const AudioEncoding& audioEncoding) noexcept
+{
+    auto it = _audioEncoders.find(audioEncoding);
+    if(it != _audioEncoders.end())
+        return it->second.teePtr.get();
+
+    const char* encoderName = FindAacEncoder();
+    if(!encoderName) {
+        Log()->warn("AAC encoder is not available. Audio will be streamed without compression.");
+        return nullptr;
+    }
+
+    GstElement* pipeline = _pipelinePtr.get();
 
-    _flvVideoSinkPad.reset(gst_element_get_request_pad(_flvMuxPtr.get(), "video"));
-    _flvAudioSinkPad.reset(gst_element_get_request_pad(_flvMuxPtr.get(), "audio"));
+    GstElementPtr binPtr(gst_bin_new(nullptr));
+    GstElement* bin = binPtr.get();
 
-    g_object_set(flvMux, "streamable", true, nullptr);
+    GstElementPtr queuePtr(gst_element_factory_make("queue", nullptr));
+    GstElement* queue = queuePtr.get();
+    if(!queue) {
+        Log()->error("Failed to create \"queue\" element");
+        return nullptr;
+    }
+
+    GstElementPtr audioConvertPtr(gst_element_factory_make("audioconvert", nullptr));
+    GstElement* audioConvert = audioConvertPtr.get();
+    if(!audioConvert) {
+        Log()->error("Failed to create \"audioconvert\" element");
+        return nullptr;
+    }
+
+    GstElementPtr audioResamplePtr(gst_element_factory_make("audioresample", nullptr));
+    GstElement* audioResample = audioResamplePtr.get();
+    if(!audioResample) {
+        Log()->error("Failed to create \"audioresample\" element");
+        return nullptr;
+    }
+
+    GstElementPtr capsFilterPtr(gst_element_factory_make("capsfilter", nullptr));
+    GstElement* capsFilter = capsFilterPtr.get();
+    if(!capsFilter) {
+        Log()->error("Failed to create \"capsfilter\" element");
+        return nullptr;
+    }
+
+    GstElementPtr encoderPtr(gst_element_factory_make(encoderName, nullptr));
+    GstElement* encoder = encoderPtr.get();
+    if(!encoder) {
+        Log()->error("Failed to create \"{}\" element", encoderName);
+        return nullptr;
+    }
+
+    GstElementPtr aacParsePtr(gst_element_factory_make("aacparse", nullptr));
+    GstElement* aacParse = aacParsePtr.get();
+    if(!aacParse) {
+        Log()->error("Failed to create \"aacparse\" element");
+        return nullptr;
+    }
+
+    GstElementPtr teePtr(gst_element_factory_make("tee", nullptr));
+    GstElement* tee = teePtr.get();
+    if(!tee) {
+        Log()->error("Failed to create \"tee\" element");
+        return nullptr;
+    }
+
+    GstCapsPtr rawCapsPtr(
+        gst_caps_new_simple(
+            "audio/x-raw",
+            "rate", G_TYPE_INT, static_cast<gint>(audioEncoding.sampleRate),
+            "channels", G_TYPE_INT, static_cast<gint>(audioEncoding.channels),
+            nullptr));
+    g_object_set(capsFilter, "caps", rawCapsPtr.get(), nullptr);
 
-    g_object_set(rtmpSink, "location", _targetUrl.c_str(), nullptr);
+    // bitrate property has different types in different encoders
+    gst_util_set_object_arg(
+        G_OBJECT(encoder),
+        "bitrate",
+        std::to_string(audioEncoding.bitrate).c_str());
+
+    g_object_set(tee, "allow-not-linked", TRUE, nullptr);
 
-    gst_object_ref(flvMux);
     gst_bin_add_many(
-        GST_BIN(pipeline),
-        srcPtr.release(), flvMux, rtmpSinkPtr.release(),
-        nullptr);
-    gst_element_link_many(
-        flvMux, rtmpSink,
+        GST_BIN(bin),
+        queuePtr.release(),
+        audioConvertPtr.release(),
+        audioResamplePtr.release(),
+        capsFilterPtr.release(),
+        encoderPtr.release(),
+        aacParsePtr.release(),
         nullptr);
+    if(!gst_element_link_many(queue, audioConvert, audioResample, capsFilter, encoder, aacParse, nullptr)) {
+        Log()->error("Failed to link audio encoder elements");
+        return nullptr;
+    }
 
-    _pipelinePtr = std::move(pipelinePtr);
+    GstPadPtr queueSinkPad(gst_element_get_static_pad(queue, "sink"));
+    GstPadPtr aacParseSrcPad(gst_element_get_static_pad(aacParse, "src"));
+    gst_element_add_pad(bin, gst_ghost_pad_new("sink", queueSinkPad.get()));
+    gst_element_add_pad(bin, gst_ghost_pad_new("src", aacParseSrcPad.get()));
 
-    play();
+    AudioEncoder& audioEncoder = _audioEncoders[audioEncoding];
+    audioEncoder.binPtr.reset(GST_ELEMENT(gst_object_ref(bin)));
+    audioEncoder.teePtr.reset(GST_ELEMENT(gst_object_ref(tee)));
+
+    gst_bin_add_many(GST_BIN(pipeline), binPtr.release(), teePtr.release(), nullptr);
+    if(!gst_element_link(bin, tee))
+        assert(false);
+
+    gst_element_sync_state_with_parent(tee);
+    gst_element_sync_state_with_parent(bin);
+
+    audioEncoder.sourceTeePadPtr.reset(gst_element_get_request_pad(_audioTeePtr.get(), "src_%u"));
+    GstPadPtr binSinkPad(gst_element_get_static_pad(bin, "sink"));
+    if(GST_PAD_LINK_OK != gst_pad_link(audioEncoder.sourceTeePadPtr.get(), binSinkPad.get()))
+        assert(false);
+
+    Log()->debug(
+        "Audio encoder \"{}\" ({} bps, {} Hz, {} channels) added to \"{}\"",
+        encoderName,
+        audioEncoding.bitrate,
+        audioEncoding.sampleRate,
+        audioEncoding.channels,
+        _sourceUrl);
+
+    return tee;
+}
+
+void ReStreamer::releaseAudioEncoderIfUnused(const AudioEncoding& audioEncoding) noexcept
+{
+    auto it = _audioEncoders.find(audioEncoding);
+    if(it == _audioEncoders.end())
+        return;
+
+    for(const auto& pair: _targets) {
+        if(pair.second.audioEncoding == audioEncoding)
+            return;
+    }
+
+    AudioEncoder& audioEncoder = it->second;
+
+    gst_element_release_request_pad(_audioTeePtr.get(), audioEncoder.sourceTeePadPtr.get());
+
+    GstElement* pipeline = _pipelinePtr.get();
+    for(GstElement* element: { audioEncoder.binPtr.get(), audioEncoder.teePtr.get() }) {
+        gst_element_set_state(element, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), element);
+    }
+
+    _audioEncoders.erase(it);
+}
+
+void ReStreamer::addSubscriber(GstPad* videoSinkPad) noexcept
+{
+    auto [it, inserted] = _subscribers.emplace(
+        videoSinkPad,
+        Subscriber { GstPadPtr(GST_PAD(gst_object_ref(videoSinkPad))) });
+    if(!inserted) {
+        Log()->warn("Subscriber is already attached to \"{}\"", _sourceUrl);
+        return;
+    }
+
+    if(_pipelinePtr)
+        attachSubscriber(&it->second);
+}
+
+void ReStreamer::removeSubscriber(GstPad* videoSinkPad) noexcept
+{
+    auto it = _subscribers.find(videoSinkPad);
+    if(it == _subscribers.end())
+        return;
+
+    detachSubscriber(&it->second);
+
+    _subscribers.erase(it);
+}
+
+void ReStreamer::attachSubscriber(Subscriber* subscriber) noexcept
+{
+    assert(!subscriber->teePadPtr);
+
+    subscriber->teePadPtr.reset(gst_element_get_request_pad(_videoTeePtr.get(), "src_%u"));
+    if(GST_PAD_LINK_OK != gst_pad_link(subscriber->teePadPtr.get(), subscriber->sinkPadPtr.get())) {
+        Log()->error("Failed to link subscriber to \"{}\"", _sourceUrl);
+        detachSubscriber(subscriber);
+    }
+}
+
+void ReStreamer::detachSubscriber(Subscriber* subscriber) noexcept
+{
+    if(subscriber->teePadPtr) {
+        gst_element_release_request_pad(_videoTeePtr.get(), subscriber->teePadPtr.get());
+        subscriber->teePadPtr.reset();
+    }
+}
+
+// called from streaming thread.
+// slate is decoded from file as fast as possible, so it's paced to real time
+// starting from the moment it's switched to
+GstPadPtr ReStreamer::addPacing(GstPad* pad)
+{
+    if(!GetSourceState(SourceBin(pad))->paced)
+        return GstPadPtr(GST_PAD(gst_object_ref(pad)));
+
+    const GstClockTime runningTime =
+        gst_element_get_current_running_time(_pipelinePtr.get());
+    if(GST_CLOCK_TIME_IS_VALID(runningTime))
+        gst_pad_set_offset(pad, runningTime);
+
+    GstPadPtr srcPadPtr = AddChain(SourceBin(pad), pad, { "identity" });
+    if(srcPadPtr)
+        g_object_set(GST_PAD_PARENT(srcPadPtr.get()), "sync", TRUE, nullptr);
+
+    return srcPadPtr;
+}
+
+// called from streaming thread.
+// source pad is exposed from source bin and passes source switch probe
+bool ReStreamer::linkSourcePad(GstPad* pad, const char* name, GstElement* tee, bool video)
+{
+    GstBin* sourceBin = SourceBin(pad);
+    SourceState* state = GetSourceState(sourceBin);
+
+    GstPad* ghostPad = gst_ghost_pad_new(name, pad);
+
+    if(state->standby) {
+        // linked on promotion
+        if(video)
+            state->standby->holdVideo(ghostPad);
+        else
+            state->standby->holdAudio(ghostPad);
+
+        gst_pad_set_active(ghostPad, TRUE);
+        gst_element_add_pad(GST_ELEMENT(sourceBin), ghostPad);
+
+        return true;
+    }
+
+    gst_pad_set_active(ghostPad, TRUE);
+    gst_element_add_pad(GST_ELEMENT(sourceBin), ghostPad);
+
+    _sourceSwitcherPtr->addPadProbe(ghostPad, video);
+
+    GstPadPtr teeSinkPad(gst_element_get_static_pad(tee, "sink"));
+    return GST_PAD_LINK_OK == gst_pad_link(ghostPad, teeSinkPad.get());
+}
+
+// called from streaming thread
+bool ReStreamer::linkVideo(GstPad* pad, bool h265)
+{
+    SourceState* state = GetSourceState(SourceBin(pad));
+
+    if(state->videoLinked.exchange(true)) {
+        Log()->error("Multiple video streams not supported");
+        return false;
+    }
+
+    if(!_sourceSwitcherPtr->acceptVideo(h265)) {
+        Log()->error("Video codec of replacement source differs from \"{}\"", _sourceUrl);
+
+        if(state->standby)
+            state->standby->fail();
+        else
+            _sourceSwitcherPtr->postSourceEos(GST_ELEMENT(SourceBin(pad)));
+
+        return false;
+    }
+
+    if(!linkSourcePad(pad, "video", _videoTeePtr.get(), true)) {
+        Log()->error("Failed to link video of \"{}\"", _sourceUrl);
+        return false;
+    }
+
+    if(!state->standby)
+        postVideoReady(_pipelinePtr.get(), h265);
+
+    return true;
+}
+
+// called from streaming thread
+bool ReStreamer::linkAudio(GstPad* pad, bool compressed)
+{
+    SourceState* state = GetSourceState(SourceBin(pad));
+
+    GstCapsPtr capsPtr(gst_pad_get_current_caps(pad));
+    if(!capsPtr)
+        capsPtr.reset(gst_pad_query_caps(pad, nullptr));
+    const bool g711 = capsPtr && gst_caps_can_intersect(capsPtr.get(), _g711CapsPtr.get());
+
+    const SourceSwitcher::AudioKind audioKind =
+        g711 ? SourceSwitcher::AudioKind::G711 :
+        compressed ? SourceSwitcher::AudioKind::Aac :
+        SourceSwitcher::AudioKind::Raw;
+    if(!_sourceSwitcherPtr->acceptAudio(audioKind)) {
+        Log()->warn("Audio of replacement source differs from \"{}\", skipping it", _sourceUrl);
+        // unlinked pad would fail the source
+        AddChain(SourceBin(pad), pad, { "fakesink" });
+        return false;
+    }
+
+    if(state->audioLinked.exchange(true)) {
+        Log()->error("Multiple audio streams not supported");
+        return false;
+    }
+
+    _audioG711 = g711;
+
+    if(!linkSourcePad(pad, "audio", _audioTeePtr.get(), false)) {
+        Log()->error("Failed to link audio of \"{}\"", _sourceUrl);
+        return false;
+    }
+
+    if(state->standby)
+        state->standby->setAudioCompressed(compressed);
+    else
+        postAudioReady(_pipelinePtr.get(), compressed);
+
+    return true;
 }
 
+// called from streaming thread
 void ReStreamer::srcPadAdded(
     GstElement* /*decodebin*/,
     GstPad* pad)
 {
-    GstElement* pipeline = _pipelinePtr.get();
+    GstBin* sourceBin = SourceBin(pad);
+    SourceState* state = GetSourceState(sourceBin);
 
     GstCapsPtr capsPtr(gst_pad_get_current_caps(pad));
     GstCaps* caps = capsPtr.get();
 
     if(gst_caps_is_always_compatible(caps, _h264CapsPtr.get())) {
-        if(_videoLinked) {
+        if(GstPadPtr srcPadPtr = addPacing(pad))
+            linkVideo(srcPadPtr.get(), false);
+    } else if(gst_caps_is_always_compatible(caps, _h265CapsPtr.get())) {
+        if(GstPadPtr srcPadPtr = addPacing(pad))
+            linkVideo(srcPadPtr.get(), true);
+    } else if(gst_caps_is_always_compatible(caps, _audioRawCapsPtr.get())) {
+        if(state->audioLinked) {
+            Log()->error("Multiple audio streams not supported");
+            return;
+        }
+
+        if(GstPadPtr srcPadPtr = AddChain(sourceBin, pad, { "audioresample" }))
+            if(GstPadPtr pacedPadPtr = addPacing(srcPadPtr.get()))
+                linkAudio(pacedPadPtr.get(), false);
+    } else if(gst_caps_is_always_compatible(caps, _aacCapsPtr.get())) {
+        if(state->audioLinked) {
+            Log()->error("Multiple audio streams not supported");
+            return;
+        }
+
+        // flvmux requires AAC in raw stream format
+        if(GstPadPtr srcPadPtr = AddChain(sourceBin, pad, { "aacparse" }))
+            if(GstPadPtr pacedPadPtr = addPacing(srcPadPtr.get()))
+                linkAudio(pacedPadPtr.get(), true);
+    } else if(gst_caps_is_always_compatible(caps, _g711CapsPtr.get())) {
+        if(GstPadPtr srcPadPtr = addPacing(pad))
+            linkAudio(srcPadPtr.get(), true);
+    } else if(caps && g_str_has_prefix(gst_structure_get_name(gst_caps_get_structure(caps, 0)), "video/")) {
+        // otherwise source would wait for video until stall timeout
+        GST_ELEMENT_ERROR(
+            GST_ELEMENT(sourceBin),
+            STREAM, CODEC_NOT_FOUND,
+            ("Unsupported video \"%s\"", gst_structure_get_name(gst_caps_get_structure(caps, 0))),
+            (nullptr));
+    } else
+        return;
+}
+
+// called from streaming thread
+void ReStreamer::rtpPadAdded(
+    GstElement* /*rtspsrc*/,
+    GstPad* pad)
+{
+    GstBin* sourceBin = SourceBin(pad);
+    SourceState* state = GetSourceState(sourceBin);
+
+    GstCapsPtr capsPtr(gst_pad_get_current_caps(pad));
+    if(!capsPtr)
+        capsPtr.reset(gst_pad_query_caps(pad, nullptr));
+    if(!capsPtr || gst_caps_is_empty(capsPtr.get()))
+        return;
+
+    const GstStructure* structure = gst_caps_get_structure(capsPtr.get(), 0);
+    const gchar* media = gst_structure_get_string(structure, "media");
+    const gchar* encodingName = gst_structure_get_string(structure, "encoding-name");
+    gint clockRate = 0;
+    gst_structure_get_int(structure, "clock-rate", &clockRate);
+    if(!media || !encodingName)
+        return;
+
+    const std::string encoding = encodingName;
+
+    if(0 == g_strcmp0(media, "video")) {
+        if(state->videoLinked) {
             Log()->error("Multiple video streams not supported");
             return;
         }
 
-        if(GST_PAD_LINK_OK != gst_pad_link(pad, _flvVideoSinkPad.get()))
-            assert(false);
+        // decodebin will either find H.264/H.265 inside (like in MP2T) or report unsupported video
+        const bool h265 = encoding == "H265";
+        if(encoding != "H264" && !h265) {
+            addFallbackDecodebin(pad);
+            return;
+        }
 
-        _videoLinked = true;
-    } else if(gst_caps_is_always_compatible(caps, _audioRawCapsPtr.get())) {
-        if(_audioLinked) {
+        GstPadPtr srcPadPtr = h265 ?
+            AddChain(sourceBin, pad, { "rtph265depay", "h265parse", "capsfilter" }) :
+            AddChain(sourceBin, pad, { "rtph264depay", "h264parse", "capsfilter" });
+        if(!srcPadPtr)
+            return;
+
+        GstCapsPtr videoCapsPtr(gst_caps_from_string(h265 ? H265Hvc1Caps : H264AvcCaps));
+        g_object_set(GST_PAD_PARENT(srcPadPtr.get()), "caps", videoCapsPtr.get(), nullptr);
+
+        linkVideo(srcPadPtr.get(), h265);
+    } else if(0 == g_strcmp0(media, "audio")) {
+        if(state->audioLinked) {
             Log()->error("Multiple audio streams not supported");
             return;
         }
 
-        GstElementPtr audioResamplePtr(gst_element_factory_make("audioresample", nullptr));
-        GstElement* audioResample = audioResamplePtr.get();
-        if(!audioResample) {
-            Log()->error("Failed to create \"audioresample\" element");
+        GstPadPtr srcPadPtr;
+        if(encoding == "MPEG4-GENERIC")
+            srcPadPtr = AddChain(sourceBin, pad, { "rtpmp4gdepay", "aacparse" });
+        else if(encoding == "MP4A-LATM")
+            srcPadPtr = AddChain(sourceBin, pad, { "rtpmp4adepay", "aacparse" });
+        else if(encoding == "PCMA" && clockRate == 8000)
+            srcPadPtr = AddChain(sourceBin, pad, { "rtppcmadepay" });
+        else if(encoding == "PCMU" && clockRate == 8000)
+            srcPadPtr = AddChain(sourceBin, pad, { "rtppcmudepay" });
+        else {
+            addFallbackDecodebin(pad);
             return;
         }
 
-        gst_bin_add(GST_BIN(pipeline), audioResamplePtr.release());
-        gst_element_sync_state_with_parent(audioResample);
+        if(srcPadPtr)
+            linkAudio(srcPadPtr.get(), true);
+    }
+}
 
-        GstPadPtr resampleSinkPad(gst_element_get_static_pad(audioResample, "sink"));
-        GstPadPtr resampleSrcPad(gst_element_get_static_pad(audioResample, "src"));
+// called from streaming thread
+void ReStreamer::addFallbackDecodebin(GstPad* pad)
+{
+    GstBin* sourceBin = SourceBin(pad);
 
-        if(GST_PAD_LINK_OK != gst_pad_link(pad, resampleSinkPad.get()))
-            assert(false);
+    GstElementPtr decodebinPtr(gst_element_factory_make("decodebin", nullptr));
+    GstElement* decodebin = decodebinPtr.get();
+    if(!decodebin) {
+        Log()->error("Failed to create \"decodebin\" element");
+        return;
+    }
 
-        if(GST_PAD_LINK_OK != gst_pad_link(resampleSrcPad.get(), _flvAudioSinkPad.get()))
-            assert(false);
+    g_object_set(decodebin, "caps", _supportedCapsPtr.get(), nullptr);
 
-        _audioLinked = true;
-    } else
-        return;
-}
+    auto srcPadAddedCallback =
+        + [] (GstElement* decodebin, GstPad* pad, gpointer userData)
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        self->srcPadAdded(decodebin, pad);
+    };
+    g_signal_connect(decodebin, "pad-added", G_CALLBACK(srcPadAddedCallback), this);
+
+    auto noMorePadsCallback =
+        + [] (GstElement* decodebin, gpointer userData)
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        self->noMorePads(decodebin);
+    };
+    g_signal_connect(decodebin, "no-more-pads", G_CALLBACK(noMorePadsCallback), this);
 
+    // silence should not be linked until decodebin exposes it's pads
+    SourceState* state = GetSourceState(sourceBin);
+    {
+        const std::lock_guard<std::mutex> lock(state->mutex);
+        state->fallbackDecodebins.emplace(decodebin, g_get_monotonic_time());
+    }
+    ++state->pendingNoMorePads;
+
+    // timeout is tracked on main thread
+    gst_element_post_message(
+        GST_ELEMENT(sourceBin),
+        gst_message_new_application(
+            GST_OBJECT(sourceBin),
+            gst_structure_new_empty("fallback-decodebin-added")));
+
+    gst_bin_add(sourceBin, decodebinPtr.release());
+    gst_element_sync_state_with_parent(decodebin);
 
-void ReStreamer::noMorePads(GstElement* /*decodebin*/)
+    GstPadPtr decodebinSinkPad(gst_element_get_static_pad(decodebin, "sink"));
+    if(GST_PAD_LINK_OK != gst_pad_link(pad, decodebinSinkPad.get()))
+        Log()->error("Failed to link \"decodebin\" for \"{}\"", _sourceUrl);
+}
+
+void ReStreamer::scheduleNoMorePadsCheck(guint interval) noexcept
 {
-    if(!_audioLinked) {
-        // stream silence if there is no audio in source.
+    // decodebins added meanwhile are checked on the next round
+    if(_noMorePadsTimerPtr)
+        return;
+
+    auto onNoMorePadsTimeout =
+        + [] (gpointer userData) -> gboolean
+    {
+        ReStreamer* self = static_cast<ReStreamer*>(userData);
+        self->_noMorePadsTimerPtr.reset();
+        self->checkNoMorePads();
+        return G_SOURCE_REMOVE;
+    };
+    _noMorePadsTimerPtr.reset(g_timeout_source_new(interval));
+    g_source_set_callback(_noMorePadsTimerPtr.get(), onNoMorePadsTimeout, this, nullptr);
+    g_source_attach(_noMorePadsTimerPtr.get(), g_main_context_get_thread_default());
+}
 
-        GstElement* pipeline = _pipelinePtr.get();
+// fallback decodebins which didn't expose pads in time are considered done,
+// so source without audio still gets silence
+void ReStreamer::checkNoMorePads() noexcept
+{
+    const gint64 now = g_get_monotonic_time();
+    const gint64 timeout = NO_MORE_PADS_TIMEOUT * G_USEC_PER_SEC;
+    gint64 nextCheckTime = 0;
+
+    for(GstElement* sourceBin: { _sourceBinPtr.get(), _standbySourceBinPtr.get() }) {
+        if(!sourceBin)
+            continue;
+
+        std::deque<GstElement*> expired;
+        {
+            SourceState* state = GetSourceState(GST_BIN(sourceBin));
+            const std::lock_guard<std::mutex> lock(state->mutex);
+            for(const auto& [decodebin, addTime]: state->fallbackDecodebins) {
+                if(!addTime)
+                    continue;
+
+                if(now - addTime >= timeout)
+                    expired.push_back(decodebin);
+                else if(!nextCheckTime || addTime + timeout < nextCheckTime)
+                    nextCheckTime = addTime + timeout;
+            }
+        }
 
-        GstElementPtr audioTestSrcPtr(gst_element_factory_make("audiotestsrc", nullptr));
-        GstElement* audioTestSrc = audioTestSrcPtr.get();
-        if(!audioTestSrc) {
-            Log()->error("Failed to create \"audiotestsrc\" element");
-            return;
+        for(GstElement* decodebin: expired) {
+            Log()->warn(
+                "Fallback decodebin of \"{}\" didn't expose all pads in time",
+                sourceBin == _sourceBinPtr.get() ? _activeSourceUrl : _sourceUrl);
+            noMorePads(decodebin);
         }
+    }
+
+    if(nextCheckTime)
+        scheduleNoMorePadsCheck((nextCheckTime - now) / 1000 + 1);
+}
 
-        gst_bin_add(GST_BIN(pipeline), audioTestSrcPtr.release());
-        gst_element_sync_state_with_parent(audioTestSrc);
+// called from streaming thread
+void ReStreamer::noMorePads(GstElement* src)
+{
+    GstElement* sourceBin = GST_ELEMENT_PARENT(src);
+    SourceState* state = GetSourceState(GST_BIN(sourceBin));
 
-        gst_util_set_object_arg(G_OBJECT(audioTestSrc), "wave", "silence");
+    {
+        const std::lock_guard<std::mutex> lock(state->mutex);
+        auto it = state->fallbackDecodebins.find(src);
+        if(it != state->fallbackDecodebins.end()) {
+            if(!it->second)
+                return; // timed out already
+            it->second = 0;
+        }
+    }
 
-        GstPadPtr audioTestSrcPad(gst_element_get_static_pad(audioTestSrc, "src"));
+    if(--state->pendingNoMorePads > 0)
+        return;
 
-        if(GST_PAD_LINK_OK != gst_pad_link(audioTestSrcPad.get(), _flvAudioSinkPad.get()))
-            assert(false);
+    // replacement source without audio could be muted only if targets expect AAC
+    const bool silenceNeeded =
+        _sourceSwitcherPtr->acceptAudio(SourceSwitcher::AudioKind::Aac) &&
+        !state->audioLinked.exchange(true);
 
-        _audioLinked = true;
+    if(state->standby) {
+        // silence is linked on promotion
+        state->standby->setPadsComplete(silenceNeeded);
+        return;
     }
+
+    if(!silenceNeeded)
+        return;
+
+    // stream silence if there is no audio in source.
+    // it's pre-encoded already, so it's linked as compressed audio.
+
+    GstPadPtr videoTeeSinkPad(gst_element_get_static_pad(_videoTeePtr.get(), "sink"));
+    GstPadPtr audioTeeSinkPad(gst_element_get_static_pad(_audioTeePtr.get(), "sink"));
+    if(!LinkSilentAudio(videoTeeSinkPad.get(), audioTeeSinkPad.get()))
+        return;
+
+    postAudioReady(_pipelinePtr.get(), TRUE);
 }
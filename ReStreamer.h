@@ -2,10 +2,34 @@
 
 #include <memory>
 #include <string>
+#include <deque>
+#include <map>
 #include <functional>
+#include <atomic>
+#include <optional>
 
 #include <CxxPtr/GstPtr.h>
+#include <CxxPtr/GlibPtr.h>
 
+#include "Stats.h"
+#include "Types.h"
+
+class GopCache;
+class HlsStream;
+class SourceCache;
+class SourceSwitcher;
+struct VideoFlow;
+
+// Pulls single source and fans it out to any number of RTMP targets
+// and subscribers (like WebRTC preview) consuming source video as is.
+// H.264 and H.265 video is forwarded without transcoding.
+// Every target has own output branch (FLV over RTMP, MPEG-TS over SRT
+// for "srt://" targets, WebRTC for "whip://" and ".../whip" targets,
+// or fMP4 parts of in-memory LL-HLS stream), so failure of one target doesn't affect others.
+// Targets attached to already running source start from cached GOP.
+// If backup sources (and/or slate) are specified, failed source is replaced
+// inside running pipeline, starting from keyframe and with timestamps
+// continuing the previous source, so targets keep their connections.
 class ReStreamer
 {
 public:
@@ -13,58 +37,277 @@ public:
         Disconnect,
         RtspSourceError,
         RtmpTargetError,
+        Stall, // source stopped to send video but didn't disconnect
         OtherError,
     };
     typedef std::function<void (EosReason reason)> EosCallback;
+    typedef std::function<void (const std::string& targetId, EosReason reason)> TargetEosCallback;
+    // called every time source (or it's replacement) starts to deliver video
+    typedef std::function<void ()> SourceReadyCallback;
+
+    struct AudioEncoding {
+        unsigned bitrate; // bits per second
+        unsigned sampleRate;
+        unsigned channels;
+
+        bool operator < (const AudioEncoding&) const;
+        bool operator == (const AudioEncoding&) const;
+    };
 
     ReStreamer(
         const std::string& sourceUrl,
-        const std::string& targetUrl,
-        const EosCallback& onEos);
+        const EosCallback& onEos,
+        const TargetEosCallback& onTargetEos,
+        const SourceReadyCallback& onSourceReady);
     ~ReStreamer();
 
+    // thread safe
+    static unsigned pipelinesCount();
+
     const std::string& sourceUrl() const { return _sourceUrl; };
 
+    // tried in order when current source fails. slate (usually pre-encoded file)
+    // is the last resort, it's looped. while backup or slate is active,
+    // primary source is periodically started next to it
+    // and replaces it as soon as primary has keyframe.
+    // urls are either URIs or file paths
+    void setBackupSources(
+        const std::deque<std::string>& backupUrls,
+        const std::string& slateUrl) noexcept;
+    // applied to source and to targets attached after that
+    void setLatencyProfile(LatencyProfile) noexcept;
+    // with RtspTransport::Auto transport RTSP source worked over last time
+    // is taken from (and stored to) rtspTransportCache
+    void setRtspTransport(RtspTransport, SourceCache* rtspTransportCache) noexcept;
+    // source is restarted (or replaced with backup) if there is no video
+    // or video timestamps don't advance for that time. 0 disables check.
+    // just started source gets at least a minute to send the first video
+    void setStallTimeout(unsigned seconds) noexcept;
+    // targets are built for video caps source had last time right on start,
+    // and rebuilt if actual caps differ
+    void setSourceCapsCache(SourceCache*) noexcept;
+
+    void addTarget(
+        const std::string& targetId,
+        const std::string& targetUrl,
+        const AudioEncoding&) noexcept;
+    void addHlsTarget(
+        const std::string& targetId,
+        const std::shared_ptr<HlsStream>&,
+        const AudioEncoding&) noexcept;
+    // restarts only target branch, source is not affected
+    void changeTargetUrl(
+        const std::string& targetId,
+        const std::string& targetUrl) noexcept;
+    void removeTarget(const std::string& targetId) noexcept;
+    bool hasTargets() const { return !_targets.empty(); }
+    std::deque<std::string> targetIds() const;
+    std::shared_ptr<const TargetStats> targetStats(const std::string& targetId) const;
+
+    void addSubscriber(GstPad* videoSinkPad) noexcept;
+    void removeSubscriber(GstPad* videoSinkPad) noexcept;
+    bool hasSubscribers() const { return !_subscribers.empty(); }
+
+    bool isSourceReady() const { return _videoReady; }
+
     void start() noexcept;
 
 private:
+    enum class VideoCodec {
+        Unknown,
+        H264,
+        H265, // forwarded with Enhanced RTMP
+    };
+
+    struct StatsSample {
+        gint64 time;
+        guint64 videoBuffers;
+        guint64 videoBytes;
+        guint64 audioBytes;
+        guint64 outBytes;
+        guint64 ackedBytes;
+    };
+
+    struct Target {
+        std::string url;
+        AudioEncoding audioEncoding;
+        std::shared_ptr<TargetStats> statsPtr;
+        StatsSample statsSample {};
+
+        GstElementPtr binPtr;
+        GstPadPtr videoTeePadPtr;
+        GstElementPtr audioTeePtr; // could be either source audio tee or encoded audio tee
+        GstPadPtr audioTeePadPtr;
+
+        std::shared_ptr<HlsStream> hlsStreamPtr; // set for HLS target only
+
+        // url could carry credentials (stream key, SRT passphrase), so it's not logged
+        std::string id;
+    };
+
+    struct AudioEncoder {
+        GstElementPtr binPtr;
+        GstElementPtr teePtr;
+        GstPadPtr sourceTeePadPtr;
+    };
+
+    struct Subscriber {
+        GstPadPtr sinkPadPtr;
+        GstPadPtr teePadPtr;
+    };
+
+    bool addSource(
+        GstBin* pipeline,
+        const std::string& url,
+        bool paced,
+        bool standby = false) noexcept;
+    void removeSource() noexcept;
+    void removeStandbySource() noexcept;
+    void beginSourceSwitch(unsigned sourceIndex) noexcept;
+    void switchSource(unsigned sourceIndex) noexcept;
+    void retryPrimarySource() noexcept;
+    void promoteStandbySource() noexcept;
+    bool failover() noexcept;
+    void onSourceEos(unsigned generation) noexcept;
+
     void setState(GstState) noexcept;
     void pause() noexcept;
     void play() noexcept;
     void stop() noexcept;
 
+    bool addMuxedOutput(
+        GstBin*,
+        GstElement* videoQueue,
+        GstElement* audioQueue,
+        const Target&,
+        GstElement** sink) noexcept;
+    bool addWhipOutput(
+        GstBin*,
+        GstElement* videoQueue,
+        GstElement* audioQueue,
+        const Target&,
+        GstElement** sink) noexcept;
+    bool addHlsOutput(
+        GstBin*,
+        GstElement* videoQueue,
+        GstElement* audioQueue,
+        const Target&,
+        GstElement** sink) noexcept;
+    void addTarget(const std::string& targetId, Target&&) noexcept;
+    bool attachTarget(Target*) noexcept;
+    void linkTargetVideo(Target*) noexcept;
+    void linkTargetAudio(Target*) noexcept;
+    void detachTarget(Target*) noexcept;
+
+    GstElement* acquireAudioEncoder(const AudioEncoding&) noexcept;
+    void releaseAudioEncoderIfUnused(const AudioEncoding&) noexcept;
+
+    void attachSubscriber(Subscriber*) noexcept;
+    void detachSubscriber(Subscriber*) noexcept;
+
+    static GstBusSyncReply onBusSyncMessage(GstMessage*);
     gboolean onBusMessage(GstMessage*);
 
     void unknownType(
         GstElement* decodebin,
         GstPad*,
         GstCaps*);
+    GstPadPtr addPacing(GstPad*);
+    bool linkSourcePad(GstPad*, const char* name, GstElement* tee, bool video);
+    bool linkVideo(GstPad*, bool h265);
+    bool linkAudio(GstPad*, bool compressed);
     void srcPadAdded(GstElement* decodebin, GstPad*);
-    void noMorePads(GstElement* decodebin);
+    void rtpPadAdded(GstElement* rtspsrc, GstPad*);
+    void addFallbackDecodebin(GstPad*);
+    void noMorePads(GstElement* src);
+    void scheduleNoMorePadsCheck(guint interval) noexcept;
+    void checkNoMorePads() noexcept;
 
     static void postEos(
         GstElement* rtcbin,
         gboolean error);
+    static void postVideoReady(
+        GstElement* pipeline,
+        gboolean h265);
+    static void postAudioReady(
+        GstElement* pipeline,
+        gboolean compressed);
+
+    // all reStreamers of the same thread are checked by single timer
+    static gboolean checkStalls();
+    void startStallWatchdog() noexcept;
+    void stopStallWatchdog() noexcept;
+    void checkStall() noexcept;
+
+    void rememberRtspTransport() noexcept;
+    void forgetRtspTransport() noexcept;
+
+    // asks source for immediate keyframe (RTCP PLI/FIR for RTSP)
+    void requestKeyFrame() noexcept;
+
+    void onVideoReady(bool h265) noexcept;
+    void onAudioReady(bool compressed) noexcept;
+
+    void updateStats() noexcept;
+    void updateSourceStats() noexcept;
 
     void onEos(EosReason);
+    void onTargetEos(const std::string& targetId, EosReason);
 
 private:
     EosCallback _onEos;
+    TargetEosCallback _onTargetEos;
+    SourceReadyCallback _onSourceReady;
 
     const std::string _sourceUrl;
-    const std::string _targetUrl;
 
     GType _rtspSrcType = 0;
     GType _rtmpSinkType = 0;
+    GType _srtSinkType = 0;
+    GType _whipSinkType = 0;
 
     GstElementPtr _pipelinePtr;
-    GstElementPtr _flvMuxPtr;
-    GstPadPtr _flvVideoSinkPad;
-    GstPadPtr _flvAudioSinkPad;
+    GstElementPtr _sourceBinPtr; // replaced on failover
+    GstElementPtr _standbySourceBinPtr; // primary source started next to backup or slate
+    GstElementPtr _videoTeePtr;
+    GstElementPtr _audioTeePtr;
 
     GstCapsPtr _h264CapsPtr;
+    GstCapsPtr _h265CapsPtr;
     GstCapsPtr _audioRawCapsPtr;
+    GstCapsPtr _aacCapsPtr;
+    GstCapsPtr _g711CapsPtr;
+    GstCapsPtr _supportedCapsPtr;
+
+    // accessed from streaming threads only
+    std::atomic<bool> _audioG711 = false; // set before audio ready is posted
+
+    // accessed from main thread only
+    VideoCodec _videoCodec = VideoCodec::Unknown; // targets are built for
+    bool _videoReady = false; // source confirmed _videoCodec
+    bool _audioReady = false;
+    bool _audioCompressed = false;
+
+    std::map<std::string, Target> _targets; // targetId -> Target
+    std::map<GstPad*, Subscriber> _subscribers; // videoSinkPad -> Subscriber
+    std::map<AudioEncoding, AudioEncoder> _audioEncoders;
+
+    std::shared_ptr<GopCache> _gopCachePtr;
+
+    unsigned _stallTimeout = 0; // seconds
+    std::shared_ptr<VideoFlow> _videoFlowPtr; // shared with source video probe
+
+    std::optional<LatencyProfile> _latencyProfile; // element defaults if not set
+    RtspTransport _rtspTransport = RtspTransport::Auto;
+    SourceCache* _rtspTransportCache = nullptr;
+    SourceCache* _sourceCapsCache = nullptr;
+    std::string _activeSourceUrl;
+    bool _activeSourcePlayed = false;
+
+    std::unique_ptr<SourceSwitcher> _sourceSwitcherPtr;
 
-    bool _videoLinked = false;
-    bool _audioLinked = false;
+    std::shared_ptr<SourceStats> _sourceStatsPtr;
+    guint64 _lastPacketsLost = 0; // as RTCP reported on the last stats update
+    GSourcePtr _statsTimerPtr;
+    GSourcePtr _noMorePadsTimerPtr; // one-shot, active while fallback decodebins are pending
 };
@@ -0,0 +1,335 @@
+#include "ReconnectScheduler.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "Log.h"
+
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+enum {
+    // attempt is considered finished if source didn't start
+    // and there was no new restart request during this time
+    ATTEMPT_TIMEOUT = 15,
+};
+
+struct BackoffPolicy {
+    unsigned initialDelay; // seconds
+    unsigned maxDelay; // seconds
+    // backoff is reset if reStreamer was running for this time before failure
+    unsigned stableTime; // seconds
+};
+
+const BackoffPolicy& Policy(ReStreamer::EosReason reason)
+{
+    // source disconnects are usually short outages,
+    // but rejected target (i.e. wrong stream key) is unlikely to recover soon
+    static const BackoffPolicy disconnect { 2, 60, 60 };
+    static const BackoffPolicy sourceError { 5, 120, 60 };
+    static const BackoffPolicy targetError { 5, 300, 60 };
+    static const BackoffPolicy stall { 2, 60, 60 };
+    static const BackoffPolicy otherError { 5, 120, 60 };
+
+    switch(reason) {
+        case ReStreamer::EosReason::Disconnect:
+            return disconnect;
+        case ReStreamer::EosReason::RtspSourceError:
+            return sourceError;
+        case ReStreamer::EosReason::RtmpTargetError:
+            return targetError;
+        case ReStreamer::EosReason::Stall:
+            return stall;
+        case ReStreamer::EosReason::OtherError:
+            break;
+    }
+
+    return otherError;
+}
+
+unsigned BackoffDelay(const BackoffPolicy& policy, unsigned attempt)
+{
+    unsigned delay = policy.initialDelay;
+    for(unsigned i = 0; i < attempt && delay < policy.maxDelay; ++i)
+        delay *= 2;
+    delay = std::min(delay, policy.maxDelay);
+
+    // +-25% to spread restarts of reStreamers failed at the same moment
+    const double jitter = g_random_double_range(-0.25, 0.25);
+    const double jitteredDelay = delay + delay * jitter;
+
+    return std::max(1u, static_cast<unsigned>(jitteredDelay + 0.5));
+}
+
+}
+
+
+bool ConnectionAttempts::tryAcquire() noexcept
+{
+    unsigned free = _free;
+    while(free > 0 && !_free.compare_exchange_weak(free, free - 1));
+
+    return free > 0;
+}
+
+ReconnectScheduler::ReconnectScheduler(
+    GMainContext* context,
+    ConnectionAttempts* connectionAttempts,
+    const StartCallback& start) :
+    _context(g_main_context_ref(context)), _connectionAttempts(connectionAttempts), _start(start)
+{
+}
+
+ReconnectScheduler::~ReconnectScheduler()
+{
+    while(!_inFlight.empty())
+        popInFlight();
+
+    if(_timer) {
+        g_source_destroy(_timer);
+        g_source_unref(_timer);
+    }
+
+    g_main_context_unref(_context);
+}
+
+void ReconnectScheduler::schedule(const std::string& id, ReStreamer::EosReason reason) noexcept
+{
+    if(_entries.find(id) != _entries.end()) {
+        Log()->debug("Restart of \"{}\" already pending. Ignoring new request...", id);
+        return;
+    }
+
+    // restart request during connection attempt means attempt failed
+    releaseInFlight(id);
+
+    const BackoffPolicy& policy = Policy(reason);
+
+    const gint64 now = g_get_monotonic_time();
+
+    Backoff& backoff = _backoff[id];
+    if(backoff.lastStartTime &&
+        now - backoff.lastStartTime > static_cast<gint64>(policy.stableTime) * G_USEC_PER_SEC)
+    {
+        backoff.attempt = 0;
+    }
+
+    const unsigned delay = BackoffDelay(policy, backoff.attempt);
+    ++backoff.attempt;
+
+    Slot* slot = &_wheel[(_tick + delay) % WHEEL_SLOTS];
+    slot->push_back(id);
+
+    _entries.emplace(
+        id,
+        Entry {
+            reason,
+            now,
+            false,
+            (delay - 1) / WHEEL_SLOTS,
+            slot,
+            std::prev(slot->end()) });
+
+    Log()->info("Restart of \"{}\" scheduled in {} seconds (attempt {})", id, delay, backoff.attempt);
+
+    {
+        const std::lock_guard<std::mutex> lock(_pendingMutex);
+        _pending[id] = Pending { id, reason, backoff.attempt, 0, false };
+        _pendingDueTime[id] = now + static_cast<gint64>(delay) * G_USEC_PER_SEC;
+
+        auto& restarts = _metrics.restarts[id];
+        ++restarts[static_cast<unsigned>(reason)];
+    }
+
+    ensureTimer();
+}
+
+bool ReconnectScheduler::cancel(const std::string& id) noexcept
+{
+    auto it = _entries.find(id);
+    if(it == _entries.end())
+        return false;
+
+    Entry& entry = it->second;
+    if(entry.ready)
+        _ready.erase(entry.slotIt);
+    else
+        entry.slot->erase(entry.slotIt);
+
+    _entries.erase(it);
+    erasePending(id);
+
+    return true;
+}
+
+bool ReconnectScheduler::isPending(const std::string& id) const noexcept
+{
+    return _entries.find(id) != _entries.end();
+}
+
+void ReconnectScheduler::started(const std::string& id) noexcept
+{
+    // waiting restarts are started on the next tick,
+    // since it's called from inside reStreamer callbacks
+    releaseInFlight(id);
+}
+
+void ReconnectScheduler::reset(const std::string& id) noexcept
+{
+    releaseInFlight(id);
+    _backoff.erase(id);
+}
+
+void ReconnectScheduler::forget(const std::string& id) noexcept
+{
+    cancel(id);
+    reset(id);
+
+    const std::lock_guard<std::mutex> lock(_pendingMutex);
+    _metrics.restarts.erase(id);
+}
+
+std::deque<ReconnectScheduler::Pending> ReconnectScheduler::pending() const
+{
+    const gint64 now = g_get_monotonic_time();
+
+    std::deque<Pending> pending;
+
+    const std::lock_guard<std::mutex> lock(_pendingMutex);
+    for(const auto& pair: _pending) {
+        Pending item = pair.second;
+
+        const auto dueTimeIt = _pendingDueTime.find(pair.first);
+        if(dueTimeIt != _pendingDueTime.end() && dueTimeIt->second > now)
+            item.secondsLeft = (dueTimeIt->second - now + G_USEC_PER_SEC - 1) / G_USEC_PER_SEC;
+
+        pending.emplace_back(std::move(item));
+    }
+
+    return pending;
+}
+
+void ReconnectScheduler::ensureTimer() noexcept
+{
+    if(_timer)
+        return;
+
+    auto onTimeout =
+        [] (gpointer userData) -> gboolean {
+            ReconnectScheduler* self = static_cast<ReconnectScheduler*>(userData);
+            self->onTick();
+            return G_SOURCE_CONTINUE;
+        };
+
+    _timer = g_timeout_source_new_seconds(1);
+    g_source_set_callback(_timer, GSourceFunc(onTimeout), this, nullptr);
+    g_source_attach(_timer, _context);
+}
+
+void ReconnectScheduler::onTick() noexcept
+{
+    ++_tick;
+
+    while(!_inFlight.empty() && _inFlight.front().expireTick <= _tick)
+        popInFlight();
+
+    Slot& slot = _wheel[_tick % WHEEL_SLOTS];
+    for(auto it = slot.begin(); it != slot.end();) {
+        auto entryIt = _entries.find(*it);
+        assert(entryIt != _entries.end());
+        Entry& entry = entryIt->second;
+        if(entry.rounds) {
+            --entry.rounds;
+            ++it;
+            continue;
+        }
+
+        auto nextIt = std::next(it);
+        _ready.splice(_ready.end(), slot, it);
+        entry.ready = true;
+        entry.slot = nullptr;
+        it = nextIt;
+    }
+
+    startReady();
+
+    if(_entries.empty() && _inFlight.empty()) {
+        g_source_destroy(_timer);
+        g_source_unref(_timer);
+        _timer = nullptr;
+    }
+}
+
+void ReconnectScheduler::startReady() noexcept
+{
+    // slots freed by other workers are noticed on the next tick
+    while(!_ready.empty() && _connectionAttempts->tryAcquire()) {
+        const std::string id = _ready.front();
+        _ready.pop_front();
+
+        auto entryIt = _entries.find(id);
+        assert(entryIt != _entries.end());
+        const gint64 requestTime = entryIt->second.requestTime;
+        _entries.erase(entryIt);
+        erasePending(id);
+
+        observeLatency(g_get_monotonic_time() - requestTime);
+
+        _inFlight.push_back(InFlight { id, _tick + ATTEMPT_TIMEOUT });
+        _backoff[id].lastStartTime = g_get_monotonic_time();
+
+        // could call schedule()/cancel() reentrantly
+        _start(id);
+    }
+
+    if(!_ready.empty()) {
+        const std::lock_guard<std::mutex> lock(_pendingMutex);
+        for(const std::string& id: _ready) {
+            auto it = _pending.find(id);
+            if(it != _pending.end())
+                it->second.waitingForSlot = true;
+        }
+    }
+}
+
+void ReconnectScheduler::observeLatency(gint64 latency) noexcept
+{
+    const double seconds = double(latency) / G_USEC_PER_SEC;
+
+    const std::lock_guard<std::mutex> lock(_pendingMutex);
+
+    size_t bucket = 0;
+    while(bucket < std::size(LatencyBuckets) && seconds > LatencyBuckets[bucket])
+        ++bucket;
+    ++_metrics.latencyBuckets[bucket];
+
+    _metrics.latencySum += seconds;
+    ++_metrics.latencyCount;
+}
+
+void ReconnectScheduler::popInFlight() noexcept
+{
+    _inFlight.pop_front();
+    _connectionAttempts->release();
+}
+
+void ReconnectScheduler::releaseInFlight(const std::string& id) noexcept
+{
+    auto it = std::find_if(
+        _inFlight.begin(), _inFlight.end(),
+        [&id] (const InFlight& inFlight) { return inFlight.id == id; });
+    if(it == _inFlight.end())
+        return;
+
+    _inFlight.erase(it);
+    _connectionAttempts->release();
+}
+
+void ReconnectScheduler::erasePending(const std::string& id) noexcept
+{
+    const std::lock_guard<std::mutex> lock(_pendingMutex);
+    _pending.erase(id);
+    _pendingDueTime.erase(id);
+}
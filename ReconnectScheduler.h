@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <list>
+#include <array>
+#include <iterator>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+#include <glib.h>
+
+#include "ReStreamer.h"
+
+
+// Connection attempt slots shared by schedulers of all workers,
+// so reStreamers of the same NVR spread across workers
+// still don't hit it all at once. Thread safe.
+class ConnectionAttempts
+{
+public:
+    enum {
+        MAX_SIMULTANEOUS_ATTEMPTS = 8,
+    };
+
+    bool tryAcquire() noexcept;
+    void release() noexcept { ++_free; }
+
+private:
+    std::atomic<unsigned> _free = MAX_SIMULTANEOUS_ATTEMPTS;
+};
+
+// Schedules reStreamers restarts with per EosReason exponential backoff and jitter.
+// Pending restarts are kept in timer wheel with 1 second resolution,
+// so there is only one timer regardless of pending restarts count.
+// Number of simultaneous connection attempts is limited by connectionAttempts,
+// restarts exceeding that limit are waiting for free slot.
+// Should be used from thread owning GMainContext passed to constructor,
+// except pending() which is thread safe.
+class ReconnectScheduler
+{
+public:
+    typedef std::function<void (const std::string& id)> StartCallback;
+
+    struct Pending {
+        std::string id;
+        ReStreamer::EosReason reason;
+        unsigned attempt;
+        unsigned secondsLeft;
+        bool waitingForSlot;
+    };
+
+    enum {
+        EOS_REASONS_COUNT = static_cast<unsigned>(ReStreamer::EosReason::OtherError) + 1,
+    };
+    // upper bounds, seconds
+    static constexpr unsigned LatencyBuckets[] = { 1, 2, 5, 10, 30, 60, 120, 300, 600 };
+
+    struct Metrics {
+        // reStreamerId -> restarts count by EosReason
+        std::map<std::string, std::array<guint64, EOS_REASONS_COUNT>> restarts;
+
+        // time from restart request to actual restart.
+        // not cumulative, the last one is for +Inf
+        std::array<guint64, std::size(LatencyBuckets) + 1> latencyBuckets {};
+        double latencySum = 0; // seconds
+        guint64 latencyCount = 0;
+    };
+
+    ReconnectScheduler(GMainContext*, ConnectionAttempts*, const StartCallback&);
+    ~ReconnectScheduler();
+
+    void schedule(const std::string& id, ReStreamer::EosReason) noexcept;
+    bool cancel(const std::string& id) noexcept;
+    bool isPending(const std::string& id) const noexcept;
+
+    // restarted reStreamer got it's source working,
+    // so connection attempt slot is freed for the next pending restart
+    void started(const std::string& id) noexcept;
+
+    // forgets backoff state, so next restart will be done with initial delay.
+    // should be called when reStreamer is (re)started or stopped on user request
+    void reset(const std::string& id) noexcept;
+    // reStreamer is removed, so it's restarts are not reported anymore
+    void forget(const std::string& id) noexcept;
+
+    std::deque<Pending> pending() const;
+
+    // thread safe, callback is called with internal lock held
+    template<typename Callback>
+    void withMetrics(const Callback& callback) const
+    {
+        const std::lock_guard<std::mutex> lock(_pendingMutex);
+        callback(_metrics);
+    }
+
+private:
+    enum {
+        WHEEL_SLOTS = 64,
+    };
+
+    typedef std::list<std::string> Slot;
+
+    struct Entry {
+        ReStreamer::EosReason reason;
+        gint64 requestTime; // monotonic
+        bool ready; // waiting for free slot in _ready
+        unsigned rounds;
+        Slot* slot;
+        Slot::iterator slotIt;
+    };
+
+    struct Backoff {
+        unsigned attempt = 0;
+        gint64 lastStartTime = 0; // monotonic
+    };
+
+    struct InFlight {
+        std::string id;
+        guint64 expireTick;
+    };
+
+    void ensureTimer() noexcept;
+    void onTick() noexcept;
+    void startReady() noexcept;
+    void observeLatency(gint64 latency) noexcept;
+    void popInFlight() noexcept;
+    void releaseInFlight(const std::string& id) noexcept;
+    void erasePending(const std::string& id) noexcept;
+
+private:
+    GMainContext* _context;
+    ConnectionAttempts *const _connectionAttempts;
+    const StartCallback _start;
+
+    GSource* _timer = nullptr;
+    guint64 _tick = 0;
+
+    std::array<Slot, WHEEL_SLOTS> _wheel;
+    Slot _ready;
+    std::unordered_map<std::string, Entry> _entries;
+    std::unordered_map<std::string, Backoff> _backoff;
+    std::deque<InFlight> _inFlight; // every one holds connection attempt slot
+
+    mutable std::mutex _pendingMutex; // guards members below
+    std::map<std::string, Pending> _pending; // secondsLeft is filled on request
+    std::map<std::string, gint64> _pendingDueTime; // monotonic
+    Metrics _metrics;
+};
+
+// one per worker
+typedef std::deque<const ReconnectScheduler*> ReconnectSchedulers;
@@ -1,11 +1,17 @@
 #include "RestApi.h"
 
 #include <cassert>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <tuple>
 
 #include <glib.h>
 #include <jansson.h>
 #include <microhttpd.h>
 
+#include "Metrics.h"
+
 
 const char *const rest::ApiPrefix = "/api";
 
@@ -20,7 +26,15 @@ const size_t ApiPrefixLen = strlen(rest::ApiPrefix);
 const char *const StreamersPrefix = "/streamers";
 const size_t StreamersPrefixLen = strlen(StreamersPrefix);
 
+const char *const StatsSuffix = "/stats";
+
+const char *const ReconnectsPrefix = "/reconnects";
+const size_t ReconnectsPrefixLen = strlen(ReconnectsPrefix);
+
+const char *const MetricsPath = "/metrics";
+
 const char* const CONTENT_TYPE_APPLICATION_JSON = "application/json";
+const char* const CONTENT_TYPE_PROMETHEUS_TEXT = "text/plain; version=0.0.4";
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(json_t, json_decref)
 typedef char* json_char_ptr;
@@ -108,11 +122,106 @@ NotFound(MHD_Response* response = nullptr)
     return { MHD_HTTP_NOT_FOUND, FixResponse(response) };
 }
 
+std::pair<rest::StatusCode, MHD_Response*>
+HandleStreamerStatsRequest(
+    const std::shared_ptr<const Config>& config,
+    const StatsRegistry* statsRegistry,
+    const std::string& id)
+{
+    if(config->reStreamers.find(id) == config->reStreamers.end())
+        return NotFound();
+
+    if(!statsRegistry)
+        return InternalError();
+
+    g_autoptr(json_t) object = json_object();
+
+    // not active reStreamer has no stats
+    json_object_set_new(object, "active", json_false());
+
+    if(const std::shared_ptr<const TargetStats> stats = statsRegistry->find(id)) {
+        const gint64 startTime = stats->startTime;
+        const gint64 uptime = startTime ? (g_get_monotonic_time() - startTime) / G_USEC_PER_SEC : 0;
+
+        json_object_set_new(object, "active", json_true());
+        json_object_set_new(object, "uptime", json_integer(uptime));
+        json_object_set_new(object, "droppedBuffers", json_integer(stats->droppedBuffers));
+
+        json_t* video = json_object();
+        json_object_set_new(video, "bitrate", json_integer(stats->videoBitrate));
+        json_object_set_new(video, "fps", json_real(stats->videoFps));
+        json_object_set_new(video, "keyFrameInterval", json_integer(stats->keyFrameInterval / 1000000)); // ms
+        json_object_set_new(video, "keyFrames", json_integer(stats->keyFrames));
+        json_object_set_new(video, "buffers", json_integer(stats->videoBuffers));
+        json_object_set_new(video, "bytes", json_integer(stats->videoBytes));
+        json_object_set_new(object, "video", video);
+
+        json_t* audio = json_object();
+        json_object_set_new(audio, "bitrate", json_integer(stats->audioBitrate));
+        json_object_set_new(audio, "buffers", json_integer(stats->audioBuffers));
+        json_object_set_new(audio, "bytes", json_integer(stats->audioBytes));
+        json_object_set_new(object, "audio", audio);
+
+        json_t* output = json_object();
+        json_object_set_new(output, "bitrate", json_integer(stats->outBitrate));
+        json_object_set_new(output, "bytes", json_integer(stats->outBytes));
+        json_object_set_new(output, "droppedFrames", json_integer(stats->congestionDroppedFrames));
+        json_object_set_new(output, "ackedBitrate", json_integer(stats->ackedBitrate));
+        json_object_set_new(output, "ackedBytes", json_integer(stats->ackedBytes));
+        json_object_set_new(output, "connectTime", json_integer(stats->connectTime / 1000)); // ms
+        json_object_set_new(output, "handshakeTime", json_integer(stats->handshakeTime / 1000)); // ms
+        json_object_set_new(output, "latency", json_integer(stats->latency / 1000)); // ms
+        json_object_set_new(object, "output", output);
+
+        if(stats->sourceStats) {
+            json_t* source = json_object();
+            json_object_set_new(source, "packetsLost", json_integer(stats->sourceStats->packetsLost));
+            json_object_set_new(source, "jitter", json_integer(stats->sourceStats->jitter / 1000)); // ms
+            json_object_set_new(source, "active", json_integer(stats->sourceStats->activeSource));
+            json_object_set_new(source, "failovers", json_integer(stats->sourceStats->failovers));
+            json_object_set_new(source, "failoverTime", json_integer(stats->sourceStats->failoverTime / 1000)); // ms
+            json_object_set_new(source, "keyFrameRequests", json_integer(stats->sourceStats->keyFrameRequests));
+            json_object_set_new(source, "keyFrameRequestsHonoured", json_integer(stats->sourceStats->keyFrameRequestsHonoured));
+            json_object_set_new(source, "keyFrameRequestTime", json_integer(stats->sourceStats->keyFrameRequestTime / 1000)); // ms
+            json_object_set_new(object, "source", source);
+        }
+    }
+
+    g_auto(json_char_ptr) json = json_dumps(object);
+    if(!json)
+        return InternalError();
+
+    MHD_Response* response = MHD_create_response_from_buffer(
+        strlen(json),
+        json,
+        MHD_RESPMEM_MUST_FREE);
+    if(!response)
+        return InternalError();
+
+    json = nullptr; // to avoid double free
+
+    return OK(response);
+}
+
 std::pair<rest::StatusCode, MHD_Response*>
 HandleStreamersRequest(
     const std::shared_ptr<const Config>& config,
+    const StatsRegistry* statsRegistry,
     const char* path)
 {
+    if(g_str_has_prefix(path, "/") && g_str_has_suffix(path, StatsSuffix)) {
+        // "/<id>/stats"
+        const size_t pathLen = strlen(path);
+        if(pathLen <= 1 + strlen(StatsSuffix))
+            return NotFound();
+
+        const std::string id(path + 1, pathLen - 1 - strlen(StatsSuffix));
+        if(id.find('/') != std::string::npos)
+            return NotFound();
+
+        return HandleStreamerStatsRequest(config, statsRegistry, id);
+    }
+
     if(strcmp(path, "") != STRCMP_EQUAL && strcmp(path, "/") != STRCMP_EQUAL)
         return BadRequest();
 
@@ -150,6 +259,100 @@ HandleStreamersRequest(
     return OK(response);
 }
 
+const char* EosReasonName(ReStreamer::EosReason reason)
+{
+    switch(reason) {
+        case ReStreamer::EosReason::Disconnect:
+            return "disconnect";
+        case ReStreamer::EosReason::RtspSourceError:
+            return "source-error";
+        case ReStreamer::EosReason::RtmpTargetError:
+            return "target-error";
+        case ReStreamer::EosReason::Stall:
+            return "stall";
+        case ReStreamer::EosReason::OtherError:
+            break;
+    }
+
+    return "other-error";
+}
+
+std::pair<rest::StatusCode, MHD_Response*>
+HandleReconnectsRequest(
+    const ReconnectSchedulers& reconnectSchedulers,
+    const char* path)
+{
+    if(strcmp(path, "") != STRCMP_EQUAL && strcmp(path, "/") != STRCMP_EQUAL)
+        return BadRequest();
+
+    if(reconnectSchedulers.empty())
+        return InternalError();
+
+    g_autoptr(json_t) array = json_array();
+
+    for(const ReconnectScheduler* reconnectScheduler: reconnectSchedulers) {
+        for(const ReconnectScheduler::Pending& pending: reconnectScheduler->pending()) {
+            g_autoptr(json_t) object = json_object();
+            json_object_set_new(object, "id", json_string(pending.id.c_str()));
+            json_object_set_new(object, "reason", json_string(EosReasonName(pending.reason)));
+            json_object_set_new(object, "attempt", json_integer(pending.attempt));
+            json_object_set_new(object, "secondsLeft", json_integer(pending.secondsLeft));
+            json_object_set_new(object, "waitingForSlot", json_boolean(pending.waitingForSlot));
+            json_array_append_new(array, object);
+            object = nullptr;
+        }
+    }
+
+    g_auto(json_char_ptr) json = json_dumps(array);
+    if(!json)
+        return InternalError();
+
+    MHD_Response* response = MHD_create_response_from_buffer(
+        strlen(json),
+        json,
+        MHD_RESPMEM_MUST_FREE);
+    if(!response)
+        return InternalError();
+
+    json = nullptr; // to avoid double free
+
+    return OK(response);
+}
+
+std::pair<rest::StatusCode, MHD_Response*>
+HandleMetricsRequest(
+    const StatsRegistry* statsRegistry,
+    const ReconnectSchedulers& reconnectSchedulers)
+{
+    // to avoid buffer reallocations during rendering
+    static std::atomic<size_t> lastSize = 0;
+
+    fmt::memory_buffer buffer;
+    buffer.reserve(lastSize + lastSize / 8);
+
+    RenderMetrics(&buffer, statsRegistry, reconnectSchedulers);
+
+    lastSize = buffer.size();
+
+    MHD_Response* response = MHD_create_response_from_buffer(
+        buffer.size(),
+        buffer.data(),
+        MHD_RESPMEM_MUST_COPY);
+    if(!response)
+        return InternalError();
+
+    MHD_add_response_header(
+        response,
+        MHD_HTTP_HEADER_CONTENT_TYPE,
+        CONTENT_TYPE_PROMETHEUS_TEXT);
+    MHD_add_response_header(
+        response,
+        MHD_HTTP_HEADER_CACHE_CONTROL,
+        "no-store");
+
+    return OK(response);
+}
+
 std::pair<rest::StatusCode, MHD_Response*>
 HandleStreamerPatch(
     const std::shared_ptr<Config>& streamersConfig,
@@ -183,6 +386,28 @@ HandleStreamerPatch(
         reStreamerChanges.enabled = reStreamerConfig.enabled;
     }
 
+    // the same names as in config file
+    const std::tuple<
+        const char*,
+        unsigned Config::ReStreamer::*,
+        std::optional<unsigned> ConfigChanges::ReStreamerChanges::*> audioSettings[] = {
+        { "audio-bitrate", &Config::ReStreamer::audioBitrate, &ConfigChanges::ReStreamerChanges::audioBitrate },
+        { "audio-sample-rate", &Config::ReStreamer::audioSampleRate, &ConfigChanges::ReStreamerChanges::audioSampleRate },
+        { "audio-channels", &Config::ReStreamer::audioChannels, &ConfigChanges::ReStreamerChanges::audioChannels },
+    };
+    for(const auto& [name, setting, change]: audioSettings) {
+        json_t* value = json_object_get(requestBody, name);
+        if(!value)
+            continue;
+
+        if(!json_is_integer(value) || json_integer_value(value) <= 0 || json_integer_value(value) > G_MAXUINT)
+            return BadRequest();
+
+        hasChanges = true;
+        reStreamerConfig.*setting = static_cast<unsigned>(json_integer_value(value));
+        reStreamerChanges.*change = reStreamerConfig.*setting;
+    }
+
     if(!hasChanges) {
         return BadRequest();
     }
@@ -216,6 +441,8 @@ HandleStreamersPatch(
 std::pair<rest::StatusCode, MHD_Response*>
 rest::HandleRequest(
     std::shared_ptr<Config>& streamersConfig,
+    const ReconnectSchedulers& reconnectSchedulers,
+    const StatsRegistry* statsRegistry,
     const rest::PostConfigChanges& postChanges,
     http::Method method,
     const char* uri,
@@ -247,12 +474,14 @@ rest::HandleRequest(
 
     if(g_str_has_prefix(requestPath, StreamersPrefix)) {
         requestPath += StreamersPrefixLen;
+
         switch(method) {
             case Method::GET:
                 return
                     ApplyDefaultHeaders(
                         HandleStreamersRequest(
                             streamersConfig,
+                            statsRegistry,
                             requestPath));
             case Method::PATCH:
                 return
@@ -265,6 +494,25 @@ rest::HandleRequest(
             case Method::OPTIONS:
                 return ApplyOptionsHeaders(OK()); // FIXME?
         }
+    } else if(strcmp(requestPath, MetricsPath) == STRCMP_EQUAL) {
+        switch(method) {
+            case Method::GET:
+                return HandleMetricsRequest(statsRegistry, reconnectSchedulers);
+            default:
+                return BadRequest();
+        }
+    } else if(g_str_has_prefix(requestPath, ReconnectsPrefix)) {
+        requestPath += ReconnectsPrefixLen;
+        switch(method) {
+            case Method::GET:
+                return
+                    ApplyDefaultHeaders(
+                        HandleReconnectsRequest(
+                            reconnectSchedulers,
+                            requestPath));
+            default:
+                return BadRequest();
+        }
     }
 
     return BadRequest();
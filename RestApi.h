@@ -6,6 +6,8 @@
 #include "Http/HttpMicroServer.h"
 
 #include "Config.h"
+#include "ReconnectScheduler.h"
+#include "Stats.h"
 
 
 namespace rest
@@ -20,6 +22,8 @@ typedef unsigned StatusCode;
 std::pair<rest::StatusCode, MHD_Response*>
 HandleRequest(
     std::shared_ptr<Config>& streamersConfig,
+    const ReconnectSchedulers&,
+    const StatsRegistry*,
     const PostConfigChanges&, // it should be thread safe
     Method method,
     const char* uri,
@@ -0,0 +1,1840 @@
+#include "RtmpPublisher.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+#include <gio/gio.h>
+#include <gst/base/gstbasesink.h>
+
+#include "Log.h"
+
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+const char *const RtmpPublisherName = "rtmppublisher";
+
+enum {
+    DEFAULT_PORT = 1935,
+    DEFAULT_TLS_PORT = 443,
+    DEFAULT_TIMEOUT = 10, // seconds
+    DNS_CACHE_TTL = 60, // seconds
+    PRECONNECT_TTL = 10, // seconds
+    DEFAULT_CHUNK_SIZE = 64 * 1024,
+    MIN_CHUNK_SIZE = 128,
+    MAX_CHUNK_SIZE = 16 * 1024 * 1024,
+    MAX_INCOMING_MESSAGE_SIZE = 1024 * 1024,
+    MAX_QUEUED_SIZE = 4 * 1024 * 1024, // render waits if more is not sent yet
+    POLL_INTERVAL = 500, // milliseconds
+
+    HANDSHAKE_SIZE = 1536,
+    RTMP_VERSION = 3,
+
+    // how often server should acknowledge received data
+    ACK_WINDOW = 256 * 1024,
+
+    EXTENDED_TIMESTAMP = 0xFFFFFF,
+
+    FLV_HEADER_SIZE = 9,
+    FLV_TAG_HEADER_SIZE = 11,
+    FLV_PREV_TAG_SIZE = 4,
+};
+
+enum ChunkStream : guint8 {
+    CONTROL_CHUNK_STREAM = 2,
+    COMMAND_CHUNK_STREAM = 3,
+    AUDIO_CHUNK_STREAM = 4,
+    DATA_CHUNK_STREAM = 5,
+    VIDEO_CHUNK_STREAM = 6,
+};
+
+enum MessageType : guint8 {
+    SET_CHUNK_SIZE = 1,
+    ACKNOWLEDGEMENT = 3,
+    USER_CONTROL = 4,
+    WINDOW_ACK_SIZE = 5,
+    AUDIO = 8,
+    VIDEO = 9,
+    DATA_AMF0 = 18,
+    COMMAND_AMF0 = 20,
+};
+
+enum UserControlEvent : guint16 {
+    PING_REQUEST = 6,
+    PING_RESPONSE = 7,
+};
+
+enum AmfMarker : guint8 {
+    AMF_NUMBER = 0x00,
+    AMF_BOOLEAN = 0x01,
+    AMF_STRING = 0x02,
+    AMF_OBJECT = 0x03,
+    AMF_NULL = 0x05,
+    AMF_UNDEFINED = 0x06,
+    AMF_ECMA_ARRAY = 0x08,
+    AMF_OBJECT_END = 0x09,
+    AMF_STRICT_ARRAY = 0x0A,
+    AMF_DATE = 0x0B,
+    AMF_LONG_STRING = 0x0C,
+};
+
+// "@setDataFrame" AMF0 string prepended to FLV script tags
+const guint8 SetDataFrame[] = {
+    AMF_STRING, 0x00, 0x0D, '@', 's', 'e', 't', 'D', 'a', 't', 'a', 'F', 'r', 'a', 'm', 'e' };
+
+guint32 ReadBE16(const guint8* data) { return (data[0] << 8) | data[1]; }
+guint32 ReadBE24(const guint8* data) { return (data[0] << 16) | (data[1] << 8) | data[2]; }
+guint32 ReadBE32(const guint8* data) { return (guint32(data[0]) << 24) | ReadBE24(data + 1); }
+guint32 ReadLE32(const guint8* data)
+    { return data[0] | (data[1] << 8) | (data[2] << 16) | (guint32(data[3]) << 24); }
+
+void WriteBE16(std::vector<guint8>* out, guint32 value)
+    { out->insert(out->end(), { guint8(value >> 8), guint8(value) }); }
+void WriteBE24(std::vector<guint8>* out, guint32 value)
+    { out->insert(out->end(), { guint8(value >> 16), guint8(value >> 8), guint8(value) }); }
+void WriteBE32(std::vector<guint8>* out, guint32 value)
+    { out->insert(out->end(), { guint8(value >> 24), guint8(value >> 16), guint8(value >> 8), guint8(value) }); }
+void WriteLE32(std::vector<guint8>* out, guint32 value)
+    { out->insert(out->end(), { guint8(value), guint8(value >> 8), guint8(value >> 16), guint8(value >> 24) }); }
+
+class AmfWriter
+{
+public:
+    const std::vector<guint8>& data() const { return _data; }
+
+    void number(double value)
+    {
+        guint64 bits;
+        memcpy(&bits, &value, sizeof(bits));
+        _data.push_back(AMF_NUMBER);
+        WriteBE32(&_data, guint32(bits >> 32));
+        WriteBE32(&_data, guint32(bits));
+    }
+    void boolean(bool value)
+        { _data.insert(_data.end(), { AMF_BOOLEAN, guint8(value ? 1 : 0) }); }
+    void string(std::string_view value)
+        { _data.push_back(AMF_STRING); key(value); }
+    void null()
+        { _data.push_back(AMF_NULL); }
+    void objectStart()
+        { _data.push_back(AMF_OBJECT); }
+    void key(std::string_view name)
+    {
+        WriteBE16(&_data, guint32(name.size()));
+        _data.insert(_data.end(), name.begin(), name.end());
+    }
+    void objectEnd()
+        { _data.insert(_data.end(), { 0x00, 0x00, AMF_OBJECT_END }); }
+
+private:
+    std::vector<guint8> _data;
+};
+
+class AmfReader
+{
+public:
+    typedef std::function<void (const std::string& name, const std::string& value)> OnStringProperty;
+
+    AmfReader(const guint8* data, gsize size) :
+        _data(data), _size(size) {}
+
+    bool atEnd() const { return _pos >= _size; }
+
+    std::optional<double> number()
+    {
+        if(!has(9) || _data[_pos] != AMF_NUMBER)
+            return {};
+
+        const guint64 bits = (guint64(ReadBE32(_data + _pos + 1)) << 32) | ReadBE32(_data + _pos + 5);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        _pos += 9;
+
+        return value;
+    }
+
+    std::optional<std::string> string()
+    {
+        if(!has(3) || _data[_pos] != AMF_STRING)
+            return {};
+
+        ++_pos;
+        return key();
+    }
+
+    // object or ECMA array, only string properties are reported
+    bool object(const OnStringProperty& onProperty)
+    {
+        if(!has(1))
+            return false;
+
+        const guint8 marker = _data[_pos++];
+        if(marker == AMF_ECMA_ARRAY) {
+            if(!has(4))
+                return false;
+            _pos += 4;
+        } else if(marker != AMF_OBJECT)
+            return false;
+
+        return properties(onProperty);
+    }
+
+    bool skip()
+    {
+        if(!has(1))
+            return false;
+
+        switch(_data[_pos++]) {
+            case AMF_NUMBER:
+                return advance(8);
+            case AMF_BOOLEAN:
+                return advance(1);
+            case AMF_STRING:
+                return key().has_value();
+            case AMF_OBJECT:
+                return properties(OnStringProperty());
+            case AMF_NULL:
+            case AMF_UNDEFINED:
+                return true;
+            case AMF_ECMA_ARRAY:
+                return advance(4) && properties(OnStringProperty());
+            case AMF_STRICT_ARRAY: {
+                if(!has(4))
+                    return false;
+                const guint32 count = ReadBE32(_data + _pos);
+                _pos += 4;
+                for(guint32 i = 0; i < count; ++i) {
+                    if(!skip())
+                        return false;
+                }
+                return true;
+            }
+            case AMF_DATE:
+                return advance(10);
+            case AMF_LONG_STRING: {
+                if(!has(4))
+                    return false;
+                const guint32 length = ReadBE32(_data + _pos);
+                return advance(4) && advance(length);
+            }
+            default:
+                return false;
+        }
+    }
+
+private:
+    bool has(gsize size) const { return _size - _pos >= size && _pos <= _size; }
+    bool advance(gsize size)
+    {
+        if(!has(size))
+            return false;
+        _pos += size;
+        return true;
+    }
+
+    std::optional<std::string> key()
+    {
+        if(!has(2))
+            return {};
+        const gsize length = ReadBE16(_data + _pos);
+        if(!has(2 + length))
+            return {};
+
+        std::string value(reinterpret_cast<const char*>(_data + _pos + 2), length);
+        _pos += 2 + length;
+
+        return value;
+    }
+
+    bool properties(const OnStringProperty& onProperty)
+    {
+        for(;;) {
+            std::optional<std::string> name = key();
+            if(!name)
+                return false;
+
+            if(name->empty() && has(1) && _data[_pos] == AMF_OBJECT_END) {
+                ++_pos;
+                return true;
+            }
+
+            if(onProperty && has(1) && _data[_pos] == AMF_STRING) {
+                ++_pos;
+                std::optional<std::string> value = key();
+                if(!value)
+                    return false;
+                onProperty(*name, *value);
+            } else if(!skip())
+                return false;
+        }
+    }
+
+private:
+    const guint8* _data;
+    const gsize _size;
+    gsize _pos = 0;
+};
+
+struct CommandResult
+{
+    std::string name;
+    double transactionId = 0;
+    std::optional<double> number; // the first number after command object
+    std::string level;
+    std::string code;
+    std::string description;
+};
+
+// RTMP publishing client. Accessed from publisher worker thread only.
+// All blocking operations are limited by socket timeout and could be cancelled.
+class RtmpSession
+{
+public:
+    RtmpSession(GCancellable*, guint timeout, guint chunkSize);
+    ~RtmpSession();
+
+    bool connect(const std::string& location, GError**);
+
+    // session connected in advance is handed over to publisher with it's own cancellable
+    void setCancellable(GCancellable*);
+
+    // data should contain whole FLV tags
+    bool sendFlv(const guint8* data, gsize size, GError**);
+    // processes everything received without blocking
+    bool pollIncoming(GError**);
+
+    gint64 connectTime() const { return _connectTime; }
+    gint64 handshakeTime() const { return _handshakeTime; }
+    guint64 sentBytes() const { return _sentBytes; }
+    guint64 ackedBytes() const { return _ackedBytes; }
+
+private:
+    struct InChunkStream {
+        guint32 timestamp = 0; // as is from header, only to detect extended timestamp
+        guint32 length = 0;
+        guint8 type = 0;
+        std::vector<guint8> payload;
+    };
+
+    typedef std::pair<const guint8*, gsize> Part;
+
+    bool handshake(GError**);
+    bool sendMessage(
+        ChunkStream,
+        MessageType,
+        guint32 timestamp,
+        guint32 messageStreamId,
+        std::initializer_list<Part> payload,
+        GError**);
+    bool sendControl(MessageType, guint32 value, GError**);
+    bool sendCommand(const AmfWriter&, guint32 messageStreamId, GError**);
+    bool readSome(bool blocking, GError**);
+    bool parseIncoming(GError**);
+    bool handleMessage(guint8 type, const std::vector<guint8>& payload, GError**);
+    std::optional<CommandResult> waitCommand(
+        const std::function<bool (const CommandResult&)>& match,
+        GError**);
+    std::optional<CommandResult> waitResult(double transactionId, GError**);
+
+private:
+    GCancellable* _cancellable;
+    const guint _timeout;
+    const guint32 _chunkSize;
+
+    GIOStream* _connection = nullptr; // either TCP or TLS
+    GInputStream* _in = nullptr;
+    GOutputStream* _out = nullptr;
+
+    guint32 _outChunkSize = MIN_CHUNK_SIZE;
+    guint32 _inChunkSize = MIN_CHUNK_SIZE;
+    std::map<guint32, InChunkStream> _inChunkStreams;
+    std::vector<guint8> _inBuffer;
+    std::deque<CommandResult> _commands;
+
+    double _nextTransactionId = 1;
+    guint32 _streamId = 0;
+    bool _publishing = false;
+    bool _flvHeaderSkipped = false;
+
+    guint64 _receivedBytes = 0;
+    guint64 _receivedBytesAcked = 0;
+    guint32 _peerAckWindow = 0;
+
+    guint64 _sentBytes = 0;
+    guint64 _ackedBytes = 0;
+    guint32 _lastAckSequence = 0;
+
+    gint64 _connectTime = 0; // microseconds
+    gint64 _handshakeTime = 0; // microseconds
+};
+
+RtmpSession::RtmpSession(GCancellable* cancellable, guint timeout, guint chunkSize) :
+    _cancellable(G_CANCELLABLE(g_object_ref(cancellable))),
+    _timeout(timeout),
+    _chunkSize(CLAMP(chunkSize, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE))
+{
+}
+
+RtmpSession::~RtmpSession()
+{
+    if(_connection) {
+        g_io_stream_close(_connection, nullptr, nullptr);
+        g_object_unref(_connection);
+    }
+
+    g_object_unref(_cancellable);
+}
+
+void RtmpSession::setCancellable(GCancellable* cancellable)
+{
+    g_object_ref(cancellable);
+    g_object_unref(_cancellable);
+    _cancellable = cancellable;
+}
+
+// stream name (and query) is usually secret stream key,
+// so url is logged only up to app
+std::string LoggableLocation(const std::string& location)
+{
+    const std::string url = location.substr(0, location.find_first_of(" ?"));
+
+    const std::string::size_type hostPos = url.find("://");
+    if(hostPos == std::string::npos)
+        return url;
+
+    const std::string::size_type appPos = url.find('/', hostPos + 3);
+    const std::string::size_type streamPos = url.rfind('/');
+    if(appPos == std::string::npos || streamPos == appPos)
+        return url;
+
+    return url.substr(0, streamPos);
+}
+
+std::mutex ResolverCacheMutex;
+std::map<std::string, std::pair<gint64, GList*>> ResolverCache; // host -> (expiration time, addresses)
+
+// resolved addresses are reused for DNS_CACHE_TTL,
+// so reconnects don't wait for resolver.
+// returned list should be freed with g_resolver_free_addresses
+GList* ResolveHost(const char* host, GCancellable* cancellable, GError** error)
+{
+    {
+        const std::lock_guard<std::mutex> lock(ResolverCacheMutex);
+
+        auto it = ResolverCache.find(host);
+        if(it != ResolverCache.end()) {
+            if(it->second.first > g_get_monotonic_time())
+                return g_list_copy_deep(it->second.second, GCopyFunc(g_object_ref), nullptr);
+
+            g_resolver_free_addresses(it->second.second);
+            ResolverCache.erase(it);
+        }
+    }
+
+    g_autoptr(GResolver) resolver = g_resolver_get_default();
+    GList* addresses = g_resolver_lookup_by_name(resolver, host, cancellable, error);
+    if(!addresses)
+        return nullptr;
+
+    const std::lock_guard<std::mutex> lock(ResolverCacheMutex);
+
+    auto& entry = ResolverCache[host];
+    if(entry.second)
+        g_resolver_free_addresses(entry.second);
+    entry.first = g_get_monotonic_time() + DNS_CACHE_TTL * G_USEC_PER_SEC;
+    entry.second = g_list_copy_deep(addresses, GCopyFunc(g_object_ref), nullptr);
+
+    return addresses;
+}
+
+// address could be changed, so it's resolved again next time
+void ForgetHost(const char* host)
+{
+    const std::lock_guard<std::mutex> lock(ResolverCacheMutex);
+
+    auto it = ResolverCache.find(host);
+    if(it == ResolverCache.end())
+        return;
+
+    g_resolver_free_addresses(it->second.second);
+    ResolverCache.erase(it);
+}
+
+bool RtmpSession::connect(const std::string& location, GError** error)
+{
+    // librtmp style options could follow url after space
+    const std::string url = location.substr(0, location.find(' '));
+
+    g_autofree gchar* scheme = nullptr;
+    g_autofree gchar* host = nullptr;
+    gint port = -1;
+    g_autofree gchar* path = nullptr;
+    g_autofree gchar* query = nullptr;
+    if(!g_uri_split(
+        url.c_str(),
+        G_URI_FLAGS_NON_DNS,
+        &scheme,
+        nullptr, //userinfo
+        &host,
+        &port,
+        &path,
+        &query,
+        nullptr, //fragment
+        error))
+    {
+        return false;
+    }
+
+    const bool tls = 0 == g_strcmp0(scheme, "rtmps");
+    if(!host || (!tls && 0 != g_strcmp0(scheme, "rtmp"))) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unsupported url \"%s\"", LoggableLocation(url).c_str());
+        return false;
+    }
+    if(port < 0)
+        port = tls ? DEFAULT_TLS_PORT : DEFAULT_PORT;
+
+    // rtmp://host[:port]/app[/instance]/stream
+    const std::string_view pathView = path ? path : "";
+    const std::string::size_type streamPos = pathView.rfind('/');
+    if(streamPos == std::string::npos || streamPos == 0 || streamPos + 1 == pathView.size()) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid url \"%s\"", LoggableLocation(url).c_str());
+        return false;
+    }
+
+    const std::string app(pathView.substr(1, streamPos - 1));
+    std::string streamName(pathView.substr(streamPos + 1));
+    if(query) {
+        streamName += '?';
+        streamName += query;
+    }
+    const std::string tcUrl =
+        std::string(scheme) + "://" + host + ":" + std::to_string(port) + "/" + app;
+
+    const gint64 connectStartTime = g_get_monotonic_time();
+
+    GList* addresses = ResolveHost(host, _cancellable, error);
+    if(!addresses)
+        return false;
+
+    g_autoptr(GSocketClient) client = g_socket_client_new();
+    g_socket_client_set_timeout(client, _timeout);
+
+    GSocketConnection* tcpConnection = nullptr;
+    GError* connectError = nullptr;
+    for(GList* item = addresses; item && !tcpConnection; item = item->next) {
+        g_autoptr(GSocketAddress) address =
+            g_inet_socket_address_new(G_INET_ADDRESS(item->data), port);
+
+        g_clear_error(&connectError);
+        tcpConnection =
+            g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), _cancellable, &connectError);
+
+        if(g_error_matches(connectError, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            break;
+    }
+    g_resolver_free_addresses(addresses);
+
+    if(!tcpConnection) {
+        ForgetHost(host);
+        g_propagate_error(error, connectError);
+        return false;
+    }
+    g_clear_error(&connectError);
+
+    // limits every blocking read and write
+    g_socket_set_timeout(g_socket_connection_get_socket(tcpConnection), _timeout);
+
+    if(tls) {
+        // host is connected by address, so server identity is specified explicitly
+        g_autoptr(GSocketConnectable) identity = g_network_address_new(host, port);
+        GIOStream* tlsConnection =
+            g_tls_client_connection_new(G_IO_STREAM(tcpConnection), identity, error);
+        g_object_unref(tcpConnection);
+        if(!tlsConnection)
+            return false;
+
+        _connection = tlsConnection;
+        if(!g_tls_connection_handshake(G_TLS_CONNECTION(tlsConnection), _cancellable, error))
+            return false;
+    } else {
+        _connection = G_IO_STREAM(tcpConnection);
+    }
+    _connectTime = g_get_monotonic_time() - connectStartTime;
+
+    _in = g_io_stream_get_input_stream(_connection);
+    _out = g_io_stream_get_output_stream(_connection);
+
+    const gint64 handshakeStartTime = g_get_monotonic_time();
+    if(!handshake(error))
+        return false;
+    _handshakeTime = g_get_monotonic_time() - handshakeStartTime;
+
+    if(!sendControl(SET_CHUNK_SIZE, _chunkSize, error))
+        return false;
+    _outChunkSize = _chunkSize;
+
+    if(!sendControl(WINDOW_ACK_SIZE, ACK_WINDOW, error))
+        return false;
+
+    AmfWriter connect;
+    const double connectTransactionId = _nextTransactionId++;
+    connect.string("connect");
+    connect.number(connectTransactionId);
+    connect.objectStart();
+    connect.key("app");
+    connect.string(app);
+    connect.key("type");
+    connect.string("nonprivate");
+    connect.key("flashVer");
+    connect.string("FMLE/3.0 (compatible; FMSc/1.0)");
+    connect.key("tcUrl");
+    connect.string(tcUrl);
+    connect.objectEnd();
+    if(!sendCommand(connect, 0, error) || !waitResult(connectTransactionId, error))
+        return false;
+
+    // not all servers respond to these, so responses are not waited
+    for(const char* command: { "releaseStream", "FCPublish" }) {
+        AmfWriter writer;
+        writer.string(command);
+        writer.number(_nextTransactionId++);
+        writer.null();
+        writer.string(streamName);
+        if(!sendCommand(writer, 0, error))
+            return false;
+    }
+
+    AmfWriter createStream;
+    const double createStreamTransactionId = _nextTransactionId++;
+    createStream.string("createStream");
+    createStream.number(createStreamTransactionId);
+    createStream.null();
+    if(!sendCommand(createStream, 0, error))
+        return false;
+
+    const std::optional<CommandResult> createStreamResult = waitResult(createStreamTransactionId, error);
+    if(!createStreamResult)
+        return false;
+    if(!createStreamResult->number) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Stream id is missing in createStream result");
+        return false;
+    }
+    _streamId = static_cast<guint32>(*createStreamResult->number);
+
+    AmfWriter publish;
+    publish.string("publish");
+    publish.number(_nextTransactionId++);
+    publish.null();
+    publish.string(streamName);
+    publish.string("live");
+    if(!sendCommand(publish, _streamId, error))
+        return false;
+
+    const std::optional<CommandResult> status =
+        waitCommand(
+            [] (const CommandResult& result) {
+                return result.name == "onStatus" &&
+                    (result.code == "NetStream.Publish.Start" || result.level == "error");
+            },
+            error);
+    if(!status)
+        return false;
+    if(status->level == "error") {
+        g_set_error(
+            error,
+            G_IO_ERROR, G_IO_ERROR_FAILED,
+            "Publish rejected: %s %s",
+            status->code.c_str(),
+            status->description.c_str());
+        return false;
+    }
+
+    // responses to commands not waited (releaseStream, FCPublish) are not needed anymore
+    _commands.clear();
+    _publishing = true;
+
+    Log()->debug(
+        "Publishing to \"{}\" started. Connect: {} ms, handshake: {} ms",
+        tcUrl,
+        _connectTime / 1000,
+        _handshakeTime / 1000);
+
+    return true;
+}
+
+bool RtmpSession::handshake(GError** error)
+{
+    std::vector<guint8> c0c1(1 + HANDSHAKE_SIZE, 0);
+    c0c1[0] = RTMP_VERSION;
+    // time and zero fields are left zeroed
+    for(gsize i = 1 + 8; i < c0c1.size(); ++i)
+        c0c1[i] = guint8(g_random_int());
+
+    if(!g_output_stream_write_all(_out, c0c1.data(), c0c1.size(), nullptr, _cancellable, error))
+        return false;
+
+    std::vector<guint8> s0s1(1 + HANDSHAKE_SIZE);
+    gsize read = 0;
+    if(!g_input_stream_read_all(_in, s0s1.data(), s0s1.size(), &read, _cancellable, error))
+        return false;
+    if(read != s0s1.size() || s0s1[0] != RTMP_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid handshake response");
+        return false;
+    }
+
+    // C2 is echo of S1
+    if(!g_output_stream_write_all(_out, s0s1.data() + 1, HANDSHAKE_SIZE, nullptr, _cancellable, error))
+        return false;
+
+    std::vector<guint8> s2(HANDSHAKE_SIZE);
+    if(!g_input_stream_read_all(_in, s2.data(), s2.size(), &read, _cancellable, error))
+        return false;
+    if(read != s2.size()) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed during handshake");
+        return false;
+    }
+
+    _sentBytes += c0c1.size() + HANDSHAKE_SIZE;
+
+    return true;
+}
+
+bool RtmpSession::sendMessage(
+    ChunkStream chunkStream,
+    MessageType type,
+    guint32 timestamp,
+    guint32 messageStreamId,
+    std::initializer_list<Part> payload,
+    GError** error)
+{
+    gsize length = 0;
+    for(const Part& part: payload)
+        length += part.second;
+
+    const bool extendedTimestamp = timestamp >= EXTENDED_TIMESTAMP;
+    const gsize chunksCount = std::max<gsize>(1, (length + _outChunkSize - 1) / _outChunkSize);
+
+    // reserved in advance, so pointers to headers stay valid
+    std::vector<guint8> headers;
+    headers.reserve(chunksCount * (1 + 11 + 4));
+    std::vector<GOutputVector> vectors;
+    vectors.reserve(chunksCount * (1 + payload.size()));
+
+    auto partIt = payload.begin();
+    gsize partOffset = 0;
+    gsize left = length;
+    for(gsize chunk = 0; chunk < chunksCount; ++chunk) {
+        const gsize headerStart = headers.size();
+        if(chunk == 0) {
+            headers.push_back(chunkStream); // fmt 0
+            WriteBE24(&headers, extendedTimestamp ? guint32(EXTENDED_TIMESTAMP) : timestamp);
+            WriteBE24(&headers, guint32(length));
+            headers.push_back(type);
+            WriteLE32(&headers, messageStreamId);
+        } else {
+            headers.push_back((3 << 6) | chunkStream); // fmt 3
+        }
+        if(extendedTimestamp)
+            WriteBE32(&headers, timestamp);
+
+        vectors.push_back({ headers.data() + headerStart, headers.size() - headerStart });
+
+        gsize chunkLeft = std::min<gsize>(_outChunkSize, left);
+        left -= chunkLeft;
+        while(chunkLeft > 0) {
+            const gsize size = std::min(chunkLeft, partIt->second - partOffset);
+            if(size > 0)
+                vectors.push_back({ partIt->first + partOffset, size });
+
+            chunkLeft -= size;
+            partOffset += size;
+            if(partOffset == partIt->second) {
+                ++partIt;
+                partOffset = 0;
+            }
+        }
+    }
+
+    gsize written = 0;
+    const bool success =
+        g_output_stream_writev_all(
+            _out,
+            vectors.data(),
+            vectors.size(),
+            &written,
+            _cancellable,
+            error);
+    _sentBytes += written;
+
+    return success;
+}
+
+bool RtmpSession::sendControl(MessageType type, guint32 value, GError** error)
+{
+    std::vector<guint8> payload;
+    WriteBE32(&payload, value);
+
+    return sendMessage(
+        CONTROL_CHUNK_STREAM,
+        type,
+        0,
+        0,
+        { { payload.data(), payload.size() } },
+        error);
+}
+
+bool RtmpSession::sendCommand(const AmfWriter& command, guint32 messageStreamId, GError** error)
+{
+    return sendMessage(
+        COMMAND_CHUNK_STREAM,
+        COMMAND_AMF0,
+        0,
+        messageStreamId,
+        { { command.data().data(), command.data().size() } },
+        error);
+}
+
+bool RtmpSession::sendFlv(const guint8* data, gsize size, GError** error)
+{
+    gsize pos = 0;
+
+    if(!_flvHeaderSkipped) {
+        if(size >= FLV_HEADER_SIZE && 0 == memcmp(data, "FLV", 3)) {
+            pos = ReadBE32(data + 5) + FLV_PREV_TAG_SIZE;
+            _flvHeaderSkipped = true;
+        }
+    }
+
+    while(pos < size) {
+        if(size - pos < FLV_TAG_HEADER_SIZE) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Truncated FLV tag header");
+            return false;
+        }
+
+        const guint8* tag = data + pos;
+        const guint8 tagType = tag[0] & 0x1F;
+        const guint32 dataSize = ReadBE24(tag + 1);
+        const guint32 timestamp = ReadBE24(tag + 4) | (guint32(tag[7]) << 24);
+        if(size - pos - FLV_TAG_HEADER_SIZE < dataSize) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Truncated FLV tag");
+            return false;
+        }
+
+        const Part tagData { tag + FLV_TAG_HEADER_SIZE, dataSize };
+
+        bool success = true;
+        switch(tagType) {
+            case AUDIO:
+                success = sendMessage(AUDIO_CHUNK_STREAM, AUDIO, timestamp, _streamId, { tagData }, error);
+                break;
+            case VIDEO:
+                success = sendMessage(VIDEO_CHUNK_STREAM, VIDEO, timestamp, _streamId, { tagData }, error);
+                break;
+            case DATA_AMF0:
+                success = sendMessage(
+                    DATA_CHUNK_STREAM,
+                    DATA_AMF0,
+                    timestamp,
+                    _streamId,
+                    { { SetDataFrame, sizeof(SetDataFrame) }, tagData },
+                    error);
+                break;
+            default:
+                break;
+        }
+
+        if(!success)
+            return false;
+
+        pos += FLV_TAG_HEADER_SIZE + dataSize + FLV_PREV_TAG_SIZE;
+    }
+
+    return true;
+}
+
+bool RtmpSession::readSome(bool blocking, GError** error)
+{
+    guint8 buffer[4096];
+
+    for(;;) {
+        gssize read;
+        if(blocking) {
+            read = g_input_stream_read(_in, buffer, sizeof(buffer), _cancellable, error);
+        } else {
+            GError* readError = nullptr;
+            read = g_pollable_input_stream_read_nonblocking(
+                G_POLLABLE_INPUT_STREAM(_in),
+                buffer,
+                sizeof(buffer),
+                _cancellable,
+                &readError);
+            if(read < 0 && g_error_matches(readError, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_error_free(readError);
+                return true;
+            }
+            if(readError)
+                g_propagate_error(error, readError);
+        }
+
+        if(read < 0)
+            return false;
+        if(read == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed by server");
+            return false;
+        }
+
+        _receivedBytes += read;
+        _inBuffer.insert(_inBuffer.end(), buffer, buffer + read);
+
+        if(!parseIncoming(error))
+            return false;
+
+        if(_peerAckWindow && _receivedBytes - _receivedBytesAcked >= _peerAckWindow) {
+            if(!sendControl(ACKNOWLEDGEMENT, guint32(_receivedBytes), error))
+                return false;
+            _receivedBytesAcked = _receivedBytes;
+        }
+
+        if(blocking)
+            return true;
+    }
+}
+
+bool RtmpSession::pollIncoming(GError** error)
+{
+    if(!G_IS_POLLABLE_INPUT_STREAM(_in) ||
+        !g_pollable_input_stream_can_poll(G_POLLABLE_INPUT_STREAM(_in)))
+    {
+        return true;
+    }
+
+    return readSome(false, error);
+}
+
+bool RtmpSession::parseIncoming(GError** error)
+{
+    static const gsize MessageHeaderSizes[] = { 11, 7, 3, 0 };
+
+    gsize pos = 0;
+    for(;;) {
+        const guint8* data = _inBuffer.data() + pos;
+        const gsize size = _inBuffer.size() - pos;
+        if(size < 1)
+            break;
+
+        const guint8 fmt = data[0] >> 6;
+        guint32 chunkStreamId = data[0] & 0x3F;
+        gsize headerSize = 1;
+        if(chunkStreamId == 0) {
+            if(size < 2)
+                break;
+            chunkStreamId = 64 + data[1];
+            headerSize = 2;
+        } else if(chunkStreamId == 1) {
+            if(size < 3)
+                break;
+            chunkStreamId = 64 + data[1] + (data[2] << 8);
+            headerSize = 3;
+        }
+
+        if(size < headerSize + MessageHeaderSizes[fmt])
+            break;
+
+        InChunkStream& stream = _inChunkStreams[chunkStreamId];
+        const guint8* header = data + headerSize;
+        headerSize += MessageHeaderSizes[fmt];
+
+        const guint32 timestamp = fmt <= 2 ? ReadBE24(header) : stream.timestamp;
+        const guint32 length = fmt <= 1 ? ReadBE24(header + 3) : stream.length;
+        const guint8 type = fmt <= 1 ? header[6] : stream.type;
+
+        if(timestamp == EXTENDED_TIMESTAMP)
+            headerSize += 4;
+
+        if(length > MAX_INCOMING_MESSAGE_SIZE) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Too large incoming message");
+            return false;
+        }
+
+        const gsize messageLeft = length - std::min<gsize>(length, stream.payload.size());
+        const gsize payloadSize = std::min<gsize>(_inChunkSize, messageLeft);
+        if(size < headerSize + payloadSize)
+            break;
+
+        // the whole chunk is available
+        stream.timestamp = timestamp;
+        stream.length = length;
+        stream.type = type;
+        stream.payload.insert(stream.payload.end(), data + headerSize, data + headerSize + payloadSize);
+        pos += headerSize + payloadSize;
+
+        if(stream.payload.size() >= stream.length) {
+            const std::vector<guint8> payload = std::move(stream.payload);
+            stream.payload.clear();
+            if(!handleMessage(type, payload, error))
+                return false;
+        }
+    }
+
+    _inBuffer.erase(_inBuffer.begin(), _inBuffer.begin() + pos);
+
+    return true;
+}
+
+bool RtmpSession::handleMessage(guint8 type, const std::vector<guint8>& payload, GError** error)
+{
+    switch(type) {
+        case SET_CHUNK_SIZE:
+            if(payload.size() >= 4) {
+                const guint32 chunkSize = ReadBE32(payload.data()) & 0x7FFFFFFF;
+                if(chunkSize == 0) {
+                    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid chunk size");
+                    return false;
+                }
+                _inChunkSize = chunkSize;
+            }
+            break;
+        case ACKNOWLEDGEMENT:
+            if(payload.size() >= 4) {
+                // sequence number wraps at 4 GB
+                const guint32 sequence = ReadBE32(payload.data());
+                _ackedBytes += guint32(sequence - _lastAckSequence);
+                _lastAckSequence = sequence;
+            }
+            break;
+        case WINDOW_ACK_SIZE:
+            if(payload.size() >= 4)
+                _peerAckWindow = ReadBE32(payload.data());
+            break;
+        case USER_CONTROL:
+            if(payload.size() >= 6 && ReadBE16(payload.data()) == PING_REQUEST) {
+                std::vector<guint8> response;
+                WriteBE16(&response, PING_RESPONSE);
+                response.insert(response.end(), payload.begin() + 2, payload.begin() + 6);
+                return sendMessage(
+                    CONTROL_CHUNK_STREAM,
+                    USER_CONTROL,
+                    0,
+                    0,
+                    { { response.data(), response.size() } },
+                    error);
+            }
+            break;
+        case COMMAND_AMF0: {
+            AmfReader reader(payload.data(), payload.size());
+
+            CommandResult result;
+            std::optional<std::string> name = reader.string();
+            std::optional<double> transactionId = reader.number();
+            if(!name || !transactionId)
+                break; // not interesting
+
+            result.name = *name;
+            result.transactionId = *transactionId;
+
+            // command object, usually null
+            if(!reader.skip())
+                break;
+
+            while(!reader.atEnd()) {
+                if(std::optional<double> number = reader.number()) {
+                    if(!result.number)
+                        result.number = number;
+                } else if(!reader.object(
+                    [&result] (const std::string& name, const std::string& value) {
+                        if(name == "level")
+                            result.level = value;
+                        else if(name == "code")
+                            result.code = value;
+                        else if(name == "description")
+                            result.description = value;
+                    }))
+                {
+                    break;
+                }
+            }
+
+            // nobody waits for command responses after publishing is started
+            if(!_publishing)
+                _commands.emplace_back(std::move(result));
+            break;
+        }
+        default:
+            break;
+    }
+
+    return true;
+}
+
+std::optional<CommandResult> RtmpSession::waitCommand(
+    const std::function<bool (const CommandResult&)>& match,
+    GError** error)
+{
+    for(;;) {
+        for(auto it = _commands.begin(); it != _commands.end(); ++it) {
+            if(match(*it)) {
+                CommandResult result = std::move(*it);
+                _commands.erase(it);
+                return result;
+            }
+        }
+
+        if(!readSome(true, error))
+            return {};
+    }
+}
+
+std::optional<CommandResult> RtmpSession::waitResult(double transactionId, GError** error)
+{
+    std::optional<CommandResult> result =
+        waitCommand(
+            [transactionId] (const CommandResult& result) {
+                return result.transactionId == transactionId &&
+                    (result.name == "_result" || result.name == "_error");
+            },
+            error);
+    if(!result)
+        return {};
+
+    if(result->name == "_error") {
+        g_set_error(
+            error,
+            G_IO_ERROR, G_IO_ERROR_FAILED,
+            "Command rejected: %s %s",
+            result->code.c_str(),
+            result->description.c_str());
+        return {};
+    }
+
+    return result;
+}
+
+// RTMP sessions connected in advance, while source is still starting.
+// Taken over by publisher with the same location (and settings) as soon as it gets data.
+struct Preconnect
+{
+    Preconnect(guint timeout, guint chunkSize) :
+        cancellable(g_cancellable_new()), timeout(timeout), chunkSize(chunkSize) {}
+    ~Preconnect() { g_object_unref(cancellable); }
+
+    GCancellable* const cancellable; // cancelled if target is detached before taking session
+    const guint timeout;
+    const guint chunkSize;
+
+    bool done = false;
+    std::unique_ptr<RtmpSession> session; // empty if connect failed or already taken
+};
+
+std::mutex PreconnectMutex;
+std::condition_variable PreconnectDone;
+std::map<std::string, std::shared_ptr<Preconnect>> Preconnects; // location -> Preconnect
+
+// waits for connect started in advance (if any) until it's done or cancellable is cancelled
+std::unique_ptr<RtmpSession> TakePreconnectedSession(
+    const std::string& location,
+    guint timeout,
+    guint chunkSize,
+    GCancellable* cancellable)
+{
+    auto onCancelled =
+        + [] (GCancellable*, gpointer)
+    {
+        const std::lock_guard<std::mutex> lock(PreconnectMutex);
+        PreconnectDone.notify_all();
+    };
+    // has to be connected without PreconnectMutex locked,
+    // since callback is called immediately if cancellable is cancelled already
+    const gulong cancelledHandlerId =
+        g_cancellable_connect(cancellable, G_CALLBACK(onCancelled), nullptr, nullptr);
+
+    std::unique_ptr<RtmpSession> session;
+    {
+        std::unique_lock<std::mutex> lock(PreconnectMutex);
+
+        auto it = Preconnects.find(location);
+        if(it != Preconnects.end()) {
+            const std::shared_ptr<Preconnect> preconnect = it->second;
+            Preconnects.erase(it);
+
+            if(preconnect->timeout != timeout || preconnect->chunkSize != chunkSize) {
+                // publisher was configured differently, so it will connect itself
+                g_cancellable_cancel(preconnect->cancellable);
+                PreconnectDone.notify_all();
+            } else {
+                PreconnectDone.wait(lock, [&preconnect, cancellable] () {
+                    return preconnect->done || g_cancellable_is_cancelled(cancellable);
+                });
+
+                if(preconnect->done) {
+                    session = std::move(preconnect->session);
+                    // lets connecting thread to finish right away
+                    PreconnectDone.notify_all();
+                } else {
+                    g_cancellable_cancel(preconnect->cancellable);
+                }
+            }
+        }
+    }
+
+    g_cancellable_disconnect(cancellable, cancelledHandlerId);
+
+    return session;
+}
+
+}
+
+void PreconnectRtmp(const std::string& location)
+{
+    PreconnectRtmp(location, DEFAULT_TIMEOUT, DEFAULT_CHUNK_SIZE);
+}
+
+void PreconnectRtmp(const std::string& location, guint timeout, guint chunkSize)
+{
+    std::shared_ptr<Preconnect> preconnect;
+    {
+        const std::lock_guard<std::mutex> lock(PreconnectMutex);
+
+        if(Preconnects.find(location) != Preconnects.end())
+            return; // connecting already
+
+        preconnect = std::make_shared<Preconnect>(timeout, chunkSize);
+        Preconnects.emplace(location, preconnect);
+    }
+
+    struct TaskData
+    {
+        std::string location;
+        std::shared_ptr<Preconnect> preconnect;
+    };
+
+    // connects, then keeps session for PRECONNECT_TTL at most
+    // and closes it if nobody took it
+    auto connect =
+        + [] (GTask* task, gpointer, gpointer taskData, GCancellable*)
+    {
+        const std::string& location = static_cast<TaskData*>(taskData)->location;
+        const std::shared_ptr<Preconnect>& preconnect = static_cast<TaskData*>(taskData)->preconnect;
+
+        std::unique_ptr<RtmpSession> session =
+            std::make_unique<RtmpSession>(
+                preconnect->cancellable,
+                preconnect->timeout,
+                preconnect->chunkSize);
+
+        GError* error = nullptr;
+        if(!session->connect(location, &error)) {
+            // publisher will try again itself
+            Log()->debug(
+                "Connecting in advance to \"{}\" failed: {}",
+                LoggableLocation(location),
+                error ? error->message : "unknown error");
+            g_clear_error(&error);
+            session.reset();
+        }
+
+        std::unique_lock<std::mutex> lock(PreconnectMutex);
+
+        preconnect->done = true;
+        if(!g_cancellable_is_cancelled(preconnect->cancellable))
+            preconnect->session = std::move(session);
+
+        PreconnectDone.notify_all();
+
+        // server could drop publisher idle for too long anyway
+        PreconnectDone.wait_for(
+            lock,
+            std::chrono::seconds(PRECONNECT_TTL),
+            [&preconnect] () {
+                return !preconnect->session || g_cancellable_is_cancelled(preconnect->cancellable);
+            });
+
+        if(preconnect->session)
+            Log()->debug("Connection made in advance to \"{}\" was not used", LoggableLocation(location));
+
+        session = std::move(preconnect->session);
+
+        auto it = Preconnects.find(location);
+        if(it != Preconnects.end() && it->second == preconnect)
+            Preconnects.erase(it);
+
+        lock.unlock();
+
+        // closed without PreconnectMutex locked
+        session.reset();
+    };
+
+    GTask* task = g_task_new(nullptr, nullptr, nullptr, nullptr);
+    g_task_set_task_data(
+        task,
+        new TaskData { location, preconnect },
+        [] (gpointer userData) {
+            delete static_cast<TaskData*>(userData);
+        });
+    g_task_run_in_thread(task, connect);
+    g_object_unref(task);
+}
+
+void CancelPreconnectRtmp(const std::string& location)
+{
+    const std::lock_guard<std::mutex> lock(PreconnectMutex);
+
+    auto it = Preconnects.find(location);
+    if(it == Preconnects.end())
+        return;
+
+    // connecting thread closes session (if any) itself
+    g_cancellable_cancel(it->second->cancellable);
+    Preconnects.erase(it);
+
+    PreconnectDone.notify_all();
+}
+
+class PublishWorker;
+
+struct RtmpPublisher
+{
+    GstBaseSink parent;
+
+    // guarded by object lock
+    gchar* location;
+    guint timeout;
+    guint chunkSize;
+    guint64 connectTime; // microseconds
+    guint64 handshakeTime; // microseconds
+    guint64 sentBytes;
+    guint64 ackedBytes;
+
+    PublishWorker* worker; // exists between start and stop
+};
+
+struct RtmpPublisherClass
+{
+    GstBaseSinkClass parent_class;
+};
+
+enum {
+    PROP_0,
+    PROP_LOCATION,
+    PROP_TIMEOUT,
+    PROP_CHUNK_SIZE,
+    PROP_CONNECT_TIME,
+    PROP_HANDSHAKE_TIME,
+    PROP_SENT_BYTES,
+    PROP_ACKED_BYTES,
+};
+
+GstStaticPadTemplate SinkTemplate =
+    GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS("video/x-flv"));
+
+G_DEFINE_TYPE(RtmpPublisher, rtmp_publisher, GST_TYPE_BASE_SINK)
+
+static GstFlowReturn rtmp_publisher_error(RtmpPublisher* self, GError* error)
+{
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return GST_FLOW_FLUSHING;
+    }
+
+    GST_OBJECT_LOCK(self);
+    g_autofree gchar* location = g_strdup(self->location);
+    GST_OBJECT_UNLOCK(self);
+
+    GST_ELEMENT_ERROR(
+        self,
+        RESOURCE, WRITE,
+        ("Failed to publish to \"%s\"", LoggableLocation(location ? location : "").c_str()),
+        ("%s", error ? error->message : "unknown error"));
+    if(error)
+        g_error_free(error);
+
+    return GST_FLOW_ERROR;
+}
+
+// Does all network I/O (including connect), so streaming thread only queues buffers
+// and is never blocked by socket for longer than queue is full.
+// Failure is reported with element error right away and returned from the next push.
+class PublishWorker
+{
+public:
+    explicit PublishWorker(RtmpPublisher*);
+    ~PublishWorker();
+
+    // waits while too much data is queued already
+    GstFlowReturn push(GstBuffer*);
+    // waits until everything queued is sent
+    GstFlowReturn drain();
+
+    // drops queued data and interrupts both waiting and network I/O
+    void unlock();
+    void unlockStop();
+
+private:
+    void run();
+    GstFlowReturn send(GstBuffer*);
+    GstFlowReturn poll();
+    void updateStats();
+    void clearQueue();
+
+private:
+    RtmpPublisher *const _publisher;
+    GCancellable *const _cancellable;
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::deque<GstBuffer*> _queue;
+    gsize _queuedSize = 0;
+    bool _sending = false;
+    bool _flushing = false;
+    bool _stopping = false;
+    GstFlowReturn _result = GST_FLOW_OK;
+
+    std::unique_ptr<RtmpSession> _session; // accessed from worker thread only
+
+    std::thread _thread;
+};
+
+PublishWorker::PublishWorker(RtmpPublisher* publisher) :
+    _publisher(publisher),
+    _cancellable(g_cancellable_new()),
+    _thread(&PublishWorker::run, this)
+{
+}
+
+PublishWorker::~PublishWorker()
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _changed.notify_all();
+    }
+    g_cancellable_cancel(_cancellable);
+
+    _thread.join();
+
+    clearQueue();
+    g_object_unref(_cancellable);
+}
+
+void PublishWorker::clearQueue()
+{
+    for(GstBuffer* buffer: _queue)
+        gst_buffer_unref(buffer);
+    _queue.clear();
+    _queuedSize = 0;
+}
+
+GstFlowReturn PublishWorker::push(GstBuffer* buffer)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _changed.wait(lock, [this] () {
+        return _flushing || _result != GST_FLOW_OK || _queuedSize < MAX_QUEUED_SIZE;
+    });
+    if(_flushing)
+        return GST_FLOW_FLUSHING;
+    if(_result != GST_FLOW_OK)
+        return _result;
+
+    _queue.push_back(gst_buffer_ref(buffer));
+    _queuedSize += gst_buffer_get_size(buffer);
+    _changed.notify_all();
+
+    return GST_FLOW_OK;
+}
+
+GstFlowReturn PublishWorker::drain()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _changed.wait(lock, [this] () {
+        return _flushing || _result != GST_FLOW_OK || (_queue.empty() && !_sending);
+    });
+    if(_flushing)
+        return GST_FLOW_FLUSHING;
+
+    return _result;
+}
+
+void PublishWorker::unlock()
+{
+    g_cancellable_cancel(_cancellable);
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _flushing = true;
+    clearQueue();
+    _changed.notify_all();
+}
+
+void PublishWorker::unlockStop()
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _flushing = false;
+    g_cancellable_reset(_cancellable);
+}
+
+void PublishWorker::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while(!_stopping) {
+        // server pings and acknowledgements are handled even if there is nothing to send
+        const bool timedOut =
+            !_changed.wait_for(
+                lock,
+                std::chrono::milliseconds(POLL_INTERVAL),
+                [this] () { return _stopping || (!_flushing && !_queue.empty()); });
+        if(_stopping)
+            break;
+        if(_result != GST_FLOW_OK)
+            continue;
+
+        GstBuffer* buffer = nullptr;
+        if(!timedOut) {
+            buffer = _queue.front();
+            _queue.pop_front();
+            _queuedSize -= gst_buffer_get_size(buffer);
+        } else if(!_session || _flushing) {
+            continue;
+        }
+
+        _sending = true;
+        lock.unlock();
+
+        const GstFlowReturn result = buffer ? send(buffer) : poll();
+        if(buffer)
+            gst_buffer_unref(buffer);
+
+        lock.lock();
+        _sending = false;
+        if(result == GST_FLOW_ERROR) {
+            _result = result;
+            clearQueue();
+        }
+        _changed.notify_all();
+    }
+
+    lock.unlock();
+
+    // closed without worker mutex locked
+    _session.reset();
+}
+
+void PublishWorker::updateStats()
+{
+    GST_OBJECT_LOCK(_publisher);
+    _publisher->sentBytes = _session->sentBytes();
+    _publisher->ackedBytes = _session->ackedBytes();
+    GST_OBJECT_UNLOCK(_publisher);
+}
+
+GstFlowReturn PublishWorker::send(GstBuffer* buffer)
+{
+    GError* error = nullptr;
+
+    if(!_session) {
+        GST_OBJECT_LOCK(_publisher);
+        const std::string location = _publisher->location ? _publisher->location : "";
+        const guint timeout = _publisher->timeout;
+        const guint chunkSize = _publisher->chunkSize;
+        GST_OBJECT_UNLOCK(_publisher);
+
+        // connected lazily to not block state change
+        std::unique_ptr<RtmpSession> session =
+            TakePreconnectedSession(location, timeout, chunkSize, _cancellable);
+        if(g_cancellable_is_cancelled(_cancellable))
+            return GST_FLOW_FLUSHING;
+
+        if(session) {
+            session->setCancellable(_cancellable);
+        } else {
+            session = std::make_unique<RtmpSession>(_cancellable, timeout, chunkSize);
+            if(!session->connect(location, &error))
+                return rtmp_publisher_error(_publisher, error);
+        }
+
+        GST_OBJECT_LOCK(_publisher);
+        _publisher->connectTime = session->connectTime();
+        _publisher->handshakeTime = session->handshakeTime();
+        GST_OBJECT_UNLOCK(_publisher);
+
+        _session = std::move(session);
+    }
+
+    GstMapInfo mapInfo;
+    if(!gst_buffer_map(buffer, &mapInfo, GST_MAP_READ)) {
+        GST_ELEMENT_ERROR(_publisher, RESOURCE, READ, ("Failed to map buffer"), (nullptr));
+        return GST_FLOW_ERROR;
+    }
+
+    const bool success =
+        _session->sendFlv(mapInfo.data, mapInfo.size, &error) &&
+        _session->pollIncoming(&error);
+
+    gst_buffer_unmap(buffer, &mapInfo);
+
+    updateStats();
+
+    if(!success) {
+        const GstFlowReturn result = rtmp_publisher_error(_publisher, error);
+        if(result == GST_FLOW_ERROR)
+            _session.reset();
+        return result;
+    }
+
+    return GST_FLOW_OK;
+}
+
+GstFlowReturn PublishWorker::poll()
+{
+    GError* error = nullptr;
+    const bool success = _session->pollIncoming(&error);
+
+    updateStats();
+
+    if(!success) {
+        const GstFlowReturn result = rtmp_publisher_error(_publisher, error);
+        if(result == GST_FLOW_ERROR)
+            _session.reset();
+        return result;
+    }
+
+    return GST_FLOW_OK;
+}
+
+static GstFlowReturn rtmp_publisher_render(GstBaseSink* sink, GstBuffer* buffer)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    return self->worker->push(buffer);
+}
+
+static gboolean rtmp_publisher_event(GstBaseSink* sink, GstEvent* event)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    // EOS is posted only after everything queued is sent
+    if(GST_EVENT_TYPE(event) == GST_EVENT_EOS && self->worker)
+        self->worker->drain();
+
+    return GST_BASE_SINK_CLASS(rtmp_publisher_parent_class)->event(sink, event);
+}
+
+static gboolean rtmp_publisher_start(GstBaseSink* sink)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    self->worker = new PublishWorker(self);
+
+    return TRUE;
+}
+
+static gboolean rtmp_publisher_unlock(GstBaseSink* sink)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    if(self->worker)
+        self->worker->unlock();
+
+    return TRUE;
+}
+
+static gboolean rtmp_publisher_unlock_stop(GstBaseSink* sink)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    if(self->worker)
+        self->worker->unlockStop();
+
+    return TRUE;
+}
+
+static gboolean rtmp_publisher_stop(GstBaseSink* sink)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(sink);
+
+    delete self->worker;
+    self->worker = nullptr;
+
+    return TRUE;
+}
+
+static void rtmp_publisher_set_property(
+    GObject* object,
+    guint propertyId,
+    const GValue* value,
+    GParamSpec* paramSpec)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(object);
+
+    GST_OBJECT_LOCK(self);
+    switch(propertyId) {
+        case PROP_LOCATION:
+            g_free(self->location);
+            self->location = g_value_dup_string(value);
+            break;
+        case PROP_TIMEOUT:
+            self->timeout = g_value_get_uint(value);
+            break;
+        case PROP_CHUNK_SIZE:
+            self->chunkSize = g_value_get_uint(value);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propertyId, paramSpec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(self);
+}
+
+static void rtmp_publisher_get_property(
+    GObject* object,
+    guint propertyId,
+    GValue* value,
+    GParamSpec* paramSpec)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(object);
+
+    GST_OBJECT_LOCK(self);
+    switch(propertyId) {
+        case PROP_LOCATION:
+            g_value_set_string(value, self->location);
+            break;
+        case PROP_TIMEOUT:
+            g_value_set_uint(value, self->timeout);
+            break;
+        case PROP_CHUNK_SIZE:
+            g_value_set_uint(value, self->chunkSize);
+            break;
+        case PROP_CONNECT_TIME:
+            g_value_set_uint64(value, self->connectTime);
+            break;
+        case PROP_HANDSHAKE_TIME:
+            g_value_set_uint64(value, self->handshakeTime);
+            break;
+        case PROP_SENT_BYTES:
+            g_value_set_uint64(value, self->sentBytes);
+            break;
+        case PROP_ACKED_BYTES:
+            g_value_set_uint64(value, self->ackedBytes);
+            break;
+        default:
+            G_OBJECT_WARN_INVALID_PROPERTY_ID(object, propertyId, paramSpec);
+            break;
+    }
+    GST_OBJECT_UNLOCK(self);
+}
+
+static void rtmp_publisher_finalize(GObject* object)
+{
+    RtmpPublisher* self = reinterpret_cast<RtmpPublisher*>(object);
+
+    delete self->worker;
+    g_free(self->location);
+
+    G_OBJECT_CLASS(rtmp_publisher_parent_class)->finalize(object);
+}
+
+static void rtmp_publisher_class_init(RtmpPublisherClass* klass)
+{
+    GObjectClass* objectClass = G_OBJECT_CLASS(klass);
+    GstElementClass* elementClass = GST_ELEMENT_CLASS(klass);
+    GstBaseSinkClass* baseSinkClass = GST_BASE_SINK_CLASS(klass);
+
+    objectClass->set_property = rtmp_publisher_set_property;
+    objectClass->get_property = rtmp_publisher_get_property;
+    objectClass->finalize = rtmp_publisher_finalize;
+
+    baseSinkClass->render = rtmp_publisher_render;
+    baseSinkClass->event = rtmp_publisher_event;
+    baseSinkClass->start = rtmp_publisher_start;
+    baseSinkClass->unlock = rtmp_publisher_unlock;
+    baseSinkClass->unlock_stop = rtmp_publisher_unlock_stop;
+    baseSinkClass->stop = rtmp_publisher_stop;
+
+    const GParamFlags readWrite =
+        GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY);
+    const GParamFlags readOnly =
+        GParamFlags(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_property(
+        objectClass,
+        PROP_LOCATION,
+        g_param_spec_string(
+            "location", "Location", "rtmp:// or rtmps:// url to publish to",
+            nullptr, readWrite));
+    g_object_class_install_property(
+        objectClass,
+        PROP_TIMEOUT,
+        g_param_spec_uint(
+            "timeout", "Timeout", "Network operations timeout in seconds",
+            1, G_MAXUINT, DEFAULT_TIMEOUT, readWrite));
+    g_object_class_install_property(
+        objectClass,
+        PROP_CHUNK_SIZE,
+        g_param_spec_uint(
+            "chunk-size", "Chunk size", "Outgoing RTMP chunk size",
+            MIN_CHUNK_SIZE, MAX_CHUNK_SIZE, DEFAULT_CHUNK_SIZE, readWrite));
+    g_object_class_install_property(
+        objectClass,
+        PROP_CONNECT_TIME,
+        g_param_spec_uint64(
+            "connect-time", "Connect time", "TCP (and TLS) connect time in microseconds",
+            0, G_MAXUINT64, 0, readOnly));
+    g_object_class_install_property(
+        objectClass,
+        PROP_HANDSHAKE_TIME,
+        g_param_spec_uint64(
+            "handshake-time", "Handshake time", "RTMP handshake time in microseconds",
+            0, G_MAXUINT64, 0, readOnly));
+    g_object_class_install_property(
+        objectClass,
+        PROP_SENT_BYTES,
+        g_param_spec_uint64(
+            "sent-bytes", "Sent bytes", "Bytes written to socket",
+            0, G_MAXUINT64, 0, readOnly));
+    g_object_class_install_property(
+        objectClass,
+        PROP_ACKED_BYTES,
+        g_param_spec_uint64(
+            "acked-bytes", "Acknowledged bytes", "Bytes acknowledged by server",
+            0, G_MAXUINT64, 0, readOnly));
+
+    gst_element_class_set_static_metadata(
+        elementClass,
+        "RTMP publisher",
+        "Sink/Network",
+        "Publishes FLV stream to RTMP server",
+        "RTMPVideoStreamer");
+    gst_element_class_add_static_pad_template(elementClass, &SinkTemplate);
+}
+
+static void rtmp_publisher_init(RtmpPublisher* self)
+{
+    self->timeout = DEFAULT_TIMEOUT;
+    self->chunkSize = DEFAULT_CHUNK_SIZE;
+
+    // data should be sent as soon as possible
+    gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
+}
+
+bool RegisterRtmpPublisher()
+{
+    return gst_element_register(
+        nullptr,
+        RtmpPublisherName,
+        GST_RANK_NONE,
+        rtmp_publisher_get_type()) != FALSE;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+#include <gst/gst.h>
+
+
+// Sink element publishing FLV stream (as produced by flvmux) to RTMP(S) server.
+// Unlike librtmp based rtmpsink it negotiates large chunk size,
+// writes FLV tags with vectored writes directly from buffer memory,
+// never blocks state changes on stalled socket
+// (network I/O is done from own thread, streaming thread waits only while send queue is full),
+// and tracks server acknowledgements to measure actual upload throughput.
+// Connect and handshake timings, sent and acknowledged bytes
+// are exposed as read-only properties.
+
+bool RegisterRtmpPublisher();
+
+// Starts connecting to location in background,
+// so publisher with the same location could start sending right away.
+// Publisher takes connection only if it's "timeout" and "chunk-size" are the same.
+// Connection is kept for a few seconds only.
+void PreconnectRtmp(const std::string& location); // with default publisher settings
+void PreconnectRtmp(const std::string& location, guint timeout, guint chunkSize);
+// Closes connection made in advance if it was not taken by publisher yet.
+void CancelPreconnectRtmp(const std::string& location);
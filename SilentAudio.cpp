@@ -0,0 +1,219 @@
+#include "SilentAudio.h"
+
+#include <CxxPtr/GstPtr.h>
+#include <CxxPtr/GlibPtr.h>
+
+#include "Log.h"
+
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+// AAC LC, 44100 Hz, mono
+const guint SampleRate = 44100;
+const guint SamplesPerFrame = 1024;
+const guint8 AudioSpecificConfig[] = { 0x12, 0x08 };
+const guint8 SilentFrame[] = { 0x00, 0xc8, 0x00, 0x80, 0x23, 0x80 };
+
+// owned by probe installed on video pad,
+// so it's accessed only from video streaming thread
+struct SilentAudio
+{
+    GstPadPtr srcPadPtr; // linked to audio sink pad
+
+    bool streamStarted = false;
+    bool segmentSent = false;
+    GstClockTime firstFramePts = GST_CLOCK_TIME_NONE;
+    guint64 framesCount = 0;
+};
+
+GstCaps* SilentAudioCaps()
+{
+    static GstCaps* caps = [] () {
+        GstBuffer* codecData =
+            gst_buffer_new_memdup(AudioSpecificConfig, sizeof(AudioSpecificConfig));
+
+        GstCaps* caps =
+            gst_caps_new_simple(
+                "audio/mpeg",
+                "mpegversion", G_TYPE_INT, 4,
+                "stream-format", G_TYPE_STRING, "raw",
+                "framed", G_TYPE_BOOLEAN, TRUE,
+                "rate", G_TYPE_INT, SampleRate,
+                "channels", G_TYPE_INT, 1,
+                "codec_data", GST_TYPE_BUFFER, codecData,
+                nullptr);
+        gst_buffer_unref(codecData);
+
+        GST_MINI_OBJECT_FLAG_SET(caps, GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+
+        return caps;
+    } ();
+
+    return caps;
+}
+
+GstMemory* SilentFrameMemory()
+{
+    static GstMemory* memory = [] () {
+        GstMemory* memory =
+            gst_memory_new_wrapped(
+                GST_MEMORY_FLAG_READONLY,
+                const_cast<guint8*>(SilentFrame),
+                sizeof(SilentFrame),
+                0,
+                sizeof(SilentFrame),
+                nullptr,
+                nullptr);
+
+        GST_MINI_OBJECT_FLAG_SET(memory, GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+
+        return memory;
+    } ();
+
+    return memory;
+}
+
+GstClockTime FramePts(const SilentAudio& silentAudio, guint64 frame)
+{
+    return silentAudio.firstFramePts +
+        gst_util_uint64_scale(frame * SamplesPerFrame, GST_SECOND, SampleRate);
+}
+
+void StartStream(SilentAudio* silentAudio)
+{
+    if(silentAudio->streamStarted)
+        return;
+
+    GstPad* srcPad = silentAudio->srcPadPtr.get();
+
+    GCharPtr streamIdPtr(gst_pad_create_stream_id(srcPad, nullptr, "silent-audio"));
+    gst_pad_push_event(srcPad, gst_event_new_stream_start(streamIdPtr.get()));
+    gst_pad_push_event(srcPad, gst_event_new_caps(SilentAudioCaps()));
+
+    silentAudio->streamStarted = true;
+}
+
+void PushSegment(SilentAudio* silentAudio, GstEvent* videoSegmentEvent)
+{
+    StartStream(silentAudio);
+
+    const GstSegment* videoSegment;
+    gst_event_parse_segment(videoSegmentEvent, &videoSegment);
+
+    // audio follows video segment to have the same running time
+    gst_pad_push_event(silentAudio->srcPadPtr.get(), gst_event_new_segment(videoSegment));
+
+    silentAudio->segmentSent = true;
+    silentAudio->firstFramePts = GST_CLOCK_TIME_NONE;
+    silentAudio->framesCount = 0;
+}
+
+void PushFramesUntil(SilentAudio* silentAudio, GstClockTime videoPts)
+{
+    if(!GST_CLOCK_TIME_IS_VALID(silentAudio->firstFramePts))
+        silentAudio->firstFramePts = videoPts;
+
+    GstMemory* frameMemory = SilentFrameMemory();
+    const GstClockTime frameDuration =
+        gst_util_uint64_scale(SamplesPerFrame, GST_SECOND, SampleRate);
+
+    for(GstClockTime pts = FramePts(*silentAudio, silentAudio->framesCount);
+        pts <= videoPts;
+        pts = FramePts(*silentAudio, silentAudio->framesCount))
+    {
+        GstBuffer* buffer = gst_buffer_new();
+        gst_buffer_append_memory(buffer, gst_memory_ref(frameMemory));
+        GST_BUFFER_PTS(buffer) = pts;
+        GST_BUFFER_DTS(buffer) = pts;
+        GST_BUFFER_DURATION(buffer) = frameDuration;
+        if(silentAudio->framesCount == 0)
+            GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+
+        ++silentAudio->framesCount;
+
+        // audio tee doesn't fail if there is nobody linked yet
+        gst_pad_push(silentAudio->srcPadPtr.get(), buffer);
+    }
+}
+
+// called from video streaming thread
+GstPadProbeReturn OnVideo(GstPad* pad, GstPadProbeInfo* info, gpointer userData)
+{
+    SilentAudio* silentAudio = static_cast<SilentAudio*>(userData);
+
+    if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent* event = GST_PAD_PROBE_INFO_EVENT(info);
+        switch(GST_EVENT_TYPE(event)) {
+            case GST_EVENT_SEGMENT:
+                PushSegment(silentAudio, event);
+                break;
+            case GST_EVENT_EOS:
+                if(silentAudio->streamStarted)
+                    gst_pad_push_event(silentAudio->srcPadPtr.get(), gst_event_new_eos());
+                break;
+            default:
+                break;
+        }
+
+        return GST_PAD_PROBE_OK;
+    }
+
+    // audio sink was relinked to replaced source
+    if(!gst_pad_is_linked(silentAudio->srcPadPtr.get()))
+        return GST_PAD_PROBE_REMOVE;
+
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    GstClockTime videoPts = GST_BUFFER_PTS(buffer);
+    if(!GST_CLOCK_TIME_IS_VALID(videoPts))
+        videoPts = GST_BUFFER_DTS(buffer);
+    if(!GST_CLOCK_TIME_IS_VALID(videoPts))
+        return GST_PAD_PROBE_OK;
+
+    if(!silentAudio->segmentSent) {
+        // segment passed video pad before probe was installed
+        GstEvent* segmentEvent = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+        if(!segmentEvent)
+            return GST_PAD_PROBE_OK;
+
+        PushSegment(silentAudio, segmentEvent);
+        gst_event_unref(segmentEvent);
+    }
+
+    PushFramesUntil(silentAudio, videoPts);
+
+    return GST_PAD_PROBE_OK;
+}
+
+}
+
+bool LinkSilentAudio(GstPad* videoPad, GstPad* audioSinkPad)
+{
+    GstPadPtr srcPadPtr(gst_pad_new("silent_audio_src", GST_PAD_SRC));
+    GstPad* srcPad = srcPadPtr.get();
+    gst_object_ref_sink(srcPad);
+
+    gst_pad_use_fixed_caps(srcPad);
+    gst_pad_set_active(srcPad, TRUE);
+
+    if(GST_PAD_LINK_OK != gst_pad_link(srcPad, audioSinkPad)) {
+        Log()->error("Failed to link silent audio");
+        gst_pad_set_active(srcPad, FALSE);
+        return false;
+    }
+
+    SilentAudio* silentAudio = new SilentAudio { std::move(srcPadPtr) };
+
+    gst_pad_add_probe(
+        videoPad,
+        GstPadProbeType(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        OnVideo,
+        silentAudio,
+        [] (gpointer userData) {
+            delete static_cast<SilentAudio*>(userData);
+        });
+
+    return true;
+}
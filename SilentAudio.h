@@ -0,0 +1,11 @@
+#pragma once
+
+#include <gst/gst.h>
+
+
+// Feeds pre-encoded AAC silence to audioSinkPad.
+// Silence frames are timestamped after buffers passing through videoPad,
+// so nothing is generated (and encoded) while there is no video.
+// All frames share the same read-only memory.
+// Stops as soon as audioSinkPad is unlinked from it.
+bool LinkSilentAudio(GstPad* videoPad, GstPad* audioSinkPad);
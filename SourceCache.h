@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <optional>
+
+
+// Remembers something about every source (like RTSP transport it was played over,
+// or video media type it had) from the last time it was played.
+// Sources are keyed by url without credentials, so they never get to the file.
+// Persisted to file (if specified) on every change. Thread safe.
+class SourceCache
+{
+public:
+    explicit SourceCache(const std::optional<std::string>& filePath);
+
+    std::optional<std::string> find(const std::string& sourceUrl) const;
+    void set(const std::string& sourceUrl, const std::string& value);
+    void remove(const std::string& sourceUrl);
+
+private:
+    void load();
+    void save() const;
+
+private:
+    const std::optional<std::string> _filePath;
+
+    mutable std::mutex _mutex;
+    std::map<std::string, std::string> _values; // sourceUrl without userinfo -> value
+};
@@ -0,0 +1,608 @@
+#include "SourceSwitcher.h"
+
+#include <atomic>
+
+#include "Log.h"
+#include "Stats.h"
+
+
+// shared by all sources replacing each other in the same pipeline.
+// without failover there is single source and nothing is switched,
+// so fields are touched by it's video streaming thread only and are not locked
+struct SourceSwitch
+{
+    std::mutex mutex;
+
+    std::shared_ptr<SourceStats> sourceStatsPtr;
+
+    bool failoverEnabled = false; // set before source is started
+
+    unsigned generation = 0;
+    bool awaitingKeyFrame = false;
+    bool trimAudioOverlap = false; // until the first audio of the next source passed
+    bool keyFramePassed = false; // by current source
+    gint64 switchStartTime = 0; // monotonic, microseconds
+    GstClockTimeDiff offset = 0; // applied to current source
+
+    std::atomic<gint64> keyFrameRequestTime = 0; // monotonic, microseconds, 0 - nothing requested
+
+    // natural GOP of current source, to tell requested keyframe from scheduled one
+    GstClockTime lastKeyFrameDts = GST_CLOCK_TIME_NONE; // with offset applied
+    bool lastKeyFrameRequested = false;
+    GstClockTime gopDuration = GST_CLOCK_TIME_NONE;
+
+    // replacements have to be compatible with targets built for the first source
+    std::optional<bool> videoH265;
+    std::optional<SourceSwitcher::AudioKind> audioKind;
+
+    // already passed to targets, with offset applied
+    GstClockTime lastVideoDts = GST_CLOCK_TIME_NONE;
+    GstClockTime videoFrameDuration;
+    GstClockTime lastAudioEnd = GST_CLOCK_TIME_NONE;
+};
+
+namespace {
+
+const auto Log = ReStreamerLog;
+
+enum {
+    // while backup source or slate is active.
+    // primary source not sent keyframe for that time is restarted
+    RETRY_PRIMARY_SOURCE_INTERVAL = 30, // seconds
+
+    // targets attached within that time are served by the same keyframe request
+    KEYFRAME_REQUEST_TIMEOUT = 1000, // milliseconds
+};
+
+// used until frame rate of the source is known
+const GstClockTime DefaultVideoFrameDuration = GST_SECOND / 25;
+
+struct SourcePadProbe
+{
+    std::shared_ptr<SourceSwitch> sourceSwitchPtr;
+    unsigned generation;
+    bool video;
+    bool failover;
+};
+
+// file paths are accepted as backup sources too
+std::string SourceUri(const std::string& location)
+{
+    if(gst_uri_is_valid(location.c_str()))
+        return location;
+
+    GCharPtr uriPtr(gst_filename_to_uri(location.c_str(), nullptr));
+    return uriPtr ? std::string(uriPtr.get()) : location;
+}
+
+GstClockTime ShiftTime(GstClockTime time, GstClockTimeDiff offset)
+{
+    if(!GST_CLOCK_TIME_IS_VALID(time))
+        return time;
+
+    const GstClockTimeDiff shifted = GstClockTimeDiff(time) + offset;
+    return shifted > 0 ? GstClockTime(shifted) : 0;
+}
+
+// keyframe following request is the answer to it only if it came
+// at least a frame earlier than the next natural GOP boundary.
+// parsers echo request downstream with the next keyframe, whatever it is,
+// so there is nothing else to rely on
+void OnKeyFrame(SourceSwitch* sourceSwitch, GstClockTime dts)
+{
+    const GstClockTime lastKeyFrameDts = sourceSwitch->lastKeyFrameDts;
+    const bool lastKeyFrameRequested = sourceSwitch->lastKeyFrameRequested;
+    const gint64 keyFrameRequestTime = sourceSwitch->keyFrameRequestTime.exchange(0);
+    const bool requested = keyFrameRequestTime != 0;
+    sourceSwitch->lastKeyFrameDts = dts;
+    sourceSwitch->lastKeyFrameRequested = requested;
+
+    const bool sinceLastKnown =
+        GST_CLOCK_TIME_IS_VALID(dts) && GST_CLOCK_TIME_IS_VALID(lastKeyFrameDts) && dts > lastKeyFrameDts;
+
+    if(!requested) {
+        // source could keep it's GOP schedule after requested keyframe
+        if(sinceLastKnown && !lastKeyFrameRequested)
+            sourceSwitch->gopDuration = dts - lastKeyFrameDts;
+        return;
+    }
+
+    const gint64 keyFrameTime = g_get_monotonic_time() - keyFrameRequestTime;
+
+    SourceStats* sourceStats = sourceSwitch->sourceStatsPtr.get();
+    sourceStats->keyFrameRequestTime = keyFrameTime;
+
+    if(!sinceLastKnown || !GST_CLOCK_TIME_IS_VALID(sourceSwitch->gopDuration)) {
+        Log()->info(
+            "Keyframe arrived {} ms after request, GOP of source is not known yet to tell if it was requested one",
+            keyFrameTime / 1000);
+        return;
+    }
+
+    const bool beforeGopBoundary =
+        dts - lastKeyFrameDts + sourceSwitch->videoFrameDuration <= sourceSwitch->gopDuration;
+    if(beforeGopBoundary) {
+        ++sourceStats->keyFrameRequestsHonoured;
+        Log()->info("Requested keyframe arrived in {} ms", keyFrameTime / 1000);
+    } else {
+        Log()->info(
+            "Keyframe arrived {} ms after request at natural GOP boundary, source ignores keyframe requests",
+            keyFrameTime / 1000);
+    }
+}
+
+// returns false if buffer should be dropped.
+// buffer is expected to be writable if offset is not zero
+bool RetimeSourceBuffer(SourceSwitch* sourceSwitch, bool video, GstBuffer* buffer)
+{
+    const bool keyFrame = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if(video && sourceSwitch->awaitingKeyFrame) {
+        const GstClockTime dts = GST_BUFFER_DTS_OR_PTS(buffer);
+        if(!keyFrame || !GST_CLOCK_TIME_IS_VALID(dts))
+            return false;
+
+        // continue right after the last frame of the previous source
+        const GstClockTime continuation = GST_CLOCK_TIME_IS_VALID(sourceSwitch->lastVideoDts) ?
+            sourceSwitch->lastVideoDts + sourceSwitch->videoFrameDuration : dts;
+        sourceSwitch->offset = GstClockTimeDiff(continuation) - GstClockTimeDiff(dts);
+        sourceSwitch->awaitingKeyFrame = false;
+
+        const gint64 failoverTime = g_get_monotonic_time() - sourceSwitch->switchStartTime;
+        sourceSwitch->sourceStatsPtr->failoverTime = failoverTime;
+        Log()->info("Source switched in {} ms", failoverTime / 1000);
+    } else if(sourceSwitch->awaitingKeyFrame) {
+        return false; // audio is started together with video
+    }
+
+    if(sourceSwitch->offset) {
+        GST_BUFFER_PTS(buffer) = ShiftTime(GST_BUFFER_PTS(buffer), sourceSwitch->offset);
+        GST_BUFFER_DTS(buffer) = ShiftTime(GST_BUFFER_DTS(buffer), sourceSwitch->offset);
+    }
+
+    if(video) {
+        sourceSwitch->keyFramePassed = sourceSwitch->keyFramePassed || keyFrame;
+
+        const GstClockTime dts = GST_BUFFER_DTS_OR_PTS(buffer);
+        if(keyFrame)
+            OnKeyFrame(sourceSwitch, dts);
+        if(!GST_CLOCK_TIME_IS_VALID(dts))
+            return true;
+
+        if(GST_BUFFER_DURATION_IS_VALID(buffer) && GST_BUFFER_DURATION(buffer) > 0) {
+            sourceSwitch->videoFrameDuration = GST_BUFFER_DURATION(buffer);
+        } else if(GST_CLOCK_TIME_IS_VALID(sourceSwitch->lastVideoDts) && dts > sourceSwitch->lastVideoDts) {
+            sourceSwitch->videoFrameDuration = dts - sourceSwitch->lastVideoDts;
+        }
+        sourceSwitch->lastVideoDts = dts;
+    } else {
+        const GstClockTime pts = GST_BUFFER_PTS(buffer);
+        if(!GST_CLOCK_TIME_IS_VALID(pts))
+            return true;
+
+        if(sourceSwitch->trimAudioOverlap) {
+            // overlapping with audio of the previous source
+            if(GST_CLOCK_TIME_IS_VALID(sourceSwitch->lastAudioEnd) && pts < sourceSwitch->lastAudioEnd)
+                return false;
+            sourceSwitch->trimAudioOverlap = false;
+        }
+
+        sourceSwitch->lastAudioEnd =
+            pts + (GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0);
+    }
+
+    return true;
+}
+
+// called from streaming thread
+void PostSourceEos(GstElement* sourceBin, guint generation)
+{
+    GstStructure* structure =
+        gst_structure_new(
+            "source-eos",
+            "generation", G_TYPE_UINT, generation,
+            nullptr);
+
+    gst_element_post_message(sourceBin, gst_message_new_application(GST_OBJECT(sourceBin), structure));
+}
+
+// called from streaming thread
+GstPadProbeReturn OnSourcePadData(
+    GstPad* pad,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    const SourcePadProbe* probe = static_cast<SourcePadProbe*>(userData);
+    SourceSwitch* sourceSwitch = probe->sourceSwitchPtr.get();
+
+    std::unique_lock<std::mutex> lock(sourceSwitch->mutex, std::defer_lock);
+    if(probe->failover)
+        lock.lock();
+
+    if(probe->generation != sourceSwitch->generation)
+        return GST_PAD_PROBE_DROP; // replaced already
+
+    const bool replacement = probe->generation > 0;
+
+    if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        switch(GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info))) {
+            case GST_EVENT_STREAM_START:
+            case GST_EVENT_SEGMENT:
+                // targets continue the stream started by the first source
+                return replacement ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+            case GST_EVENT_EOS:
+                if(!probe->failover)
+                    return GST_PAD_PROBE_OK;
+
+                // the next source will continue the stream
+                PostSourceEos(GST_ELEMENT(GST_PAD_PARENT(pad)), probe->generation);
+                return GST_PAD_PROBE_DROP;
+            default:
+                return GST_PAD_PROBE_OK;
+        }
+    }
+
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+        GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        if(replacement) {
+            buffer = gst_buffer_make_writable(buffer);
+            GST_PAD_PROBE_INFO_DATA(info) = buffer;
+        }
+
+        return RetimeSourceBuffer(sourceSwitch, probe->video, buffer) ?
+            GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+    }
+
+    if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList* list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        // buffers could be dropped only while sources are switched
+        if(probe->failover) {
+            list = gst_buffer_list_make_writable(list);
+            GST_PAD_PROBE_INFO_DATA(info) = list;
+        }
+
+        for(guint i = 0; i < gst_buffer_list_length(list);) {
+            GstBuffer* buffer = replacement ?
+                gst_buffer_list_get_writable(list, i) :
+                gst_buffer_list_get(list, i);
+            if(RetimeSourceBuffer(sourceSwitch, probe->video, buffer) || !probe->failover)
+                ++i;
+            else
+                gst_buffer_list_remove(list, i, 1);
+        }
+
+        return gst_buffer_list_length(list) > 0 ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+// called from streaming thread
+void PostStandbyMessage(GstElement* sourceBin, const char* name)
+{
+    gst_element_post_message(
+        sourceBin,
+        gst_message_new_application(GST_OBJECT(sourceBin), gst_structure_new_empty(name)));
+}
+
+// called from streaming thread.
+// audio of the new source starts together with video anyway
+GstPadProbeReturn DropStandbyAudio(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer /*userData*/)
+{
+    if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        return GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) == GST_EVENT_EOS ?
+            GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+    }
+
+    return GST_PAD_PROBE_DROP;
+}
+
+}
+
+SourceSwitcher::SourceSwitcher(
+    const std::string& primaryUrl,
+    const std::shared_ptr<SourceStats>& sourceStatsPtr,
+    const RetryPrimaryCallback& onRetryPrimary) :
+    _primaryUrl(primaryUrl), _onRetryPrimary(onRetryPrimary),
+    _switchPtr(std::make_shared<SourceSwitch>())
+{
+    _switchPtr->sourceStatsPtr = sourceStatsPtr;
+    _switchPtr->videoFrameDuration = DefaultVideoFrameDuration;
+}
+
+SourceSwitcher::~SourceSwitcher()
+{
+    if(_retryPrimaryTimerPtr)
+        g_source_destroy(_retryPrimaryTimerPtr.get());
+}
+
+void SourceSwitcher::setBackupSources(
+    const std::deque<std::string>& backupUrls,
+    const std::string& slateUrl) noexcept
+{
+    _backupUrls = backupUrls;
+    _slateUrl = slateUrl;
+
+    const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+    _switchPtr->failoverEnabled = !backupUrls.empty() || !slateUrl.empty();
+}
+
+bool SourceSwitcher::isSlate(unsigned sourceIndex) const noexcept
+{
+    return !_slateUrl.empty() && sourceIndex == 1 + _backupUrls.size();
+}
+
+std::string SourceSwitcher::sourceUri(unsigned sourceIndex) const noexcept
+{
+    if(sourceIndex == 0)
+        return _primaryUrl;
+
+    return isSlate(sourceIndex) ?
+        SourceUri(_slateUrl) :
+        SourceUri(_backupUrls[sourceIndex - 1]);
+}
+
+std::optional<unsigned> SourceSwitcher::nextSource() const noexcept
+{
+    if(_backupUrls.empty() && _slateUrl.empty())
+        return {};
+
+    const unsigned slateIndex = 1 + _backupUrls.size();
+
+    const unsigned nextSource = _activeSource + 1;
+    if(nextSource == slateIndex && _slateUrl.empty())
+        return {}; // all backups failed
+
+    if(nextSource > slateIndex) {
+        bool slatePlayed;
+        {
+            const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+            slatePlayed = _switchPtr->keyFramePassed;
+        }
+        if(!slatePlayed)
+            return {};
+
+        return slateIndex;
+    }
+
+    return nextSource;
+}
+
+// every next source starts from keyframe and continues timestamps of the previous one
+void SourceSwitcher::beginSwitch(unsigned sourceIndex) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+        _generation = ++_switchPtr->generation;
+        // switch-over time is counted from the first failure
+        if(!_switchPtr->awaitingKeyFrame)
+            _switchPtr->switchStartTime = g_get_monotonic_time();
+        _switchPtr->awaitingKeyFrame = true;
+        _switchPtr->trimAudioOverlap = true;
+        _switchPtr->keyFramePassed = false;
+        _switchPtr->keyFrameRequestTime = 0; // next source's keyframe is not the answer
+        _switchPtr->lastKeyFrameDts = GST_CLOCK_TIME_NONE;
+        _switchPtr->lastKeyFrameRequested = false;
+        _switchPtr->gopDuration = GST_CLOCK_TIME_NONE;
+    }
+
+    _activeSource = sourceIndex;
+    _switchPtr->sourceStatsPtr->activeSource = sourceIndex;
+
+    if(sourceIndex == 0) {
+        if(_retryPrimaryTimerPtr) {
+            g_source_destroy(_retryPrimaryTimerPtr.get());
+            _retryPrimaryTimerPtr.reset();
+        }
+    } else if(!_retryPrimaryTimerPtr) {
+        auto onRetryPrimaryTimeout =
+            + [] (gpointer userData) -> gboolean
+        {
+            SourceSwitcher* self = static_cast<SourceSwitcher*>(userData);
+            self->_onRetryPrimary();
+            return G_SOURCE_CONTINUE;
+        };
+        _retryPrimaryTimerPtr.reset(g_timeout_source_new_seconds(RETRY_PRIMARY_SOURCE_INTERVAL));
+        g_source_set_callback(_retryPrimaryTimerPtr.get(), onRetryPrimaryTimeout, this, nullptr);
+        g_source_attach(_retryPrimaryTimerPtr.get(), g_main_context_get_thread_default());
+    }
+}
+
+bool SourceSwitcher::requestKeyFrame() noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+
+        const gint64 now = g_get_monotonic_time();
+        const gint64 requestTime = _switchPtr->keyFrameRequestTime;
+        // several targets attached at once are served by the same keyframe
+        if(requestTime && now - requestTime < KEYFRAME_REQUEST_TIMEOUT * 1000)
+            return false;
+
+        _switchPtr->keyFrameRequestTime = now;
+    }
+
+    ++_switchPtr->sourceStatsPtr->keyFrameRequests;
+
+    return true;
+}
+
+std::optional<bool> SourceSwitcher::videoH265() const noexcept
+{
+    const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+    return _switchPtr->videoH265;
+}
+
+void SourceSwitcher::addPadProbe(GstPad* pad, bool video) noexcept
+{
+    unsigned generation;
+    bool failover;
+    {
+        const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+        generation = _switchPtr->generation;
+        failover = _switchPtr->failoverEnabled;
+    }
+
+    // single source audio goes to targets as is
+    if(!video && !failover)
+        return;
+
+    gst_pad_add_probe(
+        pad,
+        GstPadProbeType(
+            GST_PAD_PROBE_TYPE_BUFFER |
+            GST_PAD_PROBE_TYPE_BUFFER_LIST |
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+        OnSourcePadData,
+        new SourcePadProbe { _switchPtr, generation, video, failover },
+        [] (gpointer userData) {
+            delete static_cast<SourcePadProbe*>(userData);
+        });
+}
+
+bool SourceSwitcher::acceptVideo(bool h265) noexcept
+{
+    const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+
+    if(!_switchPtr->videoH265)
+        _switchPtr->videoH265 = h265;
+
+    return *_switchPtr->videoH265 == h265;
+}
+
+bool SourceSwitcher::acceptAudio(AudioKind audioKind) noexcept
+{
+    const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+
+    if(!_switchPtr->audioKind)
+        _switchPtr->audioKind = audioKind;
+
+    return *_switchPtr->audioKind == audioKind;
+}
+
+void SourceSwitcher::postSourceEos(GstElement* sourceBin) noexcept
+{
+    unsigned generation;
+    {
+        const std::lock_guard<std::mutex> lock(_switchPtr->mutex);
+        generation = _switchPtr->generation;
+    }
+
+    PostSourceEos(sourceBin, generation);
+}
+
+void StandbySource::holdVideo(GstPad* pad) noexcept
+{
+    const gulong probeId =
+        gst_pad_add_probe(
+            pad,
+            GstPadProbeType(
+                GST_PAD_PROBE_TYPE_BLOCK |
+                GST_PAD_PROBE_TYPE_BUFFER |
+                GST_PAD_PROBE_TYPE_BUFFER_LIST |
+                GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+            onVideo,
+            this,
+            nullptr);
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _pads.videoPadPtr.reset(GST_PAD(gst_object_ref(pad)));
+    _pads.videoHoldProbeId = probeId;
+}
+
+void StandbySource::holdAudio(GstPad* pad) noexcept
+{
+    const gulong probeId =
+        gst_pad_add_probe(
+            pad,
+            GstPadProbeType(
+                GST_PAD_PROBE_TYPE_BUFFER |
+                GST_PAD_PROBE_TYPE_BUFFER_LIST |
+                GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+            DropStandbyAudio,
+            nullptr,
+            nullptr);
+
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _pads.audioPadPtr.reset(GST_PAD(gst_object_ref(pad)));
+    _pads.audioDropProbeId = probeId;
+}
+
+void StandbySource::setAudioCompressed(bool compressed) noexcept
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _pads.audioCompressed = compressed;
+}
+
+void StandbySource::setPadsComplete(bool silenceNeeded) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        _pads.silenceNeeded = silenceNeeded;
+        _padsComplete = true;
+    }
+
+    postReadyIfComplete();
+}
+
+void StandbySource::fail() noexcept
+{
+    PostStandbyMessage(_sourceBin, "standby-failed");
+}
+
+StandbySource::Pads StandbySource::takePads() noexcept
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    return std::move(_pads);
+}
+
+// called from streaming thread.
+// drops video until keyframe, then blocks on it until source is promoted
+GstPadProbeReturn StandbySource::onVideo(
+    GstPad*,
+    GstPadProbeInfo* info,
+    gpointer userData)
+{
+    StandbySource* self = static_cast<StandbySource*>(userData);
+
+    if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        if(GST_EVENT_TYPE(GST_PAD_PROBE_INFO_EVENT(info)) != GST_EVENT_EOS)
+            return GST_PAD_PROBE_PASS;
+
+        self->fail();
+        return GST_PAD_PROBE_DROP;
+    }
+
+    GstBuffer* buffer = (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) ?
+        gst_buffer_list_get(GST_PAD_PROBE_INFO_BUFFER_LIST(info), 0) :
+        GST_PAD_PROBE_INFO_BUFFER(info);
+    if(!buffer || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_DROP;
+
+    {
+        const std::lock_guard<std::mutex> lock(self->_mutex);
+        self->_keyFrameHeld = true;
+    }
+    self->postReadyIfComplete();
+
+    return GST_PAD_PROBE_OK;
+}
+
+// called from streaming thread.
+// standby source could replace active one only when all it's pads are known
+// and it's first keyframe is at hand
+void StandbySource::postReadyIfComplete() noexcept
+{
+    bool ready;
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        ready = _keyFrameHeld && _padsComplete && !_readyPosted;
+        _readyPosted = _readyPosted || ready;
+    }
+
+    if(ready)
+        PostStandbyMessage(_sourceBin, "standby-ready");
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <functional>
+
+#include <gst/gst.h>
+
+#include <CxxPtr/GstPtr.h>
+#include <CxxPtr/GlibPtr.h>
+
+
+struct SourceStats;
+struct SourceSwitch;
+
+// Fails source of single pipeline over to backup sources and slate.
+// Every next source starts from keyframe and it's timestamps are shifted
+// to continue the previous one, so targets see single continuous stream.
+// While backup or slate is active, primary source is periodically retried
+// next to it (see StandbySource).
+// Source bins are built, linked and removed by owner,
+// their pads pass probes added with addPadProbe.
+// Without backup sources and slate only video is probed,
+// to tell requested keyframes from scheduled ones, and nothing is locked.
+class SourceSwitcher
+{
+public:
+    enum class AudioKind {
+        Raw,
+        Aac,
+        G711,
+    };
+
+    // called from main thread while backup source or slate is active
+    typedef std::function<void ()> RetryPrimaryCallback;
+
+    SourceSwitcher(
+        const std::string& primaryUrl,
+        const std::shared_ptr<SourceStats>&,
+        const RetryPrimaryCallback&);
+    SourceSwitcher(const SourceSwitcher&) = delete;
+    SourceSwitcher& operator = (const SourceSwitcher&) = delete;
+    ~SourceSwitcher();
+
+    // should be called before the first source is started.
+    // urls are either URIs or file paths
+    void setBackupSources(
+        const std::deque<std::string>& backupUrls,
+        const std::string& slateUrl) noexcept;
+
+    // accessed from main thread
+    unsigned activeSource() const noexcept { return _activeSource; } // 0 - primary, then backups, then slate
+    unsigned generation() const noexcept { return _generation; } // incremented on every switch
+    bool isSlate(unsigned sourceIndex) const noexcept;
+    std::string sourceUri(unsigned sourceIndex) const noexcept;
+    // source failed active one should be replaced with, if any.
+    // slate is restarted only if it played already
+    std::optional<unsigned> nextSource() const noexcept;
+    // has to be called right before the next source is started
+    void beginSwitch(unsigned sourceIndex) noexcept;
+    // returns false if source is asked already and is not late to answer yet
+    bool requestKeyFrame() noexcept;
+    std::optional<bool> videoH265() const noexcept;
+
+    // could be called from streaming threads
+    void addPadProbe(GstPad*, bool video) noexcept;
+    // replacement source is accepted only if targets could consume it as is
+    bool acceptVideo(bool h265) noexcept;
+    bool acceptAudio(AudioKind) noexcept;
+    // posts "source-eos" application message with "generation" field from sourceBin.
+    // active source should be replaced when it's handled
+    void postSourceEos(GstElement* sourceBin) noexcept;
+
+private:
+    const std::string _primaryUrl;
+    const RetryPrimaryCallback _onRetryPrimary;
+
+    std::deque<std::string> _backupUrls;
+    std::string _slateUrl;
+
+    unsigned _activeSource = 0;
+    unsigned _generation = 0;
+    std::shared_ptr<SourceSwitch> _switchPtr; // shared with pad probes
+    GSourcePtr _retryPrimaryTimerPtr;
+};
+
+// Primary source started next to active backup source (or slate),
+// inside own source bin. It's pads are held until it replaces active source:
+// video is dropped up to the first keyframe and then blocked on it, audio is dropped.
+// "standby-ready" application message is posted from source bin
+// as soon as all pads are known and keyframe is at hand,
+// "standby-failed" if source can't replace active one.
+class StandbySource
+{
+public:
+    struct Pads {
+        GstPadPtr videoPadPtr;
+        gulong videoHoldProbeId = 0;
+        GstPadPtr audioPadPtr; // not set if source has no audio
+        gulong audioDropProbeId = 0;
+        bool audioCompressed = false;
+        bool silenceNeeded = false; // there is no audio in source
+    };
+
+    explicit StandbySource(GstElement* sourceBin) : _sourceBin(sourceBin) {}
+    StandbySource(const StandbySource&) = delete;
+    StandbySource& operator = (const StandbySource&) = delete;
+
+    // called from streaming threads
+    void holdVideo(GstPad*) noexcept;
+    void holdAudio(GstPad*) noexcept;
+    void setAudioCompressed(bool) noexcept;
+    void setPadsComplete(bool silenceNeeded) noexcept;
+    void fail() noexcept;
+
+    // called from main thread on "standby-ready".
+    // probes holding pads should be removed as soon as pads are linked
+    Pads takePads() noexcept;
+
+private:
+    static GstPadProbeReturn onVideo(GstPad*, GstPadProbeInfo*, gpointer userData);
+    void postReadyIfComplete() noexcept;
+
+private:
+    GstElement *const _sourceBin;
+
+    std::mutex _mutex; // guards fields below
+    Pads _pads;
+    bool _keyFrameHeld = false;
+    bool _padsComplete = false;
+    bool _readyPosted = false;
+};
@@ -0,0 +1,25 @@
+#include "Stats.h"
+
+
+void StatsRegistry::set(const std::string& id, const std::shared_ptr<const TargetStats>& stats)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _stats[id] = stats;
+}
+
+void StatsRegistry::remove(const std::string& id)
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+    _stats.erase(id);
+}
+
+std::shared_ptr<const TargetStats> StatsRegistry::find(const std::string& id) const
+{
+    const std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _stats.find(id);
+    if(it == _stats.end())
+        return nullptr;
+
+    return it->second;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+#include <glib.h>
+
+
+// Counters are updated from streaming threads without locking
+// and could be read from any thread.
+
+struct SourceStats
+{
+    // from RTCP of RTSP source, updated periodically
+    std::atomic<guint64> packetsLost = 0; // total, across source switches
+    std::atomic<guint64> jitter = 0; // microseconds, max of all streams
+
+    // failover to backup sources and slate
+    std::atomic<unsigned> activeSource = 0; // 0 - primary, then backups, then slate
+    std::atomic<guint64> failovers = 0;
+    std::atomic<guint64> failoverTime = 0; // microseconds, from failure to the first keyframe of the next source
+
+    // keyframes requested from source when targets start
+    std::atomic<guint64> keyFrameRequests = 0;
+    std::atomic<guint64> keyFrameRequestsHonoured = 0; // answered with keyframe before natural GOP boundary
+    std::atomic<guint64> keyFrameRequestTime = 0; // microseconds, from the last request to the next keyframe
+};
+
+struct TargetStats
+{
+    std::shared_ptr<const SourceStats> sourceStats;
+
+    std::atomic<gint64> startTime = 0; // monotonic, microseconds
+
+    // into muxer
+    std::atomic<guint64> videoBuffers = 0;
+    std::atomic<guint64> videoBytes = 0;
+    std::atomic<guint64> keyFrames = 0;
+    std::atomic<guint64> keyFrameInterval = 0; // nanoseconds
+    guint64 lastKeyFramePts = G_MAXUINT64; // accessed from video streaming thread only
+    std::atomic<guint64> audioBuffers = 0;
+    std::atomic<guint64> audioBytes = 0;
+
+    // out of sink
+    std::atomic<guint64> outBytes = 0;
+    std::atomic<guint64> ackedBytes = 0; // confirmed by RTMP server
+    std::atomic<guint64> connectTime = 0; // microseconds
+    std::atomic<guint64> handshakeTime = 0; // microseconds
+
+    // how much running time of data leaving sink is behind pipeline clock,
+    // i.e. what source jitterbuffer, muxer and queues add
+    std::atomic<guint64> latency = 0; // microseconds
+    gint64 lastLatencyTime = 0; // monotonic, accessed from output streaming thread only
+
+    std::atomic<guint64> droppedBuffers = 0;
+    std::atomic<guint64> congestionDroppedFrames = 0; // because of slow uplink
+
+    // calculated periodically from counters above
+    std::atomic<guint64> videoBitrate = 0; // bits per second
+    std::atomic<double> videoFps = 0;
+    std::atomic<guint64> audioBitrate = 0; // bits per second
+    std::atomic<guint64> outBitrate = 0; // bits per second
+    std::atomic<guint64> ackedBitrate = 0; // bits per second
+};
+
+// thread safe
+class StatsRegistry
+{
+public:
+    void set(const std::string& id, const std::shared_ptr<const TargetStats>&);
+    void remove(const std::string& id);
+
+    std::shared_ptr<const TargetStats> find(const std::string& id) const;
+
+    // callback is called with internal lock held,
+    // it doesn't block streaming threads since they never take it
+    template<typename Callback>
+    void forEach(const Callback& callback) const
+    {
+        const std::lock_guard<std::mutex> lock(_mutex);
+        for(const auto& pair: _stats)
+            callback(pair.first, *pair.second);
+    }
+
+private:
+    mutable std::mutex _mutex;
+    std::map<std::string, std::shared_ptr<const TargetStats>> _stats;
+};
@@ -1,8 +1,12 @@
 #include "StreamerMain.h"
 
 #include <string>
+#include <cstring>
 #include <deque>
+#include <algorithm>
 #include <optional>
+#include <vector>
+#include <thread>
 
 #include <gst/gst.h>
 
@@ -17,11 +21,18 @@
 #include "WebRTSP/RtStreaming/GstRtStreaming/GstReStreamer2.h"
 #endif
 
+#include "CxxPtr/GstPtr.h"
+
 #include "Log.h"
 #include "Defines.h"
 #include "Types.h"
 #include "Config.h"
 #include "ReStreamer.h"
+#include "ReconnectScheduler.h"
+#include "Stats.h"
+#include "RtmpPublisher.h"
+#include "HlsStream.h"
+#include "SourceCache.h"
 
 #if ENABLE_SSDP
 #include "SSDP.h"
@@ -29,6 +40,8 @@
 
 #if ENABLE_BROWSER_UI
 #include "RestApi.h"
+#include "HlsServer.h"
+#include "IngestSrc.h"
 #endif
 
 
@@ -40,24 +53,79 @@ enum {
 
 const auto Log = ReStreamerLog;
 
-typedef std::map<std::string, ReStreamer> RTMPReStreamers;
+// HLS output is one more target of the same source
+const char *const HlsTargetSuffix = "#hls";
+
+std::string HlsTargetId(const std::string& reStreamerId)
+{
+    return reStreamerId + HlsTargetSuffix;
+}
+
+std::string ReStreamerId(const std::string& targetId)
+{
+    if(g_str_has_suffix(targetId.c_str(), HlsTargetSuffix))
+        return targetId.substr(0, targetId.size() - strlen(HlsTargetSuffix));
+
+    return targetId;
+}
+
+typedef std::map<std::string, ReStreamer> RTMPReStreamers; // sourceUrl -> ReStreamer
 #if ENABLE_BROWSER_UI
 typedef std::map<std::string, std::unique_ptr<GstStreamingSource>> ReStreamers;
 #endif
+// state of one worker main loop. every worker has own copy of config,
+// but handles only reStreamers with source assigned to it
 struct Context {
     Config config;
     NotificationCallback messageCallback;
+    unsigned workerIndex;
+    unsigned workersCount;
+    ReconnectScheduler* reconnectScheduler;
+    StatsRegistry* statsRegistry; // shared by all workers
+    HlsRegistry* hlsRegistry; // shared by all workers
+    SourceCache* rtspTransportCache; // shared by all workers
+    SourceCache* sourceCapsCache; // shared by all workers
+
+    RTMPReStreamers rtmpReStreamers;
+    std::map<std::string, std::string> rtmpTargets; // reStreamerId -> sourceUrl
+    // sources are kept running (with their GOP cache) until failed targets are restarted
+    std::map<std::string, std::string> restartingTargets; // reStreamerId -> sourceUrl
+    // EOS is handled deferred, so source or target could be recreated meanwhile.
+    // every instance gets own number to ignore EOS of the previous one
+    unsigned instancesCount = 0;
+    std::map<std::string, unsigned> sourceInstances; // sourceUrl -> instance
+    std::map<std::string, unsigned> targetInstances; // reStreamerId -> instance
 #if ENABLE_BROWSER_UI
-    ReStreamers reStreamers;
+    std::map<std::string, std::deque<GstPadPtr>> previewSubscribers; // sourceUrl -> video sink pads
+    std::map<std::string, GSourcePtr> restartingSources; // sourceUrl -> timer GSource*
 #endif
-    RTMPReStreamers rtmpReStreamers;
-    std::map<std::string, GSourcePtr> restarting; // reStreamerId -> timer GSource*
 };
 thread_local Context* streamContext = nullptr;
 
+// additional main loops, the first worker is running on StreamerMain() thread itself
+struct Worker {
+    GMainContext* mainContext;
+    std::unique_ptr<ReconnectScheduler> reconnectScheduler;
+    std::thread thread;
+};
+typedef std::deque<Worker> Workers;
+
 thread_local GMainContext* mainContext = nullptr;
 thread_local std::thread streamThread;
 thread_local GMainLoop* streamLoop = nullptr;
+thread_local Workers* workers = nullptr; // available on StreamerMain() thread only
+
+// the same source should be handled by the same worker
+// to share it between all reStreamers using it
+unsigned WorkerIndex(const std::string& sourceUrl, unsigned workersCount)
+{
+    return g_str_hash(sourceUrl.c_str()) % workersCount;
+}
+
+bool OwnsSource(const Context* context, const std::string& sourceUrl)
+{
+    return WorkerIndex(sourceUrl, context->workersCount) == context->workerIndex;
+}
 
 void AddIdle(
     GSourceFunc function,
@@ -91,35 +159,310 @@ GSource* addSecondsTimeout(
     return source;
 }
 
-void StopReStream(Context* context, const std::string& reStreamerId)
+void ReleaseSourceIfUnused(Context* context, RTMPReStreamers::iterator it)
+{
+    if(it->second.hasTargets() || it->second.hasSubscribers())
+        return;
+
+    for(const auto& pair: context->restartingTargets) {
+        if(pair.second == it->first)
+            return;
+    }
+
+    Log()->info("Stopping unused source \"{}\"...", it->first);
+    context->sourceInstances.erase(it->first);
+    context->rtmpReStreamers.erase(it);
+}
+
+void ReleaseSourceIfUnused(Context* context, const std::string& sourceUrl)
+{
+    const auto it = context->rtmpReStreamers.find(sourceUrl);
+    if(it != context->rtmpReStreamers.end())
+        ReleaseSourceIfUnused(context, it);
+}
+
+// keepSource is used to let restarted target to reuse still running source
+void StopReStream(Context* context, const std::string& reStreamerId, bool keepSource = false)
 {
-    auto restartingIt = context->restarting.find(reStreamerId);
-    if(restartingIt != context->restarting.end()) {
+    if(context->reconnectScheduler->cancel(reStreamerId))
         Log()->info("Cancelling pending reStreaming restart for \"{}\"...", reStreamerId);
-        g_source_destroy(restartingIt->second.get());
-        context->restarting.erase(restartingIt);
+
+    const auto restartingIt = context->restartingTargets.find(reStreamerId);
+    if(restartingIt != context->restartingTargets.end()) {
+        const std::string sourceUrl = restartingIt->second;
+        context->restartingTargets.erase(restartingIt);
+        ReleaseSourceIfUnused(context, sourceUrl);
     }
 
+    const auto targetIt = context->rtmpTargets.find(reStreamerId);
+    if(targetIt == context->rtmpTargets.end())
+        return;
+
+    const std::string sourceUrl = targetIt->second;
+    context->rtmpTargets.erase(targetIt);
+    context->targetInstances.erase(reStreamerId);
+    context->statsRegistry->remove(reStreamerId);
+
     RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
-    const auto& it = reStreamers->find(reStreamerId);
+    const auto& it = reStreamers->find(sourceUrl);
     if(it != reStreamers->end()) {
-        Log()->info("Stopping active reStreaming \"{}\" (\"{}\")...", it->second.sourceUrl(), reStreamerId);
-        reStreamers->erase(it);
+        Log()->info("Stopping active reStreaming \"{}\" (\"{}\")...", sourceUrl, reStreamerId);
+        it->second.removeTarget(reStreamerId);
+        it->second.removeTarget(HlsTargetId(reStreamerId));
+        if(keepSource)
+            context->restartingTargets.emplace(reStreamerId, sourceUrl);
+        else
+            ReleaseSourceIfUnused(context, it);
     }
 }
 
-void ScheduleStartReStream(Context* context, const std::string& reStreamerId);
+void ScheduleStartReStream(
+    Context* context,
+    const std::string& reStreamerId,
+    ReStreamer::EosReason,
+    bool keepSource);
+#if ENABLE_BROWSER_UI
+void ScheduleStartSource(Context* context, const std::string& sourceUrl);
+#endif
 
-void StartReStream(
+void NotifyEos(
+    Context* context,
+    const std::string& reStreamerId,
+    ReStreamer::EosReason reason)
+{
+    if(!context->messageCallback)
+        return;
+
+    NotificationType type = NotificationType::OtherError;
+    switch(reason) {
+        case ReStreamer::EosReason::Disconnect:
+            type = NotificationType::Eos;
+            break;
+        case ReStreamer::EosReason::RtspSourceError:
+            type = NotificationType::SourceError;
+            break;
+        case ReStreamer::EosReason::RtmpTargetError:
+            type = NotificationType::TargetError;
+            break;
+        case ReStreamer::EosReason::Stall:
+            type = NotificationType::SourceError;
+            break;
+        case ReStreamer::EosReason::OtherError:
+            type = NotificationType::OtherError;
+            break;
+    }
+
+    context->messageCallback(reStreamerId, type);
+}
+
+bool IsSourceInstance(
+    const Context* context,
+    const std::string& sourceUrl,
+    unsigned instance)
+{
+    const auto it = context->sourceInstances.find(sourceUrl);
+    return it != context->sourceInstances.end() && it->second == instance;
+}
+
+bool IsTargetInstance(
+    const Context* context,
+    const std::string& reStreamerId,
+    unsigned instance)
+{
+    const auto it = context->targetInstances.find(reStreamerId);
+    return it != context->targetInstances.end() && it->second == instance;
+}
+
+void OnSourceEos(
+    Context* context,
+    const std::string& sourceUrl,
+    unsigned sourceInstance,
+    ReStreamer::EosReason reason)
+{
+    RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
+
+    const auto it = reStreamers->find(sourceUrl);
+    if(it == reStreamers->end() || !IsSourceInstance(context, sourceUrl, sourceInstance))
+        return; // already stopped by another EOS or error (and maybe started again)
+
+    // failed source can't be reused by targets waiting for restart
+    for(auto restartingIt = context->restartingTargets.begin();
+        restartingIt != context->restartingTargets.end();)
+    {
+        if(restartingIt->second == sourceUrl)
+            restartingIt = context->restartingTargets.erase(restartingIt);
+        else
+            ++restartingIt;
+    }
+
+    // all targets are restarted independently,
+    // source will be destroyed when the last of them is stopped
+    const std::deque<std::string> targetIds = it->second.targetIds();
+    for(const std::string& targetId: targetIds) {
+        if(ReStreamerId(targetId) != targetId)
+            continue; // the same reStreamer is restarted with it's main target
+
+        const std::string& reStreamerId = targetId;
+        NotifyEos(context, reStreamerId, reason);
+        ScheduleStartReStream(context, reStreamerId, reason, false);
+    }
+
+    // only preview subscribers are left
+    const auto sourceIt = reStreamers->find(sourceUrl);
+    if(sourceIt != reStreamers->end()) {
+        context->sourceInstances.erase(sourceUrl);
+        reStreamers->erase(sourceIt);
+#if ENABLE_BROWSER_UI
+        ScheduleStartSource(context, sourceUrl);
+#endif
+    }
+}
+
+void OnTargetEos(
+    Context* context,
+    const std::string& targetId,
+    unsigned targetInstance,
+    ReStreamer::EosReason reason)
+{
+    const std::string reStreamerId = ReStreamerId(targetId);
+
+    if(!IsTargetInstance(context, reStreamerId, targetInstance))
+        return; // stopped already (and maybe started again)
+
+    NotifyEos(context, reStreamerId, reason);
+    // source is fine, so restarted target will continue from it's cached GOP
+    ScheduleStartReStream(context, reStreamerId, reason, true);
+}
+
+// restart attempts of all reStreamers sharing source are finished
+void OnSourceReady(
+    Context* context,
+    const std::string& sourceUrl)
+{
+    const auto it = context->rtmpReStreamers.find(sourceUrl);
+    if(it == context->rtmpReStreamers.end())
+        return;
+
+    for(const std::string& targetId: it->second.targetIds()) {
+        if(ReStreamerId(targetId) == targetId)
+            context->reconnectScheduler->started(targetId);
+    }
+}
+
+// ReStreamer reports EOS from inside it's own bus watch,
+// so it can't be destroyed (or have targets removed) right away
+void ScheduleOnSourceEos(
+    Context* context,
+    const std::string& sourceUrl,
+    unsigned sourceInstance,
+    ReStreamer::EosReason reason)
+{
+    typedef std::tuple<
+        Context*,
+        std::string,
+        unsigned,
+        ReStreamer::EosReason> Data;
+
+    AddIdle(
+        [] (gpointer userData) -> gboolean {
+            const auto& [context, sourceUrl, sourceInstance, reason] = *static_cast<Data*>(userData);
+            OnSourceEos(context, sourceUrl, sourceInstance, reason);
+            return G_SOURCE_REMOVE;
+        },
+        new Data(context, sourceUrl, sourceInstance, reason),
+        [] (gpointer userData) {
+            delete static_cast<Data*>(userData);
+        });
+}
+
+void ScheduleOnTargetEos(
+    Context* context,
+    const std::string& targetId,
+    ReStreamer::EosReason reason)
+{
+    // EOS belongs to target instance active at the moment
+    const auto instanceIt = context->targetInstances.find(ReStreamerId(targetId));
+    if(instanceIt == context->targetInstances.end())
+        return; // stopped already
+
+    typedef std::tuple<
+        Context*,
+        std::string,
+        unsigned,
+        ReStreamer::EosReason> Data;
+
+    AddIdle(
+        [] (gpointer userData) -> gboolean {
+            const auto& [context, targetId, targetInstance, reason] = *static_cast<Data*>(userData);
+            OnTargetEos(context, targetId, targetInstance, reason);
+            return G_SOURCE_REMOVE;
+        },
+        new Data(context, targetId, instanceIt->second, reason),
+        [] (gpointer userData) {
+            delete static_cast<Data*>(userData);
+        });
+}
+
+// doesn't start newly created source, to allow attach targets to it first
+std::pair<RTMPReStreamers::iterator, bool> AcquireSource(
+    Context* context,
+    const std::string& sourceUrl)
+{
+    RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
+
+    auto it = reStreamers->find(sourceUrl);
+    if(it != reStreamers->end())
+        return { it, false };
+
+    const unsigned sourceInstance = ++context->instancesCount;
+    context->sourceInstances[sourceUrl] = sourceInstance;
+
+    // handling is deferred since ReStreamer instance
+    // will be destroyed inside OnSourceEos
+    // and as consequence callbacks with all captures
+    // will be destroyed too
+    it = reStreamers->emplace(
+        std::piecewise_construct,
+        std::forward_as_tuple(sourceUrl),
+        std::forward_as_tuple(
+            sourceUrl,
+            [context, sourceUrl, sourceInstance] (ReStreamer::EosReason reason) {
+                ScheduleOnSourceEos(context, sourceUrl, sourceInstance, reason);
+            },
+            [context] (const std::string& targetId, ReStreamer::EosReason reason) {
+                ScheduleOnTargetEos(context, targetId, reason);
+            },
+            [context, sourceUrl] () {
+                OnSourceReady(context, sourceUrl);
+            }
+        )).first;
+
+#if ENABLE_BROWSER_UI
+    auto restartingIt = context->restartingSources.find(sourceUrl);
+    if(restartingIt != context->restartingSources.end()) {
+        g_source_destroy(restartingIt->second.get());
+        context->restartingSources.erase(restartingIt);
+    }
+
+    const auto subscribersIt = context->previewSubscribers.find(sourceUrl);
+    if(subscribersIt != context->previewSubscribers.end()) {
+        for(const GstPadPtr& videoSinkPadPtr: subscribersIt->second)
+            it->second.addSubscriber(videoSinkPadPtr.get());
+    }
+#endif
+
+    return { it, true };
+}
+
+void AddReStreamTarget(
     Context* context,
     const std::string& reStreamerId)
 {
     assert(context == ::streamContext);
 
     const Config& config = context->config;
-    RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
 
-    assert(reStreamers->find(reStreamerId) == reStreamers->end());
+    assert(context->rtmpTargets.find(reStreamerId) == context->rtmpTargets.end());
     StopReStream(context, reStreamerId);
 
     const auto configIt = config.reStreamers.find(reStreamerId);
@@ -130,112 +473,257 @@ void StartReStream(
 
     const Config::ReStreamer& reStreamerConfig = configIt->second;
 
-    const auto reStreamerIt = reStreamers->find(reStreamerId);
+    if(!OwnsSource(context, reStreamerConfig.sourceUrl))
+        return; // other worker will take care of it
 
     if(reStreamerConfig.enabled) {
-        if(reStreamerIt == reStreamers->end()) {
-            Log()->info("ReStreaming \"{}\" (\"{}\")", reStreamerConfig.sourceUrl, reStreamerId);
-        } else {
-            Log()->warn(
-                "Ignoring reStreaming request for already reStreaming source \"{}\" (\"{}\")...",
-                reStreamerConfig.sourceUrl,
-                reStreamerId);
-        }
+        Log()->info("ReStreaming \"{}\" (\"{}\")", reStreamerConfig.sourceUrl, reStreamerId);
     } else {
         Log()->debug(
             "Ignoring reStreaming request for disabled source \"{}\" (\"{}\")...",
             reStreamerConfig.sourceUrl,
             reStreamerId);
-        assert(reStreamerIt == reStreamers->end());
         return;
     }
 
-    auto [it, inserted] = reStreamers->emplace(
-        std::piecewise_construct,
-        std::forward_as_tuple(reStreamerId),
-        std::forward_as_tuple(
-            reStreamerConfig.sourceUrl,
-            reStreamerConfig.targetUrl,
-            [context, reStreamerId] (ReStreamer::EosReason reason) {
-                if(context->messageCallback) {
-                    NotificationType type = NotificationType::OtherError;
-                    switch(reason) {
-                        case ReStreamer::EosReason::Disconnect:
-                            type = NotificationType::Eos;
-                            break;
-                        case ReStreamer::EosReason::RtspSourceError:
-                            type = NotificationType::SourceError;
-                            break;
-                        case ReStreamer::EosReason::RtmpTargetError:
-                            type = NotificationType::TargetError;
-                            break;
-                        case ReStreamer::EosReason::OtherError:
-                            type = NotificationType::OtherError;
-                            break;
-                    }
-
-                    context->messageCallback(reStreamerId, type);
-                }
-                // it's required to do reStreamerId copy
-                // since ReStreamer instance
-                // will be destroyed inside ScheduleStartReStream
-                // and as consequence current lambda with all captures
-                // will be destroyed too
-                ScheduleStartReStream(context, std::string(reStreamerId));
-            }
-        ));
-    assert(inserted);
+    const std::string& sourceUrl = reStreamerConfig.sourceUrl;
+
+    auto [it, newSource] = AcquireSource(context, sourceUrl);
+    if(!newSource)
+        Log()->info("Sharing already active source \"{}\" with \"{}\"", sourceUrl, reStreamerId);
+
+    context->rtmpTargets.emplace(reStreamerId, sourceUrl);
+    context->targetInstances[reStreamerId] = ++context->instancesCount;
+    it->second.addTarget(
+        reStreamerId,
+        reStreamerConfig.targetUrl,
+        ReStreamer::AudioEncoding {
+            reStreamerConfig.audioBitrate,
+            reStreamerConfig.audioSampleRate,
+            reStreamerConfig.audioChannels });
+    context->statsRegistry->set(reStreamerId, it->second.targetStats(reStreamerId));
+#if ENABLE_BROWSER_UI
+    if(reStreamerConfig.hls) {
+        it->second.addHlsTarget(
+            HlsTargetId(reStreamerId),
+            context->hlsRegistry->acquire(reStreamerId),
+            ReStreamer::AudioEncoding {
+                reStreamerConfig.audioBitrate,
+                reStreamerConfig.audioSampleRate,
+                reStreamerConfig.audioChannels });
+    }
+#endif
 
-    it->second.start();
+    if(newSource) {
+        // source shared by several streamers uses source settings of the first one
+        it->second.setBackupSources(reStreamerConfig.backupSources, reStreamerConfig.slate);
+        if(reStreamerConfig.latencyProfile)
+            it->second.setLatencyProfile(*reStreamerConfig.latencyProfile);
+        it->second.setRtspTransport(reStreamerConfig.rtspTransport, context->rtspTransportCache);
+        it->second.setStallTimeout(reStreamerConfig.stallTimeout);
+        it->second.setSourceCapsCache(context->sourceCapsCache);
+        it->second.start();
+    } else if(it->second.isSourceReady()) {
+        context->reconnectScheduler->started(reStreamerId);
+    }
 }
 
-void ScheduleStartReStream(
+void StartReStream(
+    Context* context,
+    const std::string& reStreamerId)
+{
+    // source could be kept running while target restart was pending,
+    // it's either reused or released if not needed anymore
+    std::optional<std::string> keptSourceUrl;
+    const auto restartingIt = context->restartingTargets.find(reStreamerId);
+    if(restartingIt != context->restartingTargets.end()) {
+        keptSourceUrl = restartingIt->second;
+        context->restartingTargets.erase(restartingIt);
+    }
+
+    AddReStreamTarget(context, reStreamerId);
+
+    if(keptSourceUrl)
+        ReleaseSourceIfUnused(context, *keptSourceUrl);
+}
+
+void ChangeReStreamTarget(
     Context* context,
     const std::string& reStreamerId)
 {
     assert(context == ::streamContext);
 
-    if(context->restarting.find(reStreamerId) != context->restarting.end()) {
+    const auto targetIt = context->rtmpTargets.find(reStreamerId);
+    if(targetIt == context->rtmpTargets.end())
+        return; // not active at the moment, actual target url will be used on (re)start
+
+    const Config& config = context->config;
+    const auto configIt = config.reStreamers.find(reStreamerId);
+    if(configIt == config.reStreamers.end()) {
+        Log()->error("Can't find reStreamer with id \"{}\"", reStreamerId);
+        return;
+    }
+
+    const std::string& sourceUrl = targetIt->second;
+
+    RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
+    const auto it = reStreamers->find(sourceUrl);
+    if(it == reStreamers->end())
+        return;
+
+    Log()->info("Changing target of active reStreaming \"{}\" (\"{}\")...", sourceUrl, reStreamerId);
+    // EOS of the previous target url is not relevant anymore
+    context->targetInstances[reStreamerId] = ++context->instancesCount;
+    it->second.changeTargetUrl(reStreamerId, configIt->second.targetUrl);
+}
+
+void ScheduleStartReStream(
+    Context* context,
+    const std::string& reStreamerId,
+    ReStreamer::EosReason reason,
+    bool keepSource)
+{
+    assert(context == ::streamContext);
+
+    if(context->reconnectScheduler->isPending(reStreamerId)) {
         Log()->debug("ReStreamer restart already pending. Ignoring new request...");
         return;
     }
 
     Log()->info("ReStreaming restart pending...");
 
-    const Config& config = context->config;
-    RTMPReStreamers* reStreamers = &(context->rtmpReStreamers);
+    assert(context->rtmpTargets.find(reStreamerId) != context->rtmpTargets.end());
+    StopReStream(context, reStreamerId, keepSource);
 
-    assert(reStreamers->find(reStreamerId) != reStreamers->end());
-    StopReStream(context, reStreamerId);
+    context->reconnectScheduler->schedule(reStreamerId, reason);
+}
+
+#if ENABLE_BROWSER_UI
+void ScheduleStartSource(
+    Context* context,
+    const std::string& sourceUrl)
+{
+    if(context->restartingSources.find(sourceUrl) != context->restartingSources.end())
+        return;
+
+    Log()->info("Source \"{}\" restart pending...", sourceUrl);
 
     typedef std::tuple<
         Context*,
         std::string> Data;
 
-    auto reconnect =
+    auto restart =
         [] (gpointer userData) -> gboolean {
-            const auto& [context, reStreamerId] = *reinterpret_cast<Data*>(userData);
+            const auto& [context, sourceUrl] = *reinterpret_cast<Data*>(userData);
 
-            context->restarting.erase(reStreamerId);
+            context->restartingSources.erase(sourceUrl);
 
-            StartReStream(context, reStreamerId);
+            if(context->previewSubscribers.find(sourceUrl) != context->previewSubscribers.end()) {
+                auto [it, newSource] = AcquireSource(context, sourceUrl);
+                if(newSource)
+                    it->second.start();
+            }
 
             return false;
         };
 
-    // FIXME! add reconnect interval increase on error
     GSource* timeoutSource = addSecondsTimeout(
         RECONNECT_INTERVAL,
-        GSourceFunc(reconnect),
-        new Data(context, reStreamerId),
+        GSourceFunc(restart),
+        new Data(context, sourceUrl),
         [] (gpointer userData) {
             delete reinterpret_cast<Data*>(userData);
         });
 
-    context->restarting.emplace(reStreamerId, timeoutSource);
+    context->restartingSources.emplace(sourceUrl, timeoutSource);
+}
+
+void SubscribePreview(
+    Context* context,
+    const std::string& sourceUrl,
+    GstPad* videoSinkPad)
+{
+    context->previewSubscribers[sourceUrl].emplace_back(GST_PAD(gst_object_ref(videoSinkPad)));
+
+    auto [it, newSource] = AcquireSource(context, sourceUrl);
+    if(newSource)
+        it->second.start(); // all subscribers are already attached inside AcquireSource
+    else
+        it->second.addSubscriber(videoSinkPad);
+}
+
+void UnsubscribePreview(
+    Context* context,
+    const std::string& sourceUrl,
+    GstPad* videoSinkPad)
+{
+    auto subscribersIt = context->previewSubscribers.find(sourceUrl);
+    if(subscribersIt != context->previewSubscribers.end()) {
+        std::deque<GstPadPtr>& subscribers = subscribersIt->second;
+        subscribers.erase(
+            std::remove_if(
+                subscribers.begin(),
+                subscribers.end(),
+                [videoSinkPad] (const GstPadPtr& videoSinkPadPtr) {
+                    return videoSinkPadPtr.get() == videoSinkPad;
+                }),
+            subscribers.end());
+
+        if(subscribers.empty()) {
+            context->previewSubscribers.erase(subscribersIt);
+
+            auto restartingIt = context->restartingSources.find(sourceUrl);
+            if(restartingIt != context->restartingSources.end()) {
+                g_source_destroy(restartingIt->second.get());
+                context->restartingSources.erase(restartingIt);
+            }
+        }
+    }
+
+    auto it = context->rtmpReStreamers.find(sourceUrl);
+    if(it != context->rtmpReStreamers.end()) {
+        it->second.removeSubscriber(videoSinkPad);
+        ReleaseSourceIfUnused(context, it);
+    }
+}
+
+// could be called from any thread,
+// mainContext should be the one of worker owning sourceUrl
+void PostPreviewSubscription(
+    GMainContext* mainContext,
+    const std::string& sourceUrl,
+    GstPad* videoSinkPad,
+    bool subscribe)
+{
+    typedef std::tuple<
+        std::string,
+        GstPadPtr,
+        bool> Data;
+
+    GSource* source = g_idle_source_new();
+    g_source_set_callback(
+        source,
+        [] (gpointer userData) -> gboolean {
+            const auto& [sourceUrl, videoSinkPadPtr, subscribe] =
+                *static_cast<Data*>(userData);
+            assert(::streamContext);
+            if(!::streamContext)
+                return G_SOURCE_REMOVE;
+
+            if(subscribe)
+                SubscribePreview(::streamContext, sourceUrl, videoSinkPadPtr.get());
+            else
+                UnsubscribePreview(::streamContext, sourceUrl, videoSinkPadPtr.get());
+            return G_SOURCE_REMOVE;
+        },
+        new Data(sourceUrl, GstPadPtr(GST_PAD(gst_object_ref(videoSinkPad))), subscribe),
+        [] (gpointer userData) {
+            delete static_cast<Data*>(userData);
+        });
+    g_source_attach(source, mainContext);
+    g_source_unref(source);
 }
 
-#if ENABLE_BROWSER_UI
 static std::unique_ptr<WebRTCPeer> CreateWebRTCPeer(
     const ReStreamers& reStreamers,
     const std::string& uri) noexcept
@@ -278,12 +766,15 @@ void ConfigChanged(Context* context, const std::unique_ptr<ConfigChanges>& chang
             }
         } else if(reStreamerChanges.drop) {
             StopReStream(context, uniqueId);
+            context->reconnectScheduler->forget(uniqueId);
+            context->hlsRegistry->remove(uniqueId);
             config.reStreamers.erase(it);
         } else {
             Config::ReStreamer& reStreamerConfig = it->second;
 
             bool stopRequired = false;
             bool startRequired = false;
+            bool targetChangeRequired = false;
 
             if(
                 reStreamerChanges.sourceUrl &&
@@ -305,6 +796,35 @@ void ConfigChanged(Context* context, const std::unique_ptr<ConfigChanges>& chang
                 reStreamerConfig.targetUrl != *reStreamerChanges.targetUrl
             ) {
                 reStreamerConfig.targetUrl = *reStreamerChanges.targetUrl;
+                // source is kept running
+                targetChangeRequired = true;
+            }
+
+            bool audioChanged = false;
+            if(
+                reStreamerChanges.audioBitrate &&
+                reStreamerConfig.audioBitrate != *reStreamerChanges.audioBitrate
+            ) {
+                reStreamerConfig.audioBitrate = *reStreamerChanges.audioBitrate;
+                audioChanged = true;
+            }
+            if(
+                reStreamerChanges.audioSampleRate &&
+                reStreamerConfig.audioSampleRate != *reStreamerChanges.audioSampleRate
+            ) {
+                reStreamerConfig.audioSampleRate = *reStreamerChanges.audioSampleRate;
+                audioChanged = true;
+            }
+            if(
+                reStreamerChanges.audioChannels &&
+                reStreamerConfig.audioChannels != *reStreamerChanges.audioChannels
+            ) {
+                reStreamerConfig.audioChannels = *reStreamerChanges.audioChannels;
+                audioChanged = true;
+            }
+            if(audioChanged && reStreamerConfig.enabled) {
+                // target is added again with the new audio encoder,
+                // shared source is kept running if it has other targets
                 stopRequired = true;
                 startRequired = true;
             }
@@ -316,18 +836,24 @@ void ConfigChanged(Context* context, const std::unique_ptr<ConfigChanges>& chang
                 } else {
                     stopRequired = true;
                     startRequired = false; // overrides all above, so order is important
+                    context->hlsRegistry->remove(uniqueId);
                 }
             }
 
+            if(stopRequired || startRequired)
+                context->reconnectScheduler->reset(uniqueId);
+
             if(stopRequired)
                 StopReStream(context, uniqueId);
             if(startRequired)
                 StartReStream(context, uniqueId);
+            else if(targetChangeRequired && !stopRequired)
+                ChangeReStreamTarget(context, uniqueId);
         }
     }
 }
 
-void PostQuit()
+void PostQuit(GMainContext* mainContext)
 {
     GSource* source = g_idle_source_new();
     g_source_set_callback(
@@ -340,7 +866,122 @@ void PostQuit()
         },
         nullptr,
         nullptr);
-    g_source_attach(source, ::mainContext);
+    g_source_attach(source, mainContext);
+    g_source_unref(source);
+}
+
+void StartReStreams(Context* context)
+{
+    for(const auto& pair: context->config.reStreamers)
+        StartReStream(context, pair.first);
+}
+
+void WorkerMain(
+    Context* context,
+    GMainContext* mainContext)
+{
+    ::streamContext = context;
+    ::mainContext = mainContext;
+    g_main_context_push_thread_default(mainContext);
+
+    GMainLoopPtr loopPtr(g_main_loop_new(mainContext, FALSE));
+    ::streamLoop = loopPtr.get();
+
+    StartReStreams(context);
+
+    g_main_loop_run(::streamLoop);
+    ::streamLoop = nullptr;
+
+    // sources have to be destroyed on the thread owning their bus watches
+    context->rtmpReStreamers.clear();
+#if ENABLE_BROWSER_UI
+    context->restartingSources.clear();
+    context->previewSubscribers.clear();
+#endif
+
+    g_main_context_pop_thread_default(mainContext);
+    ::mainContext = nullptr;
+    ::streamContext = nullptr;
+}
+
+void StartWorkers(
+    Workers* workers,
+    unsigned workersCount,
+    const Config& config,
+    const NotificationCallback& messageCallback,
+    StatsRegistry* statsRegistry,
+    HlsRegistry* hlsRegistry,
+    SourceCache* rtspTransportCache,
+    SourceCache* sourceCapsCache,
+    ConnectionAttempts* connectionAttempts)
+{
+    for(unsigned workerIndex = 1; workerIndex < workersCount; ++workerIndex) {
+        Worker& worker = workers->emplace_back();
+        worker.mainContext = g_main_context_new();
+        worker.reconnectScheduler =
+            std::make_unique<ReconnectScheduler>(
+                worker.mainContext,
+                connectionAttempts,
+                [] (const std::string& reStreamerId) {
+                    StartReStream(::streamContext, reStreamerId);
+                });
+
+        // every worker owns its Context, it's destroyed on worker thread
+        worker.thread = std::thread(
+            [
+                context = Context {
+                    config,
+                    messageCallback,
+                    workerIndex,
+                    workersCount,
+                    worker.reconnectScheduler.get(),
+                    statsRegistry,
+                    hlsRegistry,
+                    rtspTransportCache,
+                    sourceCapsCache },
+                mainContext = worker.mainContext
+            ] () mutable {
+                WorkerMain(&context, mainContext);
+            });
+    }
+}
+
+void StopWorkers(Workers* workers)
+{
+    for(Worker& worker: *workers)
+        PostQuit(worker.mainContext);
+
+    for(Worker& worker: *workers) {
+        worker.thread.join();
+        worker.reconnectScheduler.reset();
+        g_main_context_unref(worker.mainContext);
+    }
+
+    workers->clear();
+}
+
+void PostWorkerConfigChanges(
+    GMainContext* mainContext,
+    std::unique_ptr<ConfigChanges>&& changes)
+{
+    typedef std::tuple<std::unique_ptr<ConfigChanges>> Data;
+
+    GSource* source = g_idle_source_new();
+    g_source_set_callback(
+        source,
+        [] (gpointer userData) -> gboolean {
+            Data& data = *static_cast<Data*>(userData);
+            assert(::streamContext);
+            if(::streamContext) {
+                ConfigChanged(::streamContext, std::get<0>(data));
+            }
+            return G_SOURCE_REMOVE;
+        },
+        new Data(std::move(changes)),
+        [] (gpointer userData) {
+            delete static_cast<Data*>(userData);
+        });
+    g_source_attach(source, mainContext);
     g_source_unref(source);
 }
 
@@ -353,9 +994,22 @@ void PostConfigChanges(std::unique_ptr<ConfigChanges>&& changes)
     AddIdle(
         [] (gpointer userData) -> gboolean {
             Data& data = *static_cast<Data*>(userData);
+            const std::unique_ptr<ConfigChanges>& changes = std::get<0>(data);
+
+            // every worker has to keep its config copy up to date,
+            // but only worker owning reStreamer source will (re)start or stop it.
+            // if source url is changed, old owner stops it and new one starts it
+            if(::workers) {
+                for(const Worker& worker: *::workers) {
+                    PostWorkerConfigChanges(
+                        worker.mainContext,
+                        std::make_unique<ConfigChanges>(*changes));
+                }
+            }
+
             assert(::streamContext);
             if(::streamContext) {
-                ConfigChanged(::streamContext, std::get<0>(data));
+                ConfigChanged(::streamContext, changes);
             }
             return G_SOURCE_REMOVE;
         },
@@ -374,11 +1028,11 @@ int StreamerMain(
     const NotificationCallback& messageCallback,
     GMainContext* mainContext)
 {
-    Context context { config, messageCallback };
-    ::streamContext = &context;
-
     gst_init(nullptr, nullptr);
 
+    if(!RegisterRtmpPublisher())
+        Log()->error("Failed to register RTMP publisher element");
+
     if(!mainContext) {
         mainContext = g_main_context_new();
     } else {
@@ -391,20 +1045,88 @@ int StreamerMain(
     GMainLoopPtr loopPtr(g_main_loop_new(mainContext, FALSE));
     ::streamLoop = loopPtr.get();
 
-    for(const auto& pair: context.config.reStreamers) {
-        const std::string& uniqueId = pair.first;
+    StatsRegistry statsRegistry;
+    HlsRegistry hlsRegistry;
+    SourceCache rtspTransportCache(CachePath("transports"));
+    SourceCache sourceCapsCache(CachePath("caps"));
+
+    // limit of simultaneous connection attempts is common for all workers
+    ConnectionAttempts connectionAttempts;
+    ReconnectScheduler reconnectScheduler(
+        mainContext,
+        &connectionAttempts,
+        [] (const std::string& reStreamerId) {
+            StartReStream(::streamContext, reStreamerId);
+        });
+
+    const unsigned workersCount = std::max(config.workers, 1u);
+    Log()->info("Using {} worker(s)", workersCount);
+
+    // the first worker
+    Context context {
+        config,
+        messageCallback,
+        0,
+        workersCount,
+        &reconnectScheduler,
+        &statsRegistry,
+        &hlsRegistry,
+        &rtspTransportCache,
+        &sourceCapsCache };
+    ::streamContext = &context;
+
+    Workers workers;
+    ::workers = &workers;
+    StartWorkers(
+        &workers,
+        workersCount,
+        config,
+        messageCallback,
+        &statsRegistry,
+        &hlsRegistry,
+        &rtspTransportCache,
+        &sourceCapsCache,
+        &connectionAttempts);
+
+    // worker index -> GMainContext
+    std::vector<GMainContext*> workersContexts = { mainContext };
+    ReconnectSchedulers reconnectSchedulers = { &reconnectScheduler };
+    for(const Worker& worker: workers) {
+        workersContexts.push_back(worker.mainContext);
+        reconnectSchedulers.push_back(worker.reconnectScheduler.get());
+    }
 
 #if ENABLE_BROWSER_UI
+    // WebRTC preview consumes the same ingest as RTMP targets
+    RegisterIngestSrc();
+    SetIngestSubscriptionHandlers(
+        [workersContexts] (const std::string& sourceUrl, GstPad* videoSinkPad) {
+            PostPreviewSubscription(
+                workersContexts[WorkerIndex(sourceUrl, workersContexts.size())],
+                sourceUrl,
+                videoSinkPad,
+                true);
+        },
+        [workersContexts] (const std::string& sourceUrl, GstPad* videoSinkPad) {
+            PostPreviewSubscription(
+                workersContexts[WorkerIndex(sourceUrl, workersContexts.size())],
+                sourceUrl,
+                videoSinkPad,
+                false);
+        });
+
+    ReStreamers reStreamers;
+    for(const auto& pair: config.reStreamers) {
         const Config::ReStreamer& reStreamer = pair.second;
-        context.reStreamers.emplace(
+        reStreamers.emplace(
             reStreamer.sourceUrl,
             std::make_unique<GstReStreamer2>(
-                reStreamer.sourceUrl,
+                IngestUri(reStreamer.sourceUrl),
                 reStreamer.forceH264ProfileLevelId));
+    }
 #endif
 
-        StartReStream(&context, uniqueId);
-    }
+    StartReStreams(&context);
 
 #if ENABLE_BROWSER_UI
     std::unique_ptr<http::MicroServer> httpServerPtr;
@@ -423,6 +1145,8 @@ int StreamerMain(
                 std::bind(
                     &rest::HandleRequest,
                     std::make_shared<Config>(context.config),
+                    reconnectSchedulers,
+                    &statsRegistry,
                     [] (std::unique_ptr<ConfigChanges>&& changes) {
                         PostConfigChanges(std::move(changes));
                     },
@@ -433,6 +1157,20 @@ int StreamerMain(
         httpServerPtr->init();
     }
 
+    // nothing to serve otherwise, and hls can't be enabled at runtime
+    const bool hlsEnabled =
+        std::any_of(
+            config.reStreamers.begin(),
+            config.reStreamers.end(),
+            [] (const auto& pair) { return pair.second.hls; });
+
+    std::unique_ptr<HlsServer> hlsServerPtr;
+    if(config.hlsPort && hlsEnabled) {
+        hlsServerPtr =
+            std::make_unique<HlsServer>(&hlsRegistry, config.hlsPort, httpConfig.bindToLoopbackOnly);
+        hlsServerPtr->init();
+    }
+
     std::unique_ptr<signalling::WsServer> wsServerPtr;
     if(wsConfig.port) {
         wsServerPtr = std::make_unique<signalling::WsServer>(
@@ -441,7 +1179,7 @@ int StreamerMain(
             std::bind(
                 CreateWebRTSPSession,
                 std::make_shared<WebRTCConfig>(),
-                std::ref(context.reStreamers),
+                std::ref(reStreamers),
                 std::placeholders::_1,
                 std::placeholders::_2));
         wsServerPtr->init();
@@ -488,6 +1226,17 @@ int StreamerMain(
     g_main_loop_run(::streamLoop);
     ::streamLoop = nullptr;
 
+#if ENABLE_BROWSER_UI
+    SetIngestSubscriptionHandlers(IngestSubscribe(), IngestUnsubscribe());
+
+    // to be sure nobody will use workers' schedulers anymore
+    httpServerPtr.reset();
+    hlsServerPtr.reset();
+#endif
+
+    StopWorkers(&workers);
+    ::workers = nullptr;
+
     g_main_context_pop_thread_default(mainContext);
     ::mainContext = nullptr;
     g_main_context_unref(mainContext);
@@ -527,7 +1276,7 @@ void StopStreamerThread()
     if(!::mainContext || !::streamThread.joinable())
         return;
 
-    PostQuit();
+    PostQuit(::mainContext);
     ::streamThread.join();
 
     g_main_context_unref(::mainContext);
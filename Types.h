@@ -6,3 +6,16 @@ enum class NotificationType {
     TargetError,
     OtherError,
 };
+
+enum class RtspTransport {
+    Auto, // the one worked last time first, then UDP, then TCP
+    Udp,
+    Tcp, // interleaved
+};
+
+// trade-off between added latency and tolerance to network jitter
+enum class LatencyProfile {
+    LowLatency,
+    Balanced,
+    Resilient,
+};
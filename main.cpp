@@ -91,6 +91,40 @@ void LoadStreamers(
             config_setting_lookup_string(streamerConfig, "key", &key);
             int enabled = TRUE;
             config_setting_lookup_bool(streamerConfig, "enable", &enabled);
+            int audioBitrate = 0;
+            config_setting_lookup_int(streamerConfig, "audio-bitrate", &audioBitrate);
+            int audioSampleRate = 0;
+            config_setting_lookup_int(streamerConfig, "audio-sample-rate", &audioSampleRate);
+            int audioChannels = 0;
+            config_setting_lookup_int(streamerConfig, "audio-channels", &audioChannels);
+            int hls = FALSE;
+            config_setting_lookup_bool(streamerConfig, "hls", &hls);
+            std::deque<std::string> backupSources;
+            if(config_setting_t* backupSourcesConfig = config_setting_lookup(streamerConfig, "backup-sources")) {
+                const int backupSourcesCount = config_setting_length(backupSourcesConfig);
+                for(int backupSourceIdx = 0; backupSourceIdx < backupSourcesCount; ++backupSourceIdx) {
+                    const char* backupSource =
+                        config_setting_get_string_elem(backupSourcesConfig, backupSourceIdx);
+                    if(backupSource && backupSource[0] != '\0')
+                        backupSources.emplace_back(backupSource);
+                }
+            }
+            const char* slate = nullptr;
+            config_setting_lookup_string(streamerConfig, "slate", &slate);
+            int stallTimeout = -1;
+            config_setting_lookup_int(streamerConfig, "stall-timeout", &stallTimeout);
+            const char* rtspTransportName = nullptr;
+            config_setting_lookup_string(streamerConfig, "rtsp-transport", &rtspTransportName);
+            const std::optional<RtspTransport> rtspTransport =
+                Config::ReStreamer::ParseRtspTransport(rtspTransportName);
+            if(rtspTransportName && !rtspTransport)
+                Log()->warn("Unknown \"rtsp-transport\" value \"{}\". Ignored.", rtspTransportName);
+            const char* latencyProfileName = nullptr;
+            config_setting_lookup_string(streamerConfig, "latency-profile", &latencyProfileName);
+            const std::optional<LatencyProfile> latencyProfile =
+                Config::ReStreamer::ParseLatencyProfile(latencyProfileName);
+            if(latencyProfileName && !latencyProfile)
+                Log()->warn("Unknown \"latency-profile\" value \"{}\". Ignored.", latencyProfileName);
 
             if(!source) {
                 Log()->warn("\"source\" property is empty. Streamer skipped.");
@@ -136,13 +170,29 @@ void LoadStreamers(
             }
             GCharPtr uniqueIdPtr(uniqueId);
 
-            loadedConfig->addReStreamer(
-                id,
-                Config::ReStreamer {
-                    source,
-                    description,
-                    targetUrl,
-                    enabled != FALSE });
+            Config::ReStreamer reStreamer {
+                source,
+                description,
+                targetUrl,
+                enabled != FALSE };
+            if(audioBitrate > 0)
+                reStreamer.audioBitrate = audioBitrate;
+            if(audioSampleRate > 0)
+                reStreamer.audioSampleRate = audioSampleRate;
+            if(audioChannels > 0)
+                reStreamer.audioChannels = audioChannels;
+            reStreamer.hls = hls != FALSE;
+            reStreamer.backupSources = std::move(backupSources);
+            if(slate)
+                reStreamer.slate = slate;
+            if(latencyProfile)
+                reStreamer.latencyProfile = *latencyProfile;
+            if(rtspTransport)
+                reStreamer.rtspTransport = *rtspTransport;
+            if(stallTimeout >= 0)
+                reStreamer.stallTimeout = stallTimeout;
+
+            loadedConfig->addReStreamer(id, reStreamer);
         }
     }
 }
@@ -183,6 +233,14 @@ void LoadConfig(
         }
     }
 
+    int workers = 0;
+    if(CONFIG_TRUE == config_lookup_int(&config, "workers", &workers)) {
+        if(workers > 0)
+            loadedConfig->workers = static_cast<unsigned>(workers);
+        else if(workers == 0)
+            loadedConfig->workers = g_get_num_processors();
+    }
+
 #if ENABLE_BROWSER_UI
     const char* wwwRoot = nullptr;
     if(CONFIG_TRUE == config_lookup_string(&config, "www-root", &wwwRoot)) {
@@ -203,6 +261,11 @@ void LoadConfig(
     if(CONFIG_TRUE == config_lookup_int(&config, "ws-port", &wsPort)) {
         loadedWsConfig->port = static_cast<unsigned short>(wsPort);
     }
+
+    int hlsPort;
+    if(CONFIG_TRUE == config_lookup_int(&config, "hls-port", &hlsPort)) {
+        loadedConfig->hlsPort = static_cast<unsigned short>(hlsPort);
+    }
 #endif
 
     const char* source = nullptr;
@@ -0,0 +1,451 @@
+// Publishes a single FLV video tag, larger than chunk size, with rtmppublisher
+// to minimal RTMP server listening on loopback, and checks handshake,
+// outgoing chunk size, connect/createStream/publish sequence,
+// received video payload and acknowledgements in both directions.
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <optional>
+#include <thread>
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+
+#include "../RtmpPublisher.h"
+
+
+namespace {
+
+enum {
+    HANDSHAKE_SIZE = 1536,
+    DEFAULT_CHUNK_SIZE = 128,
+    PUBLISHER_CHUNK_SIZE = 256, // video tag is split into several chunks
+    SERVER_ACK_WINDOW = 1, // publisher should acknowledge everything it receives
+    SERVER_TIMEOUT = 10, // seconds
+    ACK_WAIT_TIMEOUT = 5, // seconds
+    ACK_WAIT_INTERVAL = 100, // milliseconds
+
+    CONTROL_CHUNK_STREAM = 2,
+    COMMAND_CHUNK_STREAM = 3,
+
+    SET_CHUNK_SIZE = 1,
+    ACKNOWLEDGEMENT = 3,
+    WINDOW_ACK_SIZE = 5,
+    VIDEO = 9,
+    COMMAND_AMF0 = 20,
+
+    AMF_NUMBER = 0x00,
+    AMF_STRING = 0x02,
+    AMF_OBJECT = 0x03,
+    AMF_NULL = 0x05,
+    AMF_OBJECT_END = 0x09,
+};
+
+const guint32 StreamId = 1;
+
+std::vector<guint8> VideoPayload()
+{
+    std::vector<guint8> payload = { 0x17, 0x01, 0x00, 0x00, 0x00 };
+    for(unsigned i = 0; payload.size() < 3 * PUBLISHER_CHUNK_SIZE + 10; ++i)
+        payload.push_back(guint8(i));
+
+    return payload;
+}
+
+struct Message
+{
+    guint8 type = 0;
+    std::vector<guint8> payload;
+};
+
+struct ServerResult
+{
+    bool connected = false;
+    bool streamCreated = false;
+    bool published = false;
+    std::optional<guint32> chunkSize; // as publisher set it
+    bool acknowledged = false; // publisher acknowledged server's data
+    std::vector<guint8> video;
+    guint32 ackSequence = 0; // sent to publisher after video
+    std::string error;
+};
+
+// accessed from server thread only
+guint64 ServerReceivedBytes = 0;
+
+bool ReadAll(GInputStream* in, void* data, gsize size)
+{
+    gsize read = 0;
+    const bool success = g_input_stream_read_all(in, data, size, &read, nullptr, nullptr) && read == size;
+    ServerReceivedBytes += read;
+
+    return success;
+}
+
+bool WriteAll(GOutputStream* out, const std::vector<guint8>& data)
+{
+    return g_output_stream_write_all(out, data.data(), data.size(), nullptr, nullptr, nullptr);
+}
+
+guint32 ReadBE24(const guint8* data) { return (data[0] << 16) | (data[1] << 8) | data[2]; }
+guint32 ReadBE32(const guint8* data) { return (guint32(data[0]) << 24) | ReadBE24(data + 1); }
+
+std::vector<guint8> BE32(guint32 value)
+{
+    return { guint8(value >> 24), guint8(value >> 16), guint8(value >> 8), guint8(value) };
+}
+
+// client starts every message with type 0 chunk (and never uses extended timestamps)
+std::optional<Message> ReadMessage(GInputStream* in, guint32 chunkSize)
+{
+    guint8 header[12];
+    if(!ReadAll(in, header, sizeof(header)) || (header[0] >> 6) != 0)
+        return {};
+
+    const guint32 length = ReadBE24(header + 4);
+
+    Message message;
+    message.type = header[7];
+    message.payload.resize(length);
+
+    for(gsize pos = 0; pos < length;) {
+        if(pos > 0) {
+            guint8 continuation;
+            if(!ReadAll(in, &continuation, 1) || (continuation >> 6) != 3)
+                return {};
+        }
+
+        const gsize size = std::min<gsize>(chunkSize, length - pos);
+        if(!ReadAll(in, message.payload.data() + pos, size))
+            return {};
+        pos += size;
+    }
+
+    return message;
+}
+
+// payload should fit into default chunk size
+bool WriteMessage(
+    GOutputStream* out,
+    guint8 chunkStream,
+    guint8 type,
+    guint32 streamId,
+    const std::vector<guint8>& payload)
+{
+    std::vector<guint8> message = {
+        chunkStream, // fmt 0
+        0x00, 0x00, 0x00,
+        guint8(payload.size() >> 16), guint8(payload.size() >> 8), guint8(payload.size()),
+        type,
+        guint8(streamId), guint8(streamId >> 8), guint8(streamId >> 16), guint8(streamId >> 24),
+    };
+    message.insert(message.end(), payload.begin(), payload.end());
+
+    return WriteAll(out, message);
+}
+
+bool WriteControl(GOutputStream* out, guint8 type, guint32 value)
+{
+    return WriteMessage(out, CONTROL_CHUNK_STREAM, type, 0, BE32(value));
+}
+
+void AmfString(std::vector<guint8>* out, const std::string& value, bool marker = true)
+{
+    if(marker)
+        out->push_back(AMF_STRING);
+    out->insert(out->end(), { guint8(value.size() >> 8), guint8(value.size()) });
+    out->insert(out->end(), value.begin(), value.end());
+}
+
+void AmfNumber(std::vector<guint8>* out, double value)
+{
+    guint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    out->push_back(AMF_NUMBER);
+    for(int shift = 56; shift >= 0; shift -= 8)
+        out->push_back(guint8(bits >> shift));
+}
+
+std::optional<std::pair<std::string, double>> ParseCommand(const std::vector<guint8>& payload)
+{
+    if(payload.size() < 3 || payload[0] != AMF_STRING)
+        return {};
+
+    const gsize nameLength = (payload[1] << 8) | payload[2];
+    if(payload.size() < 3 + nameLength + 9 || payload[3 + nameLength] != AMF_NUMBER)
+        return {};
+
+    const guint8* number = payload.data() + 3 + nameLength + 1;
+    const guint64 bits = (guint64(ReadBE32(number)) << 32) | ReadBE32(number + 4);
+    double transactionId;
+    memcpy(&transactionId, &bits, sizeof(transactionId));
+
+    return std::make_pair(
+        std::string(reinterpret_cast<const char*>(payload.data() + 3), nameLength),
+        transactionId);
+}
+
+std::vector<guint8> Result(double transactionId, std::optional<double> value)
+{
+    std::vector<guint8> payload;
+    AmfString(&payload, "_result");
+    AmfNumber(&payload, transactionId);
+    payload.push_back(AMF_NULL);
+    if(value)
+        AmfNumber(&payload, *value);
+    else
+        payload.push_back(AMF_NULL);
+
+    return payload;
+}
+
+std::vector<guint8> PublishStarted()
+{
+    std::vector<guint8> payload;
+    AmfString(&payload, "onStatus");
+    AmfNumber(&payload, 0);
+    payload.push_back(AMF_NULL);
+    payload.push_back(AMF_OBJECT);
+    AmfString(&payload, "level", false);
+    AmfString(&payload, "status");
+    AmfString(&payload, "code", false);
+    AmfString(&payload, "NetStream.Publish.Start");
+    payload.insert(payload.end(), { 0x00, 0x00, AMF_OBJECT_END });
+
+    return payload;
+}
+
+void Serve(GSocketListener* listener, ServerResult* result)
+{
+    GSocketConnection* connection = g_socket_listener_accept(listener, nullptr, nullptr, nullptr);
+    if(!connection) {
+        result->error = "accept failed";
+        return;
+    }
+    g_socket_set_timeout(g_socket_connection_get_socket(connection), SERVER_TIMEOUT);
+
+    GInputStream* in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+    GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+    [&] () {
+        std::vector<guint8> c0c1(1 + HANDSHAKE_SIZE);
+        if(!ReadAll(in, c0c1.data(), c0c1.size()) || c0c1[0] != 3) {
+            result->error = "invalid C0C1";
+            return;
+        }
+
+        // S0, S1 and S2 (echo of C1)
+        std::vector<guint8> s0s1s2(1 + HANDSHAKE_SIZE, 0);
+        s0s1s2[0] = 3;
+        s0s1s2.insert(s0s1s2.end(), c0c1.begin() + 1, c0c1.end());
+        if(!WriteAll(out, s0s1s2)) {
+            result->error = "S0S1S2 write failed";
+            return;
+        }
+
+        std::vector<guint8> c2(HANDSHAKE_SIZE);
+        if(!ReadAll(in, c2.data(), c2.size())) {
+            result->error = "C2 read failed";
+            return;
+        }
+
+        guint32 chunkSize = DEFAULT_CHUNK_SIZE;
+        for(;;) {
+            std::optional<Message> message = ReadMessage(in, chunkSize);
+            if(!message) {
+                result->error = "message read failed";
+                return;
+            }
+
+            if(message->type == SET_CHUNK_SIZE && message->payload.size() == 4) {
+                chunkSize = ReadBE32(message->payload.data());
+                result->chunkSize = chunkSize;
+            } else if(message->type == ACKNOWLEDGEMENT && message->payload.size() == 4) {
+                result->acknowledged = true;
+            } else if(message->type == COMMAND_AMF0) {
+                std::optional<std::pair<std::string, double>> command = ParseCommand(message->payload);
+                if(!command)
+                    continue;
+
+                const auto& [name, transactionId] = *command;
+                bool success = true;
+                if(name == "connect") {
+                    result->connected = true;
+                    success =
+                        WriteControl(out, WINDOW_ACK_SIZE, SERVER_ACK_WINDOW) &&
+                        WriteMessage(out, COMMAND_CHUNK_STREAM, COMMAND_AMF0, 0, Result(transactionId, {}));
+                } else if(name == "createStream") {
+                    result->streamCreated = true;
+                    success = WriteMessage(out, COMMAND_CHUNK_STREAM, COMMAND_AMF0, 0, Result(transactionId, StreamId));
+                } else if(name == "publish") {
+                    result->published = true;
+                    success = WriteMessage(out, COMMAND_CHUNK_STREAM, COMMAND_AMF0, StreamId, PublishStarted());
+                }
+                if(!success) {
+                    result->error = "response write failed";
+                    return;
+                }
+            } else if(message->type == VIDEO) {
+                result->video = std::move(message->payload);
+                break;
+            }
+        }
+
+        result->ackSequence = guint32(ServerReceivedBytes);
+        if(!WriteControl(out, ACKNOWLEDGEMENT, result->ackSequence)) {
+            result->error = "acknowledgement write failed";
+            return;
+        }
+
+        // publisher keeps connection until it's stopped
+        guint8 byte;
+        while(ReadAll(in, &byte, 1));
+    } ();
+
+    g_io_stream_close(G_IO_STREAM(connection), nullptr, nullptr);
+    g_object_unref(connection);
+}
+
+// FLV header followed by single video tag
+GstBuffer* FlvBuffer()
+{
+    const std::vector<guint8> payload = VideoPayload();
+
+    std::vector<guint8> flv = {
+        'F', 'L', 'V', 0x01, 0x01, 0x00, 0x00, 0x00, 0x09,
+        0x00, 0x00, 0x00, 0x00, // previous tag size
+        VIDEO,
+        guint8(payload.size() >> 16), guint8(payload.size() >> 8), guint8(payload.size()),
+        0x00, 0x00, 0x00, 0x00, // timestamp
+        0x00, 0x00, 0x00, // stream id
+    };
+    flv.insert(flv.end(), payload.begin(), payload.end());
+    const std::vector<guint8> tagSize = BE32(guint32(11 + payload.size()));
+    flv.insert(flv.end(), tagSize.begin(), tagSize.end());
+
+    return gst_buffer_new_memdup(flv.data(), flv.size());
+}
+
+// acknowledgement is read by publisher on it's next poll
+guint64 WaitAckedBytes(GstElement* publisher)
+{
+    guint64 ackedBytes = 0;
+    for(unsigned i = 0; i < ACK_WAIT_TIMEOUT * 1000 / ACK_WAIT_INTERVAL && !ackedBytes; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ACK_WAIT_INTERVAL));
+        g_object_get(publisher, "acked-bytes", &ackedBytes, nullptr);
+    }
+
+    return ackedBytes;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    gst_init(&argc, &argv);
+
+    if(!RegisterRtmpPublisher()) {
+        g_printerr("Failed to register rtmppublisher\n");
+        return 1;
+    }
+
+    GSocketListener* listener = g_socket_listener_new();
+    GInetAddress* loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress* address = g_inet_socket_address_new(loopback, 0);
+    GSocketAddress* boundAddress = nullptr;
+    GError* error = nullptr;
+    const gboolean listening =
+        g_socket_listener_add_address(
+            listener,
+            address,
+            G_SOCKET_TYPE_STREAM,
+            G_SOCKET_PROTOCOL_TCP,
+            nullptr,
+            &boundAddress,
+            &error);
+    g_object_unref(address);
+    g_object_unref(loopback);
+    if(!listening) {
+        g_printerr("Failed to listen: %s\n", error->message);
+        return 1;
+    }
+    const guint16 port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(boundAddress));
+    g_object_unref(boundAddress);
+
+    ServerResult result;
+    std::thread serverThread(Serve, listener, &result);
+
+    GstElement* publisher = gst_element_factory_make("rtmppublisher", nullptr);
+    const std::string location = "rtmp://127.0.0.1:" + std::to_string(port) + "/live/test";
+    g_object_set(
+        publisher,
+        "location", location.c_str(),
+        "chunk-size", guint(PUBLISHER_CHUNK_SIZE),
+        nullptr);
+
+    GstPad* srcPad = gst_pad_new("src", GST_PAD_SRC);
+    GstPad* sinkPad = gst_element_get_static_pad(publisher, "sink");
+    gst_pad_set_active(srcPad, TRUE);
+    gst_pad_link(srcPad, sinkPad);
+    gst_object_unref(sinkPad);
+
+    gst_element_set_state(publisher, GST_STATE_PLAYING);
+
+    GstSegment segment;
+    gst_segment_init(&segment, GST_FORMAT_TIME);
+    gst_pad_push_event(srcPad, gst_event_new_stream_start("test"));
+    gst_pad_push_event(srcPad, gst_event_new_caps(gst_caps_new_empty_simple("video/x-flv")));
+    gst_pad_push_event(srcPad, gst_event_new_segment(&segment));
+
+    const GstFlowReturn flowReturn = gst_pad_push(srcPad, FlvBuffer());
+    // returns only after everything queued is sent
+    gst_pad_push_event(srcPad, gst_event_new_eos());
+
+    const guint64 ackedBytes = WaitAckedBytes(publisher);
+
+    // disconnects from server
+    gst_element_set_state(publisher, GST_STATE_NULL);
+
+    serverThread.join();
+
+    gst_object_unref(publisher);
+    gst_object_unref(srcPad);
+    g_object_unref(listener);
+
+    if(flowReturn != GST_FLOW_OK) {
+        g_printerr("Push failed: %s\n", gst_flow_get_name(flowReturn));
+        return 1;
+    }
+    if(!result.error.empty()) {
+        g_printerr("Server failed: %s\n", result.error.c_str());
+        return 1;
+    }
+    if(result.chunkSize != guint32(PUBLISHER_CHUNK_SIZE)) {
+        g_printerr("Unexpected chunk size\n");
+        return 1;
+    }
+    if(!result.connected || !result.streamCreated || !result.published) {
+        g_printerr("Incomplete publish sequence\n");
+        return 1;
+    }
+    if(!result.acknowledged) {
+        g_printerr("Publisher didn't acknowledge received data\n");
+        return 1;
+    }
+    if(result.video != VideoPayload()) {
+        g_printerr("Unexpected video payload\n");
+        return 1;
+    }
+    if(ackedBytes != result.ackSequence) {
+        g_printerr(
+            "Unexpected acked bytes: %" G_GUINT64_FORMAT " instead of %u\n",
+            ackedBytes,
+            result.ackSequence);
+        return 1;
+    }
+
+    return 0;
+}